@@ -19,4 +19,4 @@ EFI_HANDLE this_image;
 
 VOLUME_DESC *volumes = NULL;
 UINTN volume_count = 128;
-CHAR16 *boot_medium_path;
+EFI_DEVICE_PATH *boot_medium_devpath;
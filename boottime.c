@@ -0,0 +1,140 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include "boottime.h"
+
+#define PHASES_STR_SIZE 256
+
+static const CHAR16 *phase_names[BG_PHASE_MAX] = {
+	[BG_PHASE_INIT] = L"init",
+	[BG_PHASE_GET_VOLUMES] = L"get_volumes",
+	[BG_PHASE_LOAD_CONFIG] = L"load_config",
+	[BG_PHASE_DEVICE_PATH] = L"device_path",
+	[BG_PHASE_LOAD_IMAGE] = L"load_image",
+	[BG_PHASE_WATCHDOG] = L"watchdog",
+};
+
+static UINT64 timestamps[BG_PHASE_MAX];
+/* ticks per second, 0 if the wall clock is used */
+static UINT64 tick_freq;
+
+#if defined(__x86_64__) || defined(__i386__)
+static UINT64 read_ticks(VOID)
+{
+	UINT32 lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((UINT64)hi << 32) | lo;
+}
+
+static UINT64 ticks_per_second(VOID)
+{
+	UINT64 start = read_ticks();
+
+	BS->Stall(1000);
+	return (read_ticks() - start) * 1000;
+}
+#elif defined(__aarch64__)
+static UINT64 read_ticks(VOID)
+{
+	UINT64 ticks;
+
+	asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+}
+
+static UINT64 ticks_per_second(VOID)
+{
+	UINT64 freq;
+
+	asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	return freq;
+}
+#else
+static UINT64 read_ticks(VOID)
+{
+	return 0;
+}
+
+static UINT64 ticks_per_second(VOID)
+{
+	return 0;
+}
+#endif
+
+static UINT64 wallclock_usec(VOID)
+{
+	EFI_TIME t;
+
+	if (EFI_ERROR(RT->GetTime(&t, NULL))) {
+		return 0;
+	}
+	return ((((UINT64)t.Day * 24 + t.Hour) * 60 + t.Minute) * 60 +
+		t.Second) * 1000000 +
+	       t.Nanosecond / 1000;
+}
+
+UINT64 boottime_now(VOID)
+{
+	if (!tick_freq) {
+		return wallclock_usec();
+	}
+	UINT64 ticks = read_ticks();
+	return ticks / tick_freq * 1000000 +
+	       ticks % tick_freq * 1000000 / tick_freq;
+}
+
+VOID boottime_init(VOID)
+{
+	tick_freq = ticks_per_second();
+	timestamps[BG_PHASE_INIT] = boottime_now();
+}
+
+VOID boottime_mark(BG_BOOT_PHASE phase)
+{
+	if (phase < BG_PHASE_MAX) {
+		timestamps[phase] = boottime_now();
+	}
+}
+
+UINT64 boottime_usec(BG_BOOT_PHASE phase)
+{
+	return phase < BG_PHASE_MAX ? timestamps[phase] : 0;
+}
+
+BOOLEAN boottime_since_reset(VOID)
+{
+	return tick_freq != 0;
+}
+
+CHAR16 *boottime_phases_str(VOID)
+{
+	CHAR16 *str = AllocateZeroPool(PHASES_STR_SIZE * sizeof(CHAR16));
+	UINT64 last = timestamps[BG_PHASE_INIT];
+	UINTN pos = 0;
+
+	if (!str) {
+		return NULL;
+	}
+	for (UINTN i = BG_PHASE_INIT + 1; i < BG_PHASE_MAX; i++) {
+		if (!timestamps[i]) {
+			continue;
+		}
+		UINTN size = (PHASES_STR_SIZE - pos) * sizeof(CHAR16);
+
+		pos += SPrint(str + pos, size, L"%s%s=%ld", pos ? L" " : L"",
+			      phase_names[i], timestamps[i] - last);
+		last = timestamps[i];
+	}
+	return str;
+}
@@ -25,5 +25,11 @@ def bg_printenv():
         help="Comma-separated list of fields which are printed",
     )
     parser.add_argument("-r", "--raw", action="store_true", help="Raw output mode")
+    parser.add_argument(
+        "-F",
+        "--format",
+        choices=["json", "cbor"],
+        help="Machine-readable output of all selected environments",
+    )
     parser.add_argument("--usage", action="store_true", help="Give a short usage message")
     return parser
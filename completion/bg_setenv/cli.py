@@ -44,4 +44,23 @@ def bg_setenv():
         choices=["0", "1"],
         help="Set in_progress variable to simulate a running update process.",
     )
+    parser.add_argument(
+        "-l",
+        "--layout",
+        metavar="LAYOUT",
+        choices=["1", "2"],
+        help="Convert the user variables to layout 1 (default) or 2, which adds a sorted lookup table.",
+    )
+    parser.add_argument(
+        "-C",
+        "--compact",
+        action="store_true",
+        help="Store the environment in the compact file layout, which only holds the used part of the user variables. Requires a loader supporting it.",
+    )
+    parser.add_argument(
+        "-m",
+        "--manifest",
+        metavar="MANIFEST",
+        help="Generate multiple environment files in one go. Each line of MANIFEST holds the options for one file, including -f. Use - to read from stdin.",
+    )
     return parser
@@ -0,0 +1,157 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include "fwtables.h"
+#include "utils.h"
+
+typedef struct {
+	CHAR8 signature[4];
+	EFI_ACPI_SDT_HEADER *table;
+} ACPI_INDEX_ENTRY;
+
+static BOOLEAN acpi_indexed;
+static ACPI_INDEX_ENTRY *acpi_index;
+static UINTN acpi_index_count;
+
+static BOOLEAN smbios_indexed;
+/* first structure of each type */
+static UINT8 *smbios_index[256];
+
+static VOID acpi_index_add(EFI_ACPI_SDT_HEADER *table)
+{
+	ACPI_INDEX_ENTRY *entry = &acpi_index[acpi_index_count++];
+
+	CopyMem(entry->signature, table->signature,
+		sizeof(entry->signature));
+	entry->table = table;
+}
+
+static EFI_ACPI_ROOT_SDP_HEADER *locate_rsdp(VOID)
+{
+	EFI_CONFIGURATION_TABLE *ect = ST->ConfigurationTable;
+	EFI_GUID acpi_table_guid = ACPI_TABLE_GUID;
+	EFI_GUID acpi2_table_guid = ACPI_20_TABLE_GUID;
+	UINTN n;
+
+	for (n = 0; n < ST->NumberOfTableEntries; n++) {
+		if ((CompareGuid(&ect->VendorGuid, &acpi_table_guid) ||
+		     CompareGuid(&ect->VendorGuid, &acpi2_table_guid)) &&
+		    !strncmpa(ACPI_SIG_RSDP, (CHAR8 *)(ect->VendorTable), 8)) {
+			return (EFI_ACPI_ROOT_SDP_HEADER *)ect->VendorTable;
+		}
+		ect++;
+	}
+	return NULL;
+}
+
+static VOID acpi_build_index(VOID)
+{
+	EFI_ACPI_ROOT_SDP_HEADER *rsdp = locate_rsdp();
+	EFI_ACPI_SDT_HEADER *sdt;
+	UINTN n, count, entry_size;
+	UINT8 *entry_ptr;
+
+	if (!rsdp) {
+		return;
+	}
+	if (rsdp->revision > EFI_ACPI_ROOT_SDP_REVISION) {
+		ERROR(L"SDP revision not supported (%d)\n", rsdp->revision);
+		return;
+	}
+
+	if (rsdp->revision == EFI_ACPI_ROOT_SDP_REVISION) {
+		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->xsdt_address);
+		if (strncmpa(ACPI_SIG_XSDT, sdt->signature, 4)) {
+			return;
+		}
+		entry_size = sizeof(UINT64);
+	} else {
+		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->rsdt_address);
+		if (strncmpa(ACPI_SIG_RSDT, sdt->signature, 4)) {
+			return;
+		}
+		entry_size = sizeof(UINT32);
+	}
+
+	count = (sdt->length - sizeof(EFI_ACPI_SDT_HEADER)) / entry_size;
+	acpi_index = AllocatePool(count * sizeof(ACPI_INDEX_ENTRY));
+	if (!acpi_index) {
+		return;
+	}
+	entry_ptr = (UINT8 *)(sdt + 1);
+	for (n = 0; n < count; n++, entry_ptr += entry_size) {
+		UINT64 address = 0;
+
+		/* the entries are not naturally aligned in the XSDT */
+		CopyMem(&address, entry_ptr, entry_size);
+		if (address) {
+			acpi_index_add((EFI_ACPI_SDT_HEADER *)(UINTN)address);
+		}
+	}
+}
+
+EFI_ACPI_SDT_HEADER *acpi_find_table(const CHAR8 *signature)
+{
+	UINTN n;
+
+	if (!acpi_indexed) {
+		acpi_build_index();
+		acpi_indexed = TRUE;
+	}
+	for (n = 0; n < acpi_index_count; n++) {
+		if (!strncmpa((CHAR8 *)signature, acpi_index[n].signature,
+			      4)) {
+			return acpi_index[n].table;
+		}
+	}
+	return NULL;
+}
+
+static VOID smbios_build_index(VOID)
+{
+	SMBIOS_STRUCTURE_TABLE *table;
+	SMBIOS_STRUCTURE_POINTER strct;
+	UINT8 *str;
+	UINTN n;
+
+	if (LibGetSystemConfigurationTable(&SMBIOSTableGuid,
+					   (VOID **)&table) != EFI_SUCCESS) {
+		return;
+	}
+
+	strct.Raw = (UINT8 *)(uintptr_t)table->TableAddress;
+
+	for (n = 0; n < table->NumberOfSmbiosStructures; n++) {
+		if (!smbios_index[strct.Hdr->Type]) {
+			smbios_index[strct.Hdr->Type] = strct.Raw;
+		}
+		/* Read over any appended strings. */
+		str = strct.Raw + strct.Hdr->Length;
+		while (str[0] != 0 || str[1] != 0) {
+			str++;
+		}
+		strct.Raw = str + 2;
+	}
+}
+
+SMBIOS_STRUCTURE_POINTER smbios_find_struct(UINT8 type)
+{
+	SMBIOS_STRUCTURE_POINTER strct;
+
+	if (!smbios_indexed) {
+		smbios_build_index();
+		smbios_indexed = TRUE;
+	}
+	strct.Raw = smbios_index[type];
+	return strct;
+}
@@ -17,7 +17,7 @@
 #include <efi.h>
 #include <efilib.h>
 #include "simatic.h"
-#include "smbios.h"
+#include "fwtables.h"
 #include "utils.h"
 
 static UINT32 get_station_id(SMBIOS_STRUCTURE_POINTER oem_strct)
@@ -45,17 +45,9 @@ static UINT32 get_station_id(SMBIOS_STRUCTURE_POINTER oem_strct)
 
 UINT32 simatic_station_id(VOID)
 {
-	SMBIOS_STRUCTURE_TABLE *smbios_table;
 	SMBIOS_STRUCTURE_POINTER smbios_struct;
-	EFI_STATUS status;
 
-	status = LibGetSystemConfigurationTable(&SMBIOSTableGuid,
-						(VOID **)&smbios_table);
-	if (status != EFI_SUCCESS) {
-		return 0;
-	}
-
-	smbios_struct = smbios_find_struct(smbios_table, SMBIOS_TYPE_OEM_129);
+	smbios_struct = smbios_find_struct(SMBIOS_TYPE_OEM_129);
 	if (smbios_struct.Raw == NULL) {
 		return 0;
 	}
@@ -18,6 +18,7 @@
 #include <sys/io.h>
 #include <mmio.h>
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 /* #define AMDFCH_WDT_DEBUG */
 
@@ -105,14 +106,14 @@ static void amdfch_wdt_set_timeout_action_reboot(VOID)
 	writel(val, AMDFCH_WDT_CONTROL(watchdog.base));
 }
 
-static void amdfch_wdt_set_time(UINT32 t)
+static void amdfch_wdt_set_time(UINTN timeout)
 {
-	DebugPrint(L"\n-- amdfch_wdt_set_time(%d) ", t);
-	if (t < AMDFCH_WDT_MIN_TIMEOUT)
-		t = AMDFCH_WDT_MIN_TIMEOUT;
-	else if (t > AMDFCH_WDT_MAX_TIMEOUT)
-		t = AMDFCH_WDT_MAX_TIMEOUT;
+	/* in ticks of the 1 s resolution set by init() */
+	UINT32 t = wdt_secs_to_ticks(timeout, WDT_NSEC_PER_SEC,
+				     AMDFCH_WDT_MIN_TIMEOUT,
+				     AMDFCH_WDT_MAX_TIMEOUT);
 
+	DebugPrint(L"\n-- amdfch_wdt_set_time(%d) ", t);
 	/* Write new timeout value to watchdog COUNT register */
 	writel(t, AMDFCH_WDT_COUNT(watchdog.base));
 }
@@ -185,4 +186,9 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_SUCCESS;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_AMD, PCI_DEVICE_ID_AMD_CARRIZO_SMBUS},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -17,6 +17,7 @@
 #include <pci/header.h>
 #include <sys/io.h>
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 #define PCI_DEVICE_ID_INTEL_ITC		0x8186
 #define PCI_DEVICE_ID_INTEL_CENTERTON	0x0c60
@@ -35,6 +36,10 @@
 # define LOCK_WDT_LOCK			(1 << 0)
 # define LOCK_WDT_ENABLE		(1 << 1)
 
+/* 20 bit preload value, in steps of 2^15 periods of the 33 MHz clock */
+#define TIMER_PERIOD_NS			(30ULL << 15)
+#define TIMER_MAX			0xfffff
+
 static void unlock_timer_regs(UINT32 wdt_base)
 {
 	outb(0x80, wdt_base + RELOAD0_REG);
@@ -81,7 +86,8 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	INFO(L"Detected Intel Atom/Quark watchdog\n");
 
 	write_timer_regs(wdt_base, TIMER1_REG,
-			 ((timeout * 1000000000ULL) >> 15) / 30);
+			 wdt_secs_to_ticks(timeout, TIMER_PERIOD_NS, 1,
+					   TIMER_MAX));
 	write_timer_regs(wdt_base, TIMER2_REG, 0);
 
 	outb(CONFIG_RESET_ENABLE, wdt_base + CONFIG_REG);
@@ -91,4 +97,11 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return status;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_ITC},
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_CENTERTON},
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_QUARK_X1000},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -15,6 +15,7 @@
 #include <efi.h>
 #include <pci/header.h>
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 #define PCI_VENDOR_ID_HP		0x103c
 #define PCI_VENDOR_ID_HP_3PAR		0x1590
@@ -26,7 +27,8 @@
 #define HPWDT_TIMER_REG			0x70
 #define HPWDT_TIMER_CON			0x72
 
-#define SECS_TO_TICKS(secs)		((secs) * 1000 / 128)
+#define HPWDT_TICK_NS			(128 * WDT_NSEC_PER_MSEC)
+#define HPWDT_TICKS_MAX			0xffff
 
 #define PCI_GET_SUBSYS_VENDOR_ID(id)	(UINT16)(id)
 #define PCI_GET_SUBSYS_PRODUCT_ID(id)	(UINT16)((id) >> 16)
@@ -69,7 +71,8 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 
 	INFO(L"Detected HPE ProLiant watchdog\n");
 
-	reload = SECS_TO_TICKS(timeout);
+	reload = wdt_secs_to_ticks(timeout, HPWDT_TICK_NS, 1,
+				   HPWDT_TICKS_MAX);
 	status = pci_io->Mem.Write(
 	    pci_io, EfiPciIoWidthUint16, 1, HPWDT_TIMER_REG, 1, &reload);
 	if (EFI_ERROR(status)) {
@@ -86,4 +89,10 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_SUCCESS;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_HP, PCI_DEVICE_ID_ILO3},
+	{PCI_VENDOR_ID_HP_3PAR, PCI_DEVICE_ID_PCTRL},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
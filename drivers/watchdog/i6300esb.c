@@ -16,6 +16,7 @@
 #include <efilib.h>
 #include <pci/header.h>
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 #define PCI_DEVICE_ID_INTEL_ESB_9	0x25ab
 
@@ -27,6 +28,10 @@
 #define ESB_TIMER2_REG			0x04
 #define ESB_RELOAD_REG			0x0c
 
+/* 20 bit preload value, in steps of 2^15 periods of the 33 MHz clock */
+#define ESB_TIMER_PERIOD_NS		(30ULL << 15)
+#define ESB_TIMER_MAX			0xfffff
+
 static EFI_STATUS unlock_timer_regs(EFI_PCI_IO *pci_io)
 {
 	EFI_STATUS status;
@@ -62,7 +67,8 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 		return status;
 	}
 
-	value = ((timeout * 1000000000ULL) >> 15) / 30;
+	value = wdt_secs_to_ticks(timeout, ESB_TIMER_PERIOD_NS, 1,
+				  ESB_TIMER_MAX);
 	status = pci_io->Mem.Write(
 	    pci_io, EfiPciIoWidthUint32, 0, ESB_TIMER1_REG, 1, &value);
 	if (EFI_ERROR(status)) {
@@ -88,4 +94,9 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return status;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_ESB_9},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
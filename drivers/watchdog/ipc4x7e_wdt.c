@@ -20,6 +20,7 @@
 #include <mmio.h>
 #include "simatic.h"
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 #define PCI_DEVICE_ID_INTEL_SUNRISEPOINT_H_LPC	0xa150
 
@@ -30,6 +31,10 @@
 #define  SIMATIC_WD_TRIGGERED			(1 << 7)
 #define SIMATIC_WD_TRIGGER_REG			0x66
 
+/* timeouts covered by the scaler values in seconds, larger ones select the
+ * highest value, 7 */
+static const UINT8 scaler_limits[] = {2, 4, 6, 8, 16, 32, 48};
+
 #define SUNRISEPOINT_H_MMCFG_BASE		0xf0000000
 
 #define P2SB_PCIID				0x00
@@ -98,23 +103,10 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 			PAD_CFG_DW0_GPP_A_23;
 		writel(readl(pad_cfg) & ~PAD_CFG_GPIOTXSTATE, pad_cfg);
 
-		if (timeout <= 2) {
-			val = 0 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 4) {
-			val = 1 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 6) {
-			val = 2 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 8) {
-			val = 3 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 16) {
-			val = 4 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 32) {
-			val = 5 << SIMATIC_WD_SCALER_SHIFT;
-		} else if (timeout <= 48) {
-			val = 6 << SIMATIC_WD_SCALER_SHIFT;
-		} else {
-			val = 7 << SIMATIC_WD_SCALER_SHIFT;
-		}
+		val = wdt_select_range(timeout, scaler_limits,
+				       sizeof(scaler_limits) /
+					       sizeof(scaler_limits[0]))
+		      << SIMATIC_WD_SCALER_SHIFT;
 		val |= SIMATIC_WD_MACRO_MOD;
 		if (inb(SIMATIC_WD_ENABLE_REG) & SIMATIC_WD_TRIGGERED) {
 			WARNING(L"Detected watchdog triggered reboot\n");
@@ -137,4 +129,9 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	}
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_SUNRISEPOINT_H_LPC},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -15,8 +15,23 @@
 #include <efi.h>
 #include <pci/header.h>
 #include <sys/io.h>
-#include "smbios.h"
+#include "boottime.h"
+#include "fwtables.h"
 #include "utils.h"
+#include "watchdog_ticks.h"
+
+/* #define IPMI_WDT_DEBUG */
+
+#ifdef IPMI_WDT_DEBUG
+#define DebugPrint(fmt, ...) Print(fmt, ##__VA_ARGS__)
+#else
+/* keeps the timing variables used */
+#define DebugPrint(fmt, ...)                                                   \
+	do {                                                                   \
+		if (0)                                                         \
+			Print(fmt, ##__VA_ARGS__);                             \
+	} while (0)
+#endif
 
 #define SMBIOS_TYPE_IPMI_KCS		38
 #define IPMI_KCS_DEFAULT_IOBASE		0xca2
@@ -34,21 +49,30 @@
 #define IPMI_WDT_CMD_SET        	0x24
 #define  IPMI_WDT_SET_USE_OSLOAD        0x3
 #define  IPMI_WDT_SET_ACTION_HARD_RESET 0x1
+#define  IPMI_WDT_SET_TICK_NS		(100 * WDT_NSEC_PER_MSEC)
+#define  IPMI_WDT_SET_TICKS_MAX		0xffff
 
 #define kcs_sts_is_error(sts) (((sts >> 6 ) & 0x3) == 0x3)
 
+/*
+ * The BMC usually flips IBF/OBF within microseconds. Poll at that rate for a
+ * short while, then back off exponentially up to the stall used before.
+ */
+#define KCS_SPIN_POLLS			50
+#define KCS_STALL_MIN_USEC		10
+#define KCS_STALL_MAX_USEC		(1000 * 1000 / 10)
+
 static UINT8
 set_wdt_data[] = {IPMI_WDT_SET_USE_OSLOAD, IPMI_WDT_SET_ACTION_HARD_RESET,
 		  0x00, 0x00,0x00, 0x00};
 
 static EFI_EVENT cmdtimer;
 
-static BOOLEAN probed_before;
-
 static EFI_STATUS
 kcs_wait_iobf(UINT16 io_base, UINTN iobf)
 {
 	EFI_STATUS timerstatus = EFI_NOT_READY;
+	UINTN polls = 0, stall = 0;
 
 	while (timerstatus == EFI_NOT_READY) {
 		UINT8 sts = inb(io_base + 1);
@@ -64,7 +88,18 @@ kcs_wait_iobf(UINT16 io_base, UINTN iobf)
 			if (sts & IPMI_KCS_STS_OBF)
 				return EFI_SUCCESS;
 		}
-		BS->Stall(1000 * 1000 / 10);
+		if (polls < KCS_SPIN_POLLS) {
+			polls++;
+			BS->Stall(1);
+		} else {
+			if (stall == 0)
+				stall = KCS_STALL_MIN_USEC;
+			else if (stall < KCS_STALL_MAX_USEC / 2)
+				stall *= 2;
+			else
+				stall = KCS_STALL_MAX_USEC;
+			BS->Stall(stall);
+		}
 		timerstatus = BS->CheckEvent(cmdtimer);
 	}
 
@@ -135,6 +170,8 @@ send_ipmi_cmd(UINT16 io_base, UINT8 cmd, UINT8 *data, UINTN datalen)
 {
 	EFI_STATUS timerstatus;
 	EFI_STATUS status;
+	UINT64 start = boottime_now();
+	UINTN retries = 0;
 
 	/*
 	 * Guard every command with a 5s timeout where we retry and try to
@@ -145,11 +182,14 @@ send_ipmi_cmd(UINT16 io_base, UINT8 cmd, UINT8 *data, UINTN datalen)
 	do {
 		status = _send_ipmi_cmd(io_base, cmd, data, datalen);
 		if (status == EFI_SUCCESS)
-			return status;
+			break;
 		handle_ipmi_error(io_base);
+		retries++;
 		timerstatus = BS->CheckEvent(cmdtimer);
 	} while (timerstatus == EFI_NOT_READY);
 
+	DebugPrint(L"IPMI command 0x%x took %ld us, %ld retries\n", cmd,
+		   boottime_now() - start, (UINT64)retries);
 	return status;
 }
 
@@ -158,24 +198,12 @@ static EFI_STATUS init(__attribute__((unused)) EFI_PCI_IO *pci_io,
 		       __attribute__((unused)) UINT16 pci_device_id,
 		       UINTN timeout)
 {
-	SMBIOS_STRUCTURE_TABLE *smbios_table;
 	SMBIOS_STRUCTURE_POINTER smbios_struct;
 	EFI_STATUS status;
 	UINT64 io_base;
 	UINT16 *timeout_value;
 
-	/* We do not use PCI, and machines with IPMI have many PCI devices */
-	if (probed_before)
-		return EFI_UNSUPPORTED;
-	probed_before = TRUE;
-
-	status = LibGetSystemConfigurationTable(&SMBIOSTableGuid,
-						(VOID **)&smbios_table);
-
-	if (status != EFI_SUCCESS)
-		return EFI_UNSUPPORTED;
-
-	smbios_struct = smbios_find_struct(smbios_table, SMBIOS_TYPE_IPMI_KCS);
+	smbios_struct = smbios_find_struct(SMBIOS_TYPE_IPMI_KCS);
 
 	if (smbios_struct.Raw == NULL)
 		return EFI_UNSUPPORTED;
@@ -193,7 +221,8 @@ static EFI_STATUS init(__attribute__((unused)) EFI_PCI_IO *pci_io,
 
 	INFO(L"Detected IPMI watchdog at I/O 0x%x\n", io_base);
 	timeout_value = (UINT16 *)(set_wdt_data + 4);
-	*timeout_value = timeout * 10;
+	*timeout_value = wdt_secs_to_ticks(timeout, IPMI_WDT_SET_TICK_NS, 1,
+					   IPMI_WDT_SET_TICKS_MAX);
 
 	status = BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &cmdtimer);
 	if (status != EFI_SUCCESS)
@@ -19,6 +19,7 @@
 #include <sys/io.h>
 #include <mmio.h>
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 #define SMI_EN_REG		0x30
 #define TCO_EN			(1 << 13)
@@ -29,18 +30,9 @@
 #define TCO1_CNT_REG		0x08
 #define TCO_TMR_HLT_MASK	(1 << 11)
 #define TCO_TMR_REG		0x12
-
-enum iTCO_chipsets {
-	ITCO_INTEL_APL = 0,
-	ITCO_INTEL_BAYTRAIL,
-	ITCO_INTEL_WPT_LP,
-	ITCO_INTEL_ICH9,
-	ITCO_INTEL_LPC_NM10,
-	ITCO_INTEL_LPC_LP,
-	ITCO_INTEL_WBG,
-	ITCO_INTEL_EHL,
-	ITCO_INTEL_TLH,
-};
+/* values below are ignored by the hardware */
+#define TCO_TMR_MIN		0x004
+#define TCO_TMR_MAX		0x3ff
 
 enum iTCO_versions {
 	ITCO_V1 = 1,
@@ -108,79 +100,83 @@ static const iTCO_regs iTCO_version_regs[] = {
 	},
 };
 
+/* sorted by PCI ID for itco_lookup() */
 static const iTCO_info iTCO_chipset_info[] = {
-    [ITCO_INTEL_APL] =
-	{
-	    .name = L"Apollo Lake SoC",
-	    .pci_id = 0x5ae8,
-	    .itco_version = ITCO_V5,
-	},
-    [ITCO_INTEL_BAYTRAIL] =
 	{
 	    .name = L"Bay Trail SoC",
 	    .pci_id = 0x0f1c,
 	    .itco_version = ITCO_V3,
 	},
-    [ITCO_INTEL_WPT_LP] =
 	{
-	    .name = L"Wildcat Point_LP",
-	    .pci_id = 0x9cc3,
+	    .name = L"NM10",
+	    .pci_id = 0x27bc,
 	    .itco_version = ITCO_V2,
 	},
-    [ITCO_INTEL_ICH9] =
 	{
 	    .name = L"ICH9", /* QEmu machine q35 */
 	    .pci_id = 0x2918,
 	    .itco_version = ITCO_V2,
 	},
-    [ITCO_INTEL_LPC_NM10] =
 	{
-	    .name = L"NM10",
-	    .pci_id = 0x27bc,
-	    .itco_version = ITCO_V2,
+	    .name = L"Tiger Lake-H",
+	    .pci_id = 0x43a3,
+	    .itco_version = ITCO_V6,
+	},
+	{
+	    .name = L"Elkhart Lake",
+	    .pci_id = 0x4b23,
+	    .itco_version = ITCO_V6,
+	},
+	{
+	    .name = L"Apollo Lake SoC",
+	    .pci_id = 0x5ae8,
+	    .itco_version = ITCO_V5,
 	},
-    [ITCO_INTEL_LPC_LP] =
 	{
 	    .name = L"Lynx Point",
 	    .pci_id = 0x8c4e,
 	    .itco_version = ITCO_V2,
 	},
-    [ITCO_INTEL_WBG] =
 	{
 	    .name = L"Wellsburg",
 	    .pci_id = 0x8d44,
 	    .itco_version = ITCO_V2,
 	},
-    [ITCO_INTEL_EHL] =
 	{
-	    .name = L"Elkhart Lake",
-	    .pci_id = 0x4b23,
-	    .itco_version = ITCO_V6,
-	},
-    [ITCO_INTEL_TLH] =
-	{
-	    .name = L"Tiger Lake-H",
-	    .pci_id = 0x43a3,
-	    .itco_version = ITCO_V6,
+	    .name = L"Wildcat Point_LP",
+	    .pci_id = 0x9cc3,
+	    .itco_version = ITCO_V2,
 	},
 };
 
-static BOOLEAN itco_supported(UINT16 pci_device_id, UINT8 *index)
+static const iTCO_info *itco_lookup(UINT16 pci_device_id)
 {
-	for (UINT8 i = 0;
-	     i < (sizeof(iTCO_chipset_info) / sizeof(iTCO_chipset_info[0]));
-	     i++) {
-		if (pci_device_id == iTCO_chipset_info[i].pci_id) {
-			*index = i;
-			return TRUE;
+	UINTN low = 0;
+	UINTN high = sizeof(iTCO_chipset_info) / sizeof(iTCO_chipset_info[0]);
+
+	while (low < high) {
+		UINTN mid = low + (high - low) / 2;
+
+		if (iTCO_chipset_info[mid].pci_id < pci_device_id) {
+			low = mid + 1;
+		} else {
+			high = mid;
 		}
 	}
-	return FALSE;
+	if (low < sizeof(iTCO_chipset_info) / sizeof(iTCO_chipset_info[0]) &&
+	    iTCO_chipset_info[low].pci_id == pci_device_id) {
+		return &iTCO_chipset_info[low];
+	}
+	return NULL;
 }
 
 static UINTN get_timeout_value(UINT32 iTCO_version, UINTN seconds)
 {
-	return iTCO_version == ITCO_V3 ? seconds : ((seconds * 10 ) / 6);
+	/* ticks of 0.6 s, but of 1 s in version 3 */
+	UINT64 period = iTCO_version == ITCO_V3 ? WDT_NSEC_PER_SEC
+						: 600 * WDT_NSEC_PER_MSEC;
+
+	return wdt_secs_to_ticks(seconds, period, TCO_TMR_MIN, TCO_TMR_MAX);
 }
 
 static UINT32 get_pm_base(EFI_PCI_IO *pci_io, const iTCO_info *itco)
@@ -277,15 +273,13 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 		       UINT16 pci_device_id, UINTN timeout)
 {
 	UINT32 pm_base, tco_base, value;
-	UINT8 itco_chip;
 	const iTCO_info *itco;
 	EFI_STATUS status;
 
 	if (!pci_io || pci_vendor_id != PCI_VENDOR_ID_INTEL ||
-	    !itco_supported(pci_device_id, &itco_chip)) {
+	    !(itco = itco_lookup(pci_device_id))) {
 		return EFI_UNSUPPORTED;
 	}
-	itco = &iTCO_chipset_info[itco_chip];
 
 	INFO(L"Detected Intel TCO %s watchdog\n", itco->name);
 
@@ -308,7 +302,7 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	/* Set timer value */
 	value = inw(tco_base + TCO_TMR_REG);
 	value &= 0xfc00;
-	value |= get_timeout_value(itco->itco_version, timeout) & 0x3ff;
+	value |= get_timeout_value(itco->itco_version, timeout);
 	outw(value, tco_base + TCO_TMR_REG);
 
 	/* Force reloading of timer value */
@@ -341,4 +335,18 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_SUCCESS;
 }
 
-WATCHDOG_REGISTER(init);
+/* the devices of iTCO_chipset_info */
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_INTEL, 0x0f1c},
+	{PCI_VENDOR_ID_INTEL, 0x27bc},
+	{PCI_VENDOR_ID_INTEL, 0x2918},
+	{PCI_VENDOR_ID_INTEL, 0x43a3},
+	{PCI_VENDOR_ID_INTEL, 0x4b23},
+	{PCI_VENDOR_ID_INTEL, 0x5ae8},
+	{PCI_VENDOR_ID_INTEL, 0x8c4e},
+	{PCI_VENDOR_ID_INTEL, 0x8d44},
+	{PCI_VENDOR_ID_INTEL, 0x9cc3},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -43,6 +43,7 @@
 #include <mmio.h>
 #include "simatic.h"
 #include "utils.h"
+#include "watchdog_ticks.h"
 
 /* Use the host bridge device found on the BX-59A to limit probing to Intel
  * based machines that may be a BX59A; technically we do not use/need PCI
@@ -182,8 +183,10 @@ static int w83627hf_init(enum chips chip)
 	return 0;
 }
 
-static int wdt_set_time(unsigned int timeout)
+static int wdt_set_time(UINTN timeout)
 {
+	/* 8 bit counter in second mode, see w83627hf_init() */
+	UINT8 ticks = wdt_secs_to_ticks(timeout, WDT_NSEC_PER_SEC, 1, 0xff);
 	int ret;
 
 	ret = superio_enter();
@@ -191,7 +194,7 @@ static int wdt_set_time(unsigned int timeout)
 		return ret;
 
 	superio_select(W83627HF_LD_WDT);
-	superio_outb(cr_wdt_timeout, timeout);
+	superio_outb(cr_wdt_timeout, ticks);
 	superio_exit();
 
 	return 0;
@@ -224,4 +227,9 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_UNSUPPORTED;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_HOST_BRIDGE},
+	{0},
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
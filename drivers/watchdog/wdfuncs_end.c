@@ -15,7 +15,8 @@
 #include <efi.h>
 #include "utils.h"
 
-/* Section .wdfunc's end address for watchdog probing function pointers
+/* Section .wdfunc's end address for watchdog driver pointers
  * preceding this marker, if any. */
-WATCHDOG_PROBE wdfuncs_end __attribute__((used, section(".wdfuncs"))) =
-	(WATCHDOG_PROBE)0x4353;
+const WATCHDOG_DRIVER *wdfuncs_end
+	__attribute__((used, section(".wdfuncs"))) =
+	(const WATCHDOG_DRIVER *)0x4353;
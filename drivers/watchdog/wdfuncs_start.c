@@ -15,7 +15,8 @@
 #include <efi.h>
 #include "utils.h"
 
-/* Section .wdfunc's sentinel value and start address for watchdog probing
- * function pointers following this marker, if any. */
-WATCHDOG_PROBE wdfuncs_start __attribute__((used, section(".wdfuncs"))) =
-	(WATCHDOG_PROBE)0x5343;
+/* Section .wdfunc's sentinel value and start address for watchdog driver
+ * pointers following this marker, if any. */
+const WATCHDOG_DRIVER *wdfuncs_start
+	__attribute__((used, section(".wdfuncs"))) =
+	(const WATCHDOG_DRIVER *)0x5343;
@@ -0,0 +1,252 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "env_api.h"
+#include "ebgenvd.h"
+
+/* generation of the snapshot returned by the last ebgenvd_fetch() */
+static uint32_t snapshot_generation;
+
+const char *ebgenvd_socket_path(void)
+{
+	const char *path = getenv(EBGENVD_SOCKET_ENV);
+
+	return path && *path ? path : EBGENVD_SOCKET_PATH;
+}
+
+int ebgenvd_send(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t res = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int ebgenvd_recv(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t res = recv(fd, p, len, 0);
+
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (res == 0) {
+			return -ECONNRESET;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int ebgenvd_connect(void)
+{
+	struct timeval tv = {
+		.tv_sec = EBGENVD_TIMEOUT_MS / 1000,
+		.tv_usec = (EBGENVD_TIMEOUT_MS % 1000) * 1000,
+	};
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	const char *path = ebgenvd_socket_path();
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/* Sends a request and receives the response header. Returns the connected
+ * socket or a negative errno value, including the status of the daemon. */
+static int ebgenvd_request(uint16_t cmd, uint32_t index, uint32_t flags,
+			   const BG_ENVDATA *env,
+			   struct ebgenvd_response *resp)
+{
+	struct ebgenvd_request req = {
+		.magic = EBGENVD_MAGIC,
+		.version = EBGENVD_VERSION,
+		.cmd = cmd,
+		.index = index,
+		.flags = flags,
+		.generation = snapshot_generation,
+	};
+	int fd, res;
+
+	fd = ebgenvd_connect();
+	if (fd < 0) {
+		return fd;
+	}
+	res = ebgenvd_send(fd, &req, sizeof(req));
+	if (!res && env) {
+		res = ebgenvd_send(fd, env, sizeof(BG_ENVDATA));
+	}
+	if (!res) {
+		res = ebgenvd_recv(fd, resp, sizeof(*resp));
+	}
+	if (!res && resp->magic != EBGENVD_MAGIC) {
+		res = -EPROTO;
+	}
+	if (!res && resp->status > 0) {
+		res = -EPROTO;
+	}
+	if (!res) {
+		res = resp->status;
+	}
+	if (res) {
+		close(fd);
+		return res;
+	}
+	return fd;
+}
+
+bool ebgenvd_fetch(CONFIG_PART *parts, BG_ENVDATA *envs,
+		   bool search_all_devices)
+{
+	struct ebgenvd_response resp;
+	char devpath[PATH_MAX];
+	uint32_t len;
+	int fd, res = 0;
+	int i;
+
+	fd = ebgenvd_request(EBGENVD_CMD_GET, 0,
+			     search_all_devices ? EBGENVD_FLAG_ALL_DEVICES : 0,
+			     NULL, &resp);
+	if (fd < 0) {
+		/* no daemon running is the normal case */
+		if (fd != -ENOENT && fd != -ECONNREFUSED) {
+			VERBOSE(stderr, "Cannot query ebgenvd: %s\n",
+				strerror(-fd));
+		}
+		return false;
+	}
+	if (resp.num_parts != ENV_NUM_CONFIG_PARTS) {
+		VERBOSE(stderr, "ebgenvd uses %u config partitions.\n",
+			resp.num_parts);
+		close(fd);
+		return false;
+	}
+	memset(parts, 0, ENV_NUM_CONFIG_PARTS * sizeof(CONFIG_PART));
+	for (i = 0; i < ENV_NUM_CONFIG_PARTS && !res; i++) {
+		res = ebgenvd_recv(fd, &len, sizeof(len));
+		if (!res && len >= PATH_MAX) {
+			res = -EPROTO;
+		}
+		if (!res) {
+			res = ebgenvd_recv(fd, devpath, len);
+		}
+		if (!res) {
+			devpath[len] = '\0';
+			parts[i].devpath = bgenv_path_dup(devpath);
+			if (!parts[i].devpath) {
+				res = -ENOMEM;
+			}
+		}
+		if (!res) {
+			res = ebgenvd_recv(fd, &envs[i], sizeof(BG_ENVDATA));
+		}
+		/* writes are done by the daemon */
+		parts[i].not_mounted = true;
+	}
+	close(fd);
+	snapshot_generation = resp.generation;
+	if (res) {
+		VERBOSE(stderr, "Cannot query ebgenvd: %s\n", strerror(-res));
+		for (i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			bgenv_path_free(parts[i].devpath);
+			parts[i].devpath = NULL;
+		}
+		return false;
+	}
+	VERBOSE(stdout, "Using environments of ebgenvd.\n");
+	return true;
+}
+
+bool ebgenvd_write(uint32_t index, const BG_ENVDATA *env)
+{
+	struct ebgenvd_response resp;
+	int fd;
+
+	fd = ebgenvd_request(EBGENVD_CMD_WRITE, index, 0, env, &resp);
+	if (fd < 0) {
+		VERBOSE(stderr, "Cannot write via ebgenvd: %s\n",
+			strerror(-fd));
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+int ebgenvd_watch(struct ebgenvd_event *ev)
+{
+	struct ebgenvd_response resp;
+	int fd, res;
+
+	fd = ebgenvd_request(EBGENVD_CMD_WATCH, 0, 0, NULL, &resp);
+	if (fd < 0) {
+		return fd;
+	}
+	res = ebgenvd_recv(fd, ev, sizeof(*ev));
+	if (!res && ev->magic != EBGENVD_MAGIC) {
+		res = -EPROTO;
+	}
+	if (res) {
+		close(fd);
+		return res;
+	}
+	return fd;
+}
+
+int ebgenvd_reload(void)
+{
+	struct ebgenvd_response resp;
+	int fd;
+
+	fd = ebgenvd_request(EBGENVD_CMD_RELOAD, 0, 0, NULL, &resp);
+	if (fd < 0) {
+		return fd;
+	}
+	close(fd);
+	return 0;
+}
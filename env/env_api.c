@@ -13,12 +13,37 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <sys/queue.h>
 #include "env_api.h"
 #include "ebgenv.h"
 #include "uservars.h"
+#include "env_trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* global EBG options */
-ebgenv_opts_t ebgenv_opts;
+ebgenv_opts_t ebgenv_opts = {
+	.use_daemon = true,
+};
+
+typedef enum { EBG_TXN_SET, EBG_TXN_USTATE } EBG_TXN_TASK;
+
+struct txn_action {
+	EBG_TXN_TASK task;
+	char *key;
+	/* resolved when queued, not on every commit attempt */
+	EBGENVKEY e;
+	uint64_t type;
+	uint8_t *data;
+	uint32_t datalen;
+	STAILQ_ENTRY(txn_action) journal;
+};
+
+STAILQ_HEAD(txn_journal, txn_action);
 
 /* UEFI uses 16-bit wide unicode strings.
  * However, wchar_t support functions are fixed to 32-bit wide
@@ -60,8 +85,89 @@ char16_t *str8to16(char16_t *buffer, const char *src)
 	return tmp;
 }
 
+/* Both str16to8n() and str8to16n() convert by truncating, respectively
+ * zero-extending, 8 characters per step where SSE2 or NEON is available.
+ * Up to n - 1 characters are converted, the result is always terminated.
+ * src may be read up to n elements, or up to its terminator if that comes
+ * first for str8to16n(). The length of the result is returned. */
+size_t str16to8n(char *dst, const char16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	if (!dst || !src || n == 0) {
+		return 0;
+	}
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi16(0xFF);
+
+	for (; i + 8 < n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero))) {
+			break;
+		}
+		v = _mm_packus_epi16(_mm_and_si128(v, low), zero);
+		_mm_storel_epi64((__m128i *)(dst + i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 < n; i += 8) {
+		uint16x8_t v = vld1q_u16((const uint16_t *)(src + i));
+		uint8x8_t nul = vmovn_u16(vceqq_u16(v, vdupq_n_u16(0)));
+
+		if (vget_lane_u64(vreinterpret_u64_u8(nul), 0)) {
+			break;
+		}
+		vst1_u8((uint8_t *)(dst + i), vmovn_u16(v));
+	}
+#endif
+	for (; i + 1 < n && src[i]; i++) {
+		dst[i] = (char)src[i];
+	}
+	dst[i] = 0;
+	return i;
+}
+
+size_t str8to16n(char16_t *dst, const char *src, size_t n)
+{
+	size_t len, i = 0;
+
+	if (!dst || !src || n == 0) {
+		return 0;
+	}
+	len = strnlen(src, n - 1);
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8),
+				 _mm_unpackhi_epi8(v, zero));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+
+		vst1q_u16((uint16_t *)(dst + i), vmovl_u8(vget_low_u8(v)));
+		vst1q_u16((uint16_t *)(dst + i + 8),
+			  vmovl_u8(vget_high_u8(v)));
+	}
+#endif
+	for (; i < len; i++) {
+		dst[i] = (unsigned char)src[i];
+	}
+	dst[len] = 0;
+	return len;
+}
+
 int ebg_set_opt_bool(ebg_opt_t opt, bool value)
 {
+	int res = 0;
+
+	bgenv_lock_exclusive(NULL);
 	switch (opt) {
 	case EBG_OPT_PROBE_ALL_DEVICES:
 		ebgenv_opts.search_all_devices = value;
@@ -70,14 +176,42 @@ int ebg_set_opt_bool(ebg_opt_t opt, bool value)
 		ebgenv_opts.verbose = value;
 		bgenv_be_verbose(value);
 		break;
+	case EBG_OPT_INCREMENTAL_CRC:
+		ebgenv_opts.incremental_crc = value;
+		break;
+	case EBG_OPT_PARALLEL_PROBE:
+		ebgenv_opts.parallel_probe = value;
+		break;
+	case EBG_OPT_PROBE_CACHE:
+		ebgenv_opts.probe_cache = value;
+		break;
+	case EBG_OPT_USE_DAEMON:
+		ebgenv_opts.use_daemon = value;
+		break;
+	case EBG_OPT_COMPACT_ENV:
+		ebgenv_opts.compact_env = value;
+		break;
+	case EBG_OPT_STATS:
+		ebgenv_opts.stats = value;
+		break;
+	case EBG_OPT_PROBE_EARLY_EXIT:
+		ebgenv_opts.probe_early_exit = value;
+		break;
+	case EBG_OPT_PARALLEL_IO:
+		ebgenv_opts.parallel_io = value;
+		break;
 	default:
-		return EINVAL;
+		res = EINVAL;
 	}
-	return 0;
+	bgenv_unlock(NULL);
+	return res;
 }
 
 int ebg_get_opt_bool(ebg_opt_t opt, bool *value)
 {
+	int res = 0;
+
+	bgenv_lock_shared(NULL);
 	switch (opt) {
 	case EBG_OPT_PROBE_ALL_DEVICES:
 		*value = ebgenv_opts.search_all_devices;
@@ -85,10 +219,67 @@ int ebg_get_opt_bool(ebg_opt_t opt, bool *value)
 	case EBG_OPT_VERBOSE:
 		*value = ebgenv_opts.verbose;
 		break;
+	case EBG_OPT_INCREMENTAL_CRC:
+		*value = ebgenv_opts.incremental_crc;
+		break;
+	case EBG_OPT_PARALLEL_PROBE:
+		*value = ebgenv_opts.parallel_probe;
+		break;
+	case EBG_OPT_PROBE_CACHE:
+		*value = ebgenv_opts.probe_cache;
+		break;
+	case EBG_OPT_USE_DAEMON:
+		*value = ebgenv_opts.use_daemon;
+		break;
+	case EBG_OPT_COMPACT_ENV:
+		*value = ebgenv_opts.compact_env;
+		break;
+	case EBG_OPT_STATS:
+		*value = ebgenv_opts.stats;
+		break;
+	case EBG_OPT_PROBE_EARLY_EXIT:
+		*value = ebgenv_opts.probe_early_exit;
+		break;
+	case EBG_OPT_PARALLEL_IO:
+		*value = ebgenv_opts.parallel_io;
+		break;
 	default:
-		return EINVAL;
+		res = EINVAL;
 	}
-	return 0;
+	bgenv_unlock(NULL);
+	return res;
+}
+
+int ebg_set_opt_uint(ebg_opt_t opt, uint32_t value)
+{
+	int res = 0;
+
+	bgenv_lock_exclusive(NULL);
+	switch (opt) {
+	case EBG_OPT_PROBE_TIMEOUT_MS:
+		ebgenv_opts.probe_timeout_ms = value;
+		break;
+	default:
+		res = EINVAL;
+	}
+	bgenv_unlock(NULL);
+	return res;
+}
+
+int ebg_get_opt_uint(ebg_opt_t opt, uint32_t *value)
+{
+	int res = 0;
+
+	bgenv_lock_shared(NULL);
+	switch (opt) {
+	case EBG_OPT_PROBE_TIMEOUT_MS:
+		*value = ebgenv_opts.probe_timeout_ms;
+		break;
+	default:
+		res = EINVAL;
+	}
+	bgenv_unlock(NULL);
+	return res;
 }
 
 void ebg_beverbose(ebgenv_t __attribute__((unused)) * e, bool v)
@@ -96,7 +287,7 @@ void ebg_beverbose(ebgenv_t __attribute__((unused)) * e, bool v)
 	ebg_set_opt_bool(EBG_OPT_VERBOSE, v);
 }
 
-int ebg_env_create_new(ebgenv_t *e)
+static int env_create_new(ebgenv_t *e)
 {
 	if (!bgenv_init()) {
 		return EIO;
@@ -110,18 +301,11 @@ int ebg_env_create_new(ebgenv_t *e)
 	BG_ENVDATA *latest_data = ((BGENV *)latest_env)->data;
 
 	if (latest_data->in_progress != 1) {
-		e->bgenv = (void *)bgenv_create_new();
+		bgenv_close(latest_env);
+		e->bgenv = (void *)bgenv_create_staged();
 		if (!e->bgenv) {
-			bgenv_close(latest_env);
 			return errno;
 		}
-		BG_ENVDATA *new_data = ((BGENV *)e->bgenv)->data;
-		uint32_t new_rev = new_data->revision;
-		uint8_t new_in_progress = new_data->in_progress;
-		memcpy(new_data, latest_env->data, sizeof(BG_ENVDATA));
-		new_data->revision = new_rev;
-		new_data->in_progress = new_in_progress;
-		bgenv_close(latest_env);
 	} else {
 		e->bgenv = latest_env;
 	}
@@ -129,54 +313,216 @@ int ebg_env_create_new(ebgenv_t *e)
 	return 0;
 }
 
+int ebg_env_create_new(ebgenv_t *e)
+{
+	int res;
+
+	e->bgenv = NULL;
+	e->journal = NULL;
+	e->synced = false;
+	bgenv_lock_exclusive(NULL);
+	res = env_create_new(e);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
 int ebg_env_open_current(ebgenv_t *e)
 {
-	if (!bgenv_init()) {
-		return EIO;
+	e->bgenv = NULL;
+	e->journal = NULL;
+	e->synced = false;
+	bgenv_lock_exclusive(NULL);
+	if (bgenv_init()) {
+		e->bgenv = (void *)bgenv_open_latest();
 	}
-
-	e->bgenv = (void *)bgenv_open_latest();
+	bgenv_unlock(e->bgenv);
 
 	return e->bgenv == NULL ? EIO : 0;
 }
 
 int ebg_env_get(ebgenv_t *e, char *key, char *buffer)
 {
-	return bgenv_get((BGENV *)e->bgenv, key, NULL, buffer,
-			 ENV_STRING_LENGTH);
+	return ebg_env_get_ex(e, key, NULL, (uint8_t *)buffer,
+			      ENV_STRING_LENGTH);
 }
 
 int ebg_env_get_ex(ebgenv_t *e, char *key, uint64_t *usertype, uint8_t *buffer,
 		   uint32_t maxlen)
 {
-	return bgenv_get((BGENV *)e->bgenv, key, usertype, buffer, maxlen);
+	int res;
+
+	bgenv_lock_shared(e->bgenv);
+	res = bgenv_get((BGENV *)e->bgenv, key, usertype, buffer, maxlen);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+int ebg_env_get_u64(ebgenv_t *e, char *key, uint64_t *value)
+{
+	int res;
+
+	bgenv_lock_shared(e->bgenv);
+	res = bgenv_get_u64((BGENV *)e->bgenv, key, value);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+int ebg_env_get_view(ebgenv_t *e, char *key, uint64_t *datatype,
+		     const uint8_t **data, uint32_t *len)
+{
+	int res;
+
+	bgenv_lock_shared(e->bgenv);
+	res = bgenv_get_view((BGENV *)e->bgenv, key, datatype, data, len);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+static void txn_free_action(struct txn_action *action)
+{
+	free(action->key);
+	free(action->data);
+	free(action);
+}
+
+static int txn_add_action(struct txn_journal *journal, EBG_TXN_TASK task,
+			  char *key, uint64_t type, void *data,
+			  uint32_t datalen)
+{
+	struct txn_action *action;
+
+	if (!key || !data || datalen == 0) {
+		return -EINVAL;
+	}
+	action = calloc(1, sizeof(struct txn_action));
+	if (!action) {
+		return -ENOMEM;
+	}
+	action->task = task;
+	action->e = bgenv_str2enum(key);
+	action->type = type;
+	action->datalen = datalen;
+	action->key = strdup(key);
+	action->data = malloc(datalen);
+	if (!action->key || !action->data) {
+		txn_free_action(action);
+		return -ENOMEM;
+	}
+	memcpy(action->data, data, datalen);
+	STAILQ_INSERT_TAIL(journal, action, journal);
+	return 0;
+}
+
+static void txn_clear(struct txn_journal *journal)
+{
+	struct txn_action *action;
+
+	while ((action = STAILQ_FIRST(journal))) {
+		STAILQ_REMOVE_HEAD(journal, journal);
+		txn_free_action(action);
+	}
 }
 
 int ebg_env_set(ebgenv_t *e, char *key, char *value)
 {
-	return bgenv_set((BGENV *)e->bgenv, key, USERVAR_TYPE_DEFAULT |
-			 USERVAR_TYPE_STRING_ASCII, value,
-			 strlen(value) + 1);
+	return ebg_env_set_ex(e, key, USERVAR_TYPE_DEFAULT |
+			      USERVAR_TYPE_STRING_ASCII, (uint8_t *)value,
+			      strlen(value) + 1);
 }
 
 int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t usertype, uint8_t *value,
 		   uint32_t datalen)
 {
-	return bgenv_set((BGENV *)e->bgenv, key, usertype, value, datalen);
+	int res;
+
+	if (e->journal) {
+		return txn_add_action(e->journal, EBG_TXN_SET, key, usertype,
+				      value, datalen);
+	}
+	e->synced = false;
+	bgenv_lock_exclusive(e->bgenv);
+	res = bgenv_set((BGENV *)e->bgenv, key, usertype, value, datalen);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+int ebg_env_set_many(ebgenv_t *e, const ebg_uservar_t *vars, uint32_t count)
+{
+	/* recorded like a deletion through ebg_env_set_ex() */
+	uint8_t none = 0;
+	struct txn_journal added;
+	int res;
+
+	if (e->journal) {
+		/* the same checks as applying the records, so that none of
+		 * them fails on commit */
+		if ((!vars && count) || count > ENV_MEM_USERVARS) {
+			return -EINVAL;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			if (!vars[i].key || !vars[i].key[0] ||
+			    bgenv_str2enum(vars[i].key) != EBGENV_UNKNOWN) {
+				return -EINVAL;
+			}
+			if ((vars[i].type & USERVAR_TYPE_DELETED) == 0 &&
+			    (!vars[i].data || vars[i].len == 0)) {
+				return -EINVAL;
+			}
+		}
+		/* either all records are recorded or none */
+		STAILQ_INIT(&added);
+		for (uint32_t i = 0; i < count; i++) {
+			bool deleted = vars[i].type & USERVAR_TYPE_DELETED;
+
+			res = txn_add_action(&added, EBG_TXN_SET, vars[i].key,
+					     vars[i].type,
+					     deleted ? &none : vars[i].data,
+					     deleted ? 1 : vars[i].len);
+			if (res) {
+				txn_clear(&added);
+				return res;
+			}
+		}
+		STAILQ_CONCAT((struct txn_journal *)e->journal, &added);
+		return 0;
+	}
+	e->synced = false;
+	bgenv_lock_exclusive(e->bgenv);
+	res = bgenv_set_many((BGENV *)e->bgenv, vars, count);
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+int ebg_env_get_all(ebgenv_t *e, void *buffer, uint32_t size,
+		    uint32_t *count)
+{
+	int res;
+
+	bgenv_lock_shared(e->bgenv);
+	res = bgenv_get_all((BGENV *)e->bgenv, buffer, size, count);
+	bgenv_unlock(e->bgenv);
+	return res;
 }
 
 uint32_t ebg_env_user_free(ebgenv_t *e)
 {
+	uint32_t res;
+
 	if (!e->bgenv) {
 		return 0;
 	}
 	if (!((BGENV *)e->bgenv)->data) {
 		return 0;
 	}
-	return bgenv_user_free(((BGENV *)e->bgenv)->data->userdata);
+	bgenv_lock_shared(e->bgenv);
+	/* the index, if any, knows the used space without scanning */
+	res = bgenv_user_free_indexed(((BGENV *)e->bgenv)->uservar_index,
+				      ((BGENV *)e->bgenv)->data->userdata);
+	bgenv_unlock(e->bgenv);
+	return res;
 }
 
-uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
+static uint16_t env_getglobalstate(void)
 {
 	BGENV *env;
 	int res = USTATE_UNKNOWN;
@@ -191,8 +537,8 @@ uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
 		/* update was unsuccessful if there is a config,
 		 * with revision == REVISION_FAILED and
 		 * with ustate == USTATE_FAILED */
-		if (env->data->revision == REVISION_FAILED &&
-		    env->data->ustate == USTATE_FAILED) {
+		if (bgenv_get_revision(env) == REVISION_FAILED &&
+		    bgenv_get_ustate(env) == USTATE_FAILED) {
 			res = USTATE_FAILED;
 		}
 		bgenv_close(env);
@@ -207,27 +553,58 @@ uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
 		return res;
 	}
 
-	res = env->data->ustate;
+	res = bgenv_get_ustate(env);
 	bgenv_close(env);
 
 	return res;
 }
 
+uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
+{
+	uint16_t res;
+
+	bgenv_lock_shared(NULL);
+	res = env_getglobalstate();
+	bgenv_unlock(NULL);
+	return res;
+}
+
+static int ebg_env_confirm_all(uint16_t ustate);
+
 int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 {
-	char buffer[2];
+	uint8_t value = ustate;
 	int res;
 
 	if (ustate > USTATE_FAILED) {
 		return -EINVAL;
 	}
-	(void)snprintf(buffer, sizeof(buffer), "%d", ustate);
-	res = bgenv_set((BGENV *)e->bgenv, "ustate", 0, buffer,
-			strlen(buffer) + 1);
-
-	if (ustate != USTATE_OK) {
-		return res;
+	if (e->journal) {
+		/* stored as is, see env_commit() */
+		return txn_add_action(e->journal, EBG_TXN_USTATE, "ustate", 0,
+				      &value, sizeof(value));
+	}
+	e->synced = false;
+	bgenv_lock_exclusive(e->bgenv);
+	if (e->bgenv) {
+		bgenv_set_ustate((BGENV *)e->bgenv, value);
+		res = 0;
+	} else {
+		res = -EPERM;
+	}
+	if (ustate == USTATE_OK) {
+		res = ebg_env_confirm_all(ustate);
 	}
+	bgenv_unlock(e->bgenv);
+	return res;
+}
+
+/* Set ustate in all environments which do not have it yet and write them */
+static int ebg_env_confirm_all(uint16_t ustate)
+{
+	BGENV *envs[ENV_NUM_CONFIG_PARTS];
+	size_t count = 0;
+	int res = 0;
 
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
 		BGENV *env = bgenv_open_by_index(i);
@@ -235,20 +612,93 @@ int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 		if (!env) {
 			continue;
 		}
-		if (env->data->ustate != ustate) {
-			env->data->ustate = ustate;
-			env->data->crc32 = bgenv_crc32(0, env->data,
-				sizeof(BG_ENVDATA) - sizeof(env->data->crc32));
-			if (!bgenv_write(env)) {
-				bgenv_close(env);
-				return -EIO;
-			}
+		if (bgenv_get_ustate(env) == ustate) {
+			bgenv_close(env);
+			continue;
 		}
-		bgenv_close(env);
+		bgenv_set_ustate(env, ustate);
+		if (!env->crc_incremental) {
+			bgenv_update_crc(env);
+		}
+		envs[count++] = env;
+	}
+	if (count && !bgenv_write_all(envs, count)) {
+		res = -EIO;
+	}
+	for (size_t i = 0; i < count; i++) {
+		bgenv_close(envs[i]);
+	}
+	return res;
+}
+
+/* Keys registered for garbage collection, kept in an open addressing hash
+ * set, so that registering and looking up a key do not depend on how many
+ * there are. */
+struct gc_registry {
+	char **keys;		/* NULL marks a free slot */
+	uint32_t capacity;	/* number of slots, always a power of two */
+	uint32_t count;
+};
+
+#define GC_REGISTRY_MIN_CAPACITY 16
+
+/* FNV-1a, like the key hash of the user variables */
+static uint32_t gc_hash(const char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (uint8_t)*key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* slot holding key, or the free one it would be stored in */
+static char **gc_slot(const struct gc_registry *gc, const char *key)
+{
+	uint32_t mask = gc->capacity - 1;
+	uint32_t i = gc_hash(key) & mask;
+
+	while (gc->keys[i] && strcmp(gc->keys[i], key) != 0) {
+		i = (i + 1) & mask;
+	}
+	return &gc->keys[i];
+}
+
+static int gc_grow(struct gc_registry *gc)
+{
+	struct gc_registry grown;
+
+	grown.capacity = gc->capacity ? gc->capacity * 2
+				      : GC_REGISTRY_MIN_CAPACITY;
+	grown.count = gc->count;
+	grown.keys = calloc(grown.capacity, sizeof(char *));
+	if (!grown.keys) {
+		return ENOMEM;
 	}
+	for (uint32_t i = 0; i < gc->capacity; i++) {
+		if (gc->keys[i]) {
+			*gc_slot(&grown, gc->keys[i]) = gc->keys[i];
+		}
+	}
+	free(gc->keys);
+	*gc = grown;
 	return 0;
 }
 
+static void gc_free(struct gc_registry *gc)
+{
+	if (!gc) {
+		return;
+	}
+	for (uint32_t i = 0; i < gc->capacity; i++) {
+		free(gc->keys[i]);
+	}
+	free(gc->keys);
+	free(gc);
+}
+
 int ebg_env_close(ebgenv_t *e)
 {
 	int res = 0;
@@ -261,67 +711,270 @@ int ebg_env_close(ebgenv_t *e)
 	BGENV *env_current;
 	env_current = (BGENV *)e->bgenv;
 
-	/* recalculate checksum */
-	env_current->data->crc32 =
-	    bgenv_crc32(0, env_current->data,
-			sizeof(BG_ENVDATA) - sizeof(env_current->data->crc32));
-	/* save */
-	if (!bgenv_write(env_current)) {
-		res = EIO;
+	EBG_TRACE2(close_entry, env_current->data->revision, e->synced);
+	ebg_env_abort(e);
+	bgenv_lock_exclusive(env_current);
+	if (!e->synced) {
+		/* recalculate checksum, unless it is kept up to date on each
+		 * edit */
+		if (!env_current->crc_incremental) {
+			bgenv_update_crc(env_current);
+		}
+		/* save */
+		if (!bgenv_write(env_current)) {
+			res = EIO;
+		}
 	}
 	bgenv_close(env_current);
 	e->bgenv = NULL;
+	e->synced = false;
+	/* registered, but the update was not finalized */
+	gc_free(e->gc_registry);
+	e->gc_registry = NULL;
 	bgenv_finalize();
+	bgenv_unlock(NULL);
+	EBG_TRACE1(close_return, res);
+	return res;
+}
+
+int ebg_env_begin(ebgenv_t *e)
+{
+	struct txn_journal *journal;
+
+	if (!e->bgenv) {
+		return EIO;
+	}
+	if (e->journal) {
+		return EBUSY;
+	}
+	journal = calloc(1, sizeof(struct txn_journal));
+	if (!journal) {
+		return ENOMEM;
+	}
+	STAILQ_INIT(journal);
+	e->journal = journal;
+	return 0;
+}
+
+void ebg_env_abort(ebgenv_t *e)
+{
+	struct txn_journal *journal = e->journal;
+
+	if (!journal) {
+		return;
+	}
+	txn_clear(journal);
+	free(journal);
+	e->journal = NULL;
+}
+
+static int env_commit(ebgenv_t *e)
+{
+	struct txn_journal *journal = e->journal;
+	struct txn_action *action;
+	BGENV *env = (BGENV *)e->bgenv;
+	BG_ENVDATA *staging;
+	BGENV staged_env;
+	bool confirm = false;
+	int res = 0;
+
+	if (!journal) {
+		return EINVAL;
+	}
+	if (!env || !env->data) {
+		ebg_env_abort(e);
+		return EIO;
+	}
+
+	/* apply all actions to a copy, so that a failing one leaves the
+	 * environment untouched */
+	staging = malloc(sizeof(BG_ENVDATA));
+	if (!staging) {
+		ebg_env_abort(e);
+		return ENOMEM;
+	}
+	memcpy(staging, env->data, sizeof(BG_ENVDATA));
+	memset(&staged_env, 0, sizeof(staged_env));
+	staged_env.desc = env->desc;
+	staged_env.data = staging;
+	/* nobody else sees the copy, so records are only moved once at the
+	 * end */
+	staged_env.uservar_index = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	if (staged_env.uservar_index) {
+		bgenv_uservar_batch_begin(staged_env.uservar_index,
+					  staging->userdata);
+	}
+
+	STAILQ_FOREACH(action, journal, journal) {
+		if (action->task == EBG_TXN_USTATE) {
+			bgenv_set_ustate(&staged_env, action->data[0]);
+			confirm = action->data[0] == USTATE_OK;
+			continue;
+		}
+		res = -bgenv_set_key(&staged_env, action->e, action->key,
+				     action->type, action->data,
+				     action->datalen);
+		if (res) {
+			break;
+		}
+	}
+	bgenv_uservar_batch_end(staged_env.uservar_index, staging->userdata);
+	bgenv_uservar_index_free(staged_env.uservar_index);
+	ebg_env_abort(e);
+	if (res) {
+		free(staging);
+		return res;
+	}
+
+	memcpy(env->data, staging, sizeof(BG_ENVDATA));
+	free(staging);
+	bgenv_uservar_index_invalidate(env->uservar_index);
+	bgenv_update_crc(env);
+	if (!bgenv_write(env)) {
+		e->synced = false;
+		return EIO;
+	}
+	e->synced = true;
+
+	if (confirm) {
+		/* the current environment already has the state and is
+		 * skipped */
+		res = -ebg_env_confirm_all(USTATE_OK);
+	}
+	return res;
+}
+
+int ebg_env_commit(ebgenv_t *e)
+{
+	int res;
+
+	if (!e->journal) {
+		return EINVAL;
+	}
+	bgenv_lock_exclusive(e->bgenv);
+	res = env_commit(e);
+	bgenv_unlock(e->bgenv);
 	return res;
 }
 
 int ebg_env_register_gc_var(ebgenv_t *e, char *key)
 {
-	GC_ITEM **pgci;
-	pgci = (GC_ITEM **)&e->gc_registry;
+	struct gc_registry *gc = e->gc_registry;
+	char **slot;
 
 	if (!key) {
 		return EINVAL;
 	}
-	while (*pgci) {
-		pgci = &((*pgci)->next);
+	if (!gc) {
+		gc = calloc(1, sizeof(struct gc_registry));
+		if (!gc) {
+			return ENOMEM;
+		}
+		e->gc_registry = gc;
 	}
-	*pgci = (GC_ITEM *)calloc(1, sizeof(GC_ITEM));
-	if (!*pgci) {
+	/* keep the load factor below 3/4 */
+	if ((gc->count + 1) * 4 > gc->capacity * 3 && gc_grow(gc)) {
 		return ENOMEM;
 	}
-	if (asprintf(&((*pgci)->key), "%s", key) == -1) {
-		free(*pgci);
-		*pgci = NULL;
+	slot = gc_slot(gc, key);
+	if (*slot) {
+		/* registered already */
+		return 0;
+	}
+	*slot = strdup(key);
+	if (!*slot) {
 		return ENOMEM;
 	}
+	gc->count++;
 	return 0;
 }
 
-int ebg_env_finalize_update(ebgenv_t *e)
+static void env_finalize_update(ebgenv_t *e)
 {
-	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
-		return EIO;
+	struct gc_registry *gc = e->gc_registry;
+	BGENV *env = (BGENV *)e->bgenv;
+	BGENV_USERVAR_INDEX batch = {0};
+
+	e->synced = false;
+	uint8_t *udata, *var;
+	size_t start, end;
+	uint32_t crc_before;
+	bool v2;
+
+	/* delete all registered variables in one walk over the records,
+	 * moving the others only once */
+	udata = env->data->userdata;
+	start = end = offsetof(BG_ENVDATA, userdata);
+	v2 = bgenv_uservars_v2(udata);
+	if (v2) {
+		/* the batch starts with removing the table of layout v2 */
+		end = start + ENV_MEM_USERVARS;
+	} else if (gc && gc->count) {
+		/* only the records from the first deleted one on move */
+		for (var = udata; *var; var = bgenv_next_uservar(var)) {
+			char *key;
+
+			bgenv_map_uservar(var, &key, NULL, NULL, NULL, NULL);
+			if (*gc_slot(gc, key)) {
+				start = var - (uint8_t *)env->data;
+				end = offsetof(BG_ENVDATA, userdata) +
+				      ENV_MEM_USERVARS - bgenv_user_free(udata);
+				break;
+			}
+		}
 	}
-
-	GC_ITEM *pgci, *tmp;
-	uint8_t *udata;
-
-	pgci = (GC_ITEM *)e->gc_registry;
-	udata = ((BGENV *)e->bgenv)->data->userdata;
-	while (pgci) {
-		uint8_t *var;
-		var = bgenv_find_uservar(udata, pgci->key);
-		if (var) {
-			bgenv_del_uservar(udata, var);
+	crc_before = bgenv_crc_edit_begin(env, start, end);
+	if (!bgenv_uservar_batch_begin(&batch, udata)) {
+		/* without an index, delete one variable after the other */
+		for (uint32_t i = 0; gc && i < gc->capacity; i++) {
+			if (!gc->keys[i]) {
+				continue;
+			}
+			var = bgenv_find_uservar(udata, gc->keys[i]);
+			if (var) {
+				bgenv_del_uservar(udata, var);
+			}
 		}
-		free(pgci->key);
-		tmp = pgci->next;
-		free(pgci);
-		pgci = tmp;
 	}
+	for (var = udata; batch.batch && gc && gc->count && *var;
+	     var = bgenv_next_uservar(var)) {
+		uint64_t type;
+		char *key;
+		char **slot;
+
+		bgenv_map_uservar(var, &key, &type, NULL, NULL, NULL);
+		slot = gc_slot(gc, key);
+		/* dead records of the batch are skipped */
+		if (*slot && (type & USERVAR_TYPE_DELETED) == 0) {
+			/* deleting only marks the record dead, it stays
+			 * where it is */
+			bgenv_set_uservar_indexed(&batch, udata, *slot,
+						  USERVAR_TYPE_DELETED, *slot,
+						  1);
+		}
+	}
+	gc_free(gc);
+	e->gc_registry = NULL;
+	bgenv_uservar_batch_end(&batch, udata);
+	bgenv_crc_edit_end(env, start, end, crc_before);
+	free(batch.slots);
+	bgenv_uservar_index_invalidate(env->uservar_index);
+
+	bgenv_set_in_progress(env, 0);
+	bgenv_set_ustate(env, USTATE_INSTALLED);
+}
 
-	((BGENV *)e->bgenv)->data->in_progress = 0;
-	((BGENV *)e->bgenv)->data->ustate = USTATE_INSTALLED;
+int ebg_env_finalize_update(ebgenv_t *e)
+{
+	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
+		return EIO;
+	}
+	bgenv_lock_exclusive(e->bgenv);
+	EBG_TRACE1(finalize_update_entry,
+		   ((BGENV *)e->bgenv)->data->revision);
+	env_finalize_update(e);
+	EBG_TRACE1(finalize_update_return,
+		   ((BGENV *)e->bgenv)->data->revision);
+	bgenv_unlock(e->bgenv);
 	return 0;
 }
@@ -51,7 +51,28 @@
  * CRC32 code derived from work by Gary S. Brown.
  */
 
+/*
+ * On top of the classic byte-at-a-time loop, this file provides a
+ * slicing-by-8 variant and, where the CPU supports it, variants based on
+ * carry-less multiplication (x86_64 PCLMULQDQ) or the ARMv8 CRC32
+ * instructions. All of them compute the very same CRC as the firmware's
+ * BS->CalculateCrc32(), the backend is selected once at runtime.
+ */
+
+#include <endian.h>
+#include <pthread.h>
 #include "env_api.h"
+#include "env_stats.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32_PCLMUL
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32_ARMV8
+#endif
 
 static uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -99,16 +120,353 @@ static uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t
-bgenv_crc32(uint32_t crc, const void *buf, size_t size)
+/* crc32_tab extended by seven tables for processing 8 bytes at once */
+static uint32_t crc32_slice_tab[7][256];
+
+static void crc32_init_slice_tab(void)
+{
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = crc32_tab[i];
+
+		for (int k = 0; k < 7; k++) {
+			crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
+			crc32_slice_tab[k][i] = crc;
+		}
+	}
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
 {
-	const uint8_t *p;
+	uint32_t v;
 
-	p = buf;
-	crc = crc ^ ~0U;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
 
+/* All backends operate on the pre-inverted CRC register. */
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *p, size_t size)
+{
 	while (size--)
 		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return crc ^ ~0U;
+	return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size >= 8) {
+		uint32_t lo = crc ^ get_le32(p);
+		uint32_t hi = get_le32(p + 4);
+
+		crc = crc32_slice_tab[6][lo & 0xFF] ^
+		      crc32_slice_tab[5][(lo >> 8) & 0xFF] ^
+		      crc32_slice_tab[4][(lo >> 16) & 0xFF] ^
+		      crc32_slice_tab[3][lo >> 24] ^
+		      crc32_slice_tab[2][hi & 0xFF] ^
+		      crc32_slice_tab[1][(hi >> 8) & 0xFF] ^
+		      crc32_slice_tab[0][(hi >> 16) & 0xFF] ^
+		      crc32_tab[hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32_bytewise(crc, p, size);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/*
+ * Folding with carry-less multiplication as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction". The
+ * constants are given in the bit-reflected domain. Requires size >= 64 and
+ * a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *p, size_t size)
+{
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = {
+		0x0154442bd4, 0x01c6e41596};
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = {
+		0x01751997d0, 0x00ccaa009e};
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = {
+		0x0163cd6124, 0x0000000000};
+	static const uint64_t __attribute__((aligned(16))) poly[] = {
+		0x01db710641, 0x01f7011641};
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	p += 64;
+	size -= 64;
+
+	/* fold 4 x 128 bits in parallel */
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		size -= 64;
+	}
+
+	/* fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold remaining 16 byte blocks */
+	while (size >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+		size -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	if (size >= 64) {
+		size_t blocks = size & ~(size_t)15;
+
+		crc = crc32_pclmul_fold(crc, p, blocks);
+		p += blocks;
+		size -= blocks;
+	}
+
+	return crc32_slice8(crc, p, size);
+}
+
+static bool crc32_pclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+}
+#endif /* HAVE_CRC32_PCLMUL */
+
+#ifdef HAVE_CRC32_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, le64toh(v));
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = __crc32b(crc, *p++);
+	}
+
+	return crc;
+}
+
+static bool crc32_armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif /* HAVE_CRC32_ARMV8 */
+
+typedef uint32_t (*CRC32_FUNC)(uint32_t, const uint8_t *, size_t);
+
+static uint32_t crc32_resolve(uint32_t crc, const uint8_t *p, size_t size);
+
+/* Threads may race for the first CRC, so the pointer is published with
+ * release semantics after the tables it relies on are set up. */
+static CRC32_FUNC crc32_impl = crc32_resolve;
+static pthread_once_t crc32_auto_once = PTHREAD_ONCE_INIT;
+static pthread_once_t crc32_slice_tab_once = PTHREAD_ONCE_INIT;
+
+static inline CRC32_FUNC crc32_get_impl(void)
+{
+	return __atomic_load_n(&crc32_impl, __ATOMIC_ACQUIRE);
+}
+
+static inline void crc32_set_impl(CRC32_FUNC impl)
+{
+	__atomic_store_n(&crc32_impl, impl, __ATOMIC_RELEASE);
+}
+
+static void crc32_select_auto(void)
+{
+	bgenv_crc32_select(BGENV_CRC32_AUTO);
+}
+
+static uint32_t crc32_resolve(uint32_t crc, const uint8_t *p, size_t size)
+{
+	pthread_once(&crc32_auto_once, crc32_select_auto);
+	return crc32_get_impl()(crc, p, size);
+}
+
+bool bgenv_crc32_select(BGENV_CRC32_BACKEND backend)
+{
+	pthread_once(&crc32_slice_tab_once, crc32_init_slice_tab);
+
+	switch (backend) {
+	case BGENV_CRC32_AUTO:
+#ifdef HAVE_CRC32_PCLMUL
+		if (crc32_pclmul_supported()) {
+			crc32_set_impl(crc32_pclmul);
+			return true;
+		}
+#endif
+#ifdef HAVE_CRC32_ARMV8
+		if (crc32_armv8_supported()) {
+			crc32_set_impl(crc32_armv8);
+			return true;
+		}
+#endif
+		crc32_set_impl(crc32_slice8);
+		return true;
+	case BGENV_CRC32_BYTEWISE:
+		crc32_set_impl(crc32_bytewise);
+		return true;
+	case BGENV_CRC32_SLICE8:
+		crc32_set_impl(crc32_slice8);
+		return true;
+	case BGENV_CRC32_PCLMUL:
+#ifdef HAVE_CRC32_PCLMUL
+		if (crc32_pclmul_supported()) {
+			crc32_set_impl(crc32_pclmul);
+			return true;
+		}
+#endif
+		return false;
+	case BGENV_CRC32_ARMV8:
+#ifdef HAVE_CRC32_ARMV8
+		if (crc32_armv8_supported()) {
+			crc32_set_impl(crc32_armv8);
+			return true;
+		}
+#endif
+		return false;
+	}
+	return false;
+}
+
+uint32_t
+bgenv_crc32(uint32_t crc, const void *buf, size_t size)
+{
+	uint64_t start = bgenv_stat_begin();
+
+	crc = crc32_get_impl()(crc ^ ~0U, buf, size) ^ ~0U;
+	bgenv_stat_end(&bgenv_stats.crc32, start, size);
+	return crc;
+}
+
+uint32_t bgenv_crc32_raw(const void *buf, size_t size)
+{
+	uint64_t start = bgenv_stat_begin();
+	uint32_t crc;
+
+	crc = crc32_get_impl()(0, buf, size);
+	bgenv_stat_end(&bgenv_stats.crc32, start, size);
+	return crc;
+}
+
+/* Polynomial multiplication modulo the (reflected) CRC32 polynomial */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	while (m) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+/* x^(8 * len) modulo the CRC32 polynomial */
+static uint32_t crc32_x8nmodp(size_t len)
+{
+	static uint32_t x2n_tab[32];
+	uint32_t p = 1U << 31;
+	unsigned int k = 3;
+
+	if (!x2n_tab[0]) {
+		uint32_t x = 1U << 30;
+
+		for (int n = 0; n < 32; n++) {
+			x2n_tab[n] = x;
+			x = crc32_multmodp(x, x);
+		}
+	}
+	while (len) {
+		if (len & 1) {
+			p = crc32_multmodp(x2n_tab[k & 31], p);
+		}
+		len >>= 1;
+		k++;
+	}
+	return p;
+}
+
+uint32_t bgenv_crc32_shift(uint32_t crc, size_t len)
+{
+	return crc32_multmodp(crc32_x8nmodp(len), crc);
+}
+
+uint32_t bgenv_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return bgenv_crc32_shift(crc1, len2) ^ crc2;
 }
@@ -12,37 +12,62 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <pthread.h>
+#include <sys/stat.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_stats.h"
+#include "env_trace.h"
 #include "uservars.h"
+#include "ebgenvd.h"
 #include "test-interface.h"
 #include "ebgpart.h"
+#include "fat.h"
+#include "thread_pool.h"
 
 extern ebgenv_opts_t ebgenv_opts;
 
+#define BGENV_KEY_NAME(key, field, ...) [EBGENV_##key] = #field,
+
+static const char *const bgenv_key_names[EBGENV_UNKNOWN] = {
+	BGENV_STRING_FIELDS(BGENV_KEY_NAME)
+	BGENV_UINT_FIELDS(BGENV_KEY_NAME)
+};
+
+#undef BGENV_KEY_NAME
+
+/* Every key, and thus every user variable, ends up here. The first
+ * character, and the seventh for the two kernel keys, leave at most one
+ * candidate to compare with. */
 EBGENVKEY bgenv_str2enum(char *key)
 {
-	if (strcmp(key, "kernelfile") == 0) {
-		return EBGENV_KERNELFILE;
-	}
-	if (strcmp(key, "kernelparams") == 0) {
-		return EBGENV_KERNELPARAMS;
-	}
-	if (strcmp(key, "watchdog_timeout_sec") == 0) {
-		return EBGENV_WATCHDOG_TIMEOUT_SEC;
-	}
-	if (strcmp(key, "revision") == 0) {
-		return EBGENV_REVISION;
-	}
-	if (strcmp(key, "ustate") == 0) {
-		return EBGENV_USTATE;
-	}
-	if (strcmp(key, "in_progress") == 0) {
-		return EBGENV_IN_PROGRESS;
+	EBGENVKEY e;
+
+	switch (key[0]) {
+	case 'k':
+		if (strncmp(key, "kernel", 6) != 0) {
+			return EBGENV_UNKNOWN;
+		}
+		e = key[6] == 'f' ? EBGENV_KERNELFILE : EBGENV_KERNELPARAMS;
+		break;
+	case 'w':
+		e = EBGENV_WATCHDOG_TIMEOUT_SEC;
+		break;
+	case 'r':
+		e = EBGENV_REVISION;
+		break;
+	case 'u':
+		e = EBGENV_USTATE;
+		break;
+	case 'i':
+		e = EBGENV_IN_PROGRESS;
+		break;
+	default:
+		return EBGENV_UNKNOWN;
 	}
-	return EBGENV_UNKNOWN;
+	return strcmp(key, bgenv_key_names[e]) == 0 ? e : EBGENV_UNKNOWN;
 }
 
 void bgenv_be_verbose(bool v)
@@ -57,7 +82,18 @@ static void clear_envdata(BG_ENVDATA *data)
 				  sizeof(BG_ENVDATA) - sizeof(data->crc32));
 }
 
-bool validate_envdata(BG_ENVDATA *data)
+static bool validate_envdata_uservars(BG_ENVDATA *data)
+{
+	if (!bgenv_validate_uservars(data->userdata)) {
+		VERBOSE(stderr, "Corrupt uservars!\n");
+		/* clear invalid environment */
+		clear_envdata(data);
+		return false;
+	}
+	return true;
+}
+
+static bool validate_envdata_crc(BG_ENVDATA *data)
 {
 	uint32_t sum = bgenv_crc32(0, data,
 				   sizeof(BG_ENVDATA) - sizeof(data->crc32));
@@ -68,20 +104,165 @@ bool validate_envdata(BG_ENVDATA *data)
 		clear_envdata(data);
 		return false;
 	}
-	if (!bgenv_validate_uservars(data->userdata)) {
-		VERBOSE(stderr, "Corrupt uservars!\n");
-		/* clear invalid environment */
-		clear_envdata(data);
+	return true;
+}
+
+bool validate_envdata(BG_ENVDATA *data)
+{
+	return validate_envdata_crc(data) && validate_envdata_uservars(data);
+}
+
+/* Takes the size bytes of an environment file at buf into env, see
+ * BG_ENVHEADER for the layouts. The CRC of compact files is checked here,
+ * only over the bytes stored, env->crc32 is then set to the one of the
+ * fixed layout. buf may be env itself. */
+static bool decode_env(CONFIG_PART *part, BG_ENVDATA *env,
+		       const uint8_t *buf, size_t size)
+{
+	int64_t len;
+	uint32_t crc;
+
+	if (size == sizeof(BG_ENVDATA)) {
+		if (buf != (const uint8_t *)env) {
+			memcpy(env, buf, sizeof(BG_ENVDATA));
+		}
+		part->compact = false;
+		return true;
+	}
+	len = bgenv_compact_userdata_len(buf, size);
+	if (len < 0) {
+		VERBOSE(stderr, "Unexpected size of %s on %s.\n",
+			FAT_ENV_FILENAME, part->devpath);
 		return false;
 	}
+	memcpy(&crc, buf + size - sizeof(crc), sizeof(crc));
+	if (bgenv_crc32(0, buf, size - sizeof(crc)) != crc) {
+		VERBOSE(stderr, "Invalid CRC32!\n");
+		part->status = BGENV_CHECK_CRC;
+		return false;
+	}
+	memmove(env, buf + sizeof(BG_ENVHEADER), ENV_FIXED_FIELDS_SIZE + len);
+	memset(env->userdata + len, 0, ENV_MEM_USERVARS - len);
+	/* the remaining userdata is zero */
+	crc = bgenv_crc32(0, env, ENV_FIXED_FIELDS_SIZE + len);
+	env->crc32 = ~bgenv_crc32_shift(~crc, ENV_MEM_USERVARS - len);
+	part->compact = true;
 	return true;
 }
 
-bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
+/* Returns the file contents for env, in the compact layout if the file is
+ * already compact or that was requested and it is smaller. Must be freed
+ * unless it is env itself. */
+static uint8_t *encode_env(CONFIG_PART *part, BG_ENVDATA *env, size_t *size,
+			   bool *compact)
 {
-	if (!part) {
+	BG_ENVHEADER hdr = {
+		.magic = ENV_HEADER_MAGIC,
+		.version = ENV_HEADER_VERSION,
+		.header_len = sizeof(BG_ENVHEADER),
+	};
+	uint8_t *buf;
+	uint32_t crc;
+
+	*compact = false;
+	*size = sizeof(BG_ENVDATA);
+	if (!part->compact && !ebgenv_opts.compact_env) {
+		return (uint8_t *)env;
+	}
+	hdr.userdata_len = bgenv_userdata_used(env);
+	if (bgenv_compact_size(hdr.userdata_len) >= sizeof(BG_ENVDATA)) {
+		return (uint8_t *)env;
+	}
+	*size = bgenv_compact_size(hdr.userdata_len);
+	buf = malloc(*size);
+	if (!buf) {
+		return NULL;
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), env,
+	       ENV_FIXED_FIELDS_SIZE + hdr.userdata_len);
+	crc = bgenv_crc32(0, buf, *size - sizeof(crc));
+	memcpy(buf + *size - sizeof(crc), &crc, sizeof(crc));
+	*compact = true;
+	return buf;
+}
+
+/* Read or write the environment file of an unmounted partition directly on
+ * its block device. Fails if the file cannot be found this way, so that the
+ * caller can fall back to mounting the partition. The size of the file is
+ * stored in moved on success. */
+static bool rw_env_raw(CONFIG_PART *part, BG_ENVDATA *env, bool write,
+		       size_t *moved)
+{
+	struct fat_file file;
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	bool compact = false;
+	ssize_t res;
+	int fd;
+
+	/* bypassing a mount kept by this session would corrupt it */
+	if (part->mountpoint) {
+		return false;
+	}
+	fd = open_config_file_raw(part, write ? O_RDWR : O_RDONLY, &file);
+	if (fd < 0) {
+		return false;
+	}
+	if (write) {
+		buf = encode_env(part, env, &size, &compact);
+	} else {
+		/* compact files are decoded in place */
+		size = file.size < sizeof(BG_ENVDATA) ? file.size
+						      : sizeof(BG_ENVDATA);
+		buf = (uint8_t *)env;
+	}
+	/* the file is written in place, its size cannot change */
+	if (!buf || file.size != size) {
+		VERBOSE(stderr, "Unexpected size of %s on %s.\n",
+			FAT_ENV_FILENAME, part->devpath);
+		if (buf != (uint8_t *)env) {
+			free(buf);
+		}
+		close(fd);
+		return false;
+	}
+	if (write) {
+		res = fat_write_file(&file, buf, size);
+		if (res >= 0 && fdatasync(fd)) {
+			res = -errno;
+		}
+	} else {
+		res = fat_read_file(&file, buf, size);
+	}
+	if (close(fd) && res >= 0) {
+		res = -errno;
+	}
+	if (res == (ssize_t)size) {
+		if (write) {
+			part->compact = compact;
+		} else if (!decode_env(part, env, buf, size)) {
+			res = -EINVAL;
+		}
+	}
+	if (buf != (uint8_t *)env) {
+		free(buf);
+	}
+	if (res != (ssize_t)size) {
+		VERBOSE(stderr, "Error %s environment data on %s: %s\n",
+			write ? "writing" : "reading", part->devpath,
+			res < 0 ? strerror(-res) : "short transfer");
 		return false;
 	}
+	VERBOSE(stdout, "%s environment on %s without mounting.\n",
+		write ? "Wrote" : "Read", part->devpath);
+	*moved = size;
+	return true;
+}
+
+static bool read_env_mounted(CONFIG_PART *part, BG_ENVDATA *env,
+			     size_t *moved)
+{
 	if (part->not_mounted) {
 		/* mount partition before reading config file */
 		if (!mount_partition(part)) {
@@ -97,23 +278,42 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 		return false;
 	}
 	bool result = true;
-	if (!(fread(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	struct stat st;
+	size_t size = sizeof(BG_ENVDATA);
+
+	/* compact files are decoded in place */
+	if (fstat(fileno(config), &st) == 0 && st.st_size > 0 &&
+	    st.st_size < (off_t)sizeof(BG_ENVDATA)) {
+		size = st.st_size;
+	}
+	if (fread(env, size, 1, config) != 1) {
 		VERBOSE(stderr, "Error reading environment data from %s\n",
 			part->devpath);
 		if (feof(config)) {
 			VERBOSE(stderr, "End of file encountered.\n");
 		}
 		result = false;
+	} else if (!decode_env(part, env, (uint8_t *)env, size)) {
+		result = false;
 	}
 	if (fclose(config)) {
 		VERBOSE(stderr,
 			"Error closing environment file after reading.\n");
 	};
-	if (part->not_mounted) {
-		unmount_partition(part);
-	}
 	if (result == false) {
 		clear_envdata(env);
+	} else {
+		*moved = size;
+	}
+	return result;
+}
+
+static bool read_env_part(CONFIG_PART *part, BG_ENVDATA *env, size_t *size)
+{
+	/* refined by decode_env() */
+	part->status = BGENV_CHECK_UNREADABLE;
+	if (!(part->not_mounted && rw_env_raw(part, env, false, size)) &&
+	    !read_env_mounted(part, env, size)) {
 		return false;
 	}
 
@@ -121,43 +321,209 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 	env->kernelfile[ENV_STRING_LENGTH - 1] = 0;
 	env->kernelparams[ENV_STRING_LENGTH - 1] = 0;
 
-	return validate_envdata(env);
+	/* the CRC of compact files was already checked by decode_env() */
+	if (!part->compact && !validate_envdata_crc(env)) {
+		part->status = BGENV_CHECK_CRC;
+		return false;
+	}
+	if (!validate_envdata_uservars(env)) {
+		part->status = BGENV_CHECK_USERVARS;
+		return false;
+	}
+	part->status = BGENV_CHECK_OK;
+	return true;
 }
 
-bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
+bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 {
+	uint64_t start;
+	size_t size = 0;
+	bool result;
+
 	if (!part) {
 		return false;
 	}
-	if (part->not_mounted) {
-		/* mount partition before reading config file */
-		if (!mount_partition(part)) {
+	EBG_TRACE1(read_entry, part->devpath);
+	start = bgenv_stat_begin();
+	result = read_env_part(part, env, &size);
+	bgenv_stat_end(&bgenv_stats.read_env, start, size);
+	EBG_TRACE4(read_return, part->devpath, result, env->revision, size);
+	return result;
+}
+
+/* Enough to hold the fields before userdata in either layout */
+#define ENV_PREFIX_SIZE (sizeof(BG_ENVHEADER) + ENV_FIXED_FIELDS_SIZE)
+
+/* Takes the fields before userdata from the first len bytes of an
+ * environment file of the given size. Nothing is verified beyond the
+ * layout, the CRC needs the complete file. */
+static bool decode_env_fixed(BG_ENVDATA *env, const uint8_t *buf,
+			     size_t len, uint64_t size)
+{
+	size_t offset = 0;
+
+	if (size < sizeof(BG_ENVDATA)) {
+		if (bgenv_compact_userdata_len(buf, size) < 0) {
 			return false;
 		}
-	} else {
-		VERBOSE(stdout, "Read config file: mounted to %s\n",
-			part->mountpoint);
+		offset = sizeof(BG_ENVHEADER);
 	}
+	if (len < offset + ENV_FIXED_FIELDS_SIZE) {
+		return false;
+	}
+	memset(env, 0, sizeof(BG_ENVDATA));
+	memcpy(env, buf + offset, ENV_FIXED_FIELDS_SIZE);
+	return true;
+}
+
+/* Like read_env(), but only reads the fields before userdata, with a single
+ * small read from the start of the file */
+static bool read_env_fixed(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	uint8_t buf[ENV_PREFIX_SIZE];
+	struct fat_file file;
+	FILE *config;
+	struct stat st;
+	ssize_t len;
+	bool result;
+	int fd;
+
+	if (part->not_mounted && !part->mountpoint) {
+		fd = open_config_file_raw(part, O_RDONLY, &file);
+		if (fd >= 0) {
+			len = fat_read_file(&file, buf, sizeof(buf));
+			close(fd);
+			return len > 0 &&
+			       decode_env_fixed(env, buf, len, file.size);
+		}
+	}
+	if (part->not_mounted && !mount_partition(part)) {
+		return false;
+	}
+	config = open_config_file_from_part(part, "rb");
+	if (!config) {
+		return false;
+	}
+	fd = fileno(config);
+	result = fstat(fd, &st) == 0 &&
+		 (len = pread(fd, buf, sizeof(buf), 0)) > 0 &&
+		 decode_env_fixed(env, buf, len, st.st_size);
+	fclose(config);
+	return result;
+}
+
+/* Overwrites an existing config file of the same size in place, i.e.
+ * with a single write to the clusters it occupies and without touching the
+ * FAT, followed by a single fdatasync(). Returns -EMSGSIZE if the file
+ * cannot be written this way, otherwise 0 or a negative errno. */
+static int write_env_in_place(CONFIG_PART *part, const uint8_t *buf,
+			      size_t size)
+{
+	struct stat st;
 	FILE *config;
+	int res = 0;
+	int fd;
+
+	config = open_config_file_from_part(part, "r+b");
+	if (!config) {
+		return -EMSGSIZE;
+	}
+	fd = fileno(config);
+	if (fstat(fd, &st) || st.st_size != (off_t)size) {
+		fclose(config);
+		return -EMSGSIZE;
+	}
+	if (pwrite(fd, buf, size, 0) != (ssize_t)size) {
+		res = errno ? -errno : -EIO;
+	} else if (fdatasync(fd)) {
+		res = -errno;
+	}
+	if (fclose(config) && !res) {
+		res = -errno;
+	}
+	return res;
+}
+
+/* Creates or resizes the config file, the metadata is synced as well */
+static bool write_env_file(CONFIG_PART *part, const uint8_t *buf,
+			   size_t size)
+{
+	FILE *config;
+	bool result = true;
+
 	config = open_config_file_from_part(part, "wb");
 	if (!config) {
 		VERBOSE(stderr, "Could not open config file for writing.\n");
 		return false;
 	}
-	bool result = true;
-	if (!(fwrite(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
-		VERBOSE(stderr, "Error saving environment data to %s\n",
-			part->devpath);
+	if (fwrite(buf, size, 1, config) != 1 || fflush(config) ||
+	    fsync(fileno(config))) {
 		result = false;
 	}
 	if (fclose(config)) {
 		VERBOSE(stderr,
 			"Error closing environment file after writing.\n");
 		result = false;
-	};
+	}
+	return result;
+}
+
+/* stores the size of the file written in size on success */
+static bool write_env_part(CONFIG_PART *part, BG_ENVDATA *env, size_t *size)
+{
 	if (part->not_mounted) {
-		unmount_partition(part);
+		if (rw_env_raw(part, env, true, size)) {
+			return true;
+		}
+		/* mount partition before reading config file */
+		if (!mount_partition(part)) {
+			return false;
+		}
+	} else {
+		VERBOSE(stdout, "Read config file: mounted to %s\n",
+			part->mountpoint);
+	}
+	bool result;
+	bool compact;
+	uint8_t *buf = encode_env(part, env, size, &compact);
+	int res = -ENOMEM;
+
+	if (buf) {
+		res = write_env_in_place(part, buf, *size);
+		if (res == -EMSGSIZE) {
+			res = write_env_file(part, buf, *size) ? 0 : -EIO;
+		}
+	}
+	result = res == 0;
+	if (!result) {
+		VERBOSE(stderr, "Error saving environment data to %s\n",
+			part->devpath);
+	}
+	if (buf != (uint8_t *)env) {
+		free(buf);
 	}
+	if (result) {
+		part->compact = compact;
+	} else {
+		*size = 0;
+	}
+	return result;
+}
+
+bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	uint64_t start;
+	size_t size = 0;
+	bool result;
+
+	if (!part) {
+		return false;
+	}
+	EBG_TRACE2(write_entry, part->devpath, env->revision);
+	start = bgenv_stat_begin();
+	result = write_env_part(part, env, &size);
+	bgenv_stat_end(&bgenv_stats.write_env, start, size);
+	EBG_TRACE3(write_return, part->devpath, result, size);
 	return result;
 }
 
@@ -165,11 +531,135 @@ bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
 CONFIG_PART __attribute__((weak)) config_parts[ENV_NUM_CONFIG_PARTS];
 BG_ENVDATA __attribute__((weak)) envdata[ENV_NUM_CONFIG_PARTS];
 
-static bool initialized;
+/* number of bgenv_init() calls not yet matched by bgenv_finalize() */
+static unsigned int users;
+/* set if config_parts and envdata are a snapshot of ebgenvd */
+static bool daemon_backed;
 
-bool bgenv_init(void)
+static pthread_rwlock_t bgenv_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static bool locked_exclusive;
+/* incremented on each release of the exclusive lock */
+static unsigned long bgenv_changes;
+
+/* CRC of each config partition's environment as last read or written, so
+ * that writing it unchanged can be skipped */
+static struct {
+	uint32_t crc32;
+	bool valid;
+	/* cleared by bgenv_init_latest() without being read completely */
+	bool unread;
+} stored[ENV_NUM_CONFIG_PARTS];
+
+/* drop the uservar index of env if the environments were modified through
+ * another handle since env last held the lock */
+static void bgenv_sync_handle(BGENV *env)
 {
-	if (initialized) {
+	if (env && env->changes != bgenv_changes) {
+		bgenv_uservar_index_invalidate(env->uservar_index);
+		env->changes = bgenv_changes;
+	}
+}
+
+void bgenv_lock_shared(BGENV *env)
+{
+	pthread_rwlock_rdlock(&bgenv_rwlock);
+	bgenv_sync_handle(env);
+}
+
+void bgenv_lock_exclusive(BGENV *env)
+{
+	pthread_rwlock_wrlock(&bgenv_rwlock);
+	locked_exclusive = true;
+	bgenv_sync_handle(env);
+}
+
+void bgenv_unlock(BGENV *env)
+{
+	if (locked_exclusive) {
+		locked_exclusive = false;
+		bgenv_changes++;
+		if (env) {
+			env->changes = bgenv_changes;
+		}
+	}
+	pthread_rwlock_unlock(&bgenv_rwlock);
+}
+
+static void read_env_worker(void *ctx, size_t index)
+{
+	(void)ctx;
+	/* read_env() verified the CRC if it succeeded */
+	stored[index].valid = read_env(&config_parts[index], &envdata[index]);
+	stored[index].crc32 = envdata[index].crc32;
+}
+
+/*
+ * Reads the fixed fields of each environment first and then completely
+ * only the latest one, or the next one if that fails validation. The
+ * others are zeroed like bgenv_init() leaves invalid ones, so
+ * bgenv_open_latest() selects the same environment either way.
+ */
+static void read_latest_env(void)
+{
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
+	int invalid[ENV_NUM_CONFIG_PARTS];
+	unsigned int count, n;
+	int latest = -1;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		invalid[i] = !read_env_fixed(&config_parts[i], &envdata[i]);
+	}
+	count = bgenv_revision_order(envdata, invalid, ENV_NUM_CONFIG_PARTS,
+				     order);
+	for (n = 0; n < count && latest < 0; n++) {
+		read_env_worker(NULL, order[n]);
+		if (stored[order[n]].valid) {
+			latest = order[n];
+		}
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (i != latest) {
+			memset(&envdata[i], 0, sizeof(BG_ENVDATA));
+			stored[i].valid = false;
+			stored[i].unread = true;
+		}
+	}
+}
+
+/* completes what read_latest_env() left out */
+static void read_unread_envs(void)
+{
+	bool published = true;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (stored[i].unread) {
+			stored[i].unread = false;
+			read_env_worker(NULL, i);
+			published = false;
+		}
+	}
+	if (!published) {
+		bgenv_snapshot_publish(envdata);
+	}
+}
+
+static bool bgenv_init_parts(bool latest_only)
+{
+	if (users > 0) {
+		if (!latest_only) {
+			read_unread_envs();
+		}
+		users++;
+		return true;
+	}
+	if (ebgenv_opts.use_daemon &&
+	    ebgenvd_fetch(config_parts, envdata,
+			  ebgenv_opts.search_all_devices)) {
+		daemon_backed = true;
+		/* unverified, so each is written at least once */
+		memset(stored, 0, sizeof(stored));
+		bgenv_snapshot_publish(envdata);
+		users = 1;
 		return true;
 	}
 	/* enumerate all config partitions */
@@ -178,27 +668,111 @@ bool bgenv_init(void)
 		VERBOSE(stderr, "Error finding config partitions.\n");
 		return false;
 	}
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		read_env(&config_parts[i], &envdata[i]);
+	if (latest_only) {
+		read_latest_env();
+		/* a snapshot needs all environments */
+		users = 1;
+		return true;
 	}
-	initialized = true;
+	if (ebgenv_opts.parallel_io) {
+		thread_pool_run(read_env_worker, NULL, ENV_NUM_CONFIG_PARTS,
+				ENV_NUM_CONFIG_PARTS);
+	} else {
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			read_env_worker(NULL, i);
+		}
+	}
+	bgenv_snapshot_publish(envdata);
+	users = 1;
 	return true;
 }
 
+bool bgenv_init(void)
+{
+	bool result;
+
+	EBG_TRACE1(init_entry, users);
+	result = bgenv_init_parts(false);
+	EBG_TRACE2(init_return, result, daemon_backed);
+	return result;
+}
+
+bool bgenv_init_latest(void)
+{
+	bool result;
+
+	EBG_TRACE1(init_entry, users);
+	result = bgenv_init_parts(true);
+	EBG_TRACE2(init_return, result, daemon_backed);
+	return result;
+}
+
 void bgenv_finalize(void)
 {
-	if (!initialized) {
+	if (users == 0 || --users > 0) {
 		return;
 	}
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		free(config_parts[i].devpath);
+		/* mounts done by this session end with it */
+		release_partition(&config_parts[i]);
+		bgenv_path_free(config_parts[i].devpath);
 		config_parts[i].devpath = NULL;
-		free(config_parts[i].mountpoint);
-		config_parts[i].mountpoint = NULL;
 	}
-	initialized = false;
+	daemon_backed = false;
+	memset(stored, 0, sizeof(stored));
+	bgenv_snapshot_clear();
+}
+
+#ifdef EBG_STATIC_ALLOC
+/* handles of open contexts, and those bgenv_init() and bgenv_check() take
+ * of all config partitions at once */
+#define BGENV_HANDLES (16 + ENV_NUM_CONFIG_PARTS)
+
+static BGENV handle_pool[BGENV_HANDLES];
+static bool handle_used[BGENV_HANDLES];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static BGENV *bgenv_handle_get(void)
+{
+	BGENV *handle = NULL;
+
+	pthread_mutex_lock(&handle_lock);
+	for (size_t i = 0; i < BGENV_HANDLES; i++) {
+		if (!handle_used[i]) {
+			handle_used[i] = true;
+			handle = &handle_pool[i];
+			memset(handle, 0, sizeof(*handle));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&handle_lock);
+	return handle;
 }
 
+static void bgenv_handle_put(BGENV *handle)
+{
+	uintptr_t offset = (uintptr_t)handle - (uintptr_t)handle_pool;
+
+	/* handles set up by someone else are left alone */
+	if (!handle || offset >= sizeof(handle_pool)) {
+		return;
+	}
+	pthread_mutex_lock(&handle_lock);
+	handle_used[offset / sizeof(*handle)] = false;
+	pthread_mutex_unlock(&handle_lock);
+}
+#else
+static BGENV *bgenv_handle_get(void)
+{
+	return calloc(1, sizeof(BGENV));
+}
+
+static void bgenv_handle_put(BGENV *handle)
+{
+	free(handle);
+}
+#endif
+
 BGENV *bgenv_open_by_index(uint32_t index)
 {
 	BGENV *handle;
@@ -207,45 +781,44 @@ BGENV *bgenv_open_by_index(uint32_t index)
 	if (index >= ENV_NUM_CONFIG_PARTS) {
 		return NULL;
 	}
-	if (!(handle = calloc(1, sizeof(BGENV)))) {
+	if (!(handle = bgenv_handle_get())) {
+		VERBOSE(stderr, "Error, out of environment handles.\n");
 		return NULL;
 	}
 	handle->desc = (void *)&config_parts[index];
 	handle->data = &envdata[index];
+	handle->crc_incremental = ebgenv_opts.incremental_crc;
+	handle->changes = bgenv_changes;
 	return handle;
 }
 
 BGENV *bgenv_open_oldest(void)
 {
-	uint32_t minrev = 0xFFFFFFFF;
-	uint32_t min_idx = 0;
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
+	unsigned int n;
 
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision < minrev) {
-			minrev = envdata[i].revision;
-			min_idx = i;
-		}
+	n = bgenv_revision_order(envdata, NULL, ENV_NUM_CONFIG_PARTS, order);
+	/* the lowest index of those with the lowest revision */
+	while (n > 1 && envdata[order[n - 2]].revision ==
+				envdata[order[n - 1]].revision) {
+		n--;
 	}
-	return bgenv_open_by_index(min_idx);
+	return bgenv_open_by_index(order[n - 1]);
 }
 
 BGENV *bgenv_open_latest(void)
 {
-	uint32_t maxrev = 0;
-	uint32_t max_idx = 0;
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
 
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision > maxrev) {
-			maxrev = envdata[i].revision;
-			max_idx = i;
-		}
-	}
-	return bgenv_open_by_index(max_idx);
+	bgenv_revision_order(envdata, NULL, ENV_NUM_CONFIG_PARTS, order);
+	return bgenv_open_by_index(order[0]);
 }
 
 bool bgenv_write(BGENV *env)
 {
 	CONFIG_PART *part;
+	ptrdiff_t index;
+	bool shared;
 
 	if (!env) {
 		return false;
@@ -257,14 +830,109 @@ bool bgenv_write(BGENV *env)
 		    "Invalid config partition to store environment.\n");
 		return false;
 	}
-	if (!write_env(part, env->data)) {
+	shared = part >= config_parts &&
+		 part < config_parts + ENV_NUM_CONFIG_PARTS;
+	index = shared ? part - config_parts : -1;
+	if (shared && stored[index].unread) {
+		VERBOSE(stderr, "Environment on %s was not read.\n",
+			part->devpath);
+		return false;
+	}
+	/* data->crc32 is up to date here, so an unchanged CRC means an
+	 * unchanged environment, unless it is still to be compacted */
+	if (shared && stored[index].valid &&
+	    stored[index].crc32 == env->data->crc32 &&
+	    (part->compact || !ebgenv_opts.compact_env)) {
+		VERBOSE(stdout, "Environment on %s unchanged, not writing.\n",
+			part->devpath);
+		return true;
+	}
+	if (shared) {
+		/* a failed write may have left anything behind */
+		stored[index].valid = false;
+	}
+	if (daemon_backed && shared) {
+		if (!ebgenvd_write(index, env->data)) {
+			return false;
+		}
+	} else if (!write_env(part, env->data)) {
 		VERBOSE(stderr, "Could not write to %s\n",
 			part->devpath);
 		return false;
 	}
+	if (shared) {
+		stored[index].crc32 = env->data->crc32;
+		stored[index].valid = true;
+		bgenv_snapshot_update(index, env->data);
+	}
+	return true;
+}
+
+bool bgenv_write_all(BGENV **envs, size_t count)
+{
+	/* Never concurrently, even with EBG_OPT_PARALLEL_IO: each copy is on
+	 * disk before the next one is touched, so that a power cut can tear
+	 * at most one of them. */
+	for (size_t i = 0; i < count; i++) {
+		if (!bgenv_write(envs[i])) {
+			return false;
+		}
+	}
 	return true;
 }
 
+#define ENVDATA_CRC_SIZE (sizeof(BG_ENVDATA) - sizeof(uint32_t))
+
+void bgenv_update_crc(BGENV *env)
+{
+	env->data->crc32 = bgenv_crc32(0, env->data, ENVDATA_CRC_SIZE);
+}
+
+/* In incremental CRC mode, each edit of the bytes [start, end) of the
+ * environment data is enclosed by bgenv_crc_edit_begin() and
+ * bgenv_crc_edit_end(). The CRC is then patched with the difference of
+ * the old and new content of that range, so the cost only depends on the
+ * size of the range. */
+uint32_t bgenv_crc_edit_begin(BGENV *env, size_t start, size_t end)
+{
+	if (!env->crc_incremental || start >= end) {
+		return 0;
+	}
+	return bgenv_crc32_raw((uint8_t *)env->data + start, end - start);
+}
+
+void bgenv_crc_edit_end(BGENV *env, size_t start, size_t end, uint32_t before)
+{
+	uint32_t after;
+
+	if (!env->crc_incremental || start >= end) {
+		return;
+	}
+	after = bgenv_crc32_raw((uint8_t *)env->data + start, end - start);
+	env->data->crc32 ^= bgenv_crc32_shift(before ^ after,
+					      ENVDATA_CRC_SIZE - end);
+}
+
+static void bgenv_field_range(EBGENVKEY e, size_t *start, size_t *end)
+{
+#define FIELD_RANGE(field)                                                     \
+	*start = offsetof(BG_ENVDATA, field);                                  \
+	*end = *start + sizeof(((BG_ENVDATA *)0)->field)
+#define FIELD_CASE(key, field, ...)                                            \
+	case EBGENV_##key:                                                     \
+		FIELD_RANGE(field);                                            \
+		break;
+
+	switch (e) {
+	BGENV_STRING_FIELDS(FIELD_CASE)
+	BGENV_UINT_FIELDS(FIELD_CASE)
+	default:
+		*start = *end = 0;
+	}
+#undef FIELD_CASE
+#undef FIELD_RANGE
+}
+
 BG_ENVDATA *bgenv_read(BGENV *env)
 {
 	if (!env) {
@@ -281,7 +949,25 @@ BG_ENVDATA *bgenv_read(BGENV *env)
 __attribute((noinline))
 void bgenv_close(BGENV *env)
 {
-	free(env);
+	if (env) {
+		bgenv_uservar_index_free(env->uservar_index);
+	}
+	bgenv_handle_put(env);
+}
+
+static BGENV_USERVAR_INDEX *bgenv_uservar_index(BGENV *env)
+{
+#ifdef EBG_STATIC_ALLOC
+	/* lookups use linear search */
+	(void)env;
+	return NULL;
+#else
+	if (!env->uservar_index) {
+		/* on failure, lookups fall back to linear search */
+		env->uservar_index = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	}
+	return env->uservar_index;
+#endif
 }
 
 static int bgenv_get_uint(char *buffer, uint64_t *type, void *data,
@@ -301,13 +987,14 @@ static int bgenv_get_uint(char *buffer, uint64_t *type, void *data,
 }
 
 static int bgenv_get_string(char *buffer, uint64_t *type, void *data,
-			    const char16_t *srcstr)
+			    uint32_t maxlen, const char16_t *srcstr)
 {
-	str16to8(buffer, srcstr);
 	if (!data) {
-		return strlen(buffer)+1;
+		return str16to8n(buffer, srcstr, ENV_STRING_LENGTH) + 1;
 	}
-	strcpy(data, buffer);
+	/* cut to what fits into data */
+	str16to8n(data, srcstr,
+		  maxlen < ENV_STRING_LENGTH ? maxlen : ENV_STRING_LENGTH);
 	if (type) {
 		*type = USERVAR_TYPE_STRING_ASCII;
 	}
@@ -331,39 +1018,33 @@ int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 		if (!data) {
 			uint8_t *u;
 			uint32_t size;
-			u = bgenv_find_uservar(env->data->userdata, key);
+			u = bgenv_find_uservar_indexed(bgenv_uservar_index(env),
+						       env->data->userdata,
+						       key);
 			if (!u) {
 				return -ENOENT;
 			}
 			bgenv_map_uservar(u, NULL, NULL, NULL, NULL, &size);
 			return size;
 		}
-		return bgenv_get_uservar(env->data->userdata, key, type, data,
-					 maxlen);
+		return bgenv_get_uservar_indexed(bgenv_uservar_index(env),
+						 env->data->userdata, key,
+						 type, data, maxlen);
 	}
+#define GET_STRING(key, field)                                                 \
+	case EBGENV_##key:                                                     \
+		return bgenv_get_string(buffer, type, data, maxlen,            \
+					env->data->field);
+#define GET_UINT(key, field, ctype, usertype)                                  \
+	case EBGENV_##key:                                                     \
+		return bgenv_get_uint(buffer, type, data,                      \
+				      bgenv_get_##field(env), usertype);
+
 	switch (e) {
-	case EBGENV_KERNELFILE:
-		return bgenv_get_string(buffer, type, data,
-					env->data->kernelfile);
-	case EBGENV_KERNELPARAMS:
-		return bgenv_get_string(buffer, type, data,
-					env->data->kernelparams);
-	case EBGENV_WATCHDOG_TIMEOUT_SEC:
-		return bgenv_get_uint(buffer, type, data,
-				      env->data->watchdog_timeout_sec,
-				      USERVAR_TYPE_UINT16);
-	case EBGENV_REVISION:
-		return bgenv_get_uint(buffer, type, data,
-				      env->data->revision,
-				      USERVAR_TYPE_UINT16);
-	case EBGENV_USTATE:
-		return bgenv_get_uint(buffer, type, data,
-				      env->data->ustate,
-				      USERVAR_TYPE_UINT8);
-	case EBGENV_IN_PROGRESS:
-		return bgenv_get_uint(buffer, type, data,
-				      env->data->in_progress,
-				      USERVAR_TYPE_UINT8);
+	BGENV_STRING_FIELDS(GET_STRING)
+	BGENV_UINT_FIELDS(GET_UINT)
+#undef GET_UINT
+#undef GET_STRING
 	default:
 		if (!data) {
 			return 0;
@@ -389,67 +1070,311 @@ static long bgenv_convert_to_long(char *value)
 	return val;
 }
 
+/* Widen an integer user variable, negative values do not fit */
+static int bgenv_uservar_u64(uint64_t type, const uint8_t *val,
+			     uint32_t size, uint64_t *value)
+{
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch (type) {
+	case USERVAR_TYPE_CHAR:
+	case USERVAR_TYPE_UINT8:
+	case USERVAR_TYPE_BOOL:
+	case USERVAR_TYPE_SINT8:
+		if (size < sizeof(uint8_t)) {
+			return -EINVAL;
+		}
+		v64 = *val;
+		if (type == USERVAR_TYPE_SINT8 && (int8_t)v64 < 0) {
+			return -ERANGE;
+		}
+		break;
+	case USERVAR_TYPE_UINT16:
+	case USERVAR_TYPE_SINT16:
+		if (size < sizeof(v16)) {
+			return -EINVAL;
+		}
+		memcpy(&v16, val, sizeof(v16));
+		if (type == USERVAR_TYPE_SINT16 && (int16_t)v16 < 0) {
+			return -ERANGE;
+		}
+		v64 = v16;
+		break;
+	case USERVAR_TYPE_UINT32:
+	case USERVAR_TYPE_SINT32:
+		if (size < sizeof(v32)) {
+			return -EINVAL;
+		}
+		memcpy(&v32, val, sizeof(v32));
+		if (type == USERVAR_TYPE_SINT32 && (int32_t)v32 < 0) {
+			return -ERANGE;
+		}
+		v64 = v32;
+		break;
+	case USERVAR_TYPE_UINT64:
+	case USERVAR_TYPE_SINT64:
+		if (size < sizeof(v64)) {
+			return -EINVAL;
+		}
+		memcpy(&v64, val, sizeof(v64));
+		if (type == USERVAR_TYPE_SINT64 && (int64_t)v64 < 0) {
+			return -ERANGE;
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+	*value = v64;
+	return 0;
+}
+
+int bgenv_get_u64(BGENV *env, char *key, uint64_t *value)
+{
+	uint32_t size;
+	uint64_t type;
+	uint8_t *u, *val;
+
+	if (!key || !value) {
+		return -EINVAL;
+	}
+	if (!env) {
+		return -EPERM;
+	}
+#define GET_U64(key, field, ...)                                               \
+	case EBGENV_##key:                                                     \
+		*value = bgenv_get_##field(env);                               \
+		return 0;
+
+	switch (bgenv_str2enum(key)) {
+	BGENV_UINT_FIELDS(GET_U64)
+#undef GET_U64
+	case EBGENV_UNKNOWN:
+		break;
+	default:
+		return -EINVAL;
+	}
+	u = bgenv_find_uservar_indexed(bgenv_uservar_index(env),
+				       env->data->userdata, key);
+	if (!u) {
+		return -ENOENT;
+	}
+	bgenv_map_uservar(u, NULL, &type, &val, NULL, &size);
+	return bgenv_uservar_u64(type & USERVAR_STANDARD_TYPE_MASK, val, size,
+				 value);
+}
+
+int bgenv_get_view(BGENV *env, char *key, uint64_t *type,
+		   const uint8_t **data, uint32_t *len)
+{
+	uint8_t *u, *val;
+
+	if (!key || !data || !len) {
+		return -EINVAL;
+	}
+	if (!env) {
+		return -EPERM;
+	}
+	/* built-in strings are not stored as they are returned */
+	if (bgenv_str2enum(key) != EBGENV_UNKNOWN) {
+		return -EINVAL;
+	}
+	u = bgenv_find_uservar_indexed(bgenv_uservar_index(env),
+				       env->data->userdata, key);
+	if (!u) {
+		return -ENOENT;
+	}
+	bgenv_map_uservar(u, NULL, type, &val, NULL, len);
+	*data = val;
+	return 0;
+}
+
 int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 	      uint32_t datalen)
 {
-	EBGENVKEY e;
-	int val;
+	int res;
+
+	if (!key) {
+		return -EINVAL;
+	}
+	EBG_TRACE3(set_entry, key, type, datalen);
+	res = bgenv_set_key(env, bgenv_str2enum(key), key, type, data,
+			    datalen);
+	EBG_TRACE2(set_return, key, res);
+	return res;
+}
+
+int bgenv_set_uint(BGENV *env, EBGENVKEY e, uint64_t value)
+{
+#define SET_UINT(key, field, ctype, ...)                                       \
+	case EBGENV_##key:                                                     \
+		if ((ctype)value != value) {                                   \
+			return -ERANGE;                                        \
+		}                                                              \
+		bgenv_set_##field(env, value);                                 \
+		return 0;
+
+	if (!env) {
+		return -EPERM;
+	}
+	switch (e) {
+	BGENV_UINT_FIELDS(SET_UINT)
+#undef SET_UINT
+	default:
+		return -EINVAL;
+	}
+}
+
+int bgenv_set_key(BGENV *env, EBGENVKEY e, char *key, uint64_t type,
+		  void *data, uint32_t datalen)
+{
+	long val;
 	char *value = (char *)data;
+	size_t start, end;
+	uint32_t crc_before;
+	/* value need not be terminated within datalen */
+	size_t maxchars = datalen < ENV_STRING_LENGTH ? datalen + 1
+						      : ENV_STRING_LENGTH;
 
 	if (!key || !data || datalen == 0) {
 		return -EINVAL;
 	}
-
-	e = bgenv_str2enum(key);
 	if (!env) {
 		return -EPERM;
 	}
 	if (e == EBGENV_UNKNOWN) {
-		return bgenv_set_uservar(env->data->userdata, key, type, data,
-					 datalen);
+		BGENV_USERVAR_INDEX *idx = bgenv_uservar_index(env);
+		uint32_t ustart = 0, uend = 0;
+		int res;
+
+		if (env->crc_incremental) {
+			bgenv_uservar_edit_range(idx, env->data->userdata, key,
+						 type, datalen, &ustart, &uend);
+		}
+		start = offsetof(BG_ENVDATA, userdata) + ustart;
+		end = offsetof(BG_ENVDATA, userdata) + uend;
+		crc_before = bgenv_crc_edit_begin(env, start, end);
+		res = bgenv_set_uservar_indexed(idx, env->data->userdata, key,
+						type, data, datalen);
+		bgenv_crc_edit_end(env, start, end, crc_before);
+		return res;
 	}
+	/* numbers are truncated to the field as they always were */
+#define SET_UINT(key, field, ctype, ...)                                       \
+	case EBGENV_##key:                                                     \
+		val = bgenv_convert_to_long(value);                            \
+		if (val < 0) {                                                 \
+			return -EINVAL;                                        \
+		}                                                              \
+		bgenv_set_##field(env, (ctype)val);                            \
+		return 0;
+
 	switch (e) {
-	case EBGENV_REVISION:
-		val = bgenv_convert_to_long(value);
-		if (val < 0) {
-			return -EINVAL;
-		}
-		env->data->revision = val;
-		break;
+	BGENV_UINT_FIELDS(SET_UINT)
+#undef SET_UINT
 	case EBGENV_KERNELFILE:
-		str8to16(env->data->kernelfile, value);
-		break;
 	case EBGENV_KERNELPARAMS:
-		str8to16(env->data->kernelparams, value);
 		break;
-	case EBGENV_WATCHDOG_TIMEOUT_SEC:
-		val = bgenv_convert_to_long(value);
-		if (val < 0) {
+	default:
+		return -EINVAL;
+	}
+	bgenv_field_range(e, &start, &end);
+	crc_before = bgenv_crc_edit_begin(env, start, end);
+	str8to16n(e == EBGENV_KERNELFILE ? env->data->kernelfile
+					 : env->data->kernelparams,
+		  value, maxchars);
+	bgenv_crc_edit_end(env, start, end, crc_before);
+	return 0;
+}
+
+int bgenv_set_many(BGENV *env, const ebg_uservar_t *vars, uint32_t count)
+{
+	const size_t base = offsetof(BG_ENVDATA, userdata);
+	uint32_t start = 0, end = ENV_MEM_USERVARS;
+	uint32_t crc_before;
+	uint8_t *udata, *merged;
+	int res;
+
+	if (!vars && count) {
+		return -EINVAL;
+	}
+	if (!env) {
+		return -EPERM;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!vars[i].key ||
+		    bgenv_str2enum(vars[i].key) != EBGENV_UNKNOWN) {
 			return -EINVAL;
 		}
-		env->data->watchdog_timeout_sec = val;
-		break;
-	case EBGENV_USTATE:
-		val = bgenv_convert_to_long(value);
-		if (val < 0) {
-			return -EINVAL;
+	}
+	merged = malloc(ENV_MEM_USERVARS);
+	if (!merged) {
+		return -ENOMEM;
+	}
+	udata = env->data->userdata;
+	res = bgenv_merge_uservars(udata, vars, count, merged);
+	if (res == 0) {
+		/* only the bytes which differ are copied and checksummed */
+		while (start < end && udata[start] == merged[start]) {
+			start++;
 		}
-		env->data->ustate = val;
-		break;
-	case EBGENV_IN_PROGRESS:
-		val = bgenv_convert_to_long(value);
-		if (val < 0) {
-			return -EINVAL;
+		while (end > start && udata[end - 1] == merged[end - 1]) {
+			end--;
 		}
-		env->data->in_progress = val;
-		break;
-	default:
-		return -EINVAL;
+		crc_before = bgenv_crc_edit_begin(env, base + start,
+						  base + end);
+		memcpy(udata + start, merged + start, end - start);
+		bgenv_crc_edit_end(env, base + start, base + end, crc_before);
+		bgenv_uservar_index_invalidate(env->uservar_index);
 	}
-	return 0;
+	free(merged);
+	return res;
 }
 
-BGENV *bgenv_create_new(void)
+int bgenv_get_all(BGENV *env, void *buffer, uint32_t size, uint32_t *count)
+{
+	if (!env) {
+		return -EPERM;
+	}
+	return bgenv_export_uservars(env->data->userdata, buffer, size, count);
+}
+
+void bgenv_stage(BGENV *env, const BG_ENVDATA *base)
+{
+	BG_ENVDATA *data = env->data;
+	uint32_t used_old = bgenv_userdata_used(data);
+	uint32_t used = base ? bgenv_userdata_used(base) : 0;
+
+	if (base) {
+		memcpy(data, base, ENV_FIXED_FIELDS_SIZE + used);
+	} else {
+		memset(data, 0, ENV_FIXED_FIELDS_SIZE);
+	}
+	if (used_old > used) {
+		memset(data->userdata + used, 0, used_old - used);
+	}
+	bgenv_uservar_index_invalidate(env->uservar_index);
+	if (env->crc_incremental) {
+		/* the rest of the user variables are zeroes */
+		uint32_t crc = bgenv_crc32(0, data,
+					   ENV_FIXED_FIELDS_SIZE + used);
+
+		data->crc32 = ~bgenv_crc32_shift(~crc, ENV_MEM_USERVARS - used);
+	}
+}
+
+/* assigns a fixed field of the environment, patching an incremental CRC */
+#define BGENV_SET_FIELD(env, field, value)                                     \
+	do {                                                                   \
+		size_t _start = offsetof(BG_ENVDATA, field);                   \
+		size_t _end = _start + sizeof((env)->data->field);             \
+		uint32_t _crc = bgenv_crc_edit_begin(env, _start, _end);       \
+		(env)->data->field = (value);                                  \
+		bgenv_crc_edit_end(env, _start, _end, _crc);                   \
+	} while (0)
+
+static BGENV *bgenv_create(bool preserve)
 {
 	BGENV *env_latest;
 	BGENV *env_new;
@@ -468,15 +1393,19 @@ BGENV *bgenv_create_new(void)
 	}
 
 	if (env_latest->data != env_new->data) {
-		/* zero fields */
-		memset(env_new->data, 0, sizeof(BG_ENVDATA));
-		/* set default watchdog timeout */
-		env_new->data->watchdog_timeout_sec = DEFAULT_TIMEOUT_SEC;
+		bgenv_stage(env_new, preserve ? env_latest->data : NULL);
+		if (!preserve) {
+			BGENV_SET_FIELD(env_new, watchdog_timeout_sec,
+					DEFAULT_TIMEOUT_SEC);
+		}
+	} else if (env_new->crc_incremental) {
+		/* establish a valid base for incremental updates */
+		bgenv_update_crc(env_new);
 	}
 	bgenv_close(env_latest);
 	/* update revision field and testing mode */
-	env_new->data->revision = new_rev;
-	env_new->data->in_progress = 1;
+	BGENV_SET_FIELD(env_new, revision, new_rev);
+	BGENV_SET_FIELD(env_new, in_progress, 1);
 
 	return env_new;
 
@@ -484,3 +1413,13 @@ create_new_io_error:
 	errno = EIO;
 	return NULL;
 }
+
+BGENV *bgenv_create_new(void)
+{
+	return bgenv_create(false);
+}
+
+BGENV *bgenv_create_staged(void)
+{
+	return bgenv_create(true);
+}
@@ -0,0 +1,128 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include "env_api.h"
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+static bool is_valid(int i)
+{
+	return config_parts[i].status == BGENV_CHECK_OK;
+}
+
+/* not booted again, so not part of the revision sequence */
+static bool is_failed(int i)
+{
+	return envdata[i].revision == REVISION_FAILED;
+}
+
+static int latest_valid(void)
+{
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
+	int invalid[ENV_NUM_CONFIG_PARTS];
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		invalid[i] = !is_valid(i) || is_failed(i);
+	}
+	if (!bgenv_revision_order(envdata, invalid, ENV_NUM_CONFIG_PARTS,
+				  order)) {
+		return -1;
+	}
+	return order[0];
+}
+
+static bool repair_env(int i, int latest)
+{
+	BGENV *env;
+	bool res;
+
+	env = bgenv_open_by_index(i);
+	if (!env) {
+		return false;
+	}
+	memcpy(env->data, &envdata[latest], sizeof(BG_ENVDATA));
+	env->data->revision--;
+	env->data->in_progress = 0;
+	bgenv_update_crc(env);
+	res = bgenv_write(env);
+	bgenv_close(env);
+	if (res) {
+		config_parts[i].status = BGENV_CHECK_OK;
+	} else {
+		/* as read_env() leaves it */
+		memset(&envdata[i], 0, sizeof(BG_ENVDATA));
+	}
+	return res;
+}
+
+int bgenv_check(BGENV_CHECK *results, bool repair)
+{
+	int latest, problems = 0;
+
+	if (!results) {
+		return -EINVAL;
+	}
+	/* completes environments skipped by bgenv_init_latest() */
+	if (!bgenv_init()) {
+		return -EIO;
+	}
+	memset(results, 0, sizeof(BGENV_CHECK) * ENV_NUM_CONFIG_PARTS);
+
+	latest = latest_valid();
+	if (repair && latest >= 0 && envdata[latest].ustate == USTATE_OK &&
+	    envdata[latest].revision > REVISION_FAILED + 1) {
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			if (config_parts[i].status != BGENV_CHECK_OK &&
+			    config_parts[i].status != BGENV_CHECK_UNKNOWN) {
+				results[i].repaired = repair_env(i, latest);
+			}
+		}
+	}
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		uint32_t older = REVISION_FAILED;
+		bool has_older = false;
+
+		results[i].status = config_parts[i].status;
+		if (!is_valid(i)) {
+			problems++;
+			continue;
+		}
+		results[i].revision = envdata[i].revision;
+		results[i].ustate = envdata[i].ustate;
+		if (is_failed(i)) {
+			continue;
+		}
+		for (int j = 0; j < ENV_NUM_CONFIG_PARTS; j++) {
+			uint32_t rev = envdata[j].revision;
+
+			if (j == i || !is_valid(j) || is_failed(j)) {
+				continue;
+			}
+			if (rev == envdata[i].revision) {
+				results[i].duplicate = true;
+			} else if (rev < envdata[i].revision &&
+				   (!has_older || rev > older)) {
+				older = rev;
+				has_older = true;
+			}
+		}
+		results[i].gap = has_older && envdata[i].revision - older > 1;
+		if (results[i].duplicate || results[i].gap) {
+			problems++;
+		}
+	}
+
+	bgenv_finalize();
+	return problems;
+}
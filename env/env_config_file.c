@@ -12,11 +12,13 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_file.h"
+#include "fat.h"
 
 FILE *open_config_file(char *configfilepath, char *mode)
 {
@@ -26,40 +28,67 @@ FILE *open_config_file(char *configfilepath, char *mode)
 
 FILE *open_config_file_from_part(CONFIG_PART *cfgpart, char *mode)
 {
-	char *configfilepath;
+	char configfilepath[PATH_MAX];
+	int len;
 
 	if (!cfgpart || !cfgpart->mountpoint) {
 		return NULL;
 	}
-	configfilepath = (char *)malloc(strlen(FAT_ENV_FILENAME) +
-					strlen(cfgpart->mountpoint) + 2);
-	if (!configfilepath) {
+	len = snprintf(configfilepath, sizeof(configfilepath), "%s/%s",
+		       cfgpart->mountpoint, FAT_ENV_FILENAME);
+	if (len < 0 || (size_t)len >= sizeof(configfilepath)) {
 		return NULL;
 	}
-	strcpy(configfilepath, cfgpart->mountpoint);
-	strcat(configfilepath, "/");
-	strcat(configfilepath, FAT_ENV_FILENAME);
-	FILE *config = open_config_file(configfilepath, mode);
-	free(configfilepath);
-	return config;
+	return open_config_file(configfilepath, mode);
+}
+
+/* Locate the config file directly on the block device of an unmounted
+ * partition. Returns the open file descriptor or a negative errno value. */
+int open_config_file_raw(CONFIG_PART *cfgpart, int flags,
+			 struct fat_file *file)
+{
+	int fd, res;
+
+	if (!cfgpart || !cfgpart->devpath) {
+		return -EINVAL;
+	}
+	/* O_EXCL makes opening fail if the partition got mounted meanwhile */
+	fd = open(cfgpart->devpath, flags | O_EXCL | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	res = fat_lookup_root_file(fd, FAT_ENV_FILENAME, file, false);
+	if (res) {
+		VERBOSE(stdout, "No %s found on %s without mounting: %s\n",
+			FAT_ENV_FILENAME, cfgpart->devpath, strerror(-res));
+		close(fd);
+		return res;
+	}
+	return fd;
 }
 
 bool probe_config_file(CONFIG_PART *cfgpart)
 {
-	bool do_unmount = false;
 	if (!cfgpart) {
 		return false;
 	}
 	printf_debug("Checking device: %s\n", cfgpart->devpath);
 	if (!(cfgpart->mountpoint = get_mountpoint(cfgpart->devpath))) {
+		struct fat_file file;
+		int fd;
+
 		/* partition is not mounted */
 		cfgpart->not_mounted = true;
 		VERBOSE(stdout, "Partition %s is not mounted.\n",
 			cfgpart->devpath);
+		fd = open_config_file_raw(cfgpart, O_RDONLY, &file);
+		if (fd >= 0) {
+			close(fd);
+			return true;
+		}
 		if (!mount_partition(cfgpart)) {
 			return false;
 		}
-		do_unmount = true;
 	} else {
 		cfgpart->not_mounted = false;
 	}
@@ -83,11 +112,9 @@ bool probe_config_file(CONFIG_PART *cfgpart)
 						cfgpart->devpath);
 			}
 		}
-		if (do_unmount) {
-			unmount_partition(cfgpart);
-		} else {
-			free(cfgpart->mountpoint);
-			cfgpart->mountpoint = NULL;
+		/* keep the mount for reading and writing the environment */
+		if (!result) {
+			release_partition(cfgpart);
 		}
 		return result;
 	}
@@ -13,23 +13,31 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <limits.h>
 #include "env_api.h"
 #include "ebgpart.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_disk_utils.h"
+#include "env_probe_cache.h"
+#include "env_stats.h"
+#include "env_trace.h"
+#include "thread_pool.h"
 
 #define LOADER_PROT_VENDOR_GUID "4a67b082-0a4c-41cf-b6c7-440b29bb8c4f"
 #define GUID_LEN_CHARS		36
 #define EFI_ATTR_LEN_IN_WCHAR	2
 #define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof((arr)[0]))
+/* upper bound of partitions probed concurrently */
+#define PROBE_THREADS_MAX	8
 
 /**
  * Read the ESP UUID from the efivars. This only works if the bootloader
  * implements the LoaderDevicePartUUID from the systemd bootloader interface
- * spec. Returns a device name (e.g. sda) or NULL. The returned string needs
- * to be freed by the caller.
+ * spec. Stores the device name (e.g. sda) in rootdev and returns false if
+ * it is not known.
  */
-static char *get_rootdev_from_efi(void)
+static bool get_rootdev_from_efi(char *rootdev, size_t size)
 {
 	const char *vendor_guid = LOADER_PROT_VENDOR_GUID;
 	const char *basepath = "/sys/firmware/efi/efivars/";
@@ -39,6 +47,7 @@ static char *get_rootdev_from_efi(void)
 		char aschar[512];
 		char16_t aswchar[256];
 	} buffer;
+	char path[PATH_MAX];
 
 	// read LoaderDevicePartUUID efi variable
 	snprintf(buffer.aschar, sizeof(buffer.aschar),
@@ -46,14 +55,14 @@ static char *get_rootdev_from_efi(void)
 	if (!(f = fopen(buffer.aschar, "r"))) {
 		VERBOSE(stderr, "Error, cannot access efi var at %s.\n",
 			buffer.aschar);
-		return NULL;
+		return false;
 	}
 	const size_t readnb = fread(buffer.aswchar, sizeof(*buffer.aswchar),
 				    ARRAY_SIZE(buffer.aswchar), f);
 	if (readnb != GUID_LEN_CHARS + EFI_ATTR_LEN_IN_WCHAR) {
 		VERBOSE(stderr, "Data in LoaderDevicePartUUID not valid\n");
 		fclose(f);
-		return NULL;
+		return false;
 	}
 	fclose(f);
 
@@ -67,52 +76,89 @@ static char *get_rootdev_from_efi(void)
 	// resolve device based on partition uuid
 	snprintf(buffer.aschar, sizeof(buffer.aschar),
 		 "/dev/disk/by-partuuid/%s", part_uuid);
-	char *devpath = realpath(buffer.aschar, NULL);
-	if (!devpath) {
+	if (!realpath(buffer.aschar, path)) {
 		VERBOSE(stderr, "Error, no disk in %s\n", buffer.aschar);
-		return NULL;
+		return false;
 	}
-	VERBOSE(stdout, "resolved ESP to %s\n", devpath);
+	VERBOSE(stdout, "resolved ESP to %s\n", path);
 	// get disk name from path
-	char *partition = strrchr(devpath, '/') + 1;
+	char *partition = strrchr(path, '/') + 1;
 
 	// resolve parent device. As the ESP must be a primary partition, the
 	// parent is the block device.
 	snprintf(buffer.aschar, sizeof(buffer.aschar), "/sys/class/block/%s/..",
 		 partition);
-	free(devpath);
 
 	// resolve to e.g. /sys/devices/pci0000:00/0000:00:1f.2/<...>/block/sda
-	char *blockpath = realpath(buffer.aschar, NULL);
-	char *_blockdev = strrchr(blockpath, '/') + 1;
-	char *blockdev = strdup(_blockdev);
-	free(blockpath);
-	return blockdev;
+	if (!realpath(buffer.aschar, path)) {
+		VERBOSE(stderr, "Error, cannot resolve %s\n", buffer.aschar);
+		return false;
+	}
+	const int len = snprintf(rootdev, size, "%s", strrchr(path, '/') + 1);
+	return len > 0 && (size_t)len < size;
 }
 
-bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
+struct probe_candidate {
+	CONFIG_PART part;
+	/* disk holding the partition, recorded in the probe cache */
+	char *diskpath;
+	/* lower ranks are probed first with EBG_OPT_PROBE_EARLY_EXIT */
+	int rank;
+	/* position in partition table order */
+	size_t order;
+	bool found;
+};
+
+static int compare_candidates(const void *a, const void *b)
 {
-	PedDevice *dev = NULL;
-	char devpath[4096];
-	char *rootdev = NULL;
-	int count = 0;
+	const struct probe_candidate *ca = a;
+	const struct probe_candidate *cb = b;
 
-	if (!cfgpart) {
-		return false;
+	if (ca->rank != cb->rank) {
+		return ca->rank < cb->rank ? -1 : 1;
 	}
+	return ca->order < cb->order ? -1 : ca->order > cb->order;
+}
 
-	if (!search_all_devices) {
-		if (!(rootdev = get_rootdev_from_efi())) {
-			VERBOSE(stderr, "Warning, could not determine root "
-					"dev. Search on all devices\n");
-		} else {
-			VERBOSE(stdout, "Limit probing to disk %s\n", rootdev);
-		}
-	}
+static void probe_config_file_worker(void *ctx, size_t index)
+{
+	struct probe_candidate *c = (struct probe_candidate *)ctx + index;
 
-	ped_device_probe_all(rootdev);
-	free(rootdev);
+	c->found = probe_config_file(&c->part);
+}
 
+/* Probing runs with the lock held exclusively, so that the candidates of
+ * one run at a time exist. */
+static struct probe_candidate *grow_candidates(struct probe_candidate *list,
+					       size_t count)
+{
+#ifdef EBG_STATIC_ALLOC
+	static struct probe_candidate pool[EBG_MAX_PARTITIONS];
+
+	(void)list;
+	return count < ARRAY_SIZE(pool) ? pool : NULL;
+#else
+	return realloc(list, (count + 1) * sizeof(*list));
+#endif
+}
+
+static void free_candidates(struct probe_candidate *list)
+{
+#ifdef EBG_STATIC_ALLOC
+	(void)list;
+#else
+	free(list);
+#endif
+}
+
+/* Collect the device paths of all FAT partitions on the probed devices */
+static bool get_fat_partitions(struct probe_candidate **list, size_t *count)
+{
+	struct probe_candidate *candidates = NULL;
+	PedDevice *dev = NULL;
+	char devpath[4096];
+
+	*count = 0;
 	while ((dev = ped_device_get_next(dev))) {
 		printf_debug("Device: %s\n", dev->model);
 		PedDisk *pd = ped_disk_new(dev);
@@ -127,9 +173,12 @@ bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
 				part = ped_disk_next_partition(pd, part);
 				continue;
 			}
-			if (strncmp("/dev/mmcblk", dev->path, 11) == 0 ||
-			    strncmp("/dev/loop", dev->path, 9) == 0 ||
-			    strncmp("/dev/nvme", dev->path, 9) == 0) {
+			if (part->devpath) {
+				(void)snprintf(devpath, 4096, "%s",
+					       part->devpath);
+			} else if (strncmp("/dev/mmcblk", dev->path, 11) == 0 ||
+				   strncmp("/dev/loop", dev->path, 9) == 0 ||
+				   strncmp("/dev/nvme", dev->path, 9) == 0) {
 				(void)snprintf(devpath, 4096, "%sp%u",
 					       dev->path, part->num);
 			} else {
@@ -137,36 +186,184 @@ bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
 					       dev->path, part->num);
 			}
 
-			CONFIG_PART tmp = {.devpath = strdup(devpath)};
-			if (!tmp.devpath) {
-				VERBOSE(stderr, "Out of memory.");
-				return false;
+			struct probe_candidate *tmp;
+			tmp = grow_candidates(candidates, *count);
+			if (!tmp) {
+				goto out_of_memory;
+			}
+			candidates = tmp;
+			memset(&candidates[*count], 0, sizeof(*candidates));
+			candidates[*count].part.devpath =
+				bgenv_path_dup(devpath);
+			candidates[*count].diskpath = bgenv_path_dup(dev->path);
+			/* the disk the firmware booted from is the only one
+			 * probed if it is known, ESPs come next */
+			candidates[*count].rank = dev->has_esp ? 0 : 1;
+			candidates[*count].order = *count;
+			(*count)++;
+			if (!candidates[*count - 1].part.devpath ||
+			    !candidates[*count - 1].diskpath) {
+				goto out_of_memory;
 			}
-			if (probe_config_file(&tmp)) {
-				printf_debug("%s", "Environment file found.\n");
-				if (count < ENV_NUM_CONFIG_PARTS) {
-					cfgpart[count] = tmp;
-				} else {
-					free(tmp.devpath);
-					VERBOSE(stderr,
-						"Error, there are "
-						"more than %d config "
-						"partitions.\n",
-						ENV_NUM_CONFIG_PARTS);
-					return false;
+			part = ped_disk_next_partition(pd, part);
+		}
+	}
+	*list = candidates;
+	return true;
+
+out_of_memory:
+	VERBOSE(stderr, "Out of memory.");
+	/* finish the iteration so that the device list is released */
+	while ((dev = ped_device_get_next(dev))) {
+	}
+	for (size_t i = 0; i < *count; i++) {
+		bgenv_path_free(candidates[i].part.devpath);
+		bgenv_path_free(candidates[i].diskpath);
+	}
+	free_candidates(candidates);
+	return false;
+}
+
+static bool probe_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
+{
+	struct probe_candidate *candidates;
+	char *diskpaths[ENV_NUM_CONFIG_PARTS];
+	size_t num_candidates;
+	char *cache_key = NULL;
+	char rootdev_name[NAME_MAX + 1];
+	char *rootdev = NULL;
+	int count = 0;
+	bool result = true;
+	bool stop = false;
+
+	if (!cfgpart) {
+		return false;
+	}
+
+	if (!search_all_devices) {
+		if (get_rootdev_from_efi(rootdev_name, sizeof(rootdev_name))) {
+			rootdev = rootdev_name;
+		}
+		if (!rootdev) {
+			VERBOSE(stderr, "Warning, could not determine root "
+					"dev. Search on all devices\n");
+		} else {
+			VERBOSE(stdout, "Limit probing to disk %s\n", rootdev);
+		}
+	}
+
+	if (ebgenv_opts.probe_cache) {
+		cache_key = probe_cache_key(rootdev);
+		if (probe_cache_load(PROBE_CACHE_FILE, cache_key, cfgpart)) {
+			free(cache_key);
+			return true;
+		}
+	}
+
+	ebgpart_probe_parallel(ebgenv_opts.parallel_probe);
+	ebgpart_probe_timeout(ebgenv_opts.probe_timeout_ms);
+	ped_device_probe_all(rootdev);
+
+	if (!get_fat_partitions(&candidates, &num_candidates)) {
+		free(cache_key);
+		return false;
+	}
+
+	if (ebgenv_opts.probe_early_exit) {
+		qsort(candidates, num_candidates, sizeof(*candidates),
+		      compare_candidates);
+	}
+	/* assign in candidate order, independent of probing order */
+	for (size_t i = 0, end = 0; i < num_candidates; i++) {
+		CONFIG_PART *tmp = &candidates[i].part;
+
+		if (i == end && result) {
+			/* Without early exit, all candidates are probed to
+			 * detect surplus config partitions. Otherwise, probing
+			 * stops at the first disk completing the set. */
+			if (ebgenv_opts.probe_early_exit) {
+				if (count >= ENV_NUM_CONFIG_PARTS) {
+					stop = true;
+				}
+				while (++end < num_candidates &&
+				       !strcmp(candidates[end].diskpath,
+					       candidates[i].diskpath)) {
 				}
-				count++;
 			} else {
-				free(tmp.devpath);
+				end = num_candidates;
 			}
-			part = ped_disk_next_partition(pd, part);
+			if (ebgenv_opts.parallel_probe && !stop) {
+				thread_pool_run(probe_config_file_worker,
+						candidates + i, end - i,
+						PROBE_THREADS_MAX);
+			}
+		}
+		if (!result || stop) {
+			if (candidates[i].found) {
+				release_partition(tmp);
+			}
+			bgenv_path_free(tmp->devpath);
+			bgenv_path_free(candidates[i].diskpath);
+			continue;
+		}
+		if (!ebgenv_opts.parallel_probe) {
+			candidates[i].found = probe_config_file(tmp);
 		}
+		if (!candidates[i].found) {
+			bgenv_path_free(tmp->devpath);
+			bgenv_path_free(candidates[i].diskpath);
+			continue;
+		}
+		printf_debug("%s", "Environment file found.\n");
+		if (count < ENV_NUM_CONFIG_PARTS) {
+			cfgpart[count] = *tmp;
+			diskpaths[count] = candidates[i].diskpath;
+		} else {
+			release_partition(tmp);
+			bgenv_path_free(tmp->devpath);
+			bgenv_path_free(candidates[i].diskpath);
+			VERBOSE(stderr,
+				"Error, there are "
+				"more than %d config "
+				"partitions.\n",
+				ENV_NUM_CONFIG_PARTS);
+			result = false;
+		}
+		count++;
 	}
-	if (count < ENV_NUM_CONFIG_PARTS) {
+	free_candidates(candidates);
+	if (result && count < ENV_NUM_CONFIG_PARTS) {
 		VERBOSE(stderr,
 			"Error, less than %d config partitions exist.\n",
 			ENV_NUM_CONFIG_PARTS);
-		return false;
+		result = false;
 	}
-	return true;
+	for (int i = 0; !result && i < count && i < ENV_NUM_CONFIG_PARTS;
+	     i++) {
+		release_partition(&cfgpart[i]);
+	}
+	if (result && cache_key) {
+		(void)probe_cache_store(PROBE_CACHE_FILE, cache_key, cfgpart,
+					diskpaths);
+	}
+	for (int i = 0; i < count && i < ENV_NUM_CONFIG_PARTS; i++) {
+		bgenv_path_free(diskpaths[i]);
+	}
+	free(cache_key);
+	return result;
+}
+
+bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
+{
+	uint64_t start;
+	bool result;
+
+	EBG_TRACE1(probe_entry, search_all_devices);
+	start = bgenv_stat_begin();
+	mount_map_load();
+	result = probe_partitions(cfgpart, search_all_devices);
+	mount_map_release();
+	bgenv_stat_end(&bgenv_stats.probe, start, 0);
+	EBG_TRACE1(probe_return, result);
+	return result;
 }
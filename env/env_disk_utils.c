@@ -12,41 +12,339 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
-#include <mntent.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
+#include "env_stats.h"
+#include "env_trace.h"
 
 const char *tmp_mnt_dir = "/tmp/mnt-XXXXXX";
 
-char *get_mountpoint(char *devpath)
+const char *mountinfo_path = "/proc/self/mountinfo";
+
+#ifdef EBG_STATIC_ALLOC
+/* device path, disk path and mount point of each partition probed, and
+ * device path and mount point of the config partitions taken from the probe
+ * cache or ebgenvd instead */
+#define PATH_SLOTS (3 * EBG_MAX_PARTITIONS + 2 * ENV_NUM_CONFIG_PARTS)
+
+static char path_slots[PATH_SLOTS][EBG_PATH_LEN];
+static bool path_slot_used[PATH_SLOTS];
+static pthread_mutex_t path_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *bgenv_path_dup(const char *path)
 {
-	char *mntpoint = NULL;
-	struct mntent *part;
-	FILE *mtab;
+	size_t len = strlen(path) + 1;
+	char *copy = NULL;
 
-	mtab = setmntent("/proc/mounts", "r");
-	if (!mtab) {
+	if (len > EBG_PATH_LEN) {
+		VERBOSE(stderr, "Path %s is too long.\n", path);
+		return NULL;
+	}
+	pthread_mutex_lock(&path_slot_lock);
+	for (size_t i = 0; i < PATH_SLOTS; i++) {
+		if (!path_slot_used[i]) {
+			path_slot_used[i] = true;
+			copy = path_slots[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&path_slot_lock);
+	if (!copy) {
+		VERBOSE(stderr, "Error, no room for path %s.\n", path);
 		return NULL;
 	}
+	memcpy(copy, path, len);
+	return copy;
+}
+
+void bgenv_path_free(char *path)
+{
+	uintptr_t offset = (uintptr_t)path - (uintptr_t)path_slots;
+
+	/* paths set up by someone else are left alone */
+	if (!path || offset >= sizeof(path_slots)) {
+		return;
+	}
+	pthread_mutex_lock(&path_slot_lock);
+	path_slot_used[offset / EBG_PATH_LEN] = false;
+	pthread_mutex_unlock(&path_slot_lock);
+}
+#else
+char *bgenv_path_dup(const char *path)
+{
+	return strdup(path);
+}
+
+void bgenv_path_free(char *path)
+{
+	free(path);
+}
+#endif
+
+/* mount points of block devices, sorted by device number */
+struct mount_entry {
+	dev_t rdev;
+	/* position in mountinfo */
+	size_t order;
+#ifdef EBG_STATIC_ALLOC
+	char dir[EBG_PATH_LEN];
+#else
+	char *dir;
+#endif
+};
+
+struct mount_map {
+#ifdef EBG_STATIC_ALLOC
+	/* most mounts of block devices are of partitions */
+	struct mount_entry entries[EBG_MAX_PARTITIONS];
+#else
+	struct mount_entry *entries;
+#endif
+	size_t count;
+};
+
+static struct mount_map session_mounts;
+static bool session_mounts_loaded;
+
+static int compare_mounts(const void *a, const void *b)
+{
+	const struct mount_entry *ma = a;
+	const struct mount_entry *mb = b;
+
+	if (ma->rdev != mb->rdev) {
+		return ma->rdev < mb->rdev ? -1 : 1;
+	}
+	/* keep the first mount of a device in front */
+	return ma->order < mb->order ? -1 : ma->order > mb->order;
+}
+
+/* undo the octal escapes of spaces, tabs, newlines and backslashes */
+static void unescape_mountinfo(char *s)
+{
+	char *d = s;
 
-	while ((part = getmntent(mtab)) != NULL) {
-		if ((part->mnt_fsname != NULL) &&
-		    (strcmp(part->mnt_fsname, devpath)) == 0) {
-			mntpoint = strdup(part->mnt_dir);
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (char)((s[1] - '0') << 6 | (s[2] - '0') << 3 |
+				      (s[3] - '0'));
+			s += 4;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = '\0';
+}
+
+static void mount_map_free(struct mount_map *map)
+{
+#ifndef EBG_STATIC_ALLOC
+	for (size_t i = 0; i < map->count; i++) {
+		free(map->entries[i].dir);
+	}
+	free(map->entries);
+	map->entries = NULL;
+#endif
+	map->count = 0;
+}
+
+static bool mount_map_add(struct mount_map *map, dev_t rdev, const char *dir)
+{
+	struct mount_entry *entry;
+
+#ifdef EBG_STATIC_ALLOC
+	if (map->count == sizeof(map->entries) / sizeof(map->entries[0]) ||
+	    strlen(dir) >= sizeof(entry->dir)) {
+		return false;
+	}
+	entry = &map->entries[map->count];
+	strcpy(entry->dir, dir);
+#else
+	entry = realloc(map->entries, (map->count + 1) * sizeof(*entry));
+	if (!entry) {
+		return false;
+	}
+	map->entries = entry;
+	entry += map->count;
+	entry->dir = strdup(dir);
+	if (!entry->dir) {
+		return false;
+	}
+#endif
+	entry->rdev = rdev;
+	entry->order = map->count;
+	map->count++;
+	return true;
+}
+
+/* Calls fn for each mount of the root of a block device filesystem in the
+ * order of mountinfo until it returns false, bind mounts of directories do
+ * not show the environment file. Returns false if mountinfo is not
+ * readable. */
+static bool for_each_mount(bool (*fn)(void *ctx, dev_t rdev, char *dir),
+			   void *ctx)
+{
+#ifdef EBG_STATIC_ALLOC
+	/* what a mount point of EBG_PATH_LEN takes escaped, and the fields
+	 * in front of it; the rest of longer lines is skipped */
+	char line[4 * EBG_PATH_LEN + 64];
+#else
+	char *line = NULL;
+	size_t len = 0;
+#endif
+	FILE *f;
+
+	f = fopen(mountinfo_path, "re");
+	if (!f) {
+		return false;
+	}
+#ifdef EBG_STATIC_ALLOC
+	while (fgets(line, sizeof(line), f)) {
+		if (!strchr(line, '\n')) {
+			int c;
+
+			while ((c = fgetc(f)) != EOF && c != '\n') {
+			}
+		}
+#else
+	while (getline(&line, &len, f) != -1) {
+#endif
+		unsigned int major_nr, minor_nr;
+		int root = -1, dir = -1;
+		size_t end;
+
+		/* ID, parent ID, major:minor, root, mount point, ... */
+		if (sscanf(line, "%*u %*u %u:%u %n%*s %n%*s", &major_nr,
+			   &minor_nr, &root, &dir) != 2 ||
+		    dir < 0 || strncmp(line + root, "/ ", 2) != 0 ||
+		    major_nr == 0) {
+			continue;
+		}
+		/* the mount options follow unless the line was cut */
+		end = dir + strcspn(line + dir, " \n");
+		if (line[end] != ' ') {
+			continue;
+		}
+		line[end] = '\0';
+		unescape_mountinfo(line + dir);
+		if (!fn(ctx, makedev(major_nr, minor_nr), line + dir)) {
 			break;
 		}
 	}
-	endmntent(mtab);
+#ifndef EBG_STATIC_ALLOC
+	free(line);
+#endif
+	fclose(f);
+	return true;
+}
 
-	return mntpoint;
+struct mount_map_reader {
+	struct mount_map *map;
+	bool failed;
+};
+
+static bool mount_map_add_entry(void *ctx, dev_t rdev, char *dir)
+{
+	struct mount_map_reader *reader = ctx;
+
+	if (!mount_map_add(reader->map, rdev, dir)) {
+		reader->failed = true;
+		return false;
+	}
+	return true;
 }
 
-bool mount_partition(CONFIG_PART *cfgpart)
+static bool mount_map_read(struct mount_map *map)
+{
+	struct mount_map_reader reader = {.map = map};
+
+	if (!for_each_mount(mount_map_add_entry, &reader) || reader.failed) {
+		mount_map_free(map);
+		return false;
+	}
+	qsort(map->entries, map->count, sizeof(*map->entries),
+	      compare_mounts);
+	return true;
+}
+
+void mount_map_load(void)
+{
+	mount_map_release();
+	session_mounts_loaded = mount_map_read(&session_mounts);
+}
+
+void mount_map_release(void)
+{
+	mount_map_free(&session_mounts);
+	session_mounts_loaded = false;
+}
+
+static char *mount_map_lookup(const struct mount_map *map, dev_t rdev)
+{
+	size_t lo = 0, hi = map->count;
+
+	/* the first entry of the device */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (map->entries[mid].rdev < rdev) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == map->count || map->entries[lo].rdev != rdev) {
+		return NULL;
+	}
+	return bgenv_path_dup(map->entries[lo].dir);
+}
+
+struct mount_search {
+	dev_t rdev;
+	char *dir;
+};
+
+static bool mount_search_match(void *ctx, dev_t rdev, char *dir)
+{
+	struct mount_search *search = ctx;
+
+	if (rdev != search->rdev) {
+		return true;
+	}
+	search->dir = bgenv_path_dup(dir);
+	return false;
+}
+
+char *get_mountpoint(char *devpath)
+{
+	struct mount_search search = {0};
+	struct stat st;
+
+	if (stat(devpath, &st) != 0 || !S_ISBLK(st.st_mode)) {
+		return NULL;
+	}
+	/* the session map is not modified while partitions are probed
+	 * concurrently */
+	if (session_mounts_loaded) {
+		return mount_map_lookup(&session_mounts, st.st_rdev);
+	}
+	/* the first mount of the device, as in the map */
+	search.rdev = st.st_rdev;
+	(void)for_each_mount(mount_search_match, &search);
+	return search.dir;
+}
+
+static bool mount_tmp(CONFIG_PART *cfgpart)
 {
 	char tmpdir_template[256];
 	char *mountpoint;
+	uint64_t start;
 	(void)snprintf(tmpdir_template, 256, "%s", tmp_mnt_dir);
 	if (!cfgpart) {
 		return false;
@@ -54,11 +352,17 @@ bool mount_partition(CONFIG_PART *cfgpart)
 	if (!cfgpart->devpath) {
 		return false;
 	}
+	/* temporary mounts are kept until release_partition() */
+	if (cfgpart->mountpoint) {
+		return true;
+	}
 	if (!(mountpoint = mkdtemp(tmpdir_template))) {
 		VERBOSE(stderr, "Error creating temporary mount point.\n");
 		return false;
 	}
-	if (mount(cfgpart->devpath, mountpoint, "vfat", MS_SYNCHRONOUS, NULL)) {
+	start = bgenv_stat_begin();
+	/* not MS_SYNCHRONOUS, write_env() syncs the file once it is written */
+	if (mount(cfgpart->devpath, mountpoint, "vfat", 0, NULL)) {
 		VERBOSE(stderr, "Error mounting to temporary mount point.\n");
 		if (rmdir(tmpdir_template)) {
 			VERBOSE(stderr,
@@ -66,31 +370,65 @@ bool mount_partition(CONFIG_PART *cfgpart)
 		}
 		return false;
 	}
-	cfgpart->mountpoint = (char *)malloc(strlen(mountpoint) + 1);
+	bgenv_stat_end(&bgenv_stats.mount, start, 0);
+	cfgpart->mountpoint = bgenv_path_dup(mountpoint);
 	if (!cfgpart->mountpoint) {
 		VERBOSE(stderr, "Error, out of memory.\n");
 		return false;
 	}
-	strcpy(cfgpart->mountpoint, mountpoint);
 	return true;
 }
 
+bool mount_partition(CONFIG_PART *cfgpart)
+{
+	bool result;
+
+	if (!cfgpart) {
+		return false;
+	}
+	EBG_TRACE1(mount_entry, cfgpart->devpath);
+	result = mount_tmp(cfgpart);
+	EBG_TRACE3(mount_return, cfgpart->devpath, result, cfgpart->mountpoint);
+	return result;
+}
+
 void unmount_partition(CONFIG_PART *cfgpart)
 {
+	uint64_t start;
+
 	if (!cfgpart) {
 		return;
 	}
 	if (!cfgpart->mountpoint) {
 		return;
 	}
-	if (umount(cfgpart->mountpoint)) {
+	start = bgenv_stat_begin();
+	/* something may still hold a file open, detach it then */
+	if (umount(cfgpart->mountpoint) &&
+	    (errno != EBUSY || umount2(cfgpart->mountpoint, MNT_DETACH))) {
 		VERBOSE(stderr, "Error unmounting temporary mountpoint %s.\n",
 			cfgpart->mountpoint);
+	} else {
+		bgenv_stat_end(&bgenv_stats.unmount, start, 0);
 	}
 	if (rmdir(cfgpart->mountpoint)) {
 		VERBOSE(stderr, "Error deleting temporary directory %s.\n",
 			cfgpart->mountpoint);
 	}
-	free(cfgpart->mountpoint);
+	bgenv_path_free(cfgpart->mountpoint);
 	cfgpart->mountpoint = NULL;
 }
+
+void release_partition(CONFIG_PART *cfgpart)
+{
+	if (!cfgpart) {
+		return;
+	}
+	if (cfgpart->not_mounted) {
+		unmount_partition(cfgpart);
+	} else {
+		/* mounted by someone else, only forget where */
+		bgenv_path_free(cfgpart->mountpoint);
+		cfgpart->mountpoint = NULL;
+	}
+}
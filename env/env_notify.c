@@ -0,0 +1,288 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "env_api.h"
+#include "env_disk_utils.h"
+#include "ebgenvd.h"
+#include "ebgenv.h"
+#include "test-interface.h"
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+struct ebg_env_notify {
+	/* socket of ebgenvd or inotify descriptor */
+	int fd;
+	bool daemon;
+	/* own copies of the config partitions for re-reading them */
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	int wd[ENV_NUM_CONFIG_PARTS];
+	BG_ENVDATA *data;
+	/* state reported last */
+	struct {
+		uint32_t revision;
+		uint32_t ustate;
+	} state[ENV_NUM_CONFIG_PARTS];
+};
+
+static void notify_free(struct ebg_env_notify *n)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		free(n->parts[i].devpath);
+		free(n->parts[i].mountpoint);
+	}
+	free(n->data);
+	free(n);
+}
+
+static int notify_open_daemon(struct ebg_env_notify *n)
+{
+	struct ebgenvd_event ev;
+	int fd;
+
+	fd = ebgenvd_watch(&ev);
+	if (fd < 0) {
+		return fd;
+	}
+	n->fd = fd;
+	n->daemon = true;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		n->state[i].revision = ev.parts[i].revision;
+		n->state[i].ustate = ev.parts[i].ustate;
+	}
+	return 0;
+}
+
+/* Changes made through a mounted config partition show up on the config
+ * file, those made without mounting it on the device node. */
+static int notify_watch_part(struct ebg_env_notify *n, int i)
+{
+	CONFIG_PART *part = &n->parts[i];
+	uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF;
+	char *path;
+	int wd;
+
+	if (!part->not_mounted && part->mountpoint) {
+		if (asprintf(&path, "%s/%s", part->mountpoint,
+			     FAT_ENV_FILENAME) < 0) {
+			return -ENOMEM;
+		}
+		wd = inotify_add_watch(n->fd, path, mask);
+		free(path);
+	} else {
+		wd = inotify_add_watch(n->fd, part->devpath, mask);
+	}
+	if (wd < 0) {
+		return -errno;
+	}
+	n->wd[i] = wd;
+	return 0;
+}
+
+static int notify_open_inotify(struct ebg_env_notify *n)
+{
+	int res = 0;
+
+	n->data = malloc(sizeof(BG_ENVDATA));
+	if (!n->data) {
+		return -ENOMEM;
+	}
+	n->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (n->fd < 0) {
+		return -errno;
+	}
+
+	bgenv_lock_exclusive(NULL);
+	if (!bgenv_init()) {
+		bgenv_unlock(NULL);
+		return -EIO;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && !res; i++) {
+		n->parts[i].not_mounted = config_parts[i].not_mounted;
+		n->parts[i].devpath = config_parts[i].devpath
+					      ? strdup(config_parts[i].devpath)
+					      : NULL;
+		/* temporary mounts end with bgenv_finalize() below */
+		n->parts[i].mountpoint =
+			config_parts[i].mountpoint && !n->parts[i].not_mounted
+				? strdup(config_parts[i].mountpoint)
+				: NULL;
+		n->state[i].revision = envdata[i].revision;
+		n->state[i].ustate = envdata[i].ustate;
+		if (!n->parts[i].devpath) {
+			res = -ENOMEM;
+		}
+	}
+	bgenv_finalize();
+	bgenv_unlock(NULL);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && !res; i++) {
+		res = notify_watch_part(n, i);
+		if (res) {
+			VERBOSE(stderr, "Cannot watch %s: %s\n",
+				n->parts[i].devpath, strerror(-res));
+		}
+	}
+	return res;
+}
+
+ebg_env_notify_t *ebg_env_notify_open(void)
+{
+	struct ebg_env_notify *n;
+	int res = -ENOENT;
+
+	n = calloc(1, sizeof(struct ebg_env_notify));
+	if (!n) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	n->fd = -1;
+	if (ebgenv_opts.use_daemon) {
+		res = notify_open_daemon(n);
+	}
+	if (res == -ENOENT || res == -ECONNREFUSED) {
+		res = notify_open_inotify(n);
+	}
+	if (res) {
+		ebg_env_notify_close(n);
+		errno = -res;
+		return NULL;
+	}
+	return n;
+}
+
+int ebg_env_notify_fd(ebg_env_notify_t *n)
+{
+	return n ? n->fd : -EINVAL;
+}
+
+static int notify_read_daemon(struct ebg_env_notify *n, bool *changed)
+{
+	struct ebgenvd_event ev;
+	ssize_t len;
+	int res;
+
+	/* the last of the pending events counts */
+	while ((len = recv(n->fd, &ev, sizeof(ev), MSG_DONTWAIT)) != 0) {
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? 0 : -errno;
+		}
+		if (len < (ssize_t)sizeof(ev)) {
+			res = ebgenvd_recv(n->fd, (uint8_t *)&ev + len,
+					   sizeof(ev) - len);
+			if (res) {
+				return res;
+			}
+		}
+		if (ev.magic != EBGENVD_MAGIC) {
+			return -EPROTO;
+		}
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			if (n->state[i].revision != ev.parts[i].revision ||
+			    n->state[i].ustate != ev.parts[i].ustate) {
+				n->state[i].revision = ev.parts[i].revision;
+				n->state[i].ustate = ev.parts[i].ustate;
+				*changed = true;
+			}
+		}
+	}
+	return -ECONNRESET;
+}
+
+static int notify_read_inotify(struct ebg_env_notify *n, bool *changed)
+{
+	uint8_t buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	bool dirty[ENV_NUM_CONFIG_PARTS] = {false};
+	ssize_t len;
+	bool res;
+
+	while ((len = read(n->fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (uint8_t *p = buf; p < buf + len;
+		     p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+				/* the config partition is gone */
+				return -ENODEV;
+			}
+			for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+				if (ev->wd == n->wd[i]) {
+					dirty[i] = true;
+				}
+			}
+		}
+	}
+	if (len < 0 && errno != EAGAIN && errno != EINTR) {
+		return -errno;
+	}
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		/* a write in progress is followed by another event */
+		if (!dirty[i]) {
+			continue;
+		}
+		res = read_env(&n->parts[i], n->data);
+		/* a mount kept would hide the changes of others from the
+		 * watch on the device node */
+		if (n->parts[i].not_mounted) {
+			unmount_partition(&n->parts[i]);
+		}
+		if (!res) {
+			continue;
+		}
+		if (n->state[i].revision != n->data->revision ||
+		    n->state[i].ustate != n->data->ustate) {
+			n->state[i].revision = n->data->revision;
+			n->state[i].ustate = n->data->ustate;
+			*changed = true;
+		}
+	}
+	return 0;
+}
+
+int ebg_env_notify_read(ebg_env_notify_t *n)
+{
+	bool changed = false;
+	int res;
+
+	if (!n) {
+		return -EINVAL;
+	}
+	if (n->daemon) {
+		res = notify_read_daemon(n, &changed);
+	} else {
+		res = notify_read_inotify(n, &changed);
+	}
+	if (res) {
+		return res;
+	}
+	return changed ? 1 : 0;
+}
+
+void ebg_env_notify_close(ebg_env_notify_t *n)
+{
+	if (!n) {
+		return;
+	}
+	if (n->fd >= 0) {
+		close(n->fd);
+	}
+	notify_free(n);
+}
@@ -0,0 +1,251 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "env_api.h"
+#include "env_config_file.h"
+#include "env_disk_utils.h"
+#include "env_probe_cache.h"
+
+#define PROBE_CACHE_MAGIC	"EBGPROBECACHE"
+#define PROBE_CACHE_VERSION	2
+/* covers the MBR, the GPT header with its CRC over the partition entries
+ * and the GPT header location of disks with 4K sectors */
+#define DISK_FINGERPRINT_SIZE	8192
+
+/* Logical partitions are described by EBRs spread over the disk, so also
+ * take the start and size the kernel uses for the partition itself. */
+static uint32_t partition_fingerprint(uint32_t fp, dev_t rdev)
+{
+	static const char *const attrs[] = {"start", "size"};
+	char path[64], value[32];
+	ssize_t len;
+	int fd;
+
+	for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+			 major(rdev), minor(rdev), attrs[i]);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		len = read(fd, value, sizeof(value));
+		close(fd);
+		if (len > 0) {
+			fp = bgenv_crc32(fp, value, len);
+		}
+	}
+	return fp;
+}
+
+static bool disk_fingerprint(const char *diskpath, dev_t rdev, uint32_t *fp)
+{
+	uint8_t buffer[DISK_FINGERPRINT_SIZE];
+	ssize_t len;
+	int fd;
+
+	fd = open(diskpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	len = pread(fd, buffer, sizeof(buffer), 0);
+	close(fd);
+	if (len <= 0) {
+		return false;
+	}
+	*fp = partition_fingerprint(bgenv_crc32(0, buffer, len), rdev);
+	return true;
+}
+
+/* order independent hash over the names of all block devices */
+static uint32_t block_devices_fingerprint(void)
+{
+	struct dirent *entry;
+	uint32_t fp = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/block");
+	if (!dir) {
+		return 0;
+	}
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		fp ^= bgenv_crc32(0, entry->d_name, strlen(entry->d_name));
+	}
+	closedir(dir);
+	return fp;
+}
+
+char *probe_cache_key(const char *rootdev)
+{
+	char *key;
+
+	if (asprintf(&key, "%s:%08x", rootdev ? rootdev : "*",
+		     block_devices_fingerprint()) == -1) {
+		return NULL;
+	}
+	return key;
+}
+
+static bool load_entries(FILE *f, const char *key, CONFIG_PART *cfgpart)
+{
+	char line[4096 * 2 + 64];
+	char devpath[4096], diskpath[4096], cached_key[256];
+	unsigned int major_nr, minor_nr, version;
+	uint32_t cached_fp, fp;
+	struct stat st;
+	int count = 0;
+
+	if (!fgets(line, sizeof(line), f) ||
+	    sscanf(line, PROBE_CACHE_MAGIC " %u %255s", &version,
+		   cached_key) != 2 ||
+	    version != PROBE_CACHE_VERSION || strcmp(cached_key, key) != 0) {
+		VERBOSE(stdout, "Probe cache does not match.\n");
+		return false;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (count >= ENV_NUM_CONFIG_PARTS ||
+		    sscanf(line, "%4095s %u:%u %4095s %x", devpath, &major_nr,
+			   &minor_nr, diskpath, &cached_fp) != 5) {
+			return false;
+		}
+		for (int i = 0; i < count; i++) {
+			if (strcmp(cfgpart[i].devpath, devpath) == 0) {
+				VERBOSE(stdout,
+					"Probe cache: %s is listed twice.\n",
+					devpath);
+				return false;
+			}
+		}
+		if (stat(devpath, &st) != 0 ||
+		    major(st.st_rdev) != major_nr ||
+		    minor(st.st_rdev) != minor_nr) {
+			VERBOSE(stdout, "Probe cache: %s has changed.\n",
+				devpath);
+			return false;
+		}
+		if (!disk_fingerprint(diskpath, st.st_rdev, &fp) ||
+		    fp != cached_fp) {
+			VERBOSE(stdout,
+				"Probe cache: partition table of %s has "
+				"changed.\n",
+				diskpath);
+			return false;
+		}
+		cfgpart[count].devpath = bgenv_path_dup(devpath);
+		if (!cfgpart[count].devpath) {
+			return false;
+		}
+		count++;
+		if (!probe_config_file(&cfgpart[count - 1])) {
+			VERBOSE(stdout, "Probe cache: no environment on %s.\n",
+				devpath);
+			return false;
+		}
+	}
+	return count == ENV_NUM_CONFIG_PARTS;
+}
+
+bool probe_cache_load(const char *path, const char *key,
+		      CONFIG_PART *cfgpart)
+{
+	FILE *f;
+	bool result;
+
+	if (!key) {
+		return false;
+	}
+	f = fopen(path, "re");
+	if (!f) {
+		return false;
+	}
+	memset(cfgpart, 0, sizeof(*cfgpart) * ENV_NUM_CONFIG_PARTS);
+	result = load_entries(f, key, cfgpart);
+	fclose(f);
+	if (!result) {
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			release_partition(&cfgpart[i]);
+			bgenv_path_free(cfgpart[i].devpath);
+			cfgpart[i].devpath = NULL;
+		}
+		(void)unlink(path);
+		return false;
+	}
+	VERBOSE(stdout, "Using config partitions from %s\n", path);
+	return true;
+}
+
+bool probe_cache_store(const char *path, const char *key,
+		       const CONFIG_PART *cfgpart, char *const *diskpaths)
+{
+	char *tmppath, *dir, *sep;
+	struct stat st;
+	uint32_t fp;
+	FILE *f;
+	int fd;
+
+	if (!key) {
+		return false;
+	}
+	dir = strdup(path);
+	if (!dir) {
+		return false;
+	}
+	sep = strrchr(dir, '/');
+	if (sep && sep != dir) {
+		*sep = '\0';
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+			free(dir);
+			return false;
+		}
+	}
+	free(dir);
+
+	if (asprintf(&tmppath, "%s.XXXXXX", path) == -1) {
+		return false;
+	}
+	fd = mkostemp(tmppath, O_CLOEXEC);
+	if (fd < 0) {
+		free(tmppath);
+		return false;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto err;
+	}
+	fprintf(f, PROBE_CACHE_MAGIC " %u %s\n", PROBE_CACHE_VERSION, key);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (stat(cfgpart[i].devpath, &st) != 0 ||
+		    !disk_fingerprint(diskpaths[i], st.st_rdev, &fp)) {
+			fclose(f);
+			goto err;
+		}
+		fprintf(f, "%s %u:%u %s %08x\n", cfgpart[i].devpath,
+			major(st.st_rdev), minor(st.st_rdev), diskpaths[i], fp);
+	}
+	if (fclose(f) != 0 || rename(tmppath, path) != 0) {
+		goto err;
+	}
+	free(tmppath);
+	return true;
+
+err:
+	VERBOSE(stderr, "Could not write probe cache %s\n", path);
+	(void)unlink(tmppath);
+	free(tmppath);
+	return false;
+}
@@ -0,0 +1,208 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include "env_api.h"
+#include "uservars.h"
+#include "ebgenv.h"
+
+struct ebg_env_snapshot {
+	/* one reference is held while the snapshot is published */
+	unsigned int refs;
+	uint32_t latest;
+	uint16_t globalstate;
+	/* prebuilt and never modified, NULL if userdata could not be
+	 * indexed */
+	BGENV_USERVAR_INDEX *index;
+	BG_ENVDATA envs[ENV_NUM_CONFIG_PARTS];
+};
+
+static struct ebg_env_snapshot *published;
+
+/*
+ * Readers register in readers[] while they take a reference to the
+ * published snapshot. A publisher that replaced it flips the epoch twice
+ * and waits for the readers of the respective previous epoch to leave, so
+ * that none of them can still be about to reference the old one. Readers
+ * never wait, publishers only for those few instructions.
+ */
+static unsigned long epoch;
+static unsigned int readers[2];
+
+/* serializes publishers */
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void snapshot_release(struct ebg_env_snapshot *s)
+{
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		bgenv_uservar_index_free(s->index);
+		free(s);
+	}
+}
+
+static void snapshot_synchronize(void)
+{
+	for (int i = 0; i < 2; i++) {
+		unsigned long e = __atomic_fetch_add(&epoch, 1,
+						     __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&readers[e & 1], __ATOMIC_SEQ_CST)) {
+			sched_yield();
+		}
+	}
+}
+
+static void snapshot_replace(struct ebg_env_snapshot *s)
+{
+	struct ebg_env_snapshot *old;
+
+	old = __atomic_exchange_n(&published, s, __ATOMIC_SEQ_CST);
+	if (old) {
+		snapshot_synchronize();
+		snapshot_release(old);
+	}
+}
+
+/* same rules as bgenv_open_latest() and env_getglobalstate() */
+static void snapshot_seal(struct ebg_env_snapshot *s)
+{
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
+	uint8_t *udata;
+
+	bgenv_revision_order(s->envs, NULL, ENV_NUM_CONFIG_PARTS, order);
+	s->latest = order[0];
+	s->globalstate = s->envs[s->latest].ustate;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (s->envs[i].revision == REVISION_FAILED &&
+		    s->envs[i].ustate == USTATE_FAILED) {
+			s->globalstate = USTATE_FAILED;
+			break;
+		}
+	}
+
+	/* build the index now, readers must not modify it */
+	udata = s->envs[s->latest].userdata;
+	s->index = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	if (s->index) {
+		bgenv_find_uservar_indexed(s->index, udata, "");
+		if (!s->index->valid) {
+			bgenv_uservar_index_free(s->index);
+			s->index = NULL;
+		}
+	}
+	s->refs = 1;
+}
+
+void bgenv_snapshot_publish(const BG_ENVDATA *envs)
+{
+	struct ebg_env_snapshot *s;
+
+	pthread_mutex_lock(&publish_lock);
+	s = malloc(sizeof(struct ebg_env_snapshot));
+	if (s) {
+		memcpy(s->envs, envs, sizeof(s->envs));
+		snapshot_seal(s);
+	} else {
+		VERBOSE(stderr, "Cannot allocate environment snapshot.\n");
+	}
+	snapshot_replace(s);
+	pthread_mutex_unlock(&publish_lock);
+}
+
+void bgenv_snapshot_update(uint32_t index, const BG_ENVDATA *data)
+{
+	struct ebg_env_snapshot *s;
+
+	if (index >= ENV_NUM_CONFIG_PARTS) {
+		return;
+	}
+	pthread_mutex_lock(&publish_lock);
+	/* without a base, the other environments are unknown */
+	if (!published) {
+		pthread_mutex_unlock(&publish_lock);
+		return;
+	}
+	s = malloc(sizeof(struct ebg_env_snapshot));
+	if (s) {
+		memcpy(s->envs, published->envs, sizeof(s->envs));
+		memcpy(&s->envs[index], data, sizeof(BG_ENVDATA));
+		snapshot_seal(s);
+	} else {
+		/* rather no snapshot than an outdated one */
+		VERBOSE(stderr, "Cannot allocate environment snapshot.\n");
+	}
+	snapshot_replace(s);
+	pthread_mutex_unlock(&publish_lock);
+}
+
+void bgenv_snapshot_clear(void)
+{
+	pthread_mutex_lock(&publish_lock);
+	snapshot_replace(NULL);
+	pthread_mutex_unlock(&publish_lock);
+}
+
+const ebg_env_snapshot_t *ebg_env_snapshot_get(void)
+{
+	struct ebg_env_snapshot *s;
+	unsigned long e;
+
+	e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&readers[e], 1, __ATOMIC_SEQ_CST);
+	s = __atomic_load_n(&published, __ATOMIC_SEQ_CST);
+	if (s) {
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&readers[e], 1, __ATOMIC_SEQ_CST);
+
+	if (!s) {
+		errno = ENOENT;
+	}
+	return s;
+}
+
+void ebg_env_snapshot_put(const ebg_env_snapshot_t *s)
+{
+	if (s) {
+		snapshot_release((struct ebg_env_snapshot *)s);
+	}
+}
+
+int ebg_env_snapshot_get_ex(const ebg_env_snapshot_t *s, char *key,
+			    uint64_t *datatype, uint8_t *buffer,
+			    uint32_t maxlen)
+{
+	BGENV env = {0};
+	int res;
+
+	if (!s) {
+		return -EINVAL;
+	}
+	env.data = (BG_ENVDATA *)&s->envs[s->latest];
+	env.uservar_index = s->index;
+	res = bgenv_get(&env, key, datatype, buffer, maxlen);
+	/* bgenv_get() allocated a private index if there is none */
+	if (env.uservar_index != s->index) {
+		bgenv_uservar_index_free(env.uservar_index);
+	}
+	return res;
+}
+
+uint16_t ebg_env_snapshot_getglobalstate(const ebg_env_snapshot_t *s)
+{
+	if (!s) {
+		errno = EINVAL;
+		return USTATE_UNKNOWN;
+	}
+	return s->globalstate;
+}
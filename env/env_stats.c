@@ -0,0 +1,110 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "env_stats.h"
+
+ebg_env_stats_t bgenv_stats;
+
+/* serializes adding devices, the counters themselves are atomic */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stat_load(ebg_stat_t *dst, ebg_stat_t *src)
+{
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->nsec = __atomic_load_n(&src->nsec, __ATOMIC_RELAXED);
+	dst->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+}
+
+/* entry of devpath, added if there is room, called with devices_lock held */
+static ebg_device_stat_t *stat_device_entry(const char *devpath)
+{
+	uint32_t i;
+
+	for (i = 0; i < bgenv_stats.num_devices; i++) {
+		if (strcmp(bgenv_stats.devices[i].devpath, devpath) == 0) {
+			return &bgenv_stats.devices[i];
+		}
+	}
+	if (i == EBG_STATS_MAX_DEVICES) {
+		return NULL;
+	}
+	(void)snprintf(bgenv_stats.devices[i].devpath,
+		       sizeof(bgenv_stats.devices[i].devpath), "%s", devpath);
+	bgenv_stats.num_devices++;
+	return &bgenv_stats.devices[i];
+}
+
+void bgenv_stat_device(const char *devpath, uint64_t start)
+{
+	ebg_device_stat_t *entry;
+	uint64_t nsec;
+
+	if (!start) {
+		return;
+	}
+	nsec = bgenv_stat_elapsed(start);
+
+	pthread_mutex_lock(&devices_lock);
+	entry = stat_device_entry(devpath);
+	if (entry) {
+		entry->scan.count++;
+		entry->scan.nsec += nsec;
+	}
+	pthread_mutex_unlock(&devices_lock);
+}
+
+void bgenv_stat_device_timeout(const char *devpath)
+{
+	ebg_device_stat_t *entry;
+
+	if (!bgenv_stat_begin()) {
+		return;
+	}
+	pthread_mutex_lock(&devices_lock);
+	entry = stat_device_entry(devpath);
+	if (entry) {
+		entry->timeouts++;
+	}
+	pthread_mutex_unlock(&devices_lock);
+}
+
+int ebg_env_get_stats(ebg_env_stats_t *stats)
+{
+	if (!stats) {
+		return EINVAL;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stat_load(&stats->mount, &bgenv_stats.mount);
+	stat_load(&stats->unmount, &bgenv_stats.unmount);
+	stat_load(&stats->read_env, &bgenv_stats.read_env);
+	stat_load(&stats->write_env, &bgenv_stats.write_env);
+	stat_load(&stats->crc32, &bgenv_stats.crc32);
+	stat_load(&stats->uservar_lookup, &bgenv_stats.uservar_lookup);
+	stat_load(&stats->probe, &bgenv_stats.probe);
+
+	pthread_mutex_lock(&devices_lock);
+	memcpy(stats->devices, bgenv_stats.devices,
+	       bgenv_stats.num_devices * sizeof(stats->devices[0]));
+	stats->num_devices = bgenv_stats.num_devices;
+	pthread_mutex_unlock(&devices_lock);
+	return 0;
+}
+
+void ebg_env_reset_stats(void)
+{
+	pthread_mutex_lock(&devices_lock);
+	memset(&bgenv_stats, 0, sizeof(bgenv_stats));
+	pthread_mutex_unlock(&devices_lock);
+}
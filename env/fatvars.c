@@ -22,33 +22,179 @@
 
 static int current_partition = 0;
 static BG_ENVDATA *env;
+/* volume index of each environment in env, as found by load_config() */
+static UINTN config_volumes[ENV_NUM_CONFIG_PARTS + 1];
+static UINTN num_config_volumes;
+/* stored userdata length of each environment, see enumerate_cfg_parts() */
+static UINT32 userdata_len[ENV_NUM_CONFIG_PARTS];
 
-static BG_STATUS save_current_config(VOID)
+/* from ebgenv.h, which is not usable in the EFI environment */
+#define USERVAR_TYPE_STRING_ASCII 32
+#define USERVAR_STANDARD_TYPE_MASK ((1ULL << 32) - 1)
+
+/*
+ * Attempts to boot an environment in testing state, see check_boot_attempt().
+ * Kept in an EFI variable instead of the environment, so that retries do
+ * not rewrite the config partition, and keyed by the environment, so that
+ * each update starts counting anew.
+ */
+#define BOOT_ATTEMPTS_VAR L"BootGuardBootAttempts"
+
+static EFI_GUID boot_attempts_guid = {
+	0x3c5e8f21,
+	0x9d47,
+	0x4b6a,
+	{0xa1, 0x52, 0x7e, 0x0b, 0x64, 0xc3, 0x9f, 0x18}};
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct {
+	UINT32 config_index;
+	UINT32 revision;
+	UINT32 attempts;
+} BOOT_ATTEMPTS;
+#pragma pack(pop)
+
+/* Looks up a user variable holding a decimal number of up to max as ASCII
+ * string, see bgenv_map_uservar() for the encoding. keylen includes the
+ * zero-termination. Returns FALSE if it is not set or not valid. */
+static BOOLEAN get_uservar_number(BG_ENVDATA *e, const char *key,
+				  UINTN keylen, UINTN max, UINTN *number)
 {
-	BG_STATUS result = BG_CONFIG_ERROR;
-	EFI_STATUS efistatus;
-	UINTN numHandles = volume_count;
-	UINTN *config_volumes;
+	UINT8 *p = e->userdata;
+	UINT8 *end = e->userdata + ENV_MEM_USERVARS;
 
-	config_volumes = (UINTN *)AllocatePool(sizeof(UINTN) *  volume_count);
-	if (!config_volumes) {
-		ERROR(L"Could not allocate memory for config partition mapping.\n");
-		return result;
+	while (p < end && *p) {
+		UINT8 *payload = p;
+		UINT32 size;
+		UINT64 type;
+
+		while (payload < end && *payload) {
+			payload++;
+		}
+		payload++;
+		if (payload + sizeof(size) + sizeof(type) > end) {
+			return FALSE;
+		}
+		CopyMem(&size, payload, sizeof(size));
+		CopyMem(&type, payload + sizeof(size), sizeof(type));
+		if (size < sizeof(size) + sizeof(type) ||
+		    size > (UINTN)(end - payload)) {
+			return FALSE;
+		}
+		if ((UINTN)(payload - p) == keylen &&
+		    CompareMem(p, key, keylen) == 0) {
+			UINT8 *c = payload + sizeof(size) + sizeof(type);
+			UINT8 *data_end = payload + size;
+			UINTN value = 0;
+
+			if ((type & USERVAR_STANDARD_TYPE_MASK) !=
+			    USERVAR_TYPE_STRING_ASCII) {
+				return FALSE;
+			}
+			if (c == data_end || *c == 0) {
+				return FALSE;
+			}
+			for (; c < data_end && *c; c++) {
+				if (*c < '0' || *c > '9') {
+					return FALSE;
+				}
+				value = value * 10 + (*c - '0');
+				if (value > max) {
+					return FALSE;
+				}
+			}
+			*number = value;
+			return TRUE;
+		}
+		p = payload + size;
+	}
+	return FALSE;
+}
+
+static BOOLEAN get_boot_delay(BG_ENVDATA *e, UINTN *delay)
+{
+	return get_uservar_number(e, USERVAR_BOOT_DELAY,
+				  sizeof(USERVAR_BOOT_DELAY), BOOT_DELAY_MAX,
+				  delay);
+}
+
+static UINTN get_max_boot_attempts(BG_ENVDATA *e)
+{
+	UINTN attempts;
+
+	if (!get_uservar_number(e, USERVAR_BOOT_ATTEMPTS,
+				sizeof(USERVAR_BOOT_ATTEMPTS),
+				BOOT_ATTEMPTS_MAX, &attempts) ||
+	    attempts == 0) {
+		return 1;
+	}
+	return attempts;
+}
+
+static VOID clear_boot_attempts(VOID)
+{
+	UINTN size = 0;
+
+	/* only deleted if present to spare the flash */
+	if (RT->GetVariable(BOOT_ATTEMPTS_VAR, &boot_attempts_guid, NULL,
+			    &size, NULL) == EFI_BUFFER_TOO_SMALL) {
+		(VOID) RT->SetVariable(BOOT_ATTEMPTS_VAR, &boot_attempts_guid,
+				       0, 0, NULL);
 	}
+}
 
-	if (EFI_ERROR(enumerate_cfg_parts(config_volumes, &numHandles))) {
-		ERROR(L"Could not enumerate config partitions.\n");
-		goto scc_cleanup;
+/*
+ * Called when the environment in testing state is about to be booted again,
+ * i.e. the previous attempt did not confirm it. The transition from
+ * USTATE_INSTALLED was the first attempt. Returns TRUE and counts the
+ * attempt if another one is permitted by USERVAR_BOOT_ATTEMPTS, FALSE if
+ * the update has to be considered as failed.
+ */
+static BOOLEAN check_boot_attempt(UINTN index)
+{
+	UINTN max = get_max_boot_attempts(&env[index]);
+	BOOT_ATTEMPTS stored;
+	UINTN size = sizeof(stored);
+	UINT32 attempts = 1;
+
+	if (RT->GetVariable(BOOT_ATTEMPTS_VAR, &boot_attempts_guid, NULL,
+			    &size, &stored) == EFI_SUCCESS &&
+	    size == sizeof(stored) && stored.config_index == index &&
+	    stored.revision == env[index].revision) {
+		attempts = stored.attempts;
+	}
+	if (attempts >= max) {
+		clear_boot_attempts();
+		return FALSE;
+	}
+
+	stored.config_index = index;
+	stored.revision = env[index].revision;
+	stored.attempts = attempts + 1;
+	if (EFI_ERROR(RT->SetVariable(BOOT_ATTEMPTS_VAR, &boot_attempts_guid,
+				      EFI_VARIABLE_NON_VOLATILE |
+					      EFI_VARIABLE_BOOTSERVICE_ACCESS,
+				      sizeof(stored), &stored))) {
+		/* an uncounted attempt could be repeated endlessly */
+		ERROR(L"Cannot store boot attempt counter.\n");
+		return FALSE;
 	}
+	WARNING(L"Boot attempt %d of %ld for config partition %ld.\n",
+		stored.attempts, (UINT64)max, (UINT64)index);
+	return TRUE;
+}
 
-	numHandles = filter_cfg_parts(config_volumes, numHandles);
+static BG_STATUS save_current_config(VOID)
+{
+	EFI_STATUS efistatus;
 
-	if (numHandles != ENV_NUM_CONFIG_PARTS) {
+	if (num_config_volumes != ENV_NUM_CONFIG_PARTS) {
 		ERROR(L"Unexpected number of config partitions: found %d, but expected %d.\n",
-		      numHandles, ENV_NUM_CONFIG_PARTS);
+		      num_config_volumes, ENV_NUM_CONFIG_PARTS);
 		/* In case of saving, this must be treated as error, to not
 		 * overwrite another partition's config file. */
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
 	VOLUME_DESC *v = &volumes[config_volumes[current_partition]];
@@ -58,42 +204,72 @@ static BG_STATUS save_current_config(VOID)
 	if (EFI_ERROR(efistatus)) {
 		ERROR(L"Could not open environment file on system partition %d: %r\n",
 		      current_partition, efistatus);
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
 	UINTN writelen = sizeof(BG_ENVDATA);
+	VOID *buffer = &env[current_partition];
+	UINT32 len = userdata_len[current_partition];
 
 	uint32_t crc32;
-	(VOID) BS->CalculateCrc32(
-	    &env[current_partition],
-	    sizeof(BG_ENVDATA) - sizeof(env[current_partition].crc32), &crc32);
-	env[current_partition].crc32 = crc32;
-	efistatus = fh->Write(fh, &writelen, (VOID *)&env[current_partition]);
+	if (len < ENV_MEM_USERVARS) {
+		/* keep the compact layout, userdata is never changed here */
+		BG_ENVHEADER hdr = {
+			.magic = ENV_HEADER_MAGIC,
+			.version = ENV_HEADER_VERSION,
+			.header_len = sizeof(BG_ENVHEADER),
+			.userdata_len = len,
+		};
+
+		writelen = bgenv_compact_size(len);
+		buffer = AllocatePool(writelen);
+		if (!buffer) {
+			(VOID) close_cfg_file(v->root, fh);
+			return BG_CONFIG_ERROR;
+		}
+		CopyMem(buffer, &hdr, sizeof(hdr));
+		CopyMem((UINT8 *)buffer + sizeof(hdr), &env[current_partition],
+			ENV_FIXED_FIELDS_SIZE + len);
+		(VOID) BS->CalculateCrc32(buffer, writelen - sizeof(crc32),
+					  &crc32);
+		CopyMem((UINT8 *)buffer + writelen - sizeof(crc32), &crc32,
+			sizeof(crc32));
+	} else {
+		(VOID) BS->CalculateCrc32(
+		    &env[current_partition],
+		    sizeof(BG_ENVDATA) - sizeof(env[current_partition].crc32),
+		    &crc32);
+		env[current_partition].crc32 = crc32;
+	}
+	efistatus = fh->Write(fh, &writelen, buffer);
+	if (buffer != &env[current_partition]) {
+		FreePool(buffer);
+	}
 	if (EFI_ERROR(efistatus)) {
 		ERROR(L"Cannot write environment to file: %r\n", efistatus);
 		(VOID) close_cfg_file(v->root, fh);
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
 	if (EFI_ERROR(close_cfg_file(v->root, fh))) {
 		ERROR(L"Could not close environment config file.\n");
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
-	result = BG_SUCCESS;
-scc_cleanup:
-	FreePool(config_volumes);
-	return result;
+	return BG_SUCCESS;
 }
 
 BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 {
 	BG_STATUS result = BG_CONFIG_ERROR;
-	UINTN numHandles = volume_count;
-	UINTN *config_volumes;
+	UINTN numHandles = ENV_NUM_CONFIG_PARTS + 1;
+	EFI_STATUS env_status[ENV_NUM_CONFIG_PARTS];
 	UINTN i;
 	int env_invalid[ENV_NUM_CONFIG_PARTS] = {0};
 
+	bglp->boot_delay = ENV_BOOT_DELAY;
+	bglp->fast_boot = FALSE;
+
 	env = (BG_ENVDATA *)AllocateZeroPool(sizeof(BG_ENVDATA) *
 					 ENV_NUM_CONFIG_PARTS);
 	if (!env) {
@@ -101,18 +277,13 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 		return result;
 	}
 
-	config_volumes = (UINTN *)AllocatePool(sizeof(UINTN) * volume_count);
-	if (!config_volumes) {
-		ERROR(L"Could not allocate memory for config partition mapping.\n");
-		goto env_cleanup;
-	}
-
-	if (EFI_ERROR(enumerate_cfg_parts(config_volumes, &numHandles))) {
+	/* the config files are read during the enumeration */
+	if (EFI_ERROR(enumerate_cfg_parts(config_volumes, &numHandles, env,
+					  env_status, userdata_len))) {
 		ERROR(L"Could not enumerate config partitions.\n");
 		goto lc_cleanup;
 	}
-
-	numHandles = filter_cfg_parts(config_volumes, numHandles);
+	num_config_volumes = numHandles;
 
 	if (numHandles > ENV_NUM_CONFIG_PARTS) {
 		ERROR(L"Too many config partitions found. Aborting.\n");
@@ -129,32 +300,22 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 		result = BG_CONFIG_PARTIALLY_CORRUPTED;
 	}
 
-	/* Load all config data */
+	/* Check all config data */
 	for (i = 0; i < numHandles; i++) {
-		EFI_FILE_HANDLE fh = NULL;
-		VOLUME_DESC *v = &volumes[config_volumes[i]];
-		if (EFI_ERROR(open_cfg_file(v->root, &fh,
-					    EFI_FILE_MODE_READ))) {
-			WARNING(L"Could not open environment file on config partition %d\n",
-				i);
-			result = BG_CONFIG_PARTIALLY_CORRUPTED;
-			continue;
-		}
-		UINTN readlen = sizeof(BG_ENVDATA);
-		if (EFI_ERROR(read_cfg_file(fh, &readlen, (VOID *)&env[i])) ||
-		    readlen < sizeof(BG_ENVDATA)) {
+		if (EFI_ERROR(env_status[i])) {
 			ERROR(L"Cannot read environment from config partition %d.\n", i);
 			env_invalid[i] = 1;
-			if (EFI_ERROR(close_cfg_file(v->root, fh))) {
-				ERROR(L"Could not close environment config file.\n");
-			}
 			result = BG_CONFIG_PARTIALLY_CORRUPTED;
 			continue;
 		}
 
-		uint32_t crc32;
-		(VOID) BS->CalculateCrc32(
-		    &env[i], sizeof(BG_ENVDATA) - sizeof(env[i].crc32), &crc32);
+		/* that of compact environments was checked while reading */
+		uint32_t crc32 = env[i].crc32;
+		if (userdata_len[i] == ENV_MEM_USERVARS) {
+			(VOID) BS->CalculateCrc32(
+			    &env[i], sizeof(BG_ENVDATA) - sizeof(env[i].crc32),
+			    &crc32);
+		}
 
 		if (crc32 != env[i].crc32) {
 			ERROR(L"CRC32 error in environment data on config partition %d.\n",
@@ -168,77 +329,82 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 			result = BG_CONFIG_PARTIALLY_CORRUPTED;
 		}
 
-		if (EFI_ERROR(close_cfg_file(v->root, fh))) {
-			ERROR(L"Could not close environment config file.\n");
-			/* Don't abort, so we may still be able to boot a
-			 * config */
-			result = BG_CONFIG_PARTIALLY_CORRUPTED;
-		}
-
 		/* enforce NULL-termination of strings */
 		env[i].kernelfile[ENV_STRING_LENGTH - 1] = 0;
 		env[i].kernelparams[ENV_STRING_LENGTH - 1] = 0;
 	}
 
-	/* Find environment with latest revision and check if there is a test
-	 * configuration. */
-	UINTN latest_rev = 0, latest_idx = 0;
-	UINTN pre_latest_rev = 0, pre_latest_idx = 0;
-	for (i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (!env_invalid[i]) {
-			if (env[i].revision > latest_rev) {
-				pre_latest_rev = latest_rev;
-				latest_rev = env[i].revision;
-				pre_latest_idx = latest_idx;
-				latest_idx = i;
-			} else if (env[i].revision > pre_latest_rev) {
-				/* we always need a 2nd iteration if
-				 * revisions are decreasing with growing i
-				 * so that pre_* gets set */
-				pre_latest_rev = env[i].revision;
-				pre_latest_idx = i;
-			}
+	/* Order the valid environments by revision, the latest one is booted
+	 * unless it has to be skipped, in which case the next older one that
+	 * did not fail is tried. */
+	unsigned int order[ENV_NUM_CONFIG_PARTS];
+	unsigned int valid = bgenv_revision_order(env, env_invalid, numHandles,
+						  order);
+	UINTN latest_rev = valid ? env[order[0]].revision : 0;
+	unsigned int candidate = 0;
+
+	current_partition = valid ? order[0] : 0;
+
+	if (valid) {
+		/* Test if this environment is currently 'in_progress'. If
+		 * yes, do not boot from it, instead ignore it */
+		if (env[current_partition].in_progress == 1) {
+			candidate = 1;
+		} else if (env[current_partition].ustate == USTATE_TESTING &&
+			   !check_boot_attempt(current_partition)) {
+			/* If it has already been booted as often as permitted,
+			 * this indicates a failed update. In this case, mark
+			 * it as failed by giving a zero-revision */
+			env[current_partition].ustate = USTATE_FAILED;
+			env[current_partition].revision = REVISION_FAILED;
+			save_current_config();
+			/* We must boot with the configuration that was active
+			 * before */
+			candidate = 1;
+		} else if (env[current_partition].ustate == USTATE_INSTALLED) {
+			/* If this configuration has never been booted with, set
+			 * ustate to indicate that this configuration is now
+			 * being tested */
+			env[current_partition].ustate = USTATE_TESTING;
+			save_current_config();
+			clear_boot_attempts();
+		} else if (env[current_partition].ustate == USTATE_OK) {
+			/* the update was confirmed */
+			clear_boot_attempts();
 		}
 	}
-
-	/* Assume we boot with the latest configuration */
-	current_partition = latest_idx;
-
-	/* Test if this environment is currently 'in_progress'. If yes,
-	 * do not boot from it, instead ignore it */
-	if (env[latest_idx].in_progress == 1) {
-		current_partition = pre_latest_idx;
-	} else if (env[latest_idx].ustate == USTATE_TESTING) {
-		/* If it has already been booted, this indicates a failed
-		 * update. In this case, mark it as failed by giving a
-		 * zero-revision */
-		env[latest_idx].ustate = USTATE_FAILED;
-		env[latest_idx].revision = REVISION_FAILED;
-		save_current_config();
-		/* We must boot with the configuration that was active before
-		 */
-		current_partition = pre_latest_idx;
-	} else if (env[latest_idx].ustate == USTATE_INSTALLED) {
-		/* If this configuration has never been booted with, set ustate
-		 * to indicate that this configuration is now being tested */
-		env[latest_idx].ustate = USTATE_TESTING;
-		save_current_config();
+	if (candidate) {
+		/* without any usable fallback, the first partition is used */
+		current_partition = 0;
+		for (; candidate < valid; candidate++) {
+			BG_ENVDATA *e = &env[order[candidate]];
+
+			if (e->in_progress != 1 &&
+			    e->revision != REVISION_FAILED) {
+				current_partition = order[candidate];
+				break;
+			}
+		}
 	}
 
 	bglp->payload_path = StrDuplicate(env[current_partition].kernelfile);
 	bglp->payload_options =
 	    StrDuplicate(env[current_partition].kernelparams);
 	bglp->timeout = env[current_partition].watchdog_timeout_sec;
+	bglp->config_index = current_partition;
+	bglp->config_revision = env[current_partition].revision;
+	if (get_boot_delay(&env[current_partition], &bglp->boot_delay)) {
+		bglp->fast_boot = bglp->boot_delay == 0;
+	}
 
 	INFO(L"Config Revision: %d:\n", latest_rev);
 	INFO(L" ustate: %d\n", env[current_partition].ustate);
 	INFO(L" kernel: %s\n", bglp->payload_path);
 	INFO(L" args: %s\n", bglp->payload_options);
 	INFO(L" timeout: %d seconds\n", bglp->timeout);
+	INFO(L" boot delay: %d seconds\n", bglp->boot_delay);
 
 lc_cleanup:
-	FreePool(config_volumes);
-env_cleanup:
 	FreePool(env);
 	return result;
 }
@@ -18,7 +18,39 @@
 
 #define MAX_INFO_SIZE 1024
 
-EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *numHandles)
+/* Converts the compact environment of size bytes read into env to the
+ * fixed layout, see BG_ENVHEADER. Its CRC is checked here as it only covers
+ * the stored bytes. */
+static EFI_STATUS decode_compact_env(BG_ENVDATA *env, UINTN size,
+				     UINT32 *userdata_len)
+{
+	INT64 len = bgenv_compact_userdata_len(env, size);
+	UINT32 crc, stored;
+
+	if (len < 0) {
+		return EFI_END_OF_FILE;
+	}
+	CopyMem(&stored, (UINT8 *)env + size - sizeof(stored), sizeof(stored));
+	(VOID) BS->CalculateCrc32(env, size - sizeof(stored), &crc);
+	if (crc != stored) {
+		ERROR(L"CRC32 error in compact environment data.\n");
+		return EFI_CRC_ERROR;
+	}
+	/* CopyMem() handles the overlap */
+	CopyMem(env, (UINT8 *)env + sizeof(BG_ENVHEADER),
+		ENV_FIXED_FIELDS_SIZE + len);
+	ZeroMem(env->userdata + len, sizeof(BG_ENVDATA) -
+				     ENV_FIXED_FIELDS_SIZE - len);
+	*userdata_len = len;
+	return EFI_SUCCESS;
+}
+
+/* Volumes on the boot medium come first (see get_volumes()). If they hold
+ * config files, those on other media are ignored, thus the other volumes
+ * are not even opened in this case. */
+EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *numHandles,
+			       BG_ENVDATA *env, EFI_STATUS *env_status,
+			       UINT32 *userdata_len)
 {
 	EFI_STATUS status;
 	UINTN rootCount = 0;
@@ -30,66 +62,46 @@ EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *numHandles)
 	for (UINTN index = 0; index < volume_count && rootCount < *numHandles;
 	     index++) {
 		EFI_FILE_HANDLE fh = NULL;
-		if (!volumes[index].root) {
+		EFI_FILE_HANDLE root;
+
+		if (rootCount > 0 && !volumes[index].onbootmedium &&
+		    volumes[config_volumes[0]].onbootmedium) {
+			INFO(L"Using environments from boot medium only.\n");
+			break;
+		}
+		root = volume_open_root(&volumes[index]);
+		if (!root) {
+			continue;
+		}
+		status = open_cfg_file(root, &fh, EFI_FILE_MODE_READ);
+		if (status != EFI_SUCCESS) {
 			continue;
 		}
-		status = open_cfg_file(volumes[index].root, &fh,
-				       EFI_FILE_MODE_READ);
-		if (status == EFI_SUCCESS) {
-			INFO(L"Config file found on volume %d.\n", index);
-			config_volumes[rootCount] = index;
-			rootCount++;
-			status = close_cfg_file(volumes[index].root, fh);
-			if (EFI_ERROR(status)) {
-				ERROR(L"Could not close config file on partition %d.\n",
-				      index);
+		INFO(L"Config file found on volume %d.\n", index);
+		if (env && rootCount < ENV_NUM_CONFIG_PARTS) {
+			/* read while the file is open anyway */
+			UINTN readlen = sizeof(BG_ENVDATA);
+
+			status = read_cfg_file(fh, &readlen,
+					       (VOID *)&env[rootCount]);
+			userdata_len[rootCount] = ENV_MEM_USERVARS;
+			if (!EFI_ERROR(status) &&
+			    readlen < sizeof(BG_ENVDATA)) {
+				status = decode_compact_env(
+					&env[rootCount], readlen,
+					&userdata_len[rootCount]);
 			}
+			env_status[rootCount] = status;
+		}
+		config_volumes[rootCount] = index;
+		rootCount++;
+		status = close_cfg_file(root, fh);
+		if (EFI_ERROR(status)) {
+			ERROR(L"Could not close config file on partition %d.\n",
+			      index);
 		}
 	}
 	*numHandles = rootCount;
 	INFO(L"%d config partitions detected.\n", rootCount);
 	return EFI_SUCCESS;
 }
-
-static VOID swap_uintn(UINTN *a, UINTN *b)
-{
-	UINTN tmp;
-	tmp = *a;
-	*a = *b;
-	*b = tmp;
-}
-
-UINTN filter_cfg_parts(UINTN *config_volumes, UINTN numHandles)
-{
-	BOOLEAN use_envs_on_bootmedium_only = FALSE;
-
-	INFO(L"Config filter: \n");
-	for (UINTN index = 0; index < numHandles; index++) {
-		VOLUME_DESC *v = &volumes[config_volumes[index]];
-
-		if (IsOnBootMedium(v->devpath)) {
-			use_envs_on_bootmedium_only = TRUE;
-		};
-	}
-
-	if (!use_envs_on_bootmedium_only) {
-		// nothing to do
-		return numHandles;
-	}
-
-	INFO(L"Booting with environments from boot medium only.\n");
-	UINTN num_sorted = 0;
-	for (UINTN j = 0; j < numHandles; j++) {
-		UINTN cvi = config_volumes[j];
-		VOLUME_DESC *v = &volumes[cvi];
-
-		if (IsOnBootMedium(v->devpath)) {
-			swap_uintn(&config_volumes[j],
-				   &config_volumes[num_sorted++]);
-		} else {
-			WARNING(L"Ignoring config on volume #%d\n", cvi);
-		}
-	}
-
-	return num_sorted;
-}
@@ -15,6 +15,44 @@
 #include <string.h>
 #include "env_api.h"
 #include "uservars.h"
+#include "env_stats.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Length of the key at p, or max if it is not terminated within max bytes.
+ * Keys are short, so this beats a call of strnlen(). */
+static inline uint32_t bgenv_key_len(const uint8_t *p, uint32_t max)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= max; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= max; i += 16) {
+		/* the NUL is located by the loop below */
+		if (vmaxvq_u8(vceqzq_u8(vld1q_u8(p + i)))) {
+			break;
+		}
+	}
+#endif
+	while (i < max && p[i]) {
+		i++;
+	}
+	return i;
+}
 
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val,
 		       uint32_t *record_size, uint32_t *data_size)
@@ -72,12 +110,340 @@ void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val
 	}
 }
 
-bool bgenv_validate_uservars(uint8_t *udata)
+/* FNV-1a */
+static uint32_t bgenv_uservar_hash(const char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (uint8_t)*key++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Layout v2 appends a table to the records of layout v1:
+ * |-----------|-------------|-------------------|---------|
+ * | records[] | 0 ... free  | entries[count]    | trailer |
+ * |-----------|-------------|-------------------|---------|
+ * It lies at the end of the area, so the boot loader and readers of
+ * layout v1 see it as free space. The entries are sorted by key hash and
+ * record offset. The trailer holds the end of the records ('used'), which
+ * makes the table stale if a writer of layout v1 appended a record there.
+ * Writers of layout v1 clear all free space when deleting or moving a
+ * record, which removes the table. Both fall back to layout v1. */
+#pragma pack(push)
+#pragma pack(1)
+struct uservar_table_entry {
+	uint32_t hash;
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct uservar_table_trailer {
+	uint32_t used;
+	uint32_t count;
+	uint32_t check;
+	uint32_t magic;
+};
+#pragma pack(pop)
+
+#define USERVAR_TABLE_MAGIC	0x32565545	/* "EUV2" */
+#define USERVAR_TABLE_ENTRY	sizeof(struct uservar_table_entry)
+#define USERVAR_TABLE_TRAILER	sizeof(struct uservar_table_trailer)
+#define USERVAR_TABLE_MAX \
+	((ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER) / USERVAR_TABLE_ENTRY)
+
+static uint32_t bgenv_uservar_table_check(struct uservar_table_trailer *tr)
+{
+	uint32_t fields[] = {tr->used, tr->count, USERVAR_TABLE_MAGIC};
+	uint8_t *p = (uint8_t *)fields;
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < sizeof(fields); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t bgenv_uservar_table_start(uint32_t count)
+{
+	return ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER -
+	       count * USERVAR_TABLE_ENTRY;
+}
+
+bool bgenv_uservars_v2(uint8_t *udata)
+{
+	struct uservar_table_trailer tr;
+
+	if (!udata) {
+		return false;
+	}
+	memcpy(&tr, udata + ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER,
+	       sizeof(tr));
+	return tr.magic == USERVAR_TABLE_MAGIC &&
+	       tr.count <= USERVAR_TABLE_MAX &&
+	       tr.check == bgenv_uservar_table_check(&tr);
+}
+
+/* Returns true if the table matches the records, see above */
+static bool bgenv_uservar_table_get(uint8_t *udata,
+				    struct uservar_table_trailer *tr)
+{
+	if (!bgenv_uservars_v2(udata)) {
+		return false;
+	}
+	memcpy(tr, udata + ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER,
+	       sizeof(*tr));
+	return tr->used < bgenv_uservar_table_start(tr->count) &&
+	       udata[tr->used] == 0;
+}
+
+static void bgenv_uservar_table_entry(uint8_t *udata, uint32_t count,
+				      uint32_t i,
+				      struct uservar_table_entry *entry)
+{
+	memcpy(entry,
+	       udata + bgenv_uservar_table_start(count) +
+		       i * USERVAR_TABLE_ENTRY,
+	       sizeof(*entry));
+}
+
+/* index of the first entry not sorted before (hash, offset) */
+static uint32_t bgenv_uservar_table_search(uint8_t *udata, uint32_t count,
+					   uint32_t hash, uint32_t offset)
+{
+	struct uservar_table_entry entry;
+	uint32_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		bgenv_uservar_table_entry(udata, count, mid, &entry);
+		if (entry.hash < hash ||
+		    (entry.hash == hash && entry.offset < offset)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static uint8_t *bgenv_uservar_table_find(uint8_t *udata,
+					 struct uservar_table_trailer *tr,
+					 char *key)
+{
+	struct uservar_table_entry entry;
+	uint32_t hash = bgenv_uservar_hash(key);
+
+	for (uint32_t i = bgenv_uservar_table_search(udata, tr->count, hash, 0);
+	     i < tr->count; i++) {
+		bgenv_uservar_table_entry(udata, tr->count, i, &entry);
+		if (entry.hash != hash) {
+			break;
+		}
+		if (strcmp((char *)udata + entry.offset, key) == 0) {
+			return udata + entry.offset;
+		}
+	}
+	return NULL;
+}
+
+static void bgenv_uservar_table_drop(uint8_t *udata)
+{
+	struct uservar_table_trailer tr;
+	uint32_t start;
+
+	if (!bgenv_uservars_v2(udata)) {
+		return;
+	}
+	memcpy(&tr, udata + ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER,
+	       sizeof(tr));
+	start = bgenv_uservar_table_start(tr.count);
+	memset(udata + start, 0, ENV_MEM_USERVARS - start);
+}
+
+static int bgenv_uservar_table_cmp(const void *a, const void *b)
+{
+	const struct uservar_table_entry *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash) {
+		return ea->hash < eb->hash ? -1 : 1;
+	}
+	if (ea->offset != eb->offset) {
+		return ea->offset < eb->offset ? -1 : 1;
+	}
+	return 0;
+}
+
+/* (Re)create the table from the records. Without enough room, the area
+ * falls back to layout v1. */
+static bool bgenv_uservar_table_write(uint8_t *udata)
+{
+	struct uservar_table_entry *entries;
+	struct uservar_table_trailer tr = {.magic = USERVAR_TABLE_MAGIC};
+	uint32_t offset = 0, rsize, start;
+	uint64_t type;
+
+	bgenv_uservar_table_drop(udata);
+	while (offset < ENV_MEM_USERVARS && udata[offset]) {
+		bgenv_map_uservar(udata + offset, NULL, &type, NULL, &rsize,
+				  NULL);
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			tr.count++;
+		}
+		offset += rsize;
+	}
+	tr.used = offset;
+	if (tr.count > USERVAR_TABLE_MAX ||
+	    tr.used >= bgenv_uservar_table_start(tr.count)) {
+		errno = ENOMEM;
+		return false;
+	}
+	entries = malloc(tr.count * USERVAR_TABLE_ENTRY + 1);
+	if (!entries) {
+		return false;
+	}
+	for (offset = 0, tr.count = 0; offset < tr.used; offset += rsize) {
+		bgenv_map_uservar(udata + offset, NULL, &type, NULL, &rsize,
+				  NULL);
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			entries[tr.count].hash =
+				bgenv_uservar_hash((char *)udata + offset);
+			entries[tr.count].offset = offset;
+			entries[tr.count].length = rsize;
+			tr.count++;
+		}
+	}
+	qsort(entries, tr.count, USERVAR_TABLE_ENTRY,
+	      bgenv_uservar_table_cmp);
+
+	start = bgenv_uservar_table_start(tr.count);
+	memcpy(udata + start, entries, tr.count * USERVAR_TABLE_ENTRY);
+	tr.check = bgenv_uservar_table_check(&tr);
+	memcpy(udata + ENV_MEM_USERVARS - USERVAR_TABLE_TRAILER, &tr,
+	       sizeof(tr));
+	free(entries);
+	return true;
+}
+
+/* Checks a table which is used, i.e. matches the end of the records */
+static bool bgenv_uservar_table_validate(uint8_t *udata, uint32_t used)
+{
+	struct uservar_table_entry entry, prev;
+	struct uservar_table_trailer tr;
+	uint32_t offset, rsize, count = 0;
+	uint64_t type;
+
+	if (!bgenv_uservar_table_get(udata, &tr)) {
+		/* stale or none at all, layout v1 */
+		return true;
+	}
+	if (tr.used != used) {
+		return false;
+	}
+	for (uint32_t i = 0; i < tr.count; i++) {
+		bgenv_uservar_table_entry(udata, tr.count, i, &entry);
+		if (i > 0 && bgenv_uservar_table_cmp(&prev, &entry) >= 0) {
+			return false;
+		}
+		prev = entry;
+	}
+	for (offset = 0; offset < used; offset += rsize) {
+		uint32_t hash = bgenv_uservar_hash((char *)udata + offset);
+		uint32_t i;
+
+		bgenv_map_uservar(udata + offset, NULL, &type, NULL, &rsize,
+				  NULL);
+		if (type & USERVAR_TYPE_DELETED) {
+			continue;
+		}
+		i = bgenv_uservar_table_search(udata, tr.count, hash, offset);
+		if (i == tr.count) {
+			return false;
+		}
+		bgenv_uservar_table_entry(udata, tr.count, i, &entry);
+		if (entry.hash != hash || entry.offset != offset ||
+		    entry.length != rsize) {
+			return false;
+		}
+		count++;
+	}
+	return count == tr.count;
+}
+
+/* Size of the table once it holds one more record */
+static uint32_t bgenv_uservar_table_growth(uint8_t *udata)
 {
+	struct uservar_table_trailer tr;
+
+	return bgenv_uservar_table_get(udata, &tr) ? USERVAR_TABLE_ENTRY : 0;
+}
+
+/* Free space in front of the table, optionally the end of the records */
+static uint32_t bgenv_uservar_space(uint8_t *udata, uint32_t *end)
+{
+	struct uservar_table_trailer tr;
 	uint32_t spaceleft = ENV_MEM_USERVARS;
+	uint32_t rsize;
+	uint8_t *p = udata;
 
-	while (*udata) {
-		uint32_t key_len = strnlen((char *)udata, spaceleft);
+	if (bgenv_uservar_table_get(udata, &tr)) {
+		if (end) {
+			*end = tr.used;
+		}
+		return bgenv_uservar_table_start(tr.count) - tr.used;
+	}
+	while (*p) {
+		uint32_t key_len = bgenv_key_len(p, spaceleft);
+		uint32_t payload_size;
+
+		/* corrupt records take the rest */
+		if (key_len + 1 + sizeof(payload_size) > spaceleft) {
+			spaceleft = 0;
+			break;
+		}
+		memcpy(&payload_size, p + key_len + 1, sizeof(payload_size));
+		rsize = key_len + 1 + payload_size;
+		if (rsize >= spaceleft || rsize <= key_len) {
+			spaceleft = 0;
+			break;
+		}
+		spaceleft -= rsize;
+		p += rsize;
+	}
+	if (end) {
+		*end = ENV_MEM_USERVARS - spaceleft;
+	}
+	return spaceleft;
+}
+
+int bgenv_uservars_convert(uint8_t *udata, bool v2)
+{
+	if (!udata) {
+		return -EINVAL;
+	}
+	if (!v2) {
+		bgenv_uservar_table_drop(udata);
+		return 0;
+	}
+	if (!bgenv_uservar_table_write(udata)) {
+		return -errno;
+	}
+	return 0;
+}
+
+bool bgenv_scan_uservars(uint8_t *udata, uint32_t *used, uint32_t *records)
+{
+	uint32_t spaceleft = ENV_MEM_USERVARS;
+	uint8_t *p = udata;
+	uint32_t n = 0;
+
+	while (*p) {
+		uint32_t key_len = bgenv_key_len(p, spaceleft);
+		uint32_t payload_size;
 
 		/* we need space for the key string + null termination +
 		 * the payload size field */
@@ -86,48 +452,65 @@ bool bgenv_validate_uservars(uint8_t *udata)
 		}
 
 		spaceleft -= key_len + 1;
-		udata += key_len + 1;
+		p += key_len + 1;
 
-		uint32_t payload_size = *(uint32_t *)udata;
+		memcpy(&payload_size, p, sizeof(payload_size));
 
-		/* the payload must leave at least one byte free */
-		if (payload_size >= spaceleft) {
+		/* the payload must leave at least one byte free and hold its
+		 * own size and the type */
+		if (payload_size >= spaceleft ||
+		    payload_size < sizeof(uint32_t) + sizeof(uint64_t)) {
 			return false;
 		}
 
 		spaceleft -= payload_size;
-		udata += payload_size;
+		p += payload_size;
+		n++;
+	}
+	if (!bgenv_uservar_table_validate(udata, p - udata)) {
+		return false;
+	}
+	if (used) {
+		*used = p - udata;
+	}
+	if (records) {
+		*records = n;
 	}
 	return true;
 }
 
+bool bgenv_validate_uservars(uint8_t *udata)
+{
+	return bgenv_scan_uservars(udata, NULL, NULL);
+}
+
 static uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
 {
-	uint32_t spaceleft;
+	uint32_t spaceleft, end;
 
 	if (!udata) {
 		errno = EINVAL;
 		return NULL;
 	}
-	spaceleft = bgenv_user_free(udata);
+	spaceleft = bgenv_uservar_space(udata, &end);
 	VERBOSE(stdout, "uservar_alloc: free: %lu requested: %lu \n",
 		(unsigned long)spaceleft, (unsigned long)datalen);
 
 	/* To find the end of user variables, a 2nd 0 must be there after the
 	 * last variable content, thus, we need one extra byte if appending a
 	 * new variable. */
-	if (spaceleft < datalen + 1) {
+	if (spaceleft < datalen + 1 + bgenv_uservar_table_growth(udata)) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	return udata + (ENV_MEM_USERVARS - spaceleft);
+	return udata + end;
 }
 
 static uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 				      uint8_t *p)
 {
-	uint32_t spaceleft;
+	uint32_t spaceleft, end;
 	uint32_t rsize;
 
 	bgenv_map_uservar(p, NULL, NULL, NULL, &rsize, NULL);
@@ -138,17 +521,20 @@ static uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 		return p;
 	}
 
-	/* Delete variable and return pointer to end of whole user vars */
-	bgenv_del_uservar(udata, p);
-
-	spaceleft = bgenv_user_free(udata);
-
-	if (spaceleft < new_rsize - 1) {
+	/* The variable moves behind all others, where it needs the extra
+	 * byte of bgenv_uservar_alloc(). With layout v2, its table entry is
+	 * reused. Check first, so that it is kept on failure. */
+	spaceleft = bgenv_uservar_space(udata, NULL);
+	if (spaceleft + rsize < new_rsize + 1) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	return udata + ENV_MEM_USERVARS - spaceleft;
+	/* Delete variable and return pointer to end of whole user vars */
+	bgenv_del_uservar(udata, p);
+	bgenv_uservar_space(udata, &end);
+
+	return udata + end;
 }
 
 static void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
@@ -174,21 +560,18 @@ static void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
 	memcpy(p, data, data_size);
 }
 
-int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
-		      uint32_t maxlen)
+static int bgenv_copy_uservar(uint8_t *uservar, uint64_t *type, void *data,
+			      uint32_t maxlen)
 {
-	uint8_t *uservar, *value;
-	char *lkey;
+	uint8_t *value;
 	uint32_t dsize;
 	uint64_t ltype;
 
-	uservar = bgenv_find_uservar(udata, key);
-
 	if (!uservar) {
 		return -ENOENT;
 	}
 
-	bgenv_map_uservar(uservar, &lkey, &ltype, &value, NULL, &dsize);
+	bgenv_map_uservar(uservar, NULL, &ltype, &value, NULL, &dsize);
 
 	if (dsize > maxlen) {
 		dsize = maxlen;
@@ -203,15 +586,33 @@ int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
 	return 0;
 }
 
+int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
+		      uint32_t maxlen)
+{
+	return bgenv_copy_uservar(bgenv_find_uservar(udata, key), type, data,
+				  maxlen);
+}
+
+int bgenv_get_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t *type, void *data,
+			      uint32_t maxlen)
+{
+	return bgenv_copy_uservar(bgenv_find_uservar_indexed(idx, udata, key),
+				  type, data, maxlen);
+}
+
 int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	              uint32_t datalen)
 {
+	struct uservar_table_trailer tr;
 	uint32_t total_size;
+	bool v2;
 	uint8_t *p;
 
 	total_size = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
 		     strlen(key) + 1;
 
+	v2 = bgenv_uservar_table_get(udata, &tr);
 	p = bgenv_find_uservar(udata, key);
 	if (p) {
 		if (type & USERVAR_TYPE_DELETED) {
@@ -232,21 +633,78 @@ int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	}
 
 	bgenv_serialize_uservar(p, key, type, data, total_size);
+	if (v2) {
+		bgenv_uservar_table_write(udata);
+	}
 
 	return 0;
 }
 
+/* Calculate the byte range [start, end) of udata which is modified by a
+ * corresponding call of bgenv_set_uservar(). */
+void bgenv_uservar_edit_range(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t type, uint32_t datalen,
+			      uint32_t *start, uint32_t *end)
+{
+	uint32_t used, rsize, new_rsize;
+	bool in_place = false;
+	uint8_t *p;
+
+	new_rsize = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
+		    strlen(key) + 1;
+
+	p = bgenv_find_uservar_indexed(idx, udata, key);
+	if (idx && idx->valid) {
+		used = idx->used;
+	} else {
+		bgenv_uservar_space(udata, &used);
+	}
+	if (!p) {
+		*start = used;
+		*end = (type & USERVAR_TYPE_DELETED) ? used : used + new_rsize;
+	} else {
+		bgenv_map_uservar(p, NULL, NULL, NULL, &rsize, NULL);
+		*start = p - udata;
+		if ((type & USERVAR_TYPE_DELETED) == 0 && rsize == new_rsize) {
+			/* updated in place */
+			*end = *start + rsize;
+			in_place = true;
+		} else {
+			/* everything behind the variable is moved */
+			*end = used;
+			if ((type & USERVAR_TYPE_DELETED) == 0 &&
+			    new_rsize > rsize) {
+				*end += new_rsize - rsize;
+			}
+		}
+	}
+	/* the table of layout v2 is rewritten along with the records */
+	if (*end > *start && !in_place && bgenv_uservars_v2(udata)) {
+		*end = ENV_MEM_USERVARS;
+	}
+	if (*end > ENV_MEM_USERVARS) {
+		*end = ENV_MEM_USERVARS;
+	}
+}
+
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key)
 {
+	struct uservar_table_trailer tr;
 	char *varkey;
+	uint64_t type;
 
 	if (!udata) {
 		return NULL;
 	}
+	if (bgenv_uservar_table_get(udata, &tr)) {
+		return bgenv_uservar_table_find(udata, &tr, key);
+	}
 	while (*udata) {
-		bgenv_map_uservar(udata, &varkey, NULL, NULL, NULL, NULL);
+		bgenv_map_uservar(udata, &varkey, &type, NULL, NULL, NULL);
 
-		if (strcmp(varkey, key) == 0) {
+		/* skip dead records, see bgenv_uservar_batch_begin() */
+		if (strcmp(varkey, key) == 0 &&
+		    (type & USERVAR_TYPE_DELETED) == 0) {
 			return udata;
 		}
 		udata = bgenv_next_uservar(udata);
@@ -265,46 +723,670 @@ uint8_t *bgenv_next_uservar(uint8_t *udata)
 
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var)
 {
-	uint32_t spaceleft;
+	struct uservar_table_trailer tr;
+	uint32_t used;
 	uint32_t rsize;
+	bool v2;
 
 	/* Get the record size of the variable */
 	bgenv_map_uservar(var, NULL, NULL, NULL, &rsize, NULL);
 
 	/* Move variable out of place and close gap. */
-	spaceleft = bgenv_user_free(udata);
+	v2 = bgenv_uservar_table_get(udata, &tr);
+	bgenv_uservar_space(udata, &used);
 
 	memmove(var,
 	        var + rsize,
-	        ENV_MEM_USERVARS - spaceleft - (var - udata) - rsize);
-
-	spaceleft = spaceleft + rsize;
+	        used - (var - udata) - rsize);
 
-	memset(udata + ENV_MEM_USERVARS - spaceleft, 0, spaceleft);
+	if (v2) {
+		memset(udata + used - rsize, 0, rsize);
+		bgenv_uservar_table_write(udata);
+	} else {
+		memset(udata + used - rsize, 0,
+		       ENV_MEM_USERVARS - used + rsize);
+	}
 }
 
 uint32_t bgenv_user_free(uint8_t *udata)
 {
+	if (!udata) {
+		return 0;
+	}
+	return bgenv_uservar_space(udata, NULL);
+}
+
+/* Maps the keys of the records of bgenv_merge_uservars() to the last
+ * record of each, in an open addressing hash table */
+struct uservar_requests {
+	uint32_t *slots;	/* record index + 1, 0 marks a free slot */
+	uint32_t mask;
+};
+
+/* marks a record which replaced an existing variable */
+#define USERVAR_REQUEST_DONE	(1U << 31)
+
+static uint32_t *bgenv_uservar_request(struct uservar_requests *req,
+				       const ebg_uservar_t *vars, char *key)
+{
+	uint32_t slot = bgenv_uservar_hash(key) & req->mask;
+
+	while (req->slots[slot]) {
+		uint32_t i = (req->slots[slot] & ~USERVAR_REQUEST_DONE) - 1;
+
+		if (strcmp(vars[i].key, key) == 0) {
+			break;
+		}
+		slot = (slot + 1) & req->mask;
+	}
+	return &req->slots[slot];
+}
+
+static bool bgenv_uservar_requests_init(struct uservar_requests *req,
+					const ebg_uservar_t *vars,
+					uint32_t count)
+{
+	uint32_t capacity = 16;
+
+	while (capacity < count * 2) {
+		capacity *= 2;
+	}
+	req->slots = calloc(capacity, sizeof(uint32_t));
+	if (!req->slots) {
+		return false;
+	}
+	req->mask = capacity - 1;
+	for (uint32_t i = 0; i < count; i++) {
+		*bgenv_uservar_request(req, vars, vars[i].key) = i + 1;
+	}
+	return true;
+}
+
+/* Appends the record of var to out at *end, keeping the byte behind all
+ * records free */
+static int bgenv_uservar_append(uint8_t *out, uint32_t *end,
+				const ebg_uservar_t *var)
+{
+	uint32_t total_size;
+
+	if (var->len > ENV_MEM_USERVARS) {
+		return -ENOMEM;
+	}
+	total_size = var->len + sizeof(uint64_t) + sizeof(uint32_t) +
+		     strlen(var->key) + 1;
+	if (*end + total_size + 1 > ENV_MEM_USERVARS) {
+		return -ENOMEM;
+	}
+	bgenv_serialize_uservar(out + *end, var->key, var->type, var->data,
+				total_size);
+	*end += total_size;
+	return 0;
+}
+
+static int bgenv_merge_records(uint8_t *udata, const ebg_uservar_t *vars,
+			       uint32_t count, struct uservar_requests *req,
+			       uint8_t *out, uint32_t *end, uint32_t *records)
+{
+	uint32_t used, offset, rsize;
+	uint32_t *slot;
+	uint64_t type;
+	char *key;
+	int res;
+
+	if (!bgenv_scan_uservars(udata, &used, NULL)) {
+		return -EINVAL;
+	}
+	for (offset = 0; offset < used; offset += rsize) {
+		bgenv_map_uservar(udata + offset, &key, &type, NULL, &rsize,
+				  NULL);
+		if (type & USERVAR_TYPE_DELETED) {
+			continue;
+		}
+		slot = bgenv_uservar_request(req, vars, key);
+		if (*slot) {
+			const ebg_uservar_t *var = &vars[*slot - 1];
+
+			/* replaced in place, or deleted */
+			*slot |= USERVAR_REQUEST_DONE;
+			if (var->type & USERVAR_TYPE_DELETED) {
+				continue;
+			}
+			res = bgenv_uservar_append(out, end, var);
+			if (res) {
+				return res;
+			}
+		} else {
+			if (*end + rsize + 1 > ENV_MEM_USERVARS) {
+				return -ENOMEM;
+			}
+			memcpy(out + *end, udata + offset, rsize);
+			*end += rsize;
+		}
+		(*records)++;
+	}
+	/* the remaining last records of their key are new variables */
+	for (uint32_t i = 0; i < count; i++) {
+		if (*bgenv_uservar_request(req, vars, vars[i].key) != i + 1 ||
+		    (vars[i].type & USERVAR_TYPE_DELETED)) {
+			continue;
+		}
+		res = bgenv_uservar_append(out, end, &vars[i]);
+		if (res) {
+			return res;
+		}
+		(*records)++;
+	}
+	return 0;
+}
+
+int bgenv_merge_uservars(uint8_t *udata, const ebg_uservar_t *vars,
+			 uint32_t count, uint8_t *out)
+{
+	struct uservar_requests req;
+	struct uservar_table_trailer tr;
+	uint32_t end = 0, records = 0;
+	bool v2;
+	int res;
+
+	if (!udata || !out || (count && !vars) ||
+	    count > ENV_MEM_USERVARS) {
+		return -EINVAL;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!vars[i].key || !vars[i].key[0]) {
+			return -EINVAL;
+		}
+		if ((vars[i].type & USERVAR_TYPE_DELETED) == 0 &&
+		    (!vars[i].data || vars[i].len == 0)) {
+			return -EINVAL;
+		}
+	}
+	if (!bgenv_uservar_requests_init(&req, vars, count)) {
+		return -ENOMEM;
+	}
+	v2 = bgenv_uservar_table_get(udata, &tr);
+
+	memset(out, 0, ENV_MEM_USERVARS);
+	res = bgenv_merge_records(udata, vars, count, &req, out, &end,
+				  &records);
+	free(req.slots);
+	if (res) {
+		return res;
+	}
+	if (v2) {
+		if (records > USERVAR_TABLE_MAX ||
+		    end >= bgenv_uservar_table_start(records)) {
+			return -ENOMEM;
+		}
+		bgenv_uservar_table_write(out);
+	}
+	return 0;
+}
+
+int bgenv_export_uservars(uint8_t *udata, void *buffer, uint32_t size,
+			  uint32_t *count)
+{
+	uint32_t used, offset, rsize, dsize, n = 0, needed = 0;
+	ebg_uservar_t *vars = buffer;
+	uint64_t type;
+	uint8_t *val, *p;
+	char *key;
+
+	if (!udata || !count) {
+		return -EINVAL;
+	}
+	if (!bgenv_scan_uservars(udata, &used, NULL)) {
+		return -EINVAL;
+	}
+	for (offset = 0; offset < used; offset += rsize) {
+		bgenv_map_uservar(udata + offset, &key, &type, NULL, &rsize,
+				  &dsize);
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			needed += sizeof(ebg_uservar_t) + strlen(key) + 1 +
+				  dsize;
+			n++;
+		}
+	}
+	*count = n;
+	if (!buffer) {
+		return needed;
+	}
+	if (size < needed) {
+		return -ENOSPC;
+	}
+
+	p = (uint8_t *)(vars + n);
+	for (offset = 0; offset < used; offset += rsize) {
+		uint32_t key_size;
+
+		bgenv_map_uservar(udata + offset, &key, &type, &val, &rsize,
+				  &dsize);
+		if (type & USERVAR_TYPE_DELETED) {
+			continue;
+		}
+		key_size = strlen(key) + 1;
+		memcpy(p, key, key_size);
+		vars->key = (char *)p;
+		p += key_size;
+		memcpy(p, val, dsize);
+		vars->data = p;
+		p += dsize;
+		vars->type = type;
+		vars->len = dsize;
+		vars++;
+	}
+	return 0;
+}
+
+static void bgenv_uservar_index_add(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				    uint32_t offset)
+{
+	uint32_t mask = idx->capacity - 1;
+	uint32_t slot = bgenv_uservar_hash((char *)udata + offset) & mask;
+
+	while (idx->slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	idx->slots[slot] = offset + 1;
+	idx->count++;
+}
+
+static void bgenv_uservar_index_remove(BGENV_USERVAR_INDEX *idx,
+				       uint8_t *udata, uint32_t offset)
+{
+	uint32_t mask = idx->capacity - 1;
+	uint32_t slot = bgenv_uservar_hash((char *)udata + offset) & mask;
+	uint32_t next, home;
+
+	while (idx->slots[slot] != offset + 1) {
+		if (!idx->slots[slot]) {
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	/* move up the following records of the cluster which could not be
+	 * found anymore otherwise */
+	for (next = (slot + 1) & mask; idx->slots[next];
+	     next = (next + 1) & mask) {
+		home = bgenv_uservar_hash((char *)udata + idx->slots[next] - 1) &
+		       mask;
+		/* keep it if home lies within (slot, next] */
+		if (((next - home) & mask) < ((next - slot) & mask)) {
+			continue;
+		}
+		idx->slots[slot] = idx->slots[next];
+		slot = next;
+	}
+	idx->slots[slot] = 0;
+	idx->count--;
+}
+
+/* Make room for one more record, keeping the load factor at or below 1/2 */
+static bool bgenv_uservar_index_reserve(BGENV_USERVAR_INDEX *idx,
+					uint8_t *udata)
+{
+	uint32_t *old_slots = idx->slots;
+	uint32_t old_capacity = idx->capacity;
+	uint32_t capacity;
+
+	if ((idx->count + 1) * 2 <= idx->capacity) {
+		return true;
+	}
+	capacity = old_capacity ? old_capacity * 2 : 64;
+	idx->slots = calloc(capacity, sizeof(uint32_t));
+	if (!idx->slots) {
+		idx->slots = old_slots;
+		return false;
+	}
+	idx->capacity = capacity;
+	idx->count = 0;
+	for (uint32_t i = 0; i < old_capacity; i++) {
+		if (old_slots[i]) {
+			bgenv_uservar_index_add(idx, udata, old_slots[i] - 1);
+		}
+	}
+	free(old_slots);
+	return true;
+}
+
+static bool bgenv_uservar_index_rebuild(BGENV_USERVAR_INDEX *idx,
+					uint8_t *udata)
+{
+	uint32_t offset = 0;
 	uint32_t rsize;
-	uint32_t spaceleft;
+	uint64_t type;
 
-	spaceleft = ENV_MEM_USERVARS;
+	if (idx->slots) {
+		memset(idx->slots, 0, idx->capacity * sizeof(uint32_t));
+	}
+	idx->count = 0;
+	idx->dead = 0;
+	idx->valid = false;
 
-	if (!udata) {
-		return 0;
+	while (offset < ENV_MEM_USERVARS && udata[offset]) {
+		bgenv_map_uservar(udata + offset, NULL, &type, NULL, &rsize,
+				  NULL);
+		if (type & USERVAR_TYPE_DELETED) {
+			idx->dead += rsize;
+		} else {
+			if (!bgenv_uservar_index_reserve(idx, udata)) {
+				return false;
+			}
+			bgenv_uservar_index_add(idx, udata, offset);
+		}
+		offset += rsize;
 	}
-	if (!*udata) {
-		return spaceleft;
+	if (offset > ENV_MEM_USERVARS) {
+		/* corrupt data, leave it to the linear functions */
+		return false;
 	}
+	idx->used = offset;
+	idx->valid = true;
+	return true;
+}
 
-	while (*udata) {
-		bgenv_map_uservar(udata, NULL, NULL, NULL, &rsize, NULL);
-		spaceleft -= rsize;
-		if (spaceleft == 0) {
+static bool bgenv_uservar_index_ready(BGENV_USERVAR_INDEX *idx,
+				      uint8_t *udata)
+{
+	if (!idx || !udata) {
+		return false;
+	}
+	return idx->valid || bgenv_uservar_index_rebuild(idx, udata);
+}
+
+static uint8_t *uservar_lookup(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			       char *key)
+{
+	uint32_t mask, slot;
+
+	if (!bgenv_uservar_index_ready(idx, udata)) {
+		return bgenv_find_uservar(udata, key);
+	}
+	if (idx->count == 0) {
+		return NULL;
+	}
+	mask = idx->capacity - 1;
+	slot = bgenv_uservar_hash(key) & mask;
+	while (idx->slots[slot]) {
+		uint8_t *p = udata + idx->slots[slot] - 1;
+
+		if (strcmp((char *)p, key) == 0) {
+			return p;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+uint8_t *bgenv_find_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				    char *key)
+{
+	uint64_t start = bgenv_stat_begin();
+	uint8_t *p;
+
+	p = uservar_lookup(idx, udata, key);
+	bgenv_stat_end(&bgenv_stats.uservar_lookup, start, 0);
+	return p;
+}
+
+/* a dead record needs a key of one character */
+#define USERVAR_MIN_RECORD	(2 + sizeof(uint32_t) + sizeof(uint64_t))
+
+static void bgenv_uservar_fill_dead(uint8_t *p, uint32_t record_size)
+{
+	uint32_t payload_size = record_size - 2;
+	uint64_t type = USERVAR_TYPE_DELETED;
+
+	memset(p, 0, record_size);
+	p[0] = '~';
+	memcpy(p + 2, &payload_size, sizeof(payload_size));
+	memcpy(p + 2 + sizeof(payload_size), &type, sizeof(type));
+}
+
+static void bgenv_uservar_kill(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			       uint8_t *p)
+{
+	uint32_t rsize;
+	uint64_t type;
+	uint8_t *val;
+
+	bgenv_uservar_index_remove(idx, udata, p - udata);
+	bgenv_map_uservar(p, NULL, &type, &val, &rsize, NULL);
+	type |= USERVAR_TYPE_DELETED;
+	memcpy(val - sizeof(type), &type, sizeof(type));
+	idx->dead += rsize;
+}
+
+/* Like bgenv_del_uservar() for layout v1, but the known end of the records
+ * saves walking them, and the index is kept valid */
+static void bgenv_uservar_remove(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				 uint8_t *p)
+{
+	uint32_t offset = p - udata;
+	uint32_t rsize;
+
+	bgenv_map_uservar(p, NULL, NULL, NULL, &rsize, NULL);
+	bgenv_uservar_index_remove(idx, udata, offset);
+	memmove(p, p + rsize, idx->used - offset - rsize);
+	memset(udata + idx->used - rsize, 0, rsize);
+	idx->used -= rsize;
+	/* slots depend on the keys only, just the offsets change */
+	for (uint32_t i = 0; i < idx->capacity; i++) {
+		if (idx->slots[i] > offset + 1) {
+			idx->slots[i] -= rsize;
+		}
+	}
+}
+
+/* size of the record at p plus that of the dead records following it */
+static uint32_t bgenv_uservar_span(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				   uint8_t *p)
+{
+	uint32_t span, rsize;
+	uint64_t type;
+
+	bgenv_map_uservar(p, NULL, NULL, NULL, &span, NULL);
+	while ((uint32_t)(p - udata) + span < idx->used) {
+		bgenv_map_uservar(p + span, NULL, &type, NULL, &rsize, NULL);
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
 			break;
 		}
-		udata = bgenv_next_uservar(udata);
+		span += rsize;
 	}
+	return span;
+}
 
-	return spaceleft;
+/* Returns true if the record at p could be updated in place, otherwise it
+ * is dead afterwards and the new one must be appended. */
+static bool bgenv_uservar_update_batched(BGENV_USERVAR_INDEX *idx,
+					 uint8_t *udata, uint8_t *p, char *key,
+					 uint64_t type, void *data,
+					 uint32_t total_size)
+{
+	uint32_t rsize, span;
+
+	if (type & USERVAR_TYPE_DELETED) {
+		bgenv_uservar_kill(idx, udata, p);
+		return true;
+	}
+	bgenv_map_uservar(p, NULL, NULL, NULL, &rsize, NULL);
+	span = bgenv_uservar_span(idx, udata, p);
+	if (total_size == span ||
+	    (total_size < span && span - total_size >= USERVAR_MIN_RECORD)) {
+		bgenv_serialize_uservar(p, key, type, data, total_size);
+		if (total_size < span) {
+			bgenv_uservar_fill_dead(p + total_size,
+						span - total_size);
+		}
+		idx->dead += rsize - total_size;
+		return true;
+	}
+	bgenv_uservar_kill(idx, udata, p);
+	return false;
+}
+
+/* Move all live records together in one pass */
+static void bgenv_uservar_compact(BGENV_USERVAR_INDEX *idx, uint8_t *udata)
+{
+	uint32_t src = 0, dst = 0;
+	uint32_t rsize;
+	uint64_t type;
+
+	while (src < ENV_MEM_USERVARS && udata[src]) {
+		bgenv_map_uservar(udata + src, NULL, &type, NULL, &rsize,
+				  NULL);
+		if (rsize == 0 || rsize > ENV_MEM_USERVARS - src) {
+			break;
+		}
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			if (dst != src) {
+				memmove(udata + dst, udata + src, rsize);
+			}
+			dst += rsize;
+		}
+		src += rsize;
+	}
+	memset(udata + dst, 0, src - dst);
+	bgenv_uservar_index_rebuild(idx, udata);
+}
+
+bool bgenv_uservar_batch_begin(BGENV_USERVAR_INDEX *idx, uint8_t *udata)
+{
+	struct uservar_table_trailer tr;
+
+	if (!bgenv_uservar_index_ready(idx, udata)) {
+		return false;
+	}
+	/* the table cannot follow dead records, rewrite it at the end */
+	idx->v2 = bgenv_uservar_table_get(udata, &tr);
+	bgenv_uservar_table_drop(udata);
+	idx->batch = true;
+	return true;
+}
+
+void bgenv_uservar_batch_end(BGENV_USERVAR_INDEX *idx, uint8_t *udata)
+{
+	if (!idx || !idx->batch) {
+		return;
+	}
+	/* without a valid index, the amount of dead records is unknown */
+	if (!idx->valid || idx->dead) {
+		bgenv_uservar_compact(idx, udata);
+	}
+	if (idx->v2) {
+		bgenv_uservar_table_write(udata);
+	}
+	idx->batch = false;
+	idx->v2 = false;
+}
+
+/* End of the room for records if the index holds 'extra' more of them */
+static uint32_t bgenv_uservar_limit(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				    uint32_t extra)
+{
+	struct uservar_table_trailer tr;
+	bool v2;
+
+	v2 = idx->batch ? idx->v2 : bgenv_uservar_table_get(udata, &tr);
+	if (!v2) {
+		return ENV_MEM_USERVARS;
+	}
+	return bgenv_uservar_table_start(idx->count + extra);
+}
+
+uint32_t bgenv_user_free_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata)
+{
+	if (!bgenv_uservar_index_ready(idx, udata)) {
+		return bgenv_user_free(udata);
+	}
+	/* dead records are free after the batch */
+	return bgenv_uservar_limit(idx, udata, 0) - idx->used + idx->dead;
+}
+
+int bgenv_set_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t type, void *data,
+			      uint32_t datalen)
+{
+	uint32_t total_size, rsize, limit;
+	uint8_t *p;
+
+	if (!bgenv_uservar_index_ready(idx, udata)) {
+		return bgenv_set_uservar(udata, key, type, data, datalen);
+	}
+
+	total_size = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
+		     strlen(key) + 1;
+
+	p = bgenv_find_uservar_indexed(idx, udata, key);
+	if (p && idx->batch) {
+		if (bgenv_uservar_update_batched(idx, udata, p, key, type, data,
+						 total_size)) {
+			return 0;
+		}
+	} else if (p) {
+		bgenv_map_uservar(p, NULL, NULL, NULL, &rsize, NULL);
+		if ((type & USERVAR_TYPE_DELETED) == 0 && rsize == total_size) {
+			bgenv_serialize_uservar(p, key, type, data, total_size);
+			return 0;
+		}
+		if (bgenv_uservar_limit(idx, udata, 0) < ENV_MEM_USERVARS) {
+			/* the table of layout v2 is rewritten anyway, let the
+			 * next lookup rebuild the index */
+			idx->valid = false;
+			return bgenv_set_uservar(udata, key, type, data,
+						 datalen);
+		}
+		/* the record is moved to the end, as bgenv_uservar_realloc()
+		 * does */
+		if ((type & USERVAR_TYPE_DELETED) == 0 &&
+		    idx->used - rsize + total_size + 1 > ENV_MEM_USERVARS) {
+			return -ENOMEM;
+		}
+		bgenv_uservar_remove(idx, udata, p);
+	}
+	if (type & USERVAR_TYPE_DELETED) {
+		return 0;
+	}
+
+	/* append, see bgenv_uservar_alloc() for the extra byte */
+	limit = bgenv_uservar_limit(idx, udata, 1);
+	if (idx->used + total_size + 1 > limit && idx->dead) {
+		bgenv_uservar_compact(idx, udata);
+		if (!idx->valid) {
+			return bgenv_set_uservar(udata, key, type, data,
+						 datalen);
+		}
+	}
+	if (idx->used + total_size + 1 > limit) {
+		return -ENOMEM;
+	}
+	if (!bgenv_uservar_index_reserve(idx, udata)) {
+		idx->valid = false;
+		return bgenv_set_uservar(udata, key, type, data, datalen);
+	}
+	p = udata + idx->used;
+	bgenv_serialize_uservar(p, key, type, data, total_size);
+	bgenv_uservar_index_add(idx, udata, idx->used);
+	idx->used += total_size;
+	/* there is a table of layout v2 if the limit lies in front of it */
+	if (!idx->batch && limit < ENV_MEM_USERVARS) {
+		bgenv_uservar_table_write(udata);
+	}
+
+	return 0;
+}
+
+void bgenv_uservar_index_invalidate(BGENV_USERVAR_INDEX *idx)
+{
+	if (idx) {
+		idx->valid = false;
+	}
+}
+
+void bgenv_uservar_index_free(BGENV_USERVAR_INDEX *idx)
+{
+	if (idx) {
+		free(idx->slots);
+		free(idx);
+	}
 }
@@ -37,4 +37,9 @@ typedef struct _BG_LOADER_PARAMS {
 	CHAR16 *payload_path;
 	CHAR16 *payload_options;
 	UINTN timeout;
+	UINTN boot_delay;
+	BOOLEAN fast_boot;
+	/* the selected config partition */
+	UINTN config_index;
+	UINT32 config_revision;
 } BG_LOADER_PARAMS;
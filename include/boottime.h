@@ -0,0 +1,44 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+
+/* Boot phases of the loader, each one is timestamped when it completes */
+typedef enum {
+	BG_PHASE_INIT,
+	BG_PHASE_GET_VOLUMES,
+	BG_PHASE_LOAD_CONFIG,
+	BG_PHASE_DEVICE_PATH,
+	BG_PHASE_LOAD_IMAGE,
+	BG_PHASE_WATCHDOG,
+	BG_PHASE_MAX
+} BG_BOOT_PHASE;
+
+/* Calibrates the timer and records BG_PHASE_INIT. Call first. */
+VOID boottime_init(VOID);
+VOID boottime_mark(BG_BOOT_PHASE phase);
+/* Current time in microseconds */
+UINT64 boottime_now(VOID);
+/* Timestamp of the phase in microseconds, 0 if not recorded */
+UINT64 boottime_usec(BG_BOOT_PHASE phase);
+/*
+ * Returns TRUE if timestamps count from the CPU reset (TSC or generic
+ * timer) and FALSE if only the wall clock is available, in which case only
+ * the phase durations are meaningful.
+ */
+BOOLEAN boottime_since_reset(VOID);
+/*
+ * Returns the duration of each recorded phase as "name=usec" pairs
+ * separated by spaces. Must be freed by the caller.
+ */
+CHAR16 *boottime_phases_str(VOID);
@@ -39,15 +39,89 @@
 typedef struct {
 	bool search_all_devices;
 	bool verbose;
+	bool incremental_crc;
+	bool parallel_probe;
+	bool probe_cache;
+	bool use_daemon;
+	bool compact_env;
+	bool stats;
+	bool probe_early_exit;
+	bool parallel_io;
+	uint32_t probe_timeout_ms;
 } ebgenv_opts_t;
 
 typedef struct {
 	void *bgenv;
 	void *gc_registry;
 	ebgenv_opts_t opts;
+	/* pending operations of a transaction, see ebg_env_begin() */
+	void *journal;
+	/* set if the environment was written by ebg_env_commit() and not
+	 * modified afterwards */
+	bool synced;
 } ebgenv_t;
 
-typedef enum { EBG_OPT_PROBE_ALL_DEVICES, EBG_OPT_VERBOSE } ebg_opt_t;
+/* a user variable, see ebg_env_set_many() and ebg_env_get_all() */
+typedef struct {
+	char *key;
+	uint64_t type;
+	uint8_t *data;
+	uint32_t len;
+} ebg_uservar_t;
+
+/* immutable copy of the environments, see ebg_env_snapshot_get() */
+typedef struct ebg_env_snapshot ebg_env_snapshot_t;
+
+/* watches the environments, see ebg_env_notify_open() */
+typedef struct ebg_env_notify ebg_env_notify_t;
+
+typedef enum {
+	EBG_OPT_PROBE_ALL_DEVICES,
+	EBG_OPT_VERBOSE,
+	EBG_OPT_INCREMENTAL_CRC,
+	EBG_OPT_PARALLEL_PROBE,
+	EBG_OPT_PROBE_CACHE,
+	EBG_OPT_USE_DAEMON,
+	EBG_OPT_COMPACT_ENV,
+	EBG_OPT_STATS,
+	EBG_OPT_PROBE_EARLY_EXIT,
+	EBG_OPT_PARALLEL_IO,
+	/* numeric, see ebg_set_opt_uint() */
+	EBG_OPT_PROBE_TIMEOUT_MS
+} ebg_opt_t;
+
+/* number of calls, time spent in them and bytes they moved */
+typedef struct {
+	uint64_t count;
+	uint64_t nsec;
+	uint64_t bytes;
+} ebg_stat_t;
+
+/* devices beyond this are not accounted individually */
+#define EBG_STATS_MAX_DEVICES 16
+
+/* reading the partition table of a device */
+typedef struct {
+	char devpath[64];
+	ebg_stat_t scan;
+	/* scans which exceeded EBG_OPT_PROBE_TIMEOUT_MS */
+	uint64_t timeouts;
+} ebg_device_stat_t;
+
+/* counters of this process, see ebg_env_get_stats() */
+typedef struct {
+	ebg_stat_t mount;
+	ebg_stat_t unmount;
+	ebg_stat_t read_env;
+	ebg_stat_t write_env;
+	ebg_stat_t crc32;
+	ebg_stat_t uservar_lookup;
+	/* whole runs of probing for config partitions */
+	ebg_stat_t probe;
+	/* reading the partition table of each device */
+	ebg_device_stat_t devices[EBG_STATS_MAX_DEVICES];
+	uint32_t num_devices;
+} ebg_env_stats_t;
 
 /**
  * @brief Set a global EBG option. Call before creating the ebg env.
@@ -65,6 +139,26 @@ int ebg_set_opt_bool(ebg_opt_t opt, bool value);
  */
 int ebg_get_opt_bool(ebg_opt_t opt, bool *value);
 
+/**
+ * @brief Set a numeric global EBG option. Call before creating the ebg env.
+ *        EBG_OPT_PROBE_TIMEOUT_MS bounds the time reading the partition
+ *        table of a device may take while probing for config partitions.
+ *        Devices exceeding it are skipped with a warning. 0, the default,
+ *        waits for each device as long as it takes.
+ * @param opt option to set
+ * @param value option value
+ * @return 0 on success
+ */
+int ebg_set_opt_uint(ebg_opt_t opt, uint32_t value);
+
+/**
+ * @brief Get a numeric global EBG option.
+ * @param opt option to get
+ * @param value out variable to retrieve option value
+ * @return 0 on success
+ */
+int ebg_get_opt_uint(ebg_opt_t opt, uint32_t *value);
+
 /** @brief Tell the library to output information for the user.
  *  @param e A pointer to an ebgenv_t context.
  *  @param v A boolean to set verbosity.
@@ -129,6 +223,62 @@ int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t datatype, uint8_t *value,
 int ebg_env_get_ex(ebgenv_t *e, char *key, uint64_t *datatype, uint8_t *buffer,
 		   uint32_t maxlen);
 
+/** @brief Get the value of an integer variable without conversion to a
+ *         string. Works for numeric built-in variables and user variables of
+ *         the standard integer types, char and bool.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key name of the environment variable to retrieve
+ *  @param value destination for the value
+ *  @return 0 on success, -ENOENT if the variable does not exist, -EINVAL if
+ *          it is no integer, -ERANGE if it is negative
+ */
+int ebg_env_get_u64(ebgenv_t *e, char *key, uint64_t *value);
+
+/** @brief Get the content of a user variable without copying it
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key name of the user variable to retrieve
+ *  @param datatype destination for the datatype of the value, may be NULL
+ *  @param data destination for a pointer to the value inside the
+ *         environment. No lock is held after returning, so it is only valid
+ *         while no context, in any thread, modifies, commits to or closes
+ *         this environment and the environments are not probed again.
+ *         Use ebg_env_get_ex() for a copy otherwise.
+ *  @param len destination for the length of the value
+ *  @return 0 on success, -ENOENT if the variable does not exist, -EINVAL
+ *          for built-in variables
+ */
+int ebg_env_get_view(ebgenv_t *e, char *key, uint64_t *datatype,
+		     const uint8_t **data, uint32_t *len);
+
+/** @brief Set or, with USERVAR_TYPE_DELETED in their type, delete several
+ *         user variables at once. The resulting user variable area is
+ *         computed and written in a single pass, existing variables keep
+ *         their position and new ones are appended in the given order. If
+ *         a key is given more than once, its last record applies. Either
+ *         all records are applied or none.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param vars the records, data and len may be NULL and 0 for deletions
+ *  @param count number of records
+ *  @return 0 on success, -EINVAL for built-in variables or invalid records,
+ *          -ENOMEM if the variables do not fit, -errno on other failures
+ */
+int ebg_env_set_many(ebgenv_t *e, const ebg_uservar_t *vars, uint32_t count);
+
+/** @brief Export all user variables at once
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param buffer destination for an array of the user variables, followed
+ *         by the keys and values its entries point to. It must be aligned
+ *         like ebg_uservar_t, e.g. by coming from malloc(). If buffer is
+ *         NULL, the needed buffer size is returned.
+ *  @param size size of the provided buffer
+ *  @param count destination for the number of user variables
+ *  @return If buffer != NULL: 0 on success, -ENOSPC if size is too small,
+ *          -errno on other failures
+ *          If buffer == NULL: needed buffer size, -errno on failure
+ */
+int ebg_env_get_all(ebgenv_t *e, void *buffer, uint32_t size,
+		    uint32_t *count);
+
 /** @brief Get available space for user variables
  *  @param e A pointer to an ebgenv_t context.
  *  @return Free space in bytes
@@ -151,12 +301,34 @@ uint16_t ebg_env_getglobalstate(ebgenv_t *e);
 int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate);
 
 /** @brief Closes environment and finalize library. Changes are written before
- *         closing.
+ *         closing. Changes of an uncommitted transaction are discarded.
  *  @param e A pointer to an ebgenv_t context.
  *  @return 0 on success, errno on failure
  */
 int ebg_env_close(ebgenv_t *e);
 
+/** @brief Start a transaction on the opened environment. Until the
+ *         transaction is committed, ebg_env_set(), ebg_env_set_ex() and
+ *         ebg_env_setglobalstate() only record the requested change.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_begin(ebgenv_t *e);
+
+/** @brief Apply all changes recorded since ebg_env_begin() and write each
+ *         affected environment exactly once. If any change fails, none of
+ *         them is applied. A subsequent ebg_env_close() does not write the
+ *         environment again unless it was modified after the commit.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_commit(ebgenv_t *e);
+
+/** @brief Discard all changes recorded since ebg_env_begin().
+ *  @param e A pointer to an ebgenv_t context.
+ */
+void ebg_env_abort(ebgenv_t *e);
+
 /** @brief Register a variable that will be deleted on finalize
  *  @param e A pointer to an ebgenv_t context.
  *  @param key A string containing the variable key
@@ -169,3 +341,72 @@ int ebg_env_register_gc_var(ebgenv_t *e, char *key);
  *  @return 0 on success, errno on failure
  */
 int ebg_env_finalize_update(ebgenv_t *e);
+
+/** @brief Get a reference to an immutable copy of all environments as they
+ *         were last read or written. It is replaced whenever an environment
+ *         is written, without blocking on or being blocked by writers.
+ *         Snapshots exist while at least one context is open.
+ *  @return The snapshot, NULL with errno set if there is none
+ */
+const ebg_env_snapshot_t *ebg_env_snapshot_get(void);
+
+/** @brief Release a reference obtained by ebg_env_snapshot_get()
+ *  @param s The snapshot, may be NULL
+ */
+void ebg_env_snapshot_put(const ebg_env_snapshot_t *s);
+
+/** @brief Like ebg_env_get_ex(), on the latest environment of a snapshot
+ *  @param s The snapshot
+ *  @param key name of the environment variable to retrieve
+ *  @param datatype buffer to store the datatype of the value
+ *  @param buffer destination for data to be stored into the variable
+ *  @param maxlen size of provided buffer
+ *  @return 0 on success, -errno on failure
+ */
+int ebg_env_snapshot_get_ex(const ebg_env_snapshot_t *s, char *key,
+			    uint64_t *datatype, uint8_t *buffer,
+			    uint32_t maxlen);
+
+/** @brief Like ebg_env_getglobalstate(), on the environments of a snapshot
+ *  @param s The snapshot
+ *  @return ustate value
+ */
+uint16_t ebg_env_snapshot_getglobalstate(const ebg_env_snapshot_t *s);
+
+/** @brief Start watching the environments for changes of their revision or
+ *         ustate, done by this or any other process. The events come from
+ *         ebgenvd if it is running, otherwise from inotify on the config
+ *         partitions.
+ *  @return The notifier, NULL with errno set on failure
+ */
+ebg_env_notify_t *ebg_env_notify_open(void);
+
+/** @brief Get the file descriptor of a notifier to wait for with poll() or
+ *         epoll. It becomes readable when ebg_env_notify_read() is due.
+ *  @param n The notifier
+ *  @return file descriptor, -errno on failure
+ */
+int ebg_env_notify_fd(ebg_env_notify_t *n);
+
+/** @brief Consume the pending events of a notifier without blocking.
+ *  @param n The notifier
+ *  @return 1 if the revision or ustate of any environment changed since the
+ *          notifier was opened or last read, 0 if not, -errno on failure,
+ *          after which the notifier has to be opened again
+ */
+int ebg_env_notify_read(ebg_env_notify_t *n);
+
+/** @brief Stop watching and release a notifier
+ *  @param n The notifier, may be NULL
+ */
+void ebg_env_notify_close(ebg_env_notify_t *n);
+
+/** @brief Get the statistics collected while EBG_OPT_STATS is set. Without
+ *         it, only the counters of earlier calls are returned.
+ *  @param stats destination of the counters
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_get_stats(ebg_env_stats_t *stats);
+
+/** @brief Reset all statistics to zero */
+void ebg_env_reset_stats(void);
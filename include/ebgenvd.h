@@ -0,0 +1,125 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "env_api.h"
+
+#define EBGENVD_SOCKET_PATH	"/run/ebgenvd.sock"
+/* environment variable overriding EBGENVD_SOCKET_PATH */
+#define EBGENVD_SOCKET_ENV	"EBGENVD_SOCKET"
+
+#define EBGENVD_MAGIC		0x44564745 /* "EGVD" */
+#define EBGENVD_VERSION		1
+
+/* I/O timeout of clients and of the daemon towards its clients */
+#define EBGENVD_TIMEOUT_MS	5000
+
+enum ebgenvd_cmd {
+	/* returns all config partitions and their environments */
+	EBGENVD_CMD_GET = 1,
+	/* writes the environment of the config partition at index */
+	EBGENVD_CMD_WRITE,
+	/* probes the config partitions again */
+	EBGENVD_CMD_RELOAD,
+	/* keeps the connection open to send a struct ebgenvd_event on
+	 * changes */
+	EBGENVD_CMD_WATCH,
+};
+
+/* the daemon searches all devices, see EBG_OPT_PROBE_ALL_DEVICES */
+#define EBGENVD_FLAG_ALL_DEVICES	(1 << 0)
+
+/*
+ * One request per connection, all fields in host byte order. A request
+ * of EBGENVD_CMD_WRITE is followed by the BG_ENVDATA to be written and is
+ * rejected with -ESTALE if generation is not the one of the snapshot the
+ * index refers to.
+ */
+struct ebgenvd_request {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t cmd;
+	uint32_t index;
+	uint32_t flags;
+	uint32_t generation;
+} __attribute__((packed));
+
+/*
+ * status is 0 or a negative errno value. On success, the response to
+ * EBGENVD_CMD_GET is followed by num_parts entries of a uint32_t length,
+ * the device path of this length without terminator and the BG_ENVDATA
+ * read from the partition. generation changes whenever the daemon probes
+ * the config partitions again or finds an environment changed by someone
+ * else.
+ */
+struct ebgenvd_response {
+	uint32_t magic;
+	int32_t status;
+	uint32_t flags;
+	uint32_t num_parts;
+	uint32_t generation;
+} __attribute__((packed));
+
+/*
+ * Sent after the response to EBGENVD_CMD_WATCH and whenever the revision or
+ * ustate of an environment changed afterwards. A watcher that does not keep
+ * up with reading is disconnected.
+ */
+struct ebgenvd_event {
+	uint32_t magic;
+	uint32_t generation;
+	struct {
+		uint32_t revision;
+		uint32_t ustate;
+	} parts[ENV_NUM_CONFIG_PARTS];
+} __attribute__((packed));
+
+/**
+ * Returns the path of the daemon socket.
+ */
+const char *ebgenvd_socket_path(void);
+
+/**
+ * Send or receive exactly len bytes, returns 0 or a negative errno value.
+ */
+int ebgenvd_send(int fd, const void *buf, size_t len);
+int ebgenvd_recv(int fd, void *buf, size_t len);
+
+/**
+ * Fills parts and envs with the snapshot held by the daemon. Fails without
+ * a message if no daemon is running or if it was started with a different
+ * search_all_devices setting, in which case the caller probes by itself.
+ * The device paths must be freed by the caller.
+ */
+bool ebgenvd_fetch(CONFIG_PART *parts, BG_ENVDATA *envs,
+		   bool search_all_devices);
+
+/**
+ * Lets the daemon write env to the config partition at index of the last
+ * fetched snapshot and update its own copy.
+ */
+bool ebgenvd_write(uint32_t index, const BG_ENVDATA *env);
+
+/**
+ * Subscribes to the events of the daemon. Returns the connected socket, after
+ * the first event was received into ev, or a negative errno value, -ENOENT
+ * or -ECONNREFUSED if no daemon is running.
+ */
+int ebgenvd_watch(struct ebgenvd_event *ev);
+
+/**
+ * Asks the daemon to probe the config partitions again. Returns 0 or a
+ * negative errno value.
+ */
+int ebgenvd_reload(void);
@@ -58,9 +58,23 @@
 #define MBR_TYPE_FAT32_LBA 0x0C
 #define MBR_TYPE_FAT16_LBA 0x0E
 #define MBR_TYPE_EXTENDED_LBA 0x0F
-
-#define GPT_PARTITION_GUID_FAT_NTFS "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7"
-#define GPT_PARTITION_GUID_ESP "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
+#define MBR_TYPE_ESP 0xEF
+
+/* partition type GUIDs in their on-disk (mixed endian) byte order */
+/* EBD0A0A2-B9E5-4433-87C0-68B6B72699C7 */
+#define GPT_PARTITION_GUID_FAT_NTFS                                            \
+	{                                                                      \
+		0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44, 0x87, 0xC0,    \
+		0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7                             \
+	}
+/* C12A7328-F81F-11D2-BA4B-00A0C93EC93B */
+#define GPT_PARTITION_GUID_ESP                                                 \
+	{                                                                      \
+		0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11, 0xBA, 0x4B,    \
+		0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B                             \
+	}
+/* upper bound of the GPT partition entry array read at once */
+#define GPT_ENTRY_ARRAY_MAX (1024 * 1024)
 
 #pragma pack(push)
 #pragma pack(1)
@@ -119,6 +133,8 @@ typedef enum {
 typedef struct _PedPartition {
 	EbgFileSystemType fs_type;
 	uint16_t num;
+	/* device node of FAT partitions, NULL if sysfs did not tell */
+	char *devpath;
 	struct _PedPartition *next;
 } PedPartition;
 
@@ -126,6 +142,8 @@ typedef struct _PedDevice {
 	char *model;
 	char *path;
 	PedPartition *part_list;
+	/* holds an EFI system partition */
+	bool has_esp;
 	struct _PedDevice *next;
 } PedDevice;
 
@@ -140,3 +158,6 @@ PedPartition *ped_disk_next_partition(const PedDisk *pd,
 				      const PedPartition *part);
 
 void ebgpart_beverbose(bool v);
+void ebgpart_probe_parallel(bool v);
+/* deadline for reading the partition table of each device, 0 for none */
+void ebgpart_probe_timeout(unsigned int ms);
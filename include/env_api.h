@@ -47,53 +47,212 @@ extern ebgenv_opts_t ebgenv_opts;
 #define VERBOSE(o, ...)                                                        \
 	if (ebgenv_opts.verbose) fprintf(o, __VA_ARGS__)
 
+/* The built-in fields of BG_ENVDATA: key, field, and for the numeric ones
+ * their C type and the type bgenv_get() reports. Everything dealing with
+ * them one by one is generated from these tables. */
+#define BGENV_STRING_FIELDS(X)                                                 \
+	X(KERNELFILE, kernelfile)                                              \
+	X(KERNELPARAMS, kernelparams)
+
+#define BGENV_UINT_FIELDS(X)                                                   \
+	X(WATCHDOG_TIMEOUT_SEC, watchdog_timeout_sec, uint16_t,                \
+	  USERVAR_TYPE_UINT16)                                                 \
+	X(REVISION, revision, uint32_t, USERVAR_TYPE_UINT32)                   \
+	X(USTATE, ustate, uint8_t, USERVAR_TYPE_UINT8)                         \
+	X(IN_PROGRESS, in_progress, uint8_t, USERVAR_TYPE_UINT8)
+
+#define BGENV_KEY_ENUM(key, ...) EBGENV_##key,
+
 typedef enum {
-	EBGENV_KERNELFILE,
-	EBGENV_KERNELPARAMS,
-	EBGENV_WATCHDOG_TIMEOUT_SEC,
-	EBGENV_REVISION,
-	EBGENV_USTATE,
-	EBGENV_IN_PROGRESS,
+	BGENV_STRING_FIELDS(BGENV_KEY_ENUM)
+	BGENV_UINT_FIELDS(BGENV_KEY_ENUM)
 	EBGENV_UNKNOWN
 } EBGENVKEY;
 
+#undef BGENV_KEY_ENUM
+
+/* outcome of reading the environment of a config partition */
+typedef enum {
+	/* not read by this process, e.g. as it was fetched from ebgenvd */
+	BGENV_CHECK_UNKNOWN,
+	BGENV_CHECK_OK,
+	/* missing, not accessible or of unknown layout */
+	BGENV_CHECK_UNREADABLE,
+	BGENV_CHECK_CRC,
+	BGENV_CHECK_USERVARS
+} BGENV_CHECK_STATUS;
+
 typedef struct {
 	char *devpath;
 	char *mountpoint;
 	bool not_mounted;
+	/* the environment file uses the compact layout, see BG_ENVHEADER */
+	bool compact;
+	/* set by read_env() */
+	BGENV_CHECK_STATUS status;
 } CONFIG_PART;
 
+/* Copies of devpath and mountpoint are made and released with these. With
+ * EBG_STATIC_ALLOC, they come from a fixed pool and paths longer than
+ * EBG_PATH_LEN are rejected. */
+extern char *bgenv_path_dup(const char *path);
+extern void bgenv_path_free(char *path);
+
 typedef struct {
 	void *desc;
 	BG_ENVDATA *data;
+	/* if set, data->crc32 is kept valid by patching it on every edit
+	 * done through bgenv_set() instead of recalculating it on close */
+	bool crc_incremental;
+	/* lookup index over data->userdata, allocated on first use; code
+	 * which modifies the user variables without going through bgenv_set()
+	 * must invalidate it */
+	struct bgenv_uservar_index *uservar_index;
+	/* modification count of the shared environments uservar_index was
+	 * last checked against, see bgenv_lock_shared() */
+	unsigned long changes;
 } BGENV;
 
-typedef struct gc_item {
-	char *key;
-	struct gc_item *next;
-} GC_ITEM;
-
 extern void bgenv_be_verbose(bool v);
 
 extern char *str16to8(char *buffer, const char16_t *src);
 extern char16_t *str8to16(char16_t *buffer, const char *src);
+/* bounded variants, n is the capacity of dst in characters */
+extern size_t str16to8n(char *dst, const char16_t *src, size_t n);
+extern size_t str8to16n(char16_t *dst, const char *src, size_t n);
+
+typedef enum {
+	BGENV_CRC32_AUTO,
+	BGENV_CRC32_BYTEWISE,
+	BGENV_CRC32_SLICE8,
+	BGENV_CRC32_PCLMUL,
+	BGENV_CRC32_ARMV8
+} BGENV_CRC32_BACKEND;
 
 extern uint32_t bgenv_crc32(uint32_t, const void *, size_t);
+/* Force a CRC32 implementation, returns false if not supported by the CPU.
+ * By default, the fastest available one is picked on first use. */
+extern bool bgenv_crc32_select(BGENV_CRC32_BACKEND backend);
+/* CRC32 of buf without pre- and post-conditioning, which makes it linear
+ * with respect to XOR. Used to patch a CRC after partial changes. */
+extern uint32_t bgenv_crc32_raw(const void *buf, size_t size);
+/* Advance a CRC32 as if len zero bytes were appended (unconditioned). */
+extern uint32_t bgenv_crc32_shift(uint32_t crc, size_t len);
+/* CRC32 of A|B from crc(A), crc(B) and the length of B, like zlib's. */
+extern uint32_t bgenv_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
 
+/* Calls nest, only the last bgenv_finalize() releases the config
+ * partitions. Both must be called with the lock held exclusively if other
+ * threads use the library at the same time. */
 extern bool bgenv_init(void);
+/* Like bgenv_init(), for read-only access to the environment selected by
+ * bgenv_open_latest(). Only that one is read completely, the others are
+ * cleared and cannot be written until bgenv_init() is called. */
+extern bool bgenv_init_latest(void);
 extern void bgenv_finalize(void);
+/* The config partitions and environments are shared by all handles and
+ * ebgenv_t contexts of a process. The ebg_env_*() functions hold this lock
+ * while accessing them, shared if they only read. It is not recursive.
+ * env is the handle worked on, if any, whose uservar index is dropped if
+ * the data was modified through another handle in the meantime. */
+extern void bgenv_lock_shared(BGENV *env);
+extern void bgenv_lock_exclusive(BGENV *env);
+extern void bgenv_unlock(BGENV *env);
 extern BGENV *bgenv_open_by_index(uint32_t index);
 extern BGENV *bgenv_open_oldest(void);
 extern BGENV *bgenv_open_latest(void);
+/* Expects env->data->crc32 to be up to date. An environment of a config
+ * partition which is unchanged since it was last read or written is not
+ * written again. */
 extern bool bgenv_write(BGENV *env);
+/* Writes count environments one after another, each one synced before the
+ * next is written. Writing stops at the first failure. */
+extern bool bgenv_write_all(BGENV **envs, size_t count);
 extern BG_ENVDATA *bgenv_read(BGENV *env);
 extern void bgenv_close(BGENV *env);
 
 extern BGENV *bgenv_create_new(void);
+/* Like bgenv_create_new(), but the new environment starts as a copy of the
+ * latest one */
+extern BGENV *bgenv_create_staged(void);
+/* Turns env into a copy of base, or clears it for NULL. Only the fixed
+ * fields and those user variable bytes are written which are in use by
+ * either. In incremental CRC mode, the CRC is derived from them as well. */
+extern void bgenv_stage(BGENV *env, const BG_ENVDATA *base);
 extern int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 		     uint32_t maxlen);
+extern int bgenv_get_u64(BGENV *env, char *key, uint64_t *value);
+extern int bgenv_get_view(BGENV *env, char *key, uint64_t *type,
+			  const uint8_t **data, uint32_t *len);
 extern int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 		     uint32_t datalen);
+/* bgenv_set() with key already resolved by bgenv_str2enum() */
+extern int bgenv_set_key(BGENV *env, EBGENVKEY e, char *key, uint64_t type,
+			 void *data, uint32_t datalen);
+/* Sets the numeric built-in field e without a string conversion. Returns
+ * -EINVAL if e is no such field and -ERANGE if value does not fit. */
+extern int bgenv_set_uint(BGENV *env, EBGENVKEY e, uint64_t value);
+/* See ebg_env_set_many() and ebg_env_get_all() */
+extern int bgenv_set_many(BGENV *env, const ebg_uservar_t *vars,
+			  uint32_t count);
+extern int bgenv_get_all(BGENV *env, void *buffer, uint32_t size,
+			 uint32_t *count);
+extern EBGENVKEY bgenv_str2enum(char *key);
 extern uint8_t *bgenv_find_uservar(uint8_t *userdata, char *key);
 
 extern bool validate_envdata(BG_ENVDATA *data);
+
+typedef struct {
+	BGENV_CHECK_STATUS status;
+	/* of valid environments only */
+	uint32_t revision;
+	uint8_t ustate;
+	/* another valid environment has the same revision */
+	bool duplicate;
+	/* revisions are missing down to the next older valid environment */
+	bool gap;
+	/* was invalid and has been overwritten by bgenv_check() */
+	bool repaired;
+} BGENV_CHECK;
+
+/* Reports the state of all environments in results, which must hold
+ * ENV_NUM_CONFIG_PARTS entries, after bgenv_init(). With repair, invalid
+ * ones are overwritten with a copy of the latest valid environment if that
+ * is confirmed, with the revision one below it, so that it remains the one
+ * booted and the copy becomes its fallback. Environments failed by the
+ * loader are valid and take part in neither revision check. Returns the
+ * number of environments left with problems or a negative errno value. */
+extern int bgenv_check(BGENV_CHECK *results, bool repair);
+
+/* Publish the snapshot returned by ebg_env_snapshot_get(): all envs after
+ * they were read, the environment at index after it was written, or none
+ * after the last bgenv_finalize(). */
+extern void bgenv_snapshot_publish(const BG_ENVDATA *envs);
+extern void bgenv_snapshot_update(uint32_t index, const BG_ENVDATA *data);
+extern void bgenv_snapshot_clear(void);
+
+extern uint32_t bgenv_crc_edit_begin(BGENV *env, size_t start, size_t end);
+extern void bgenv_crc_edit_end(BGENV *env, size_t start, size_t end,
+			       uint32_t before);
+extern void bgenv_update_crc(BGENV *env);
+
+/* Typed accessors of the numeric built-in fields, bgenv_get_revision(),
+ * bgenv_set_ustate() and so on. Setters patch the CRC like bgenv_set(). */
+#define BGENV_UINT_ACCESSORS(key, field, ctype, usertype)                      \
+	static inline ctype bgenv_get_##field(const BGENV *env)                \
+	{                                                                      \
+		return env->data->field;                                       \
+	}                                                                      \
+	static inline void bgenv_set_##field(BGENV *env, ctype value)          \
+	{                                                                      \
+		const size_t start = offsetof(BG_ENVDATA, field);              \
+		const size_t end = start + sizeof(value);                      \
+		uint32_t crc_before = bgenv_crc_edit_begin(env, start, end);   \
+                                                                               \
+		env->data->field = value;                                      \
+		bgenv_crc_edit_end(env, start, end, crc_before);               \
+	}
+
+BGENV_UINT_FIELDS(BGENV_UINT_ACCESSORS)
+
+#undef BGENV_UINT_ACCESSORS
@@ -16,6 +16,10 @@
 #include <stdio.h>
 #include "env_api.h"
 
+struct fat_file;
+
 FILE *open_config_file_from_part(CONFIG_PART *cfgpart, char *mode);
+int open_config_file_raw(CONFIG_PART *cfgpart, int flags,
+			 struct fat_file *file);
 FILE *open_config_file(char *configfilepath, char *mode);
 bool probe_config_file(CONFIG_PART *cfgpart);
@@ -18,5 +18,13 @@
 #include "env_api.h"
 
 char *get_mountpoint(char *devpath);
+/* Read the mounts of the system once, get_mountpoint() looks them up in
+ * this record until mount_map_release(). Mounts done by mount_partition()
+ * in the meantime are not part of it. */
+void mount_map_load(void);
+void mount_map_release(void);
 bool mount_partition(CONFIG_PART *cfgpart);
 void unmount_partition(CONFIG_PART *cfgpart);
+/* Drop the mount point of cfgpart, i.e. unmount the partition if it was
+ * mounted by mount_partition() */
+void release_partition(CONFIG_PART *cfgpart);
@@ -0,0 +1,42 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "env_api.h"
+
+#define PROBE_CACHE_DIR		"/run/efibootguard"
+#define PROBE_CACHE_FILE	PROBE_CACHE_DIR "/probe.cache"
+
+/**
+ * Returns the key identifying a probe run, built from the device probing
+ * was limited to (or all devices if rootdev is NULL) and the set of block
+ * devices in the system. Must be freed by the caller.
+ */
+char *probe_cache_key(const char *rootdev);
+
+/**
+ * Fills cfgpart with the config partitions recorded in the cache file at
+ * path. Each entry is only accepted if the key matches, the device node
+ * still has the same major:minor number, the partition table of its disk
+ * is unchanged and the partition still holds the environment file. On any
+ * mismatch the cache file is removed and false is returned.
+ */
+bool probe_cache_load(const char *path, const char *key,
+		      CONFIG_PART *cfgpart);
+
+/**
+ * Records the config partitions found by a full probe run. diskpaths holds
+ * the path of the disk device of each entry in cfgpart.
+ */
+bool probe_cache_store(const char *path, const char *key,
+		       const CONFIG_PART *cfgpart, char *const *diskpaths);
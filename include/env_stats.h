@@ -0,0 +1,68 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "ebgenv.h"
+
+extern ebgenv_opts_t ebgenv_opts;
+extern ebg_env_stats_t bgenv_stats;
+
+/**
+ * Returns the start time of an operation to be passed to bgenv_stat_end(),
+ * or 0 if statistics are disabled. This check is all that is done then.
+ */
+static inline uint64_t bgenv_stat_begin(void)
+{
+	struct timespec ts;
+
+	if (!__atomic_load_n(&ebgenv_opts.stats, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* nanoseconds since start */
+static inline uint64_t bgenv_stat_elapsed(uint64_t start)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+}
+
+/**
+ * Accounts an operation begun at start which moved the given number of
+ * bytes. Counters are only updated atomically, no lock is taken.
+ */
+static inline void bgenv_stat_end(ebg_stat_t *stat, uint64_t start,
+				  uint64_t bytes)
+{
+	if (!start) {
+		return;
+	}
+	__atomic_add_fetch(&stat->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat->nsec, bgenv_stat_elapsed(start),
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Like bgenv_stat_end(), for reading the partition table of the device at
+ * devpath. Also accounted per device as far as there is room.
+ */
+void bgenv_stat_device(const char *devpath, uint64_t start);
+
+/* Accounts a scan of the device at devpath which exceeded its deadline */
+void bgenv_stat_device_timeout(const char *devpath);
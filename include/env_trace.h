@@ -0,0 +1,43 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+/*
+ * Static probe points of libebgenv for bpftrace, perf or SystemTap, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libebgenv.so:libebgenv:read_return
+ *                { printf("%s %d\n", str(arg0), arg3); }'
+ *
+ * Each probe is a single nop until a tracer attaches. Without sys/sdt.h,
+ * they are compiled out.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define EBG_TRACE0(name) DTRACE_PROBE(libebgenv, name)
+#define EBG_TRACE1(name, a) DTRACE_PROBE1(libebgenv, name, a)
+#define EBG_TRACE2(name, a, b) DTRACE_PROBE2(libebgenv, name, a, b)
+#define EBG_TRACE3(name, a, b, c) DTRACE_PROBE3(libebgenv, name, a, b, c)
+#define EBG_TRACE4(name, a, b, c, d)                                         \
+	DTRACE_PROBE4(libebgenv, name, a, b, c, d)
+#else
+#define EBG_TRACE0(name)                                                     \
+	do {                                                                 \
+	} while (0)
+#define EBG_TRACE1(name, a) EBG_TRACE0(name)
+#define EBG_TRACE2(name, a, b) EBG_TRACE0(name)
+#define EBG_TRACE3(name, a, b, c) EBG_TRACE0(name)
+#define EBG_TRACE4(name, a, b, c, d) EBG_TRACE0(name)
+#endif
@@ -29,6 +29,17 @@
 
 #define REVISION_FAILED 0
 
+/* User variable overriding the boot delay of the loader, in seconds as
+ * ASCII string. A value of 0 selects fast boot: no delay and no console
+ * output once the configuration is loaded. */
+#define USERVAR_BOOT_DELAY "EBG_BOOT_DELAY"
+#define BOOT_DELAY_MAX 3600
+
+/* User variable permitting more than one attempt to boot an environment in
+ * testing state before it is marked as failed, as ASCII string. */
+#define USERVAR_BOOT_ATTEMPTS "EBG_BOOT_ATTEMPTS"
+#define BOOT_ATTEMPTS_MAX 255
+
 #pragma pack(push)
 #pragma pack(1)
 struct _BG_ENVDATA {
@@ -44,3 +55,88 @@ struct _BG_ENVDATA {
 #pragma pack(pop)
 
 typedef struct _BG_ENVDATA BG_ENVDATA;
+
+/*
+ * Environment files of exactly sizeof(BG_ENVDATA) bytes hold BG_ENVDATA as
+ * is. Smaller ones may use the compact layout: this header, the fields of
+ * BG_ENVDATA before userdata, the first userdata_len bytes of userdata and
+ * a CRC32 over all of that. The remaining userdata is zero. Files are only
+ * written compact if that is smaller, so the size tells the layouts apart.
+ */
+#define ENV_HEADER_MAGIC 0x56454245 /* "EBEV" */
+#define ENV_HEADER_VERSION 1
+
+struct _BG_ENVHEADER {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_len;
+	uint32_t userdata_len;
+};
+
+typedef struct _BG_ENVHEADER BG_ENVHEADER;
+
+#define ENV_FIXED_FIELDS_SIZE __builtin_offsetof(BG_ENVDATA, userdata)
+
+static inline uint32_t bgenv_compact_size(uint32_t userdata_len)
+{
+	return sizeof(BG_ENVHEADER) + ENV_FIXED_FIELDS_SIZE + userdata_len +
+	       sizeof(uint32_t);
+}
+
+/* Returns the userdata length if the size bytes at buf are a compact
+ * environment as far as the header tells, -1 otherwise */
+static inline int64_t bgenv_compact_userdata_len(const void *buf,
+						 uint64_t size)
+{
+	const BG_ENVHEADER *hdr = (const BG_ENVHEADER *)buf;
+
+	if (size >= sizeof(BG_ENVDATA) || size < sizeof(BG_ENVHEADER) ||
+	    hdr->magic != ENV_HEADER_MAGIC ||
+	    hdr->version != ENV_HEADER_VERSION ||
+	    hdr->header_len != sizeof(BG_ENVHEADER) ||
+	    hdr->userdata_len > ENV_MEM_USERVARS ||
+	    bgenv_compact_size(hdr->userdata_len) != size) {
+		return -1;
+	}
+	return hdr->userdata_len;
+}
+
+/* Length of the userdata up to the last byte in use, i.e. not zero */
+static inline uint32_t bgenv_userdata_used(const BG_ENVDATA *env)
+{
+	uint32_t len = ENV_MEM_USERVARS;
+
+	while (len > 0 && env->userdata[len - 1] == 0) {
+		len--;
+	}
+	return len;
+}
+
+/* Stores the indices of those of the num environments in envs that are not
+ * flagged in invalid (may be NULL) into order, by descending revision, and
+ * returns their number. Of equal revisions, the lower index comes first.
+ * Shared by the loader and the library to select and fall back. */
+static inline unsigned int bgenv_revision_order(const BG_ENVDATA *envs,
+						const int *invalid,
+						unsigned int num,
+						unsigned int *order)
+{
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < num; i++) {
+		unsigned int pos = count;
+
+		if (invalid && invalid[i]) {
+			continue;
+		}
+		/* insertion sort, there are only a few environments */
+		while (pos > 0 &&
+		       envs[order[pos - 1]].revision < envs[i].revision) {
+			order[pos] = order[pos - 1];
+			pos--;
+		}
+		order[pos] = i;
+		count++;
+	}
+	return count;
+}
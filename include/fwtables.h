@@ -0,0 +1,65 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+#include <efilib.h>
+
+#define EFI_ACPI_ROOT_SDP_REVISION 0x02
+
+#define ACPI_SIG_RSDP (CHAR8 *)"RSD PTR "
+#define ACPI_SIG_RSDT (CHAR8 *)"RSDT"
+#define ACPI_SIG_XSDT (CHAR8 *)"XSDT"
+
+#pragma pack(push)
+#pragma pack(1)
+
+/* Root System Description Pointer  (ACPI section 5.2.5.3) */
+typedef struct {
+    CHAR8   signature[8];
+    UINT8   checksum;
+    UINT8   oem_id[6];
+    UINT8   revision;
+    UINT32  rsdt_address;
+    UINT32  length;
+    UINT64  xsdt_address;
+    UINT8   extended_checksum;
+    UINT8   reserved[3];
+} EFI_ACPI_ROOT_SDP_HEADER;
+
+/* System Description Table  (ACPI section 5.2.6) */
+typedef struct {
+	CHAR8   signature[4];
+	UINT32  length;
+	UINT8   revision;
+	UINT8   checksum;
+	CHAR8   oem_id[6];
+	CHAR8   oem_table_id[8];
+	UINT32  oem_revision;
+	UINT32  creator_id;
+	UINT32  creator_revision;
+} EFI_ACPI_SDT_HEADER;
+
+#pragma pack(pop)
+
+/*
+ * Firmware tables are looked up by all drivers, on every probe. The ACPI
+ * tables listed in the RSDT/XSDT and the SMBIOS structures are indexed on
+ * the first lookup, later ones do not walk them again.
+ */
+
+/* Returns the ACPI table with the given signature, or NULL */
+EFI_ACPI_SDT_HEADER *acpi_find_table(const CHAR8 *signature);
+
+/* Returns the first SMBIOS structure of the given type, Raw is NULL if there
+ * is none */
+SMBIOS_STRUCTURE_POINTER smbios_find_struct(UINT8 type);
@@ -16,10 +16,29 @@
 
 typedef struct _BG_INTERFACE_PARAMS {
 	CHAR16 *loader_device_part_uuid;
+	/* keep the LoaderDevicePartUUID of a loader that ran before in this
+	 * boot, as the unified kernel stub does when started by Boot Guard */
+	BOOLEAN keep_loader_device_part_uuid;
+	/* loader timestamps in microseconds since reset, 0 if unknown */
+	UINT64 time_init_usec;
+	UINT64 time_exec_usec;
+	/* per-phase durations, see boottime_phases_str(), or NULL */
+	CHAR16 *phase_times;
+	/* selected config partition, only exported if has_config is set */
+	BOOLEAN has_config;
+	UINTN config_index;
+	UINT32 config_revision;
 } BG_INTERFACE_PARAMS;
 
 // systemd bootloader interface vendor id
 extern EFI_GUID vendor_guid;
 
+/* Stages the interface variables, they are written by
+ * commit_bg_interface_vars(). */
 EFI_STATUS set_bg_interface_vars(const BG_INTERFACE_PARAMS *params);
+/* Writes the staged variables right before handing over to the kernel, all
+ * of them volatile. Variables already holding the staged value are not
+ * written again. Non-volatile ones of the same name cannot stem from this
+ * boot and are always replaced. */
+EFI_STATUS commit_bg_interface_vars(VOID);
 CHAR16 *disk_get_part_uuid(EFI_HANDLE *handle);
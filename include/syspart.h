@@ -31,5 +31,14 @@
 #define read_cfg_file(file, len, buffer)				\
 	(file)->Read((file), (len), (buffer))
 
-EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *maxHandles);
-UINTN filter_cfg_parts(UINTN *config_volumes, UINTN maxHandles);
+/*
+ * Finds up to *maxHandles volumes holding a config file. Those of the first
+ * ENV_NUM_CONFIG_PARTS volumes are read into env unless it is NULL, the
+ * result of each read is stored in env_status. Compact environments are
+ * converted to BG_ENVDATA, their CRC is already checked, and the length of
+ * the stored userdata is returned in userdata_len. It is ENV_MEM_USERVARS
+ * for the fixed layout.
+ */
+EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *maxHandles,
+			       BG_ENVDATA *env, EFI_STATUS *env_status,
+			       UINT32 *userdata_len);
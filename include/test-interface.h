@@ -19,4 +19,3 @@
 bool read_env(CONFIG_PART *part, BG_ENVDATA *env);
 bool write_env(CONFIG_PART *part, BG_ENVDATA *env);
 
-EBGENVKEY bgenv_str2enum(char *key);
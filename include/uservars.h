@@ -16,6 +16,21 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "ebgenv.h"
+
+/* Optional in-memory index over the records of a user variable area. It maps
+ * the hash of a key to the offset of its record and is rebuilt lazily from
+ * the raw data after it has been invalidated. */
+typedef struct bgenv_uservar_index {
+	uint32_t *slots;	/* record offset + 1, 0 marks a free slot */
+	uint32_t capacity;	/* number of slots, always a power of two */
+	uint32_t count;		/* number of indexed records */
+	uint32_t used;		/* bytes occupied by all records */
+	uint32_t dead;		/* bytes of those which are dead */
+	bool valid;
+	bool batch;		/* see bgenv_uservar_batch_begin() */
+	bool v2;		/* table to restore at the end of the batch */
+} BGENV_USERVAR_INDEX;
 
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type,
 		       uint8_t **val, uint32_t *record_size,
@@ -27,9 +42,49 @@ int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	              uint32_t datalen);
 
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key);
+uint8_t *bgenv_find_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+				    char *key);
+int bgenv_get_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t *type, void *data,
+			      uint32_t maxlen);
+int bgenv_set_uservar_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t type, void *data,
+			      uint32_t datalen);
+void bgenv_uservar_index_invalidate(BGENV_USERVAR_INDEX *idx);
+uint32_t bgenv_user_free_indexed(BGENV_USERVAR_INDEX *idx, uint8_t *udata);
+
+/* In batch mode, bgenv_set_uservar_indexed() marks deleted and resized
+ * records dead instead of moving all records behind them. A record which
+ * shrinks stays in place with a dead filler behind it, which it can grow
+ * into again. bgenv_uservar_batch_end() removes the dead records in a single
+ * pass, it must be called before the data is used in any other way. */
+bool bgenv_uservar_batch_begin(BGENV_USERVAR_INDEX *idx, uint8_t *udata);
+void bgenv_uservar_batch_end(BGENV_USERVAR_INDEX *idx, uint8_t *udata);
+void bgenv_uservar_index_free(BGENV_USERVAR_INDEX *idx);
 uint8_t *bgenv_next_uservar(uint8_t *udata);
 
+void bgenv_uservar_edit_range(BGENV_USERVAR_INDEX *idx, uint8_t *udata,
+			      char *key, uint64_t type, uint32_t datalen,
+			      uint32_t *start, uint32_t *end);
+
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var);
 uint32_t bgenv_user_free(uint8_t *udata);
 
 bool bgenv_validate_uservars(uint8_t *udata);
+/* Like bgenv_validate_uservars(), also returning the bytes occupied by the
+ * records and their number, deleted ones included, in a single pass */
+bool bgenv_scan_uservars(uint8_t *udata, uint32_t *used, uint32_t *records);
+
+/* Writes to out, which holds ENV_MEM_USERVARS bytes, the area resulting
+ * from applying all count records to udata, see ebg_env_set_many(). Dead
+ * records are dropped. udata is not modified. */
+int bgenv_merge_uservars(uint8_t *udata, const ebg_uservar_t *vars,
+			 uint32_t count, uint8_t *out);
+/* See ebg_env_get_all() */
+int bgenv_export_uservars(uint8_t *udata, void *buffer, uint32_t size,
+			  uint32_t *count);
+
+/* Layout v2 keeps a table of all records sorted by the hash of their key at
+ * the end of the area, see bgenv_uservars_convert(). */
+bool bgenv_uservars_v2(uint8_t *udata);
+int bgenv_uservars_convert(uint8_t *udata, bool v2);
@@ -20,8 +20,13 @@
 
 #define MAX_INFO_SIZE 1024
 
+/* The root and the labels of a volume are only read on first use, see
+ * volume_open_root() and volume_read_labels(). */
 typedef struct _VOLUME_DESC {
+	EFI_HANDLE handle;
 	EFI_DEVICE_PATH *devpath;
+	BOOLEAN onbootmedium;
+	BOOLEAN labels_read;
 	CHAR16 *fslabel;
 	CHAR16 *fscustomlabel;
 	EFI_FILE_HANDLE root;
@@ -29,24 +34,54 @@ typedef struct _VOLUME_DESC {
 
 extern VOLUME_DESC *volumes;
 extern UINTN volume_count;
+/* device path of the partition the loader was started from */
+extern EFI_DEVICE_PATH *boot_medium_devpath;
 
 typedef enum { DOSFSLABEL, CUSTOMLABEL, NOLABEL } LABELMODE;
 
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status);
 CHAR16 *get_volume_label(EFI_FILE_HANDLE fh);
 EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count);
+EFI_FILE_HANDLE volume_open_root(VOLUME_DESC *volume);
+VOID volume_read_labels(VOLUME_DESC *volume);
 EFI_STATUS close_volumes(VOLUME_DESC *volumes, UINTN count);
 EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 					  CHAR16 *payloadpath);
+/* Reads the file a device path from FileDevicePathFromConfig() points to
+ * into a buffer allocated from pool. */
+EFI_STATUS prefetch_file(EFI_DEVICE_PATH *filedevpath, VOID **buffer,
+			 UINTN *size);
 CHAR16 *GetBootMediumPath(CHAR16 *input);
+/* Sets boot_medium_devpath and caches its disk prefix for IsOnBootMedium() */
+VOID SetBootMedium(EFI_DEVICE_PATH *dp);
 BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp);
 
 typedef EFI_STATUS (*WATCHDOG_PROBE)(EFI_PCI_IO *, UINT16, UINT16, UINTN);
+
+typedef struct {
+	UINT16 vendor_id;
+	UINT16 device_id;
+} WATCHDOG_PCI_ID;
+
+/* pci_ids lists the devices the probe function is called for, terminated
+ * by a zero vendor ID. Drivers not bound to a PCI device use NULL, they are
+ * probed once with a NULL pci_io. */
+typedef struct {
+	WATCHDOG_PROBE probe;
+	const WATCHDOG_PCI_ID *pci_ids;
+} WATCHDOG_DRIVER;
+
 #define _CONCAT(prefix, func) prefix  ## func
 #define CONCAT(prefix, func) _CONCAT(prefix, func)
-#define WATCHDOG_REGISTER(_func)                                               \
-	__attribute__((used, section(".wdfuncs"))) static WATCHDOG_PROBE       \
-		CONCAT(wdfuncs##_, _func) = (WATCHDOG_PROBE)_func;
+#define WATCHDOG_REGISTER_PCI(_func, _pci_ids)                                 \
+	static const WATCHDOG_DRIVER CONCAT(wddriver_, _func) = {              \
+		.probe = _func,                                                \
+		.pci_ids = _pci_ids,                                           \
+	};                                                                     \
+	__attribute__((used, section(".wdfuncs"))) static const                \
+		WATCHDOG_DRIVER *CONCAT(wdfuncs##_, _func) =                   \
+			&CONCAT(wddriver_, _func);
+#define WATCHDOG_REGISTER(_func) WATCHDOG_REGISTER_PCI(_func, NULL)
 
 VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...);
 #define ERROR(fmt, ...)                                                        \
@@ -62,8 +97,13 @@ VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...);
 	} while (0)
 
 #if !defined(SILENT_BOOT)
+extern BOOLEAN quiet_boot;
 #define INFO(fmt, ...)                                                         \
-	PrintC(EFI_LIGHTGRAY, fmt, ##__VA_ARGS__)
+	do {                                                                   \
+		if (!quiet_boot) {                                             \
+			PrintC(EFI_LIGHTGRAY, fmt, ##__VA_ARGS__);             \
+		}                                                              \
+	} while (0)
 #else
 #define INFO(fmt, ...) do { } while (0)
 #endif
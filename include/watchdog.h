@@ -0,0 +1,28 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+
+/* Starts the first watchdog found with the given timeout in seconds.
+ * Drivers not bound to a PCI device are tried first, then each PCI device
+ * is probed with the drivers listing its ID, starting with the device a
+ * watchdog was found on during the previous boot. */
+EFI_STATUS probe_watchdogs(UINTN timeout);
+
+/* Schedules probe_watchdogs() to run from a timer event, so that probing can
+ * overlap with loading the payload. */
+VOID start_watchdog_probe(UINTN timeout);
+/* Completes the probing started by start_watchdog_probe(), running it now if
+ * the event did not fire yet, and returns its result. The watchdog is armed
+ * when this returns EFI_SUCCESS. */
+EFI_STATUS finish_watchdog_probe(VOID);
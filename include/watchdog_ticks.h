@@ -0,0 +1,48 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+
+/* Conversions of timeouts in seconds for the watchdog drivers. They are
+ * inlined, so that the constant arguments most drivers pass are folded. */
+
+#define WDT_NSEC_PER_SEC	1000000000ULL
+#define WDT_NSEC_PER_MSEC	1000000ULL
+
+/* Returns the number of ticks of period_ns nanoseconds that fit into the
+ * timeout, clamped to [min, max] instead of wrapping around in the counter
+ * register. */
+static inline UINT64 wdt_secs_to_ticks(UINTN seconds, UINT64 period_ns,
+				       UINT64 min, UINT64 max)
+{
+	UINT64 ticks = (seconds * WDT_NSEC_PER_SEC) / period_ns;
+
+	if (ticks < min) {
+		return min;
+	}
+	return ticks > max ? max : ticks;
+}
+
+/* For counters with a few selectable ranges: returns the index of the first
+ * of the count ascending limits, in seconds, that covers the timeout, or
+ * count if none does. */
+static inline UINTN wdt_select_range(UINTN seconds, const UINT8 *limits,
+				     UINTN count)
+{
+	UINTN n = 0;
+
+	while (n < count && seconds > limits[n]) {
+		n++;
+	}
+	return n;
+}
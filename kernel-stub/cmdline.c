@@ -0,0 +1,168 @@
+/*
+ * EFI Boot Guard, unified kernel stub
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "kernel-stub.h"
+#include "loader_interface.h"
+
+#define TEMPLATE_VALUE_MAX	64
+
+/*
+ * The only values that can be inserted into the signed command line. They
+ * come from boot loader interface variables and may only consist of
+ * characters that cannot add further kernel parameters.
+ */
+typedef struct {
+	CHAR16 *placeholder;
+	CHAR16 *variable;
+	CHAR16 value[TEMPLATE_VALUE_MAX + 1];
+	BOOLEAN fetched;
+} TEMPLATE_VALUE;
+
+static TEMPLATE_VALUE template_values[] = {
+	{ .placeholder = L"@BG_CONFIG_INDEX@",
+	  .variable = L"BootGuardConfigIndex" },
+	{ .placeholder = L"@BG_CONFIG_REVISION@",
+	  .variable = L"BootGuardConfigRevision" },
+	{ .placeholder = L"@LOADER_DEVICE_PART_UUID@",
+	  .variable = L"LoaderDevicePartUUID" },
+};
+
+static BOOLEAN is_valid_value(const CHAR16 *value)
+{
+	if (!*value) {
+		return FALSE;
+	}
+	for (; *value; value++) {
+		if (!((*value >= '0' && *value <= '9') ||
+		      (*value >= 'a' && *value <= 'f') ||
+		      (*value >= 'A' && *value <= 'F') || *value == '-')) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static const CHAR16 *get_value(TEMPLATE_VALUE *tv, const CHAR16 *part_uuid)
+{
+	UINTN size = TEMPLATE_VALUE_MAX * sizeof(CHAR16);
+	UINT32 attributes = 0;
+	EFI_STATUS status;
+
+	if (tv->fetched) {
+		return tv->value;
+	}
+	tv->fetched = TRUE;
+
+	/* the variables may or may not include the zero-termination */
+	status = RT->GetVariable(tv->variable, &vendor_guid, &attributes, &size,
+				 tv->value);
+	/* Loaders of this boot set them volatile. A non-volatile one was
+	 * planted from the OS and must not steer the signed command line. */
+	if (!EFI_ERROR(status) && (attributes & EFI_VARIABLE_NON_VOLATILE)) {
+		status = EFI_NOT_FOUND;
+	}
+	if (!EFI_ERROR(status)) {
+		tv->value[size / sizeof(CHAR16)] = L'\0';
+	} else if (status == EFI_NOT_FOUND && part_uuid &&
+		   StrCmp(tv->variable, L"LoaderDevicePartUUID") == 0) {
+		/* the stub was started directly, it exports its own one */
+		StrnCpy(tv->value, part_uuid, TEMPLATE_VALUE_MAX);
+	} else {
+		error_exit(L"Cannot read value for command line template",
+			   status);
+	}
+	if (!is_valid_value(tv->value)) {
+		error_exit(L"Invalid value for command line template",
+			   EFI_INVALID_PARAMETER);
+	}
+	return tv->value;
+}
+
+static TEMPLATE_VALUE *match_placeholder(const CHAR16 *pos, UINTN left)
+{
+	UINTN n, len;
+
+	for (n = 0; n < sizeof(template_values) / sizeof(template_values[0]);
+	     n++) {
+		len = StrLen(template_values[n].placeholder);
+		if (len <= left &&
+		    CompareMem(pos, template_values[n].placeholder,
+			       len * sizeof(CHAR16)) == 0) {
+			return &template_values[n];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Copies the command line with all placeholders replaced to dst, or only
+ * determines the resulting length if dst is NULL. Returns the number of
+ * characters, without zero-termination, and the number of placeholders.
+ */
+static UINTN expand(const CHAR16 *cmdline, UINTN len, const CHAR16 *part_uuid,
+		    CHAR16 *dst, UINTN *replaced)
+{
+	const CHAR16 *value;
+	TEMPLATE_VALUE *tv;
+	UINTN pos = 0, out = 0, value_len;
+
+	*replaced = 0;
+	while (pos < len) {
+		tv = cmdline[pos] == L'@' ?
+			match_placeholder(cmdline + pos, len - pos) : NULL;
+		if (!tv) {
+			if (dst) {
+				dst[out] = cmdline[pos];
+			}
+			out++;
+			pos++;
+			continue;
+		}
+		value = get_value(tv, part_uuid);
+		value_len = StrLen(value);
+		if (dst) {
+			CopyMem(dst + out, (VOID *) value,
+				value_len * sizeof(CHAR16));
+		}
+		out += value_len;
+		pos += StrLen(tv->placeholder);
+		(*replaced)++;
+	}
+	return out;
+}
+
+VOID *expand_cmdline(const VOID *cmdline, UINT32 *size,
+		     const CHAR16 *part_uuid)
+{
+	UINTN len, out_len, replaced;
+	CHAR16 *buffer;
+
+	len = StrnLen(cmdline, *size / sizeof(CHAR16));
+	out_len = expand(cmdline, len, part_uuid, NULL, &replaced);
+	if (!replaced) {
+		return NULL;
+	}
+
+	/* sized in advance, so that it is assembled in one go */
+	buffer = AllocatePool((out_len + 1) * sizeof(CHAR16));
+	if (!buffer) {
+		error_exit(L"Error allocating command line",
+			   EFI_OUT_OF_RESOURCES);
+	}
+	expand(cmdline, len, part_uuid, buffer, &replaced);
+	buffer[out_len] = L'\0';
+	*size = (out_len + 1) * sizeof(CHAR16);
+
+	return buffer;
+}
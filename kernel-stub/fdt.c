@@ -154,14 +154,89 @@ BOOLEAN match_fdt(const VOID *fdt, const CHAR8 *compatible)
 	return strcmpa(compatible, alt_compatible) == 0;
 }
 
-static EFI_STATUS clone_fdt(const VOID *fdt, UINTN size,
+/*
+ * Index over the .dtb-* sections, generated by bg_gen_unified_kernel. The
+ * entries are sorted by the FNV-1a hash of the first root compatible string
+ * of the referenced device tree.
+ */
+#define FDT_INDEX_MAGIC	"DTBINDEX"
+
+typedef struct {
+	UINT32 Hash;
+	UINT32 VirtualAddress;
+} __attribute__((packed)) FDT_INDEX_ENTRY;
+
+typedef struct {
+	CHAR8 Magic[8];
+	UINT32 NumEntries;
+	UINT32 Reserved;
+	FDT_INDEX_ENTRY Entries[];
+} __attribute__((packed)) FDT_INDEX;
+
+static UINT32 fnv1a_hash(const CHAR8 *str)
+{
+	UINT32 hash = 2166136261U;
+
+	for (; *str; str++) {
+		hash = (hash ^ *str) * 16777619U;
+	}
+	return hash;
+}
+
+const VOID *lookup_fdt_index(const VOID *index, UINTN index_size,
+			     const VOID *image_base, UINTN image_size,
+			     const CHAR8 *compatible)
+{
+	const FDT_INDEX *header = index;
+	const VOID *fdt, *alt_fdt = NULL;
+	UINTN low = 0, high, mid;
+	UINT32 hash, addr;
+
+	if (!compatible || index_size < sizeof(*header) ||
+	    CompareMem(header->Magic, FDT_INDEX_MAGIC,
+		       sizeof(header->Magic)) != 0 ||
+	    header->NumEntries > (index_size - sizeof(*header)) /
+				 sizeof(FDT_INDEX_ENTRY)) {
+		return NULL;
+	}
+
+	hash = fnv1a_hash(compatible);
+	high = header->NumEntries;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (header->Entries[mid].Hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	/* confirm the match, hashes may collide */
+	for (; low < header->NumEntries && header->Entries[low].Hash == hash;
+	     low++) {
+		addr = header->Entries[low].VirtualAddress;
+		if (addr > image_size ||
+		    image_size - addr < sizeof(FDT_HEADER)) {
+			error_exit(L"Invalid .dtbidx section",
+				   EFI_INVALID_PARAMETER);
+		}
+		fdt = (const UINT8 *) image_base + addr;
+		if (match_fdt(fdt, compatible)) {
+			alt_fdt = fdt;
+		}
+	}
+
+	return alt_fdt;
+}
+
+static EFI_STATUS clone_fdt(const VOID *fdt, UINTN pages,
 			    EFI_PHYSICAL_ADDRESS *fdt_buffer)
 {
 	const FDT_HEADER *header = fdt;
 	EFI_STATUS status;
 
 	status = BS->AllocatePages(AllocateAnyPages, EfiACPIReclaimMemory,
-				   SIZE_IN_PAGES(size), fdt_buffer);
+				   pages, fdt_buffer);
 	if (EFI_ERROR(status)) {
 		error(L"Error allocating device tree buffer", status);
 		return status;
@@ -173,24 +248,28 @@ static EFI_STATUS clone_fdt(const VOID *fdt, UINTN size,
 
 EFI_STATUS replace_fdt(const VOID *fdt)
 {
+	const FDT_HEADER *header = fdt;
 	EFI_DT_FIXUP_PROTOCOL *protocol;
 	EFI_PHYSICAL_ADDRESS fdt_buffer;
 	EFI_STATUS status;
-	UINTN size;
+	UINTN size, pages;
 
 	status = LibLocateProtocol(&EfiDtFixupProtocol, (VOID **)&protocol);
 	if (EFI_ERROR(status)) {
-		const FDT_HEADER *header = fdt;
-
 		info(L"Firmware does not provide device tree fixup protocol");
 
-		size = BE32_TO_HOST(header->TotalSize);
-		status = clone_fdt(fdt, size, &fdt_buffer);
+		/*
+		 * Nothing to modify, but the table must not point into the
+		 * stub image, which is unloaded if the kernel returns and is
+		 * no memory type other payloads may rely on.
+		 */
+		pages = SIZE_IN_PAGES(BE32_TO_HOST(header->TotalSize));
+		status = clone_fdt(fdt, pages, &fdt_buffer);
 		if (EFI_ERROR(status)) {
 			return status;
 		}
 	} else {
-		/* Find out which size we need */
+		/* Find out which size we need, including room for the fixups */
 		size = 0;
 		status = protocol->Fixup(protocol, (VOID *) fdt, &size,
 					 EFI_DT_APPLY_FIXUPS);
@@ -198,8 +277,13 @@ EFI_STATUS replace_fdt(const VOID *fdt)
 			error(L"Device tree fixup: unexpected error", status);
 			return status;
 		}
+		if (size < BE32_TO_HOST(header->TotalSize)) {
+			size = BE32_TO_HOST(header->TotalSize);
+		}
 
-		status = clone_fdt(fdt, size, &fdt_buffer);
+		/* Fixup() updates size, keep what was allocated for freeing */
+		pages = SIZE_IN_PAGES(size);
+		status = clone_fdt(fdt, pages, &fdt_buffer);
 		if (EFI_ERROR(status)) {
 			return status;
 		}
@@ -209,7 +293,7 @@ EFI_STATUS replace_fdt(const VOID *fdt)
 					 EFI_DT_APPLY_FIXUPS |
 					 EFI_DT_RESERVE_MEMORY);
 		if (EFI_ERROR(status)) {
-			(VOID) BS->FreePages(fdt_buffer, SIZE_IN_PAGES(size));
+			(VOID) BS->FreePages(fdt_buffer, pages);
 			error(L"Device tree fixup failed", status);
 			return status;
 		}
@@ -218,7 +302,7 @@ EFI_STATUS replace_fdt(const VOID *fdt)
 	status = BS->InstallConfigurationTable(&EfiDtbTableGuid,
 					       (VOID *)(uintptr_t)fdt_buffer);
 	if (EFI_ERROR(status)) {
-		(VOID) BS->FreePages(fdt_buffer, SIZE_IN_PAGES(size));
+		(VOID) BS->FreePages(fdt_buffer, pages);
 		error(L"Failed to install alternative device tree", status);
 	}
 
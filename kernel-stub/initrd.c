@@ -27,11 +27,30 @@ typedef struct {
 	 {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68}}
 
 typedef struct {
-	EFI_LOAD_FILE_PROTOCOL protocol;
 	const void *addr;
 	UINTN size;
+	UINTN compressed_size;
+} INITRD_PART;
+
+typedef struct {
+	EFI_LOAD_FILE_PROTOCOL protocol;
+	INITRD_PART parts[INITRD_MAX_PARTS];
+	UINTN num_parts;
+	UINTN size;
 } INITRD_LOADER;
 
+/*
+ * Header of an LZ4 compressed initrd, followed by a single LZ4 block (raw
+ * block format, no frame). Generated by bg_gen_unified_kernel.
+ */
+#define INITRD_LZ4_MAGIC	"EBGLZ4\0\0"
+
+typedef struct {
+	CHAR8 magic[8];
+	UINT64 size;
+	UINT64 compressed_size;
+} __attribute__((packed)) INITRD_LZ4_HEADER;
+
 #ifndef EfiLoadFile2Protocol
 static const EFI_GUID gEfiLoadFile2Protocol = {
 	0x4006c0c1, 0xfcb3, 0x403e,
@@ -61,6 +80,82 @@ static INITRD_LOADER initrd_loader;
 
 static EFI_HANDLE initrd_handle;
 
+static BOOLEAN lz4_read_length(const UINT8 **src, const UINT8 *src_end,
+				UINTN *length)
+{
+	UINT8 byte;
+
+	do {
+		if (*src >= src_end) {
+			return FALSE;
+		}
+		byte = *(*src)++;
+		*length += byte;
+	} while (byte == 255);
+
+	return TRUE;
+}
+
+static EFI_STATUS lz4_decompress(const UINT8 *src, UINTN src_size,
+				 UINT8 *dst, UINTN dst_size)
+{
+	const UINT8 *src_end = src + src_size;
+	UINT8 *dst_start = dst, *dst_end = dst + dst_size;
+	UINTN length, offset;
+	UINT8 token;
+
+	while (src < src_end) {
+		token = *src++;
+
+		length = token >> 4;
+		if (length == 15 && !lz4_read_length(&src, src_end, &length)) {
+			return EFI_LOAD_ERROR;
+		}
+		if (length > (UINTN)(src_end - src) ||
+		    length > (UINTN)(dst_end - dst)) {
+			return EFI_LOAD_ERROR;
+		}
+		CopyMem(dst, (VOID *) src, length);
+		src += length;
+		dst += length;
+
+		/* the last sequence consists of literals only */
+		if (src == src_end) {
+			break;
+		}
+
+		if (src_end - src < 2) {
+			return EFI_LOAD_ERROR;
+		}
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (offset == 0 || offset > (UINTN)(dst - dst_start)) {
+			return EFI_LOAD_ERROR;
+		}
+
+		length = token & 0xf;
+		if (length == 15 && !lz4_read_length(&src, src_end, &length)) {
+			return EFI_LOAD_ERROR;
+		}
+		length += 4;
+		if (length > (UINTN)(dst_end - dst)) {
+			return EFI_LOAD_ERROR;
+		}
+
+		if (offset >= length) {
+			CopyMem(dst, dst - offset, length);
+			dst += length;
+		} else {
+			/* overlapping match, repeats the last offset bytes */
+			for (; length > 0; length--, dst++) {
+				*dst = *(dst - offset);
+			}
+		}
+	}
+
+	return dst == dst_end ? EFI_SUCCESS : EFI_LOAD_ERROR;
+}
+
 static EFIAPI EFI_STATUS initrd_load_file(EFI_LOAD_FILE_PROTOCOL *this,
 					  EFI_DEVICE_PATH *file_path,
 					  BOOLEAN boot_policy,
@@ -68,6 +163,10 @@ static EFIAPI EFI_STATUS initrd_load_file(EFI_LOAD_FILE_PROTOCOL *this,
 					  VOID *buffer)
 {
 	INITRD_LOADER *loader = (INITRD_LOADER *) this;
+	const INITRD_PART *part;
+	EFI_STATUS status;
+	UINT8 *dst;
+	UINTN n;
 
 	if (!loader || !file_path || !buffer_size) {
 		return EFI_INVALID_PARAMETER;
@@ -80,19 +179,72 @@ static EFIAPI EFI_STATUS initrd_load_file(EFI_LOAD_FILE_PROTOCOL *this,
 		return EFI_BUFFER_TOO_SMALL;
 	}
 
-	CopyMem(buffer, (VOID*)loader->addr, loader->size);
+	/* the kernel unpacks concatenated initramfs archives one by one */
+	for (n = 0, dst = buffer; n < loader->num_parts; n++) {
+		part = &loader->parts[n];
+		if (part->compressed_size) {
+			status = lz4_decompress((const UINT8 *) part->addr +
+						sizeof(INITRD_LZ4_HEADER),
+						part->compressed_size, dst,
+						part->size);
+			if (EFI_ERROR(status)) {
+				error(L"Error decompressing initrd", status);
+				return status;
+			}
+		} else {
+			CopyMem(dst, (VOID*)part->addr, part->size);
+		}
+		dst += part->size;
+	}
 	*buffer_size = loader->size;
 
 	return EFI_SUCCESS;
 }
 
-VOID install_initrd_loader(VOID *initrd, UINTN initrd_size)
+VOID add_initrd(const VOID *initrd, UINTN initrd_size)
+{
+	const INITRD_LZ4_HEADER *header = initrd;
+	INITRD_PART *part;
+
+	if (initrd_loader.num_parts == INITRD_MAX_PARTS) {
+		error_exit(L"Too many initrd sections", EFI_UNSUPPORTED);
+	}
+	part = &initrd_loader.parts[initrd_loader.num_parts];
+
+	part->addr = initrd;
+	part->size = initrd_size;
+	part->compressed_size = 0;
+
+	if (initrd_size >= sizeof(*header) &&
+	    CompareMem(header->magic, INITRD_LZ4_MAGIC,
+		       sizeof(header->magic)) == 0) {
+		if (header->compressed_size == 0 ||
+		    header->compressed_size > initrd_size - sizeof(*header) ||
+		    header->size == 0 ||
+		    header->size != (UINTN) header->size) {
+			error_exit(L"Invalid compressed initrd",
+				   EFI_LOAD_ERROR);
+		}
+		part->size = header->size;
+		part->compressed_size = header->compressed_size;
+	}
+
+	if (initrd_loader.size + part->size < initrd_loader.size) {
+		error_exit(L"Invalid initrd size", EFI_LOAD_ERROR);
+	}
+	initrd_loader.size += part->size;
+	initrd_loader.num_parts++;
+}
+
+VOID install_initrd_loader(VOID)
 {
 	EFI_STATUS status;
 
+	if (initrd_loader.num_parts == 0) {
+		return;
+	}
+
 	initrd_loader.protocol.LoadFile = initrd_load_file;
-	initrd_loader.addr = initrd;
-	initrd_loader.size = initrd_size;
 
 	status = BS->InstallMultipleProtocolInterfaces(
 			&initrd_handle, &DevicePathProtocol,
@@ -14,13 +14,26 @@
 
 #include <efi.h>
 
+/* .initrd plus .initrd1 to .initrd8 */
+#define INITRD_MAX_PARTS	9
+
 VOID error(CHAR16 *message, EFI_STATUS status);
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status);
 VOID info(CHAR16 *message);
 
 const VOID *get_fdt_compatible(VOID);
 BOOLEAN match_fdt(const VOID *fdt, const CHAR8 *compatible);
+const VOID *lookup_fdt_index(const VOID *index, UINTN index_size,
+			     const VOID *image_base, UINTN image_size,
+			     const CHAR8 *compatible);
 EFI_STATUS replace_fdt(const VOID *fdt);
 
-VOID install_initrd_loader(VOID *initrd, UINTN initrd_size);
+VOID measure_section(const VOID *digests, UINTN digests_size,
+		     const CHAR8 *name);
+
+VOID *expand_cmdline(const VOID *cmdline, UINT32 *size,
+		     const CHAR16 *part_uuid);
+
+VOID add_initrd(const VOID *initrd, UINTN initrd_size);
+VOID install_initrd_loader(VOID);
 VOID uninstall_initrd_loader(VOID);
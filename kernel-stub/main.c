@@ -52,9 +52,26 @@ typedef struct {
 	CHAR8 Name[8];
 	UINT32 VirtualSize;
 	UINT32 VirtualAddress;
-	UINT8 Ignore[24];
+	UINT32 SizeOfRawData;
+	UINT8 Ignore[16];
+	UINT32 Characteristics;
 } __attribute__((packed)) SECTION;
 
+/* sections of the stub image the stub acts on, all in section order */
+typedef struct {
+	const SECTION *cmdline;
+	const SECTION *kernel;
+	const SECTION *dtb_index;
+	const SECTION *digests;
+	const SECTION *initrds[INITRD_MAX_PARTS];
+	UINTN num_initrds;
+	const SECTION **dtbs;
+	UINTN num_dtbs;
+} STUB_SECTIONS;
+
+#define IMAGE_SCN_MEM_EXECUTE	0x20000000
+#define IMAGE_SCN_MEM_WRITE	0x80000000
+
 static EFI_HANDLE this_image;
 static EFI_LOADED_IMAGE kernel_image;
 
@@ -96,25 +113,138 @@ static const SECTION *get_sections(const PE_HEADER *pe_header)
 				  pe_header->Coff.SizeOfOptionalHeader);
 }
 
+static BOOLEAN is_initrd_section(const CHAR8 *name)
+{
+	return CompareMem(name, ".initrd", 7) == 0 &&
+		(name[7] == '\0' || (name[7] >= '1' && name[7] <= '8'));
+}
+
+/*
+ * Sort the sections into the table in one pass. The second character
+ * tells the candidates apart, so that each section is compared against
+ * one or two names at most.
+ */
+static VOID classify_sections(const PE_HEADER *pe_header,
+			      STUB_SECTIONS *sections)
+{
+	UINTN n, num_sections = pe_header->Coff.NumberOfSections;
+	const SECTION *section;
+	const CHAR8 *name;
+
+	SetMem(sections, sizeof(*sections), 0);
+	sections->dtbs = AllocatePool(num_sections * sizeof(*sections->dtbs));
+	if (!sections->dtbs) {
+		error_exit(L"Error allocating section table",
+			   EFI_OUT_OF_RESOURCES);
+	}
+
+	for (n = 0, section = get_sections(pe_header); n < num_sections;
+	     n++, section++) {
+		name = section->Name;
+		if (name[0] != '.') {
+			continue;
+		}
+		switch (name[1]) {
+		case 'c':
+			if (CompareMem(name, ".cmdline", 8) == 0) {
+				sections->cmdline = section;
+			}
+			break;
+		case 'k':
+			if (CompareMem(name, ".kernel", 8) == 0) {
+				sections->kernel = section;
+			}
+			break;
+		case 'i':
+			if (!is_initrd_section(name)) {
+				break;
+			}
+			if (sections->num_initrds == INITRD_MAX_PARTS) {
+				error_exit(L"Too many initrd sections",
+					   EFI_UNSUPPORTED);
+			}
+			sections->initrds[sections->num_initrds++] = section;
+			break;
+		case 'd':
+			if (CompareMem(name, ".dtbidx", 8) == 0) {
+				sections->dtb_index = section;
+			} else if (CompareMem(name, ".digests", 8) == 0) {
+				sections->digests = section;
+			} else if (CompareMem(name, ".dtb-", 5) == 0) {
+				sections->dtbs[sections->num_dtbs++] = section;
+			}
+			break;
+		}
+	}
+}
+
+/* in a fixed order, so that the resulting PCR value is deterministic */
+static VOID measure_sections(const STUB_SECTIONS *sections,
+			     const SECTION *fdt_section, const VOID *image_base)
+{
+	const VOID *digests;
+	UINTN n, size;
+
+	/* without digests, only the firmware's measurement of the image */
+	if (!sections->digests) {
+		return;
+	}
+	digests = (const UINT8 *) image_base +
+		sections->digests->VirtualAddress;
+	size = sections->digests->VirtualSize;
+
+	measure_section(digests, size, sections->kernel->Name);
+	for (n = 0; n < sections->num_initrds; n++) {
+		measure_section(digests, size, sections->initrds[n]->Name);
+	}
+	if (fdt_section) {
+		measure_section(digests, size, fdt_section->Name);
+	}
+	if (sections->cmdline) {
+		measure_section(digests, size, sections->cmdline->Name);
+	}
+}
+
+/*
+ * The kernel can run from its section if that is writable and executable,
+ * spans the kernel's SizeOfImage and happens to be loaded at an address
+ * aligned to the kernel's SectionAlignment. bg_gen_unified_kernel emits
+ * such a section with --kernel-in-place.
+ */
+static BOOLEAN kernel_runs_in_place(const SECTION *kernel_section,
+				    const VOID *kernel_source)
+{
+	const PE_HEADER *pe_header = get_pe_header(kernel_source);
+	UINT32 chars = kernel_section->Characteristics;
+
+	return (chars & IMAGE_SCN_MEM_EXECUTE) &&
+		(chars & IMAGE_SCN_MEM_WRITE) &&
+		kernel_section->VirtualSize >= pe_header->Opt.SizeOfImage &&
+		kernel_section->SizeOfRawData <= pe_header->Opt.SizeOfImage &&
+		align_addr((uintptr_t) kernel_source,
+			   pe_header->Opt.SectionAlignment) ==
+			(uintptr_t) kernel_source;
+}
+
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 {
-	const SECTION *cmdline_section = NULL;
-	const SECTION *kernel_section = NULL;
-	const SECTION *initrd_section = NULL;
+	STUB_SECTIONS sections;
+	const SECTION *kernel_section, *fdt_section = NULL;
 	EFI_HANDLE kernel_handle = NULL;
-	BOOLEAN has_dtbs = FALSE;
+	BOOLEAN has_dtbs;
 	const VOID *kernel_source;
-	EFI_PHYSICAL_ADDRESS kernel_buffer;
+	EFI_PHYSICAL_ADDRESS kernel_buffer = 0;
 	EFI_PHYSICAL_ADDRESS aligned_kernel_buffer;
 	const CHAR8 *fdt_compatible;
 	VOID *fdt, *alt_fdt = NULL;
 	EFI_IMAGE_ENTRY_POINT kernel_entry;
 	EFI_LOADED_IMAGE *stub_image;
 	const PE_HEADER *pe_header;
-	const SECTION *section;
 	EFI_STATUS status, cleanup_status;
-	UINTN n, kernel_pages;
+	UINTN n, kernel_size, kernel_pages = 0;
 	BG_INTERFACE_PARAMS bg_interface_params;
+	UINT16 *boot_medium_uuidstr;
+	VOID *cmdline_buffer = NULL;
 
 	this_image = image_handle;
 	InitializeLib(image_handle, system_table);
@@ -137,40 +267,96 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	}
 
 	pe_header = get_pe_header(stub_image->ImageBase);
-	for (n = 0, section = get_sections(pe_header);
-	     n < pe_header->Coff.NumberOfSections;
-	     n++, section++) {
-		if (CompareMem(section->Name, ".cmdline", 8) == 0) {
-			cmdline_section = section;
-		} else if (CompareMem(section->Name, ".kernel", 8) == 0) {
-			kernel_section = section;
-		} else if (CompareMem(section->Name, ".initrd", 8) == 0) {
-			initrd_section = section;
-		} else if (CompareMem(section->Name, ".dtb-", 5) == 0) {
-			has_dtbs = TRUE;
-			fdt = (UINT8 *) stub_image->ImageBase +
-				section->VirtualAddress;
-			if (match_fdt(fdt, fdt_compatible)) {
-				alt_fdt = fdt;
-			}
+	classify_sections(pe_header, &sections);
+	kernel_section = sections.kernel;
+	has_dtbs = sections.num_dtbs > 0;
+
+	/* in section order, which the generator keeps */
+	for (n = 0; n < sections.num_initrds; n++) {
+		add_initrd((UINT8 *) stub_image->ImageBase +
+			   sections.initrds[n]->VirtualAddress,
+			   sections.initrds[n]->VirtualSize);
+	}
+
+	if (has_dtbs && sections.dtb_index) {
+		alt_fdt = (VOID *) lookup_fdt_index(
+			(UINT8 *) stub_image->ImageBase +
+			sections.dtb_index->VirtualAddress,
+			sections.dtb_index->VirtualSize,
+			stub_image->ImageBase, stub_image->ImageSize,
+			fdt_compatible);
+	}
+	/*
+	 * No index or no hit, fall back to checking each device tree. The
+	 * last matching one wins, so search backwards.
+	 */
+	for (n = sections.num_dtbs; !alt_fdt && n > 0; n--) {
+		fdt = (UINT8 *) stub_image->ImageBase +
+			sections.dtbs[n - 1]->VirtualAddress;
+		if (match_fdt(fdt, fdt_compatible)) {
+			alt_fdt = fdt;
+			fdt_section = sections.dtbs[n - 1];
+		}
+	}
+	/* the index must refer to one of the device trees */
+	for (n = 0; alt_fdt && !fdt_section && n < sections.num_dtbs; n++) {
+		if ((UINT8 *) stub_image->ImageBase +
+		    sections.dtbs[n]->VirtualAddress == alt_fdt) {
+			fdt_section = sections.dtbs[n];
 		}
 	}
+	if (alt_fdt && !fdt_section) {
+		error_exit(L"Invalid .dtbidx section", EFI_INVALID_PARAMETER);
+	}
+	FreePool(sections.dtbs);
 
 	if (!kernel_section) {
 		error_exit(L"Missing .kernel section", EFI_NOT_FOUND);
 	}
+	/* only what is both in the file and in the loaded section is kernel */
+	kernel_size = kernel_section->SizeOfRawData;
+	if (kernel_size > kernel_section->VirtualSize) {
+		kernel_size = kernel_section->VirtualSize;
+	}
+	if (kernel_section->VirtualAddress > stub_image->ImageSize ||
+	    kernel_size >
+	    stub_image->ImageSize - kernel_section->VirtualAddress) {
+		error_exit(L"Invalid .kernel section", EFI_LOAD_ERROR);
+	}
+
+	measure_sections(&sections, fdt_section, stub_image->ImageBase);
+
+	boot_medium_uuidstr = disk_get_part_uuid(stub_image->DeviceHandle);
 
-	if (cmdline_section) {
+	if (sections.cmdline) {
 		kernel_image.LoadOptions = (UINT8 *) stub_image->ImageBase +
-			cmdline_section->VirtualAddress;
-		kernel_image.LoadOptionsSize = cmdline_section->VirtualSize;
+			sections.cmdline->VirtualAddress;
+		kernel_image.LoadOptionsSize = sections.cmdline->VirtualSize;
+		/* placeholders are replaced in a copy of the signed one */
+		cmdline_buffer = expand_cmdline(kernel_image.LoadOptions,
+						&kernel_image.LoadOptionsSize,
+						boot_medium_uuidstr);
+		if (cmdline_buffer) {
+			kernel_image.LoadOptions = cmdline_buffer;
+		}
 	}
 
-	if (initrd_section) {
-		install_initrd_loader(
-			(UINT8 *) stub_image->ImageBase +
-			initrd_section->VirtualAddress,
-			initrd_section->VirtualSize);
+	install_initrd_loader();
+
+	kernel_source = (UINT8 *) stub_image->ImageBase +
+		kernel_section->VirtualAddress;
+
+	pe_header = get_pe_header(kernel_source);
+	if (kernel_size > pe_header->Opt.SizeOfImage) {
+		status = EFI_LOAD_ERROR;
+		error(L"Kernel image exceeds its SizeOfImage", status);
+		goto cleanup_initrd;
+	}
+
+	if (kernel_runs_in_place(kernel_section, kernel_source)) {
+		kernel_image.ImageBase = (VOID *) kernel_source;
+		kernel_image.ImageSize = kernel_size;
+		goto clear_bss;
 	}
 
 	/*
@@ -182,11 +368,6 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	 * the kernels SectionAlignment. As SectionAlignment may be larger than
 	 * the page size, over-allocate in order to adjust the base as needed.
 	 */
-	kernel_source = (UINT8 *) stub_image->ImageBase +
-		kernel_section->VirtualAddress;
-
-	pe_header = get_pe_header(kernel_source);
-
 	kernel_pages = EFI_SIZE_TO_PAGES(pe_header->Opt.SizeOfImage +
 					 pe_header->Opt.SectionAlignment);
 	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
@@ -204,9 +385,10 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	}
 
 	kernel_image.ImageBase = (VOID *) (uintptr_t) aligned_kernel_buffer;
-	kernel_image.ImageSize = kernel_section->VirtualSize;
+	kernel_image.ImageSize = kernel_size;
 
 	CopyMem(kernel_image.ImageBase, (VOID*)kernel_source, kernel_image.ImageSize);
+clear_bss:
 	/* Clear the rest so that .bss is definitely zero. */
 	SetMem((UINT8 *) kernel_image.ImageBase + kernel_image.ImageSize,
 	       pe_header->Opt.SizeOfImage - kernel_image.ImageSize, 0);
@@ -232,19 +414,28 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 		info(L"Using firmware-provided device tree");
 	}
 
-	UINT16 *boot_medium_uuidstr =
-		disk_get_part_uuid(stub_image->DeviceHandle);
 	bg_interface_params.loader_device_part_uuid = boot_medium_uuidstr;
+	bg_interface_params.keep_loader_device_part_uuid = TRUE;
+	/* the stub does not measure its own phases */
+	bg_interface_params.time_init_usec = 0;
+	bg_interface_params.time_exec_usec = 0;
+	bg_interface_params.phase_times = NULL;
+	/* only Boot Guard itself knows the config partition */
+	bg_interface_params.has_config = FALSE;
 	status = set_bg_interface_vars(&bg_interface_params);
 	if (EFI_ERROR(status)) {
 		error(L"could not set interface vars", status);
 	}
-	FreePool(boot_medium_uuidstr);
 
 	kernel_entry = (EFI_IMAGE_ENTRY_POINT)
 		((UINT8 *) kernel_image.ImageBase +
 		 pe_header->Opt.AddressOfEntryPoint);
 
+	status = commit_bg_interface_vars();
+	if (EFI_ERROR(status)) {
+		error(L"could not set interface vars", status);
+	}
+
 	status = kernel_entry(kernel_handle, system_table);
 
 cleanup_protocols:
@@ -258,9 +449,17 @@ cleanup_protocols:
 		}
 	}
 cleanup_buffer:
-	BS->FreePages(kernel_buffer, kernel_pages);
+	if (kernel_pages > 0) {
+		BS->FreePages(kernel_buffer, kernel_pages);
+	}
 cleanup_initrd:
 	uninstall_initrd_loader();
+	if (cmdline_buffer) {
+		FreePool(cmdline_buffer);
+	}
+	if (boot_medium_uuidstr) {
+		FreePool(boot_medium_uuidstr);
+	}
 
 	return status;
 }
@@ -0,0 +1,154 @@
+/*
+ * EFI Boot Guard, unified kernel stub
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "kernel-stub.h"
+
+/*
+ * Digests of the sections added by bg_gen_unified_kernel --section-digests.
+ * The firmware measures or verifies the whole image before starting the
+ * stub, so these are as trustworthy as the image itself and the used
+ * sections do not need to be hashed again.
+ */
+#define SECTION_DIGESTS_MAGIC	"SECTDGST"
+#define TPM_ALG_SHA256		0x000b
+
+/* where unified kernel stubs commonly measure their sections */
+#define SECTION_DIGESTS_PCR	11
+
+typedef struct {
+	CHAR8 Name[8];
+	UINT8 Digest[32];
+} __attribute__((packed)) SECTION_DIGEST;
+
+typedef struct {
+	CHAR8 Magic[8];
+	UINT32 NumEntries;
+	UINT32 Algorithm;
+	SECTION_DIGEST Entries[];
+} __attribute__((packed)) SECTION_DIGESTS;
+
+#ifndef EfiTcg2Protocol
+static EFI_GUID gEfiTcg2Protocol = {
+	0x607f766c, 0x7455, 0x42be,
+	{0x93, 0x0b, 0xe4, 0xd7, 0x6d, 0xb2, 0x72, 0x0f}
+};
+#define EfiTcg2Protocol gEfiTcg2Protocol
+
+#define EV_IPL			0x0000000d
+#define EFI_TCG2_EVENT_HEADER_VERSION	1
+
+typedef struct {
+	UINT32 HeaderSize;
+	UINT16 HeaderVersion;
+	UINT32 PCRIndex;
+	UINT32 EventType;
+} __attribute__((packed)) EFI_TCG2_EVENT_HEADER;
+
+typedef struct {
+	UINT32 Size;
+	EFI_TCG2_EVENT_HEADER Header;
+	UINT8 Event[];
+} __attribute__((packed)) EFI_TCG2_EVENT;
+
+typedef struct _EFI_TCG2_PROTOCOL EFI_TCG2_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_TCG2_HASH_LOG_EXTEND_EVENT)(
+	EFI_TCG2_PROTOCOL *This, UINT64 Flags,
+	EFI_PHYSICAL_ADDRESS DataToHash, UINT64 DataToHashLen,
+	EFI_TCG2_EVENT *EfiTcgEvent);
+
+/* only the member used here is typed */
+struct _EFI_TCG2_PROTOCOL {
+	VOID *GetCapability;
+	VOID *GetEventLog;
+	EFI_TCG2_HASH_LOG_EXTEND_EVENT HashLogExtendEvent;
+	VOID *SubmitCommand;
+	VOID *GetActivePcrBanks;
+	VOID *SetActivePcrBanks;
+	VOID *GetResultOfSetActivePcrBanks;
+};
+#endif
+
+typedef struct {
+	EFI_TCG2_EVENT Tcg;
+	CHAR8 Name[8];
+} __attribute__((packed)) SECTION_EVENT;
+
+static EFI_TCG2_PROTOCOL *tcg2;
+static BOOLEAN tcg2_located;
+
+static const SECTION_DIGEST *find_digest(const VOID *digests,
+					 UINTN digests_size,
+					 const CHAR8 *name)
+{
+	const SECTION_DIGESTS *header = digests;
+	UINT32 n;
+
+	if (digests_size < sizeof(*header) ||
+	    CompareMem(header->Magic, SECTION_DIGESTS_MAGIC,
+		       sizeof(header->Magic)) != 0 ||
+	    header->Algorithm != TPM_ALG_SHA256 ||
+	    header->NumEntries > (digests_size - sizeof(*header)) /
+				 sizeof(SECTION_DIGEST)) {
+		error_exit(L"Invalid .digests section", EFI_INVALID_PARAMETER);
+	}
+
+	for (n = 0; n < header->NumEntries; n++) {
+		if (CompareMem(header->Entries[n].Name, name, 8) == 0) {
+			return &header->Entries[n];
+		}
+	}
+	/* a used section without digest would go unmeasured */
+	error_exit(L"Section missing in .digests", EFI_NOT_FOUND);
+}
+
+VOID measure_section(const VOID *digests, UINTN digests_size,
+		     const CHAR8 *name)
+{
+	const SECTION_DIGEST *digest;
+	SECTION_EVENT event;
+	EFI_STATUS status;
+
+	if (!tcg2_located) {
+		tcg2_located = TRUE;
+		status = LibLocateProtocol(&EfiTcg2Protocol, (VOID **)&tcg2);
+		if (EFI_ERROR(status)) {
+			tcg2 = NULL;
+		}
+	}
+	if (!tcg2) {
+		return;
+	}
+
+	digest = find_digest(digests, digests_size, name);
+
+	/*
+	 * Extend the PCR with the digest entry, i.e. the section name along
+	 * with the digest of its data. That only hashes 40 bytes and is as
+	 * deterministic as measuring the data itself.
+	 */
+	event.Tcg.Size = sizeof(event);
+	event.Tcg.Header.HeaderSize = sizeof(event.Tcg.Header);
+	event.Tcg.Header.HeaderVersion = EFI_TCG2_EVENT_HEADER_VERSION;
+	event.Tcg.Header.PCRIndex = SECTION_DIGESTS_PCR;
+	event.Tcg.Header.EventType = EV_IPL;
+	CopyMem(event.Name, (VOID *) name, sizeof(event.Name));
+
+	status = tcg2->HashLogExtendEvent(tcg2, 0,
+					  (uintptr_t) digest, sizeof(*digest),
+					  &event.Tcg);
+	if (EFI_ERROR(status)) {
+		error(L"Error measuring section", status);
+	}
+}
@@ -22,22 +22,182 @@ EFI_GUID vendor_guid = {0x4a67b082,
 			0x41cf,
 			{0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f}};
 
+#define MAX_STAGED_VARS 8
+
+/* Interface variables are collected and only written on
+ * commit_bg_interface_vars(), as NVRAM writes are costly. */
+typedef struct {
+	CHAR16 *name;
+	VOID *data;
+	UINTN size;
+	/* not written if a previous stage loader set the variable, which
+	 * it did as a volatile one */
+	BOOLEAN keep_existing;
+	/* failing to write it fails the commit */
+	BOOLEAN required;
+} STAGED_VAR;
+
+static STAGED_VAR staged_vars[MAX_STAGED_VARS];
+static UINTN staged_count;
+
+static EFI_STATUS stage_var(CHAR16 *name, const VOID *data, UINTN size,
+			    BOOLEAN keep_existing, BOOLEAN required)
+{
+	STAGED_VAR *var = NULL;
+
+	for (UINTN i = 0; i < staged_count; i++) {
+		if (StrCmp(staged_vars[i].name, name) == 0) {
+			var = &staged_vars[i];
+			FreePool(var->data);
+			break;
+		}
+	}
+	if (!var) {
+		if (staged_count == MAX_STAGED_VARS) {
+			return EFI_OUT_OF_RESOURCES;
+		}
+		var = &staged_vars[staged_count++];
+		var->name = name;
+	}
+	var->keep_existing = keep_existing;
+	var->required = required;
+	var->size = size;
+	var->data = AllocatePool(size);
+	if (!var->data) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	CopyMem(var->data, data, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS stage_str_var(CHAR16 *name, CHAR16 *value,
+				BOOLEAN required)
+{
+	return stage_var(name, value, (StrLen(value) + 1) * sizeof(CHAR16),
+			 FALSE, required);
+}
+
+static VOID stage_uint_var(CHAR16 *name, UINT64 value)
+{
+	CHAR16 buffer[24];
+
+	SPrint(buffer, sizeof(buffer), L"%ld", value);
+	(VOID) stage_str_var(name, buffer, FALSE);
+}
+
+static VOID stage_usec_var(CHAR16 *name, UINT64 usec)
+{
+	if (usec) {
+		stage_uint_var(name, usec);
+	}
+}
+
+/* Timing data is informational, thus failing to export it does not fail
+ * the boot. */
+static VOID stage_time_vars(const BG_INTERFACE_PARAMS *params)
+{
+	// keep the timestamps of a previous stage loader
+	UINTN readsize = 0;
+	if (RT->GetVariable(L"LoaderTimeInitUSec", &vendor_guid, NULL,
+			    &readsize, NULL) == EFI_NOT_FOUND) {
+		stage_usec_var(L"LoaderTimeInitUSec", params->time_init_usec);
+		stage_usec_var(L"LoaderTimeExecUSec", params->time_exec_usec);
+	}
+	if (params->phase_times) {
+		(VOID) stage_str_var(L"BootGuardPhaseTimesUSec",
+				     params->phase_times, FALSE);
+	}
+}
+
 EFI_STATUS set_bg_interface_vars(const BG_INTERFACE_PARAMS *params)
+{
+	EFI_STATUS status = EFI_SUCCESS;
+
+	if (params->loader_device_part_uuid) {
+		status = stage_var(L"LoaderDevicePartUUID",
+				   params->loader_device_part_uuid,
+				   StrLen(params->loader_device_part_uuid) *
+					   sizeof(UINT16),
+				   params->keep_loader_device_part_uuid, TRUE);
+	}
+	stage_time_vars(params);
+	/* informational as well, but the unified kernel stub may insert
+	 * them into the kernel command line */
+	if (params->has_config) {
+		stage_uint_var(L"BootGuardConfigIndex", params->config_index);
+		stage_uint_var(L"BootGuardConfigRevision",
+			       params->config_revision);
+	}
+	return status;
+}
+
+/* Checks whether the variable exists, whether it is non-volatile and
+ * whether it already holds the staged value. Variables whose attributes
+ * cannot be read count as non-volatile. */
+static BOOLEAN var_unchanged(const STAGED_VAR *var, BOOLEAN *exists,
+			     BOOLEAN *persistent)
+{
+	EFI_STATUS status;
+	BOOLEAN same;
+	UINT32 attributes = 0;
+	UINTN size = 0;
+	VOID *data;
+
+	status = RT->GetVariable(var->name, &vendor_guid, NULL, &size, NULL);
+	*exists = status != EFI_NOT_FOUND;
+	*persistent = *exists;
+	if (status != EFI_BUFFER_TOO_SMALL) {
+		return FALSE;
+	}
+	data = AllocatePool(size);
+	if (!data) {
+		return FALSE;
+	}
+	status = RT->GetVariable(var->name, &vendor_guid, &attributes, &size,
+				 data);
+	if (!EFI_ERROR(status)) {
+		*persistent = (attributes & EFI_VARIABLE_NON_VOLATILE) != 0;
+	}
+	same = !EFI_ERROR(status) && !*persistent && size == var->size &&
+	       CompareMem(data, var->data, size) == 0;
+	FreePool(data);
+	return same;
+}
+
+EFI_STATUS commit_bg_interface_vars(VOID)
 {
 	EFI_STATUS status = EFI_SUCCESS;
 	UINT32 attribs =
 		EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
 
-	// only set this if not set by a previous stage loader
-	UINTN readsize = 0;
-	if (RT->GetVariable(L"LoaderDevicePartUUID", &vendor_guid, NULL,
-			    &readsize, NULL) == EFI_NOT_FOUND) {
-		status = RT->SetVariable(
-			L"LoaderDevicePartUUID", &vendor_guid, attribs,
-			StrLen(params->loader_device_part_uuid) *
-				sizeof(UINT16),
-			params->loader_device_part_uuid);
+	for (UINTN i = 0; i < staged_count; i++) {
+		STAGED_VAR *var = &staged_vars[i];
+		EFI_STATUS err = EFI_OUT_OF_RESOURCES;
+		BOOLEAN exists, persistent;
+
+		if (var->data) {
+			err = EFI_SUCCESS;
+			if (!var_unchanged(var, &exists, &persistent) &&
+			    !(var->keep_existing && exists && !persistent)) {
+				/* planted from the OS, and the attributes of
+				 * an existing variable cannot be changed */
+				if (persistent) {
+					(VOID) RT->SetVariable(var->name,
+							       &vendor_guid,
+							       0, 0, NULL);
+				}
+				err = RT->SetVariable(var->name, &vendor_guid,
+						      attribs, var->size,
+						      var->data);
+			}
+			FreePool(var->data);
+			var->data = NULL;
+		}
+		if (EFI_ERROR(err) && var->required && !EFI_ERROR(status)) {
+			status = err;
+		}
 	}
+	staged_count = 0;
 	return status;
 }
 
@@ -23,103 +23,26 @@
 #include "version.h"
 #include "utils.h"
 #include "loader_interface.h"
-
-extern const unsigned long wdfuncs_start[];
-extern const unsigned long wdfuncs_end[];
-extern CHAR16 *boot_medium_path;
-
-#define PCI_GET_VENDOR_ID(id)	(UINT16)(id)
-#define PCI_GET_PRODUCT_ID(id)	(UINT16)((id) >> 16)
-
-
-static EFI_STATUS probe_watchdogs(UINTN timeout)
-{
-	if (wdfuncs_end - wdfuncs_start - 1 == 0) {
-		if (timeout > 0) {
-			ERROR(L"No watchdog drivers registered, but timeout is non-zero.\n");
-			return EFI_UNSUPPORTED;
-		}
-		return EFI_SUCCESS;
-	}
-	if (timeout == 0) {
-		WARNING(L"Watchdog is disabled.\n");
-		return EFI_SUCCESS;
-	}
-
-	UINTN handle_count = 0;
-	EFI_HANDLE *handle_buffer = NULL;
-	EFI_STATUS status = BS->LocateHandleBuffer(ByProtocol, &PciIoProtocol,
-						   NULL, &handle_count,
-						   &handle_buffer);
-	if (EFI_ERROR(status) || (handle_count == 0)) {
-		ERROR(L"No PCI I/O Protocol handles found.\n");
-		if (handle_buffer) {
-			FreePool(handle_buffer);
-		}
-		return EFI_UNSUPPORTED;
-	}
-
-	EFI_PCI_IO_PROTOCOL *pci_io;
-	UINT32 value;
-	for (UINTN index = 0; index < handle_count; index++) {
-		status = BS->OpenProtocol(handle_buffer[index], &PciIoProtocol,
-					  (VOID **)&pci_io, this_image, NULL,
-					  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
-		if (EFI_ERROR(status)) {
-			ERROR(L"Cannot not open PciIoProtocol: %r\n", status);
-			FreePool(handle_buffer);
-			return status;
-		}
-
-		status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32,
-					  PCI_VENDOR_ID, 1, &value);
-		if (EFI_ERROR(status)) {
-			WARNING(
-			    L"Cannot not read from PCI device, skipping: %r\n",
-			    status);
-			(VOID) BS->CloseProtocol(handle_buffer[index],
-						 &PciIoProtocol, this_image,
-						 NULL);
-			continue;
-		}
-
-		const unsigned long *entry = wdfuncs_start;
-		for (entry++; entry < wdfuncs_end; entry++) {
-			WATCHDOG_PROBE probe = (WATCHDOG_PROBE) *entry;
-			if ((status = probe(pci_io, PCI_GET_VENDOR_ID(value),
-					    PCI_GET_PRODUCT_ID(value),
-					    timeout)) == EFI_SUCCESS) {
-				break;
-			}
-		}
-
-		(VOID) BS->CloseProtocol(handle_buffer[index], &PciIoProtocol,
-					 this_image, NULL);
-
-		if (status == EFI_SUCCESS) {
-			break;
-		}
-	}
-	FreePool(handle_buffer);
-
-	return status;
-}
+#include "boottime.h"
+#include "watchdog.h"
 
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 {
 	EFI_DEVICE_PATH *payload_dev_path;
 	EFI_LOADED_IMAGE *loaded_image;
 	EFI_HANDLE payload_handle;
+	VOID *payload_buffer;
+	UINTN payload_size;
 	EFI_STATUS status;
 	BG_STATUS bg_status;
 	BG_LOADER_PARAMS bg_loader_params;
 	BG_INTERFACE_PARAMS bg_interface_params;
-	CHAR16 *tmp;
 
 	ZeroMem(&bg_loader_params, sizeof(bg_loader_params));
 
 	this_image = image_handle;
 	InitializeLib(this_image, system_table);
+	boottime_init();
 
 #if !defined(SILENT_BOOT)
 	(VOID) ST->ConOut->ClearScreen(ST->ConOut);
@@ -134,15 +57,20 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 			   status);
 	}
 
-	tmp = DevicePathToStr(DevicePathFromHandle(loaded_image->DeviceHandle));
-	boot_medium_path = GetBootMediumPath(tmp);
+	SetBootMedium(DevicePathFromHandle(loaded_image->DeviceHandle));
+#if !defined(SILENT_BOOT)
+	CHAR16 *tmp = DevicePathToStr(boot_medium_devpath);
+	CHAR16 *boot_medium_path = GetBootMediumPath(tmp);
 	FreePool(tmp);
 	INFO(L"Boot medium: %s\n", boot_medium_path);
+	FreePool(boot_medium_path);
+#endif
 
 	status = get_volumes(&volumes, &volume_count);
 	if (EFI_ERROR(status)) {
 		error_exit(L"Cannot get volumes installed on system", status);
 	}
+	boottime_mark(BG_PHASE_GET_VOLUMES);
 
 	INFO(L"Loading configuration...\n");
 
@@ -162,6 +90,10 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 				   EFI_ABORTED);
 		}
 	}
+	boottime_mark(BG_PHASE_LOAD_CONFIG);
+#if !defined(SILENT_BOOT)
+	quiet_boot = bg_loader_params.fast_boot;
+#endif
 
 	payload_dev_path = FileDevicePathFromConfig(
 	    loaded_image->DeviceHandle, bg_loader_params.payload_path);
@@ -174,31 +106,67 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	if (EFI_ERROR(status)) {
 		WARNING(L"Cannot close volumes.\n", status);
 	}
+	boottime_mark(BG_PHASE_DEVICE_PATH);
 
-	status = probe_watchdogs(bg_loader_params.timeout);
+	start_watchdog_probe(bg_loader_params.timeout);
+
+	/* Read the kernel while the watchdog is probed, LoadImage() reads it
+	 * on its own if that fails */
+	status = prefetch_file(payload_dev_path, &payload_buffer,
+			       &payload_size);
 	if (EFI_ERROR(status)) {
-		error_exit(L"Cannot probe watchdog", status);
+		WARNING(L"Cannot prefetch kernel image (%r).\n", status);
+		payload_buffer = NULL;
+		payload_size = 0;
 	}
 
 	/* Load and start image */
-	status = BS->LoadImage(TRUE, this_image, payload_dev_path, NULL, 0,
-			       &payload_handle);
+	status = BS->LoadImage(TRUE, this_image, payload_dev_path,
+			       payload_buffer, payload_size, &payload_handle);
+	if (payload_buffer) {
+		FreePool(payload_buffer);
+	}
 	if (EFI_ERROR(status)) {
+		(VOID) finish_watchdog_probe();
 		error_exit(L"Cannot load specified kernel image", status);
 	}
+	boottime_mark(BG_PHASE_LOAD_IMAGE);
+
+	status = finish_watchdog_probe();
+	if (EFI_ERROR(status)) {
+		(VOID) BS->UnloadImage(payload_handle);
+		error_exit(L"Cannot probe watchdog", status);
+	}
+	boottime_mark(BG_PHASE_WATCHDOG);
 
 	UINT16 *boot_medium_uuidstr =
 		disk_get_part_uuid(loaded_image->DeviceHandle);
 	bg_interface_params.loader_device_part_uuid = boot_medium_uuidstr;
+	bg_interface_params.keep_loader_device_part_uuid = FALSE;
+	bg_interface_params.time_init_usec = 0;
+	bg_interface_params.time_exec_usec = 0;
+	if (boottime_since_reset()) {
+		bg_interface_params.time_init_usec =
+			boottime_usec(BG_PHASE_INIT);
+		bg_interface_params.time_exec_usec = boottime_now();
+	}
+	bg_interface_params.phase_times = boottime_phases_str();
+	bg_interface_params.has_config = TRUE;
+	bg_interface_params.config_index = bg_loader_params.config_index;
+	bg_interface_params.config_revision = bg_loader_params.config_revision;
 	status = set_bg_interface_vars(&bg_interface_params);
 	if (EFI_ERROR(status)) {
 		error_exit(L"Cannot set bootloader interface variables",
 			   status);
 	}
 	INFO(L"LoaderDevicePartUUID=%s\n", boot_medium_uuidstr);
+	if (bg_interface_params.phase_times) {
+		INFO(L"Boot phases (usec): %s\n",
+		     bg_interface_params.phase_times);
+		FreePool(bg_interface_params.phase_times);
+	}
 	FreePool(boot_medium_uuidstr);
 	FreePool(payload_dev_path);
-	FreePool(boot_medium_path);
 
 	status = BS->OpenProtocol(payload_handle, &LoadedImageProtocol,
 				  (VOID **)&loaded_image, this_image,
@@ -215,7 +183,16 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	INFO(L"Starting %s with watchdog set to %d seconds ...\n",
 	     bg_loader_params.payload_path, bg_loader_params.timeout);
 
-	BS->Stall(1000 * 1000 * ENV_BOOT_DELAY);
+	if (bg_loader_params.boot_delay > 0) {
+		BS->Stall(1000 * 1000 * bg_loader_params.boot_delay);
+	}
+
+	status = commit_bg_interface_vars();
+	if (EFI_ERROR(status)) {
+		(VOID) BS->UnloadImage(payload_handle);
+		error_exit(L"Cannot set bootloader interface variables",
+			   status);
+	}
 
 	return BS->StartImage(payload_handle, NULL, NULL);
 }
@@ -0,0 +1,130 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include "bg_envtools.h"
+#include "bg_envcheck.h"
+
+static char tool_doc[] =
+	"bg_envcheck - Integrity check for the EFI Boot Guard environments\v"
+	"Prints one line of key=value pairs per config partition. Exits with "
+	"0 if all environments are fine, 2 if problems are left and 1 on "
+	"errors.";
+
+static struct argp_option options_envcheck[] = {
+	OPT("repair", 'r', 0, 0,
+	    "Overwrite invalid environments with a copy of the latest one if "
+	    "that is confirmed"),
+	OPT("all", 'A', 0, 0,
+	    "search on all devices instead of root device only"),
+	OPT("verbose", 'v', 0, 0, "Be verbose"),
+	OPT("version", 'V', 0, 0, "Print version"),
+	{0},
+};
+
+struct arguments_envcheck {
+	struct arguments_common common;
+	bool repair;
+};
+
+static const char *statusmap[] = {
+	[BGENV_CHECK_UNKNOWN] = "unknown",
+	[BGENV_CHECK_OK] = "ok",
+	[BGENV_CHECK_UNREADABLE] = "unreadable",
+	[BGENV_CHECK_CRC] = "crc",
+	[BGENV_CHECK_USERVARS] = "uservars",
+};
+
+static error_t parse_envcheck_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments_envcheck *arguments = state->input;
+
+	switch (key) {
+	case 'r':
+		arguments->repair = true;
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		break;
+	default:
+		return parse_common_opt(key, arg, false, &arguments->common);
+	}
+	return 0;
+}
+
+static void print_result(int index, const BGENV_CHECK *result)
+{
+	const char *devpath = NULL;
+	BGENV *env;
+
+	env = bgenv_open_by_index(index);
+	if (env) {
+		devpath = ((CONFIG_PART *)env->desc)->devpath;
+	}
+	fprintf(stdout, "partition=%d device=%s status=%s", index,
+		devpath ? devpath : "none", statusmap[result->status]);
+	if (result->status == BGENV_CHECK_OK) {
+		fprintf(stdout, " revision=%u ustate=%s duplicate=%d gap=%d",
+			result->revision, ustate2str(result->ustate),
+			result->duplicate, result->gap);
+	}
+	fprintf(stdout, " repaired=%d\n", result->repaired);
+	bgenv_close(env);
+}
+
+/* This is the entrypoint for the command bg_envcheck. */
+error_t bg_envcheck(int argc, char **argv)
+{
+	struct argp argp_envcheck = {
+		.options = options_envcheck,
+		.parser = parse_envcheck_opt,
+		.doc = tool_doc,
+	};
+	struct arguments_envcheck arguments = {0};
+	BGENV_CHECK results[ENV_NUM_CONFIG_PARTS];
+	error_t e;
+	int problems;
+
+	e = argp_parse(&argp_envcheck, argc, argv, 0, 0, &arguments);
+	if (e) {
+		return e;
+	}
+
+	/* statuses are only known for environments read by this process */
+	ebg_set_opt_bool(EBG_OPT_USE_DAEMON, false);
+	ebg_set_opt_bool(EBG_OPT_PROBE_CACHE, true);
+	ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, true);
+	if (arguments.common.search_all_devices) {
+		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, true);
+	}
+	if (arguments.common.verbosity) {
+		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
+	}
+	/* keeps the device paths beyond bgenv_check() */
+	if (!bgenv_init()) {
+		fprintf(stderr, "Error initializing FAT environment.\n");
+		return 1;
+	}
+
+	problems = bgenv_check(results, arguments.repair);
+	if (problems < 0) {
+		fprintf(stderr, "Error checking environments: %s\n",
+			strerror(-problems));
+		bgenv_finalize();
+		return 1;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		print_result(i, &results[i]);
+	}
+
+	bgenv_finalize();
+	return problems ? 2 : 0;
+}
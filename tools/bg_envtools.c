@@ -13,8 +13,11 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "env_config_file.h"
+#include "uservars.h"
 #include "version.h"
 
 #include "bg_envtools.h"
@@ -136,36 +139,132 @@ error_t parse_common_opt(int key, char *arg, bool compat_mode,
 	return 0;
 }
 
-bool get_env(char *configfilepath, BG_ENVDATA *data)
+/* Like validate_envdata(), but leaves invalid data untouched */
+static bool check_envdata(BG_ENVDATA *data)
 {
-	FILE *config;
-	bool result = true;
-
-	if (!(config = open_config_file(configfilepath, "rb"))) {
+	if (data->kernelfile[ENV_STRING_LENGTH - 1] != 0 ||
+	    data->kernelparams[ENV_STRING_LENGTH - 1] != 0) {
+		VERBOSE(stderr, "Unterminated strings in environment!\n");
+		return false;
+	}
+	if (data->crc32 != bgenv_crc32(0, data, sizeof(BG_ENVDATA) -
+						 sizeof(data->crc32))) {
+		VERBOSE(stderr, "Invalid CRC32!\n");
+		return false;
+	}
+	if (!bgenv_validate_uservars(data->userdata)) {
+		VERBOSE(stderr, "Corrupt uservars!\n");
 		return false;
 	}
+	return true;
+}
 
-	if (!(fread(data, sizeof(BG_ENVDATA), 1, config) == 1)) {
+BG_ENVDATA *map_env(char *configfilepath, bool validate)
+{
+	BG_ENVDATA *data;
+	struct stat st;
+	int fd, err;
+
+	fd = open(configfilepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		VERBOSE(stderr, "Error opening %s: %s\n", configfilepath,
+			strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		goto err_close;
+	}
+	if (st.st_size < (off_t)sizeof(BG_ENVDATA)) {
 		VERBOSE(stderr, "Error reading environment data from %s\n",
 			configfilepath);
-		if (feof(config)) {
-			VERBOSE(stderr, "End of file encountered.\n");
-		}
-		result = false;
+		VERBOSE(stderr, "End of file encountered.\n");
+		close(fd);
+		errno = EINVAL;
+		return NULL;
 	}
 
-	if (fclose(config)) {
-		VERBOSE(stderr,
-			"Error closing environment file after reading.\n");
-	};
+	/* A private mapping avoids any chance of modifying the file. */
+	data = mmap(NULL, sizeof(BG_ENVDATA), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		goto err_close;
+	}
+	close(fd);
 
-	if (result == false) {
+	if (validate && !check_envdata(data)) {
+		munmap(data, sizeof(BG_ENVDATA));
+		errno = EINVAL;
+		return NULL;
+	}
+	return data;
+
+err_close:
+	err = errno;
+	VERBOSE(stderr, "Error mapping %s: %s\n", configfilepath,
+		strerror(err));
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+void unmap_env(BG_ENVDATA *data)
+{
+	munmap(data, sizeof(BG_ENVDATA));
+}
+
+bool get_env(char *configfilepath, BG_ENVDATA *data)
+{
+	BG_ENVDATA *mapped;
+
+	mapped = map_env(configfilepath, true);
+	if (!mapped) {
 		return false;
 	}
+	memcpy(data, mapped, sizeof(BG_ENVDATA));
+	unmap_env(mapped);
+
+	return true;
+}
 
-	/* enforce NULL-termination of strings */
-	data->kernelfile[ENV_STRING_LENGTH - 1] = 0;
-	data->kernelparams[ENV_STRING_LENGTH - 1] = 0;
+bool put_env(char *configfilepath, const BG_ENVDATA *data)
+{
+	char *tmppath;
+	int fd, err;
+
+	/* each output file has its own, names are unique within a run */
+	if (asprintf(&tmppath, "%s.tmp", configfilepath) == -1) {
+		errno = ENOMEM;
+		return false;
+	}
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = errno;
+		free(tmppath);
+		errno = err;
+		return false;
+	}
+	if (write(fd, data, sizeof(BG_ENVDATA)) != sizeof(BG_ENVDATA)) {
+		err = errno ? errno : EIO;
+		goto err_close;
+	}
+	/* the new content has to be on disk before it replaces the old */
+	if (fsync(fd) != 0) {
+		err = errno;
+		goto err_close;
+	}
+	if (close(fd) != 0 || rename(tmppath, configfilepath) != 0) {
+		err = errno;
+		goto err_unlink;
+	}
+	free(tmppath);
+	return true;
 
-	return validate_envdata(data);
+err_close:
+	close(fd);
+err_unlink:
+	(void)unlink(tmppath);
+	free(tmppath);
+	errno = err;
+	return false;
 }
@@ -60,6 +60,18 @@ uint8_t str2ustate(char *str);
 error_t parse_common_opt(int key, char *arg, bool compat_mode,
 			 struct arguments_common *arguments);
 
+/* Reads an environment file. Files with an invalid CRC, corrupt user
+ * variables or kernel file or parameters that are not terminated within
+ * their fields are rejected. */
 bool get_env(char *configfilepath, BG_ENVDATA *data);
 
+/* Replaces an environment file atomically, via a temporary file next to it
+ * that is synced and renamed over the old one. */
+bool put_env(char *configfilepath, const BG_ENVDATA *data);
+
+/* Maps an environment file read-only and private to the caller, checked
+ * like by get_env() if validate is set. */
+BG_ENVDATA *map_env(char *configfilepath, bool validate);
+void unmap_env(BG_ENVDATA *data);
+
 #endif
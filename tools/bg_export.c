@@ -0,0 +1,516 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include "uservars.h"
+
+#include "bg_envtools.h"
+#include "bg_export.h"
+
+#define EXPORT_MAX_DEPTH	8
+
+#define CBOR_UINT	0
+#define CBOR_NINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_FALSE	0xf4
+#define CBOR_TRUE	0xf5
+
+/* Collects the whole document so that it can be written at once. JSON needs
+ * to know whether a separator is due, CBOR the number of map and array items
+ * up front. */
+struct exporter {
+	enum bg_export_format format;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	bool oom;
+	int depth;
+	bool first[EXPORT_MAX_DEPTH];
+	bool after_key;
+};
+
+static void put(struct exporter *ex, const void *data, size_t len)
+{
+	uint8_t *tmp;
+	size_t size;
+
+	if (ex->oom) {
+		return;
+	}
+	if (ex->len + len > ex->size) {
+		size = ex->size ? ex->size : 4096;
+		while (size < ex->len + len) {
+			size *= 2;
+		}
+		tmp = realloc(ex->buf, size);
+		if (!tmp) {
+			ex->oom = true;
+			return;
+		}
+		ex->buf = tmp;
+		ex->size = size;
+	}
+	memcpy(ex->buf + ex->len, data, len);
+	ex->len += len;
+}
+
+static void put_char(struct exporter *ex, char c)
+{
+	put(ex, &c, 1);
+}
+
+static void __attribute__((format(printf, 2, 3)))
+put_printf(struct exporter *ex, const char *fmt, ...)
+{
+	char buffer[64];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	if (len > 0 && (size_t)len < sizeof(buffer)) {
+		put(ex, buffer, len);
+	}
+}
+
+static void cbor_head(struct exporter *ex, uint8_t major, uint64_t arg)
+{
+	uint8_t head[9];
+	size_t len;
+
+	head[0] = major << 5;
+	if (arg < 24) {
+		head[0] |= arg;
+		len = 1;
+	} else if (arg <= UINT8_MAX) {
+		head[0] |= 24;
+		head[1] = arg;
+		len = 2;
+	} else if (arg <= UINT16_MAX) {
+		head[0] |= 25;
+		head[1] = arg >> 8;
+		head[2] = arg;
+		len = 3;
+	} else if (arg <= UINT32_MAX) {
+		head[0] |= 26;
+		for (int i = 0; i < 4; i++) {
+			head[1 + i] = arg >> (24 - 8 * i);
+		}
+		len = 5;
+	} else {
+		head[0] |= 27;
+		for (int i = 0; i < 8; i++) {
+			head[1 + i] = arg >> (56 - 8 * i);
+		}
+		len = 9;
+	}
+	put(ex, head, len);
+}
+
+/* JSON separator before a value or key */
+static void json_next(struct exporter *ex)
+{
+	if (ex->after_key) {
+		ex->after_key = false;
+		return;
+	}
+	if (!ex->first[ex->depth]) {
+		put_char(ex, ',');
+	}
+	ex->first[ex->depth] = false;
+}
+
+static void json_string(struct exporter *ex, const char *str, size_t len)
+{
+	put_char(ex, '"');
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\') {
+			put_char(ex, '\\');
+			put_char(ex, c);
+		} else if (c < 0x20) {
+			put_printf(ex, "\\u%04x", c);
+		} else {
+			put_char(ex, c);
+		}
+	}
+	put_char(ex, '"');
+}
+
+static void begin(struct exporter *ex, uint8_t major, size_t count)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		cbor_head(ex, major, count);
+		return;
+	}
+	json_next(ex);
+	put_char(ex, major == CBOR_MAP ? '{' : '[');
+	/* the document has a fixed nesting depth below the maximum */
+	ex->depth++;
+	ex->first[ex->depth] = true;
+}
+
+static void end(struct exporter *ex, uint8_t major)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		return;
+	}
+	ex->depth--;
+	put_char(ex, major == CBOR_MAP ? '}' : ']');
+}
+
+static void put_key(struct exporter *ex, const char *key)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		cbor_head(ex, CBOR_TEXT, strlen(key));
+		put(ex, key, strlen(key));
+		return;
+	}
+	json_next(ex);
+	json_string(ex, key, strlen(key));
+	put_char(ex, ':');
+	ex->after_key = true;
+}
+
+static void put_text(struct exporter *ex, const char *str, size_t len)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		cbor_head(ex, CBOR_TEXT, len);
+		put(ex, str, len);
+		return;
+	}
+	json_next(ex);
+	json_string(ex, str, len);
+}
+
+static void put_string(struct exporter *ex, const char *str)
+{
+	put_text(ex, str, strlen(str));
+}
+
+static void put_bytes(struct exporter *ex, const uint8_t *data, size_t len)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		cbor_head(ex, CBOR_BYTES, len);
+		put(ex, data, len);
+		return;
+	}
+	/* hex string in JSON */
+	json_next(ex);
+	put_char(ex, '"');
+	for (size_t i = 0; i < len; i++) {
+		put_printf(ex, "%02x", data[i]);
+	}
+	put_char(ex, '"');
+}
+
+static void put_uint(struct exporter *ex, uint64_t val)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		cbor_head(ex, CBOR_UINT, val);
+		return;
+	}
+	json_next(ex);
+	put_printf(ex, "%llu", (unsigned long long)val);
+}
+
+static void put_sint(struct exporter *ex, int64_t val)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		if (val < 0) {
+			cbor_head(ex, CBOR_NINT, -(val + 1));
+		} else {
+			cbor_head(ex, CBOR_UINT, val);
+		}
+		return;
+	}
+	json_next(ex);
+	put_printf(ex, "%lld", (long long)val);
+}
+
+static void put_bool(struct exporter *ex, bool val)
+{
+	if (ex->format == BG_EXPORT_CBOR) {
+		put_char(ex, val ? CBOR_TRUE : CBOR_FALSE);
+		return;
+	}
+	json_next(ex);
+	put_printf(ex, "%s", val ? "true" : "false");
+}
+
+static const char *uservar_type_name(uint64_t type)
+{
+	switch (type) {
+	case USERVAR_TYPE_CHAR:
+		return "char";
+	case USERVAR_TYPE_UINT8:
+		return "uint8";
+	case USERVAR_TYPE_UINT16:
+		return "uint16";
+	case USERVAR_TYPE_UINT32:
+		return "uint32";
+	case USERVAR_TYPE_UINT64:
+		return "uint64";
+	case USERVAR_TYPE_SINT8:
+		return "sint8";
+	case USERVAR_TYPE_SINT16:
+		return "sint16";
+	case USERVAR_TYPE_SINT32:
+		return "sint32";
+	case USERVAR_TYPE_SINT64:
+		return "sint64";
+	case USERVAR_TYPE_STRING_ASCII:
+		return "string";
+	case USERVAR_TYPE_BOOL:
+		return "bool";
+	default:
+		return NULL;
+	}
+}
+
+static uint64_t get_unsigned(const uint8_t *value, uint32_t size)
+{
+	uint8_t u8;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64 = 0;
+
+	/* values are not aligned inside the uservar area */
+	switch (size) {
+	case 1:
+		memcpy(&u8, value, 1);
+		return u8;
+	case 2:
+		memcpy(&u16, value, 2);
+		return u16;
+	case 4:
+		memcpy(&u32, value, 4);
+		return u32;
+	default:
+		memcpy(&u64, value, size < 8 ? size : 8);
+		return u64;
+	}
+}
+
+static int64_t get_signed(const uint8_t *value, uint32_t size)
+{
+	uint64_t val = get_unsigned(value, size);
+
+	switch (size) {
+	case 1:
+		return (int8_t)val;
+	case 2:
+		return (int16_t)val;
+	case 4:
+		return (int32_t)val;
+	default:
+		return (int64_t)val;
+	}
+}
+
+static void export_uservar(struct exporter *ex, uint64_t type,
+			   const uint8_t *value, uint32_t size)
+{
+	const char *name = uservar_type_name(type);
+
+	begin(ex, CBOR_MAP, name ? 2 : 3);
+	put_key(ex, "type");
+	put_string(ex, name ? name : "unknown");
+	if (!name) {
+		put_key(ex, "type_id");
+		put_uint(ex, type);
+	}
+	put_key(ex, "value");
+	switch (type) {
+	case USERVAR_TYPE_STRING_ASCII:
+		/* the stored string is zero-terminated */
+		put_text(ex, (const char *)value,
+			 strnlen((const char *)value, size));
+		break;
+	case USERVAR_TYPE_UINT8:
+	case USERVAR_TYPE_UINT16:
+	case USERVAR_TYPE_UINT32:
+	case USERVAR_TYPE_UINT64:
+		put_uint(ex, get_unsigned(value, size));
+		break;
+	case USERVAR_TYPE_SINT8:
+	case USERVAR_TYPE_SINT16:
+	case USERVAR_TYPE_SINT32:
+	case USERVAR_TYPE_SINT64:
+		put_sint(ex, get_signed(value, size));
+		break;
+	case USERVAR_TYPE_CHAR:
+		put_text(ex, (const char *)value, size ? 1 : 0);
+		break;
+	case USERVAR_TYPE_BOOL:
+		put_bool(ex, size && *value);
+		break;
+	default:
+		put_bytes(ex, value, size);
+	}
+	end(ex, CBOR_MAP);
+}
+
+/* udata is NULL if the user variables did not validate, they are exported
+ * as an empty map then */
+static void export_uservars(struct exporter *ex, uint8_t *udata)
+{
+	uint32_t record_size, data_size;
+	size_t count = 0;
+	uint8_t *value;
+	uint64_t type;
+	char *key;
+
+	for (uint8_t *u = udata; u && *u; u = bgenv_next_uservar(u)) {
+		count++;
+	}
+
+	begin(ex, CBOR_MAP, count);
+	for (; udata && *udata; udata = bgenv_next_uservar(udata)) {
+		bgenv_map_uservar(udata, &key, &type, &value, &record_size,
+				  &data_size);
+		put_key(ex, key);
+		export_uservar(ex, type & USERVAR_STANDARD_TYPE_MASK, value,
+			       data_size);
+	}
+	end(ex, CBOR_MAP);
+}
+
+static void export_env(struct exporter *ex, const struct bg_export_env *env,
+		       const struct fields *fields)
+{
+	BG_ENVDATA *data = env->data;
+	char buffer[ENV_STRING_LENGTH];
+	size_t count, len;
+	bool uservars_valid, valid;
+
+	/* the records of corrupt user data cannot be walked */
+	uservars_valid = bgenv_validate_uservars(data->userdata);
+	valid = data->crc32 == bgenv_crc32(0, data, sizeof(BG_ENVDATA) -
+						     sizeof(data->crc32)) &&
+		uservars_valid;
+
+	count = 2 + (env->index >= 0) + (env->source != NULL) +
+		fields->in_progress + fields->revision + fields->kernel +
+		fields->kernelargs + fields->wdog_timeout +
+		2 * fields->ustate + fields->user;
+
+	begin(ex, CBOR_MAP, count);
+	if (env->index >= 0) {
+		put_key(ex, "index");
+		put_uint(ex, env->index);
+	}
+	if (env->source) {
+		put_key(ex, "source");
+		put_string(ex, env->source);
+	}
+	put_key(ex, "valid");
+	put_bool(ex, valid);
+	put_key(ex, "crc32");
+	put_uint(ex, data->crc32);
+	if (fields->in_progress) {
+		put_key(ex, "in_progress");
+		put_bool(ex, data->in_progress);
+	}
+	if (fields->revision) {
+		put_key(ex, "revision");
+		put_uint(ex, data->revision);
+	}
+	if (fields->kernel) {
+		put_key(ex, "kernel");
+		len = str16to8n(buffer, data->kernelfile, ENV_STRING_LENGTH);
+		put_text(ex, buffer, len);
+	}
+	if (fields->kernelargs) {
+		put_key(ex, "kernelargs");
+		len = str16to8n(buffer, data->kernelparams, ENV_STRING_LENGTH);
+		put_text(ex, buffer, len);
+	}
+	if (fields->wdog_timeout) {
+		put_key(ex, "watchdog_timeout");
+		put_uint(ex, data->watchdog_timeout_sec);
+	}
+	if (fields->ustate) {
+		put_key(ex, "ustate");
+		put_uint(ex, data->ustate);
+		put_key(ex, "ustate_name");
+		put_string(ex, ustate2str(data->ustate));
+	}
+	if (fields->user) {
+		put_key(ex, "user");
+		export_uservars(ex, uservars_valid ? data->userdata : NULL);
+	}
+	end(ex, CBOR_MAP);
+}
+
+uint8_t *bg_export_encode(enum bg_export_format format,
+			  const struct bg_export_env *envs, size_t num_envs,
+			  const struct fields *output_fields, size_t *len)
+{
+	struct exporter ex = {
+		.format = format,
+		.first = {true},
+	};
+
+	begin(&ex, CBOR_MAP, 1);
+	put_key(&ex, "environments");
+	begin(&ex, CBOR_ARRAY, num_envs);
+	for (size_t i = 0; i < num_envs; i++) {
+		export_env(&ex, &envs[i], output_fields);
+	}
+	end(&ex, CBOR_ARRAY);
+	end(&ex, CBOR_MAP);
+	if (format == BG_EXPORT_JSON) {
+		put_char(&ex, '\n');
+	}
+
+	if (ex.oom) {
+		free(ex.buf);
+		return NULL;
+	}
+	*len = ex.len;
+	return ex.buf;
+}
+
+int bg_export(int fd, enum bg_export_format format,
+	      const struct bg_export_env *envs, size_t num_envs,
+	      const struct fields *output_fields)
+{
+	size_t len, done = 0;
+	uint8_t *buf;
+	ssize_t res;
+
+	buf = bg_export_encode(format, envs, num_envs, output_fields, &len);
+	if (!buf) {
+		return -ENOMEM;
+	}
+	/* a single write unless the output is a pipe with less room */
+	while (done < len) {
+		res = write(fd, buf + done, len - done);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			res = -errno;
+			free(buf);
+			return res;
+		}
+		done += res;
+	}
+	free(buf);
+	return 0;
+}
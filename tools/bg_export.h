@@ -0,0 +1,47 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#ifndef __bg_export_h_
+#define __bg_export_h_
+
+#include "env_api.h"
+#include "bg_printenv.h"
+
+/* machine-readable output formats of bg_printenv */
+enum bg_export_format {
+	BG_EXPORT_JSON,
+	BG_EXPORT_CBOR,
+};
+
+struct bg_export_env {
+	BG_ENVDATA *data;
+	/* index of the config partition, negative if read from a file */
+	int index;
+	/* device or file the environment was read from, may be NULL */
+	const char *source;
+};
+
+/*
+ * Encodes the environments as one document of the form
+ *   {"environments": [{"index": 0, "source": ..., "valid": ..., ...}]}
+ * into a newly allocated buffer. Returns NULL if out of memory.
+ */
+uint8_t *bg_export_encode(enum bg_export_format format,
+			  const struct bg_export_env *envs, size_t num_envs,
+			  const struct fields *output_fields, size_t *len);
+
+/* Encodes the environments and writes them to fd in one go. Returns 0 or a
+ * negative errno value. */
+int bg_export(int fd, enum bg_export_format format,
+	      const struct bg_export_env *envs, size_t num_envs,
+	      const struct fields *output_fields);
+
+#endif
@@ -16,6 +16,7 @@
 #include "uservars.h"
 
 #include "bg_envtools.h"
+#include "bg_export.h"
 #include "bg_printenv.h"
 
 static char tool_doc[] =
@@ -32,6 +33,9 @@ static struct argp_option options_printenv[] = {
 	    "watchdog_timeout, ustate, user. "
 	    "If omitted, all available fields are printed."),
 	OPT("raw", 'r', 0, 0, "Raw output mode, e.g. for shell scripting"),
+	OPT("format", 'F', "FORMAT", 0,
+	    "Machine-readable output of all selected environments including "
+	    "their validity and uservar types. FORMAT is json or cbor."),
 	{0},
 };
 
@@ -42,6 +46,9 @@ struct arguments_printenv {
 	/* a bitset to decide which fields are printed */
 	struct fields output_fields;
 	bool raw;
+	/* machine-readable output, if set */
+	bool export;
+	enum bg_export_format format;
 };
 
 const struct fields ALL_FIELDS = {1, 1, 1, 1, 1, 1, 1};
@@ -167,7 +174,9 @@ void dump_env(BG_ENVDATA *env, const struct fields *output_fields, bool raw)
 		}
 	}
 	if (output_fields->kernel) {
-		char *kernelfile = str16to8(buffer, env->kernelfile);
+		char *kernelfile = buffer;
+
+		str16to8n(buffer, env->kernelfile, ENV_STRING_LENGTH);
 		if (raw) {
 			fprintf(stdout, "KERNEL=%s\n", kernelfile);
 		} else {
@@ -175,7 +184,9 @@ void dump_env(BG_ENVDATA *env, const struct fields *output_fields, bool raw)
 		}
 	}
 	if (output_fields->kernelargs) {
-		char *kernelargs = str16to8(buffer, env->kernelparams);
+		char *kernelargs = buffer;
+
+		str16to8n(buffer, env->kernelparams, ENV_STRING_LENGTH);
 		if (raw) {
 			fprintf(stdout, "KERNELARGS=%s\n", kernelargs);
 		} else {
@@ -256,12 +267,12 @@ static void dump_env_by_index(uint32_t index, struct fields output_fields,
 static int printenv_from_file(char *envfilepath, const struct fields *output_fields,
 			      bool raw)
 {
-	int success = 0;
-	BG_ENVDATA data;
+	BG_ENVDATA *data;
 
-	success = get_env(envfilepath, &data);
-	if (success) {
-		dump_env(&data, output_fields, raw);
+	data = map_env(envfilepath, true);
+	if (data) {
+		dump_env(data, output_fields, raw);
+		unmap_env(data);
 		return 0;
 	} else {
 		fprintf(stderr, "Error reading environment file.\n");
@@ -269,6 +280,92 @@ static int printenv_from_file(char *envfilepath, const struct fields *output_fie
 	}
 }
 
+static int export_env_file(char *envfilepath, enum bg_export_format format,
+			   const struct fields *output_fields)
+{
+	struct bg_export_env env = {
+		.index = -1,
+		.source = envfilepath,
+	};
+	int res;
+
+	env.data = map_env(envfilepath, false);
+	if (!env.data) {
+		fprintf(stderr, "Error reading environment file.\n");
+		return 1;
+	}
+	res = bg_export(STDOUT_FILENO, format, &env, 1, output_fields);
+	unmap_env(env.data);
+	if (res) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(-res));
+		return 1;
+	}
+	return 0;
+}
+
+/* Exports the config partition selected by index, the latest one if index is
+ * negative and latest is set, or all of them */
+static int export_envs(int index, bool latest, enum bg_export_format format,
+		       const struct fields *output_fields)
+{
+	struct bg_export_env envs[ENV_NUM_CONFIG_PARTS];
+	BGENV *handles[ENV_NUM_CONFIG_PARTS];
+	BG_ENVDATA *latest_data = NULL;
+	size_t count = 0;
+	int res = 0;
+
+	if (latest) {
+		BGENV *env = bgenv_open_latest();
+
+		if (!env) {
+			fprintf(stderr,
+				"Failed to retrieve latest environment.\n");
+			return 1;
+		}
+		latest_data = env->data;
+		bgenv_close(env);
+	}
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BGENV *env;
+
+		if (index >= 0 && i != index) {
+			continue;
+		}
+		env = bgenv_open_by_index(i);
+		if (!env) {
+			fprintf(stderr, "Error, could not read environment "
+					"for index %d\n",
+				i);
+			res = 1;
+			break;
+		}
+		if (latest && env->data != latest_data) {
+			bgenv_close(env);
+			continue;
+		}
+		handles[count] = env;
+		envs[count].data = env->data;
+		envs[count].index = i;
+		envs[count].source = ((CONFIG_PART *)env->desc)->devpath;
+		count++;
+	}
+
+	if (res == 0) {
+		res = bg_export(STDOUT_FILENO, format, envs, count,
+				output_fields);
+		if (res) {
+			fprintf(stderr, "Error writing output: %s\n",
+				strerror(-res));
+			res = 1;
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		bgenv_close(handles[i]);
+	}
+	return res;
+}
+
 static error_t parse_printenv_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments_printenv *arguments = state->input;
@@ -284,6 +381,17 @@ static error_t parse_printenv_opt(int key, char *arg, struct argp_state *state)
 	case 'r':
 		arguments->raw = true;
 		break;
+	case 'F':
+		if (strcmp(arg, "json") == 0) {
+			arguments->format = BG_EXPORT_JSON;
+		} else if (strcmp(arg, "cbor") == 0) {
+			arguments->format = BG_EXPORT_CBOR;
+		} else {
+			fprintf(stderr, "Unknown output format: %s\n", arg);
+			return 1;
+		}
+		arguments->export = true;
+		break;
 	case ARGP_KEY_ARG:
 		/* too many arguments - program terminates with call to
 		 * argp_usage with non-zero return code */
@@ -327,6 +435,10 @@ error_t bg_printenv(int argc, char **argv)
 		fprintf(stderr, "Error, only one of -c/-f/-p can be set.\n");
 		return 1;
 	}
+	if (arguments.raw && arguments.export) {
+		fprintf(stderr, "Error, -r and -F cannot be combined.\n");
+		return 1;
+	}
 	if (arguments.raw && counter != 1) {
 		/* raw mode makes only sense if applied to a single
 		 * partition */
@@ -337,24 +449,44 @@ error_t bg_printenv(int argc, char **argv)
 	}
 
 	if (common->envfilepath) {
-		e = printenv_from_file(common->envfilepath,
-				       &arguments.output_fields, arguments.raw);
+		if (arguments.export) {
+			e = export_env_file(common->envfilepath,
+					    arguments.format,
+					    &arguments.output_fields);
+		} else {
+			e = printenv_from_file(common->envfilepath,
+					       &arguments.output_fields,
+					       arguments.raw);
+		}
 		free(common->envfilepath);
 		return e;
 	}
 
 	/* not in file mode */
+	ebg_set_opt_bool(EBG_OPT_PROBE_CACHE, true);
 	if (arguments.common.search_all_devices) {
 		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, true);
 	}
 	if (arguments.common.verbosity) {
 		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
 	}
-	if (!bgenv_init()) {
+	/* -c only needs the environment it prints to be read completely */
+	if (!(arguments.current ? bgenv_init_latest() : bgenv_init())) {
 		fprintf(stderr, "Error initializing FAT environment.\n");
 		return 1;
 	}
 
+	if (arguments.export) {
+		e = export_envs(common->part_specified ? common->which_part
+						       : -1,
+				arguments.current, arguments.format,
+				&arguments.output_fields);
+		bgenv_finalize();
+		return e;
+	}
+
 	if (arguments.current) {
 		if (!arguments.raw) {
 			fprintf(stdout, "Using latest config partition\n");
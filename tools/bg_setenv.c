@@ -17,8 +17,10 @@
 #include <sys/stat.h>
 
 #include "ebgenv.h"
+#include "uservars.h"
 
 #include "bg_envtools.h"
+#include "thread_pool.h"
 #include "bg_setenv.h"
 #include "bg_printenv.h"
 
@@ -42,6 +44,17 @@ static struct argp_option options_setenv[] = {
 	    "use this option multiple times."),
 	OPT("in_progress", 'i', "IN_PROGRESS", 0,
 	    "Set in_progress variable to simulate a running update process."),
+	OPT("layout", 'l', "LAYOUT", 0,
+	    "Convert the user variables to layout 1 (default) or 2, which "
+	    "adds a sorted lookup table."),
+	OPT("compact", 'C', 0, 0,
+	    "Store the environment in the compact file layout, which only "
+	    "holds the used part of the user variables. Requires a loader "
+	    "supporting it."),
+	OPT("manifest", 'm', "MANIFEST", 0,
+	    "Generate multiple environment files in one go. Each line of "
+	    "MANIFEST holds the options for one file, including -f. Use - to "
+	    "read from stdin."),
 	{0},
 };
 
@@ -54,67 +67,146 @@ struct arguments_setenv {
 	/* whether to keep existing entries in BGENV before applying new
 	 * settings */
 	bool preserve_env;
+	/* file with one set of file mode arguments per line */
+	char *manifest;
+	/* write the environment in the compact layout */
+	bool compact;
 };
 
-typedef enum { ENV_TASK_SET, ENV_TASK_DEL } BGENV_TASK;
+/* ENV_TASK_SET_UINT sets a numeric built-in field and ENV_TASK_LAYOUT
+ * converts the user variables, both take their value from type */
+typedef enum {
+	ENV_TASK_SET,
+	ENV_TASK_SET_UINT,
+	ENV_TASK_DEL,
+	ENV_TASK_LAYOUT
+} BGENV_TASK;
 
 struct stailhead *headp;
 struct env_action {
 	char *key;
 	uint64_t type;
 	uint8_t *data;
+	uint32_t datalen;
 	BGENV_TASK task;
 	STAILQ_ENTRY(env_action) journal;
 };
 
 STAILQ_HEAD(stailhead, env_action) head = STAILQ_HEAD_INITIALIZER(head);
 
-static void journal_free_action(struct env_action *action)
+/* Actions are carved from blocks together with their keys and data, so
+ * that a journal is released at once. The first block is sized for the
+ * command line, more are only added for what does not fit. */
+struct journal_block {
+	struct journal_block *next;
+	size_t size;
+	size_t used;
+	uint8_t mem[] __attribute__((aligned));
+};
+
+#define JOURNAL_ALIGN __alignof__(struct env_action)
+#define JOURNAL_BLOCK_SIZE 4096
+
+/* blocks of the journal in head */
+static struct journal_block *arena;
+
+static struct journal_block *journal_add_block(size_t size)
+{
+	struct journal_block *block;
+
+	block = malloc(sizeof(struct journal_block) + size);
+	if (!block) {
+		return NULL;
+	}
+	block->next = arena;
+	block->size = size;
+	block->used = 0;
+	arena = block;
+	return block;
+}
+
+static void *journal_alloc(size_t size)
 {
-	if (!action) {
-		return;
+	struct journal_block *block = arena;
+	void *p;
+
+	size = (size + JOURNAL_ALIGN - 1) & ~(JOURNAL_ALIGN - 1);
+	if (!block || block->size - block->used < size) {
+		block = journal_add_block(size > JOURNAL_BLOCK_SIZE
+						  ? size
+						  : JOURNAL_BLOCK_SIZE);
+		if (!block) {
+			return NULL;
+		}
+	}
+	p = block->mem + block->used;
+	block->used += size;
+	return p;
+}
+
+/* Reserves what the actions of argv take at most: one per argument, with
+ * a built-in key or a copy of the argument as key and as data. */
+static void journal_reserve(int argc, char **argv)
+{
+	size_t size = 0;
+
+	for (int i = 1; i < argc; i++) {
+		size += sizeof(struct env_action) + 2 * JOURNAL_ALIGN +
+			sizeof("watchdog_timeout_sec") +
+			2 * (strlen(argv[i]) + 1);
+	}
+	if (size > JOURNAL_BLOCK_SIZE) {
+		/* if this fails, journal_alloc() retries in smaller steps */
+		(void)journal_add_block(size);
+	}
+}
+
+static void journal_free_blocks(struct journal_block *blocks)
+{
+	while (blocks) {
+		struct journal_block *next = blocks->next;
+
+		free(blocks);
+		blocks = next;
 	}
-	free(action->data);
-	free(action->key);
-	free(action);
 }
 
 static error_t journal_add_action(BGENV_TASK task, char *key, uint64_t type,
 				  uint8_t *data, size_t datalen)
 {
 	struct env_action *new_action;
+	size_t keylen = key ? strlen(key) + 1 : 0;
 
-	new_action = calloc(1, sizeof(struct env_action));
+	if (datalen > UINT32_MAX) {
+		return EINVAL;
+	}
+	new_action = journal_alloc(sizeof(struct env_action) + keylen +
+				   datalen);
 	if (!new_action) {
 		return ENOMEM;
 	}
 	new_action->task = task;
+	new_action->type = type;
+	new_action->key = NULL;
+	new_action->data = NULL;
+	new_action->datalen = 0;
 	if (key) {
-		if (asprintf(&(new_action->key), "%s", key) == -1) {
-			new_action->key = NULL;
-			goto newaction_nomem;
-		}
+		new_action->key = (char *)(new_action + 1);
+		memcpy(new_action->key, key, keylen);
 	}
-	new_action->type = type;
 	if (data && datalen) {
-		new_action->data = (uint8_t *)malloc(datalen);
-		if (!new_action->data) {
-			new_action->data = NULL;
-			goto newaction_nomem;
-		}
+		new_action->data = (uint8_t *)(new_action + 1) + keylen;
+		new_action->datalen = datalen;
 		memcpy(new_action->data, data, datalen);
 	}
 	STAILQ_INSERT_TAIL(&head, new_action, journal);
 	return 0;
-
-newaction_nomem:
-	journal_free_action(new_action);
-	return ENOMEM;
 }
 
 static void journal_process_action(BGENV *env, struct env_action *action)
 {
 	ebgenv_t e;
+	int res;
 	memset(&e, 0, sizeof(ebgenv_t));
 
 	switch (action->task) {
@@ -141,12 +233,42 @@ static void journal_process_action(BGENV *env, struct env_action *action)
 			return;
 		}
 		bgenv_set(env, action->key, action->type, action->data,
-			  strlen((char *)action->data) + 1);
+			  action->datalen);
+		break;
+	case ENV_TASK_SET_UINT:
+		VERBOSE(stdout, "Task = SET, key = %s, val = %llu\n",
+			action->key, (long long unsigned int)action->type);
+		if (strcmp(action->key, "ustate") == 0) {
+			e.bgenv = env;
+			res = ebg_env_setglobalstate(&e, action->type);
+			if (res) {
+				fprintf(stderr,
+					"Error setting global state: %s.",
+					strerror(-res));
+			}
+			return;
+		}
+		res = bgenv_set_uint(env, bgenv_str2enum(action->key),
+				     action->type);
+		if (res) {
+			fprintf(stderr, "Cannot set %s: %s\n", action->key,
+				strerror(-res));
+		}
 		break;
 	case ENV_TASK_DEL:
 		VERBOSE(stdout, "Task = DEL, key = %s\n", action->key);
 		bgenv_set(env, action->key, action->type, "", 1);
 		break;
+	case ENV_TASK_LAYOUT:
+		VERBOSE(stdout, "Task = LAYOUT, layout = %llu\n",
+			(long long unsigned int)action->type);
+		res = bgenv_uservars_convert(env->data->userdata,
+					     action->type == 2);
+		if (res) {
+			fprintf(stderr, "Cannot convert user variables: %s\n",
+				strerror(-res));
+		}
+		break;
 	}
 }
 
@@ -173,8 +295,7 @@ static error_t set_uservars(char *arg)
 static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments_setenv *arguments = state->input;
-	int i, res;
-	char *tmp;
+	int i;
 	error_t e = 0;
 
 	switch (key) {
@@ -221,13 +342,8 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 			}
 			return 1;
 		} else {
-			res = asprintf(&tmp, "%u", i);
-			if (res == -1) {
-				return ENOMEM;
-			}
-			e = journal_add_action(ENV_TASK_SET, "ustate", 0,
-					       (uint8_t *)tmp, strlen(tmp) + 1);
-			free(tmp);
+			e = journal_add_action(ENV_TASK_SET_UINT, "ustate", i,
+					       NULL, 0);
 			VERBOSE(stdout, "Ustate set to %d (%s).\n", i,
 				ustate2str(i));
 		}
@@ -244,45 +360,39 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 				"0 (no), 1 (yes)\n");
 			return 1;
 		} else {
-			res = asprintf(&tmp, "%u", i);
-			if (res == -1) {
-				return ENOMEM;
-			}
-			e = journal_add_action(ENV_TASK_SET, "in_progress", 0,
-					       (uint8_t *)tmp, strlen(tmp) + 1);
-			free(tmp);
+			e = journal_add_action(ENV_TASK_SET_UINT,
+					       "in_progress", i, NULL, 0);
 			VERBOSE(stdout, "in_progress set to %d.\n", i);
 		}
 		break;
 	case 'r':
 		i = parse_int(arg);
-		if (errno) {
+		if (errno || i < 0) {
 			fprintf(stderr, "Invalid revision specified.\n");
 			return 1;
 		}
 		VERBOSE(stdout, "Revision is set to %u.\n", (unsigned int) i);
-		e = journal_add_action(ENV_TASK_SET, "revision", 0,
-				       (uint8_t *)arg, strlen(arg) + 1);
+		e = journal_add_action(ENV_TASK_SET_UINT, "revision", i, NULL,
+				       0);
 		break;
 	case 'w':
 		i = parse_int(arg);
-		if (errno || i < 0) {
+		if (errno || i < 0 || i > UINT16_MAX) {
 			fprintf(stderr,
 				"Invalid watchdog timeout specified.\n");
 			return 1;
 		}
 		VERBOSE(stdout,
 			"Setting watchdog timeout to %d seconds.\n", i);
-		e = journal_add_action(ENV_TASK_SET,
-				       "watchdog_timeout_sec", 0,
-				       (uint8_t *)arg, strlen(arg) + 1);
+		e = journal_add_action(ENV_TASK_SET_UINT,
+				       "watchdog_timeout_sec", i, NULL, 0);
 		break;
 	case 'c':
 		VERBOSE(stdout,
 			"Confirming environment to work. Removing boot-once "
 			"and testing flag.\n");
-		e = journal_add_action(ENV_TASK_SET, "ustate", 0,
-				       (uint8_t *)"0", 2);
+		e = journal_add_action(ENV_TASK_SET_UINT, "ustate", USTATE_OK,
+				       NULL, 0);
 		break;
 	case 'u':
 		arguments->auto_update = true;
@@ -291,14 +401,35 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 		/* Set user-defined variable(s) */
 		e = set_uservars(arg);
 		break;
+	case 'l':
+		i = parse_int(arg);
+		if (errno || i < 1 || i > 2) {
+			fprintf(stderr,
+				"Invalid layout specified. Possible values: "
+				"1, 2\n");
+			return 1;
+		}
+		e = journal_add_action(ENV_TASK_LAYOUT, NULL, i, NULL, 0);
+		break;
 	case 'P':
 		arguments->preserve_env = true;
 		break;
+	case 'C':
+		arguments->compact = true;
+		break;
+	case 'm':
+		free(arguments->manifest);
+		arguments->manifest = strdup(arg);
+		if (!arguments->manifest) {
+			e = ENOMEM;
+		}
+		break;
 	case ARGP_KEY_ARG:
 		/* too many arguments - program terminates with call to
-		 * argp_usage with non-zero return code */
+		 * argp_usage with non-zero return code, manifest lines are
+		 * parsed without exiting and get rejected */
 		argp_usage(state);
-		break;
+		return EINVAL;
 	default:
 		return parse_common_opt(key, arg, true, &arguments->common);
 	}
@@ -309,18 +440,25 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 	return e;
 }
 
-static void update_environment(BGENV *env, bool verbosity)
+static void journal_free(struct stailhead *journal,
+			 struct journal_block **blocks)
+{
+	STAILQ_INIT(journal);
+	journal_free_blocks(*blocks);
+	*blocks = NULL;
+}
+
+static void update_environment(BGENV *env, struct stailhead *journal,
+			       bool verbosity)
 {
 	if (verbosity) {
 		fprintf(stdout, "Processing journal...\n");
 	}
 
-	while (!STAILQ_EMPTY(&head)) {
-		struct env_action *action = STAILQ_FIRST(&head);
+	struct env_action *action;
 
+	STAILQ_FOREACH(action, journal, journal) {
 		journal_process_action(env, action);
-		STAILQ_REMOVE_HEAD(&head, journal);
-		journal_free_action(action);
 	}
 
 	env->data->crc32 =
@@ -329,44 +467,259 @@ static void update_environment(BGENV *env, bool verbosity)
 
 }
 
-static int dumpenv_to_file(char *envfilepath, bool verbosity, bool preserve_env)
+static int dumpenv_to_file(char *envfilepath, struct stailhead *journal,
+			   bool verbosity, bool preserve_env)
 {
-	/* execute journal and write to file */
-	int result = 0;
+	/* execute journal and replace the file with the result */
+	BG_ENVDATA *data;
 	BGENV env;
-	BG_ENVDATA data;
 
+	data = calloc(1, sizeof(BG_ENVDATA));
+	if (!data) {
+		fprintf(stderr, "Error: out of memory.\n");
+		return 1;
+	}
 	memset(&env, 0, sizeof(BGENV));
-	memset(&data, 0, sizeof(BG_ENVDATA));
-	env.data = &data;
+	env.data = data;
 
-	if (preserve_env && !get_env(envfilepath, &data)) {
+	if (preserve_env && !get_env(envfilepath, data)) {
+		free(data);
 		return 1;
 	}
 
-	update_environment(&env, verbosity);
+	update_environment(&env, journal, verbosity);
+	bgenv_uservar_index_free(env.uservar_index);
 	if (verbosity) {
 		dump_env(env.data, &ALL_FIELDS, false);
 	}
-	FILE *of = fopen(envfilepath, "wb");
-	if (of) {
-		if (fwrite(&data, sizeof(BG_ENVDATA), 1, of) != 1) {
+	if (!put_env(envfilepath, data)) {
+		fprintf(stderr, "Error writing to output file %s (%s).\n",
+			envfilepath, strerror(errno));
+		free(data);
+		return 1;
+	}
+	free(data);
+	fprintf(stdout, "Output written to %s.\n", envfilepath);
+
+	return 0;
+}
+
+/* Per line state of a manifest */
+struct manifest_variant {
+	struct arguments_setenv arguments;
+	struct stailhead journal;
+	struct journal_block *arena;
+	unsigned int line;
+	int result;
+};
+
+/* Splits a manifest line in place into words separated by white space.
+ * Single or double quotes group words, a backslash escapes the next
+ * character and # starts a comment. argv needs to have room for
+ * strlen(line) / 2 + 1 entries. Returns the number of words or -1 for
+ * unbalanced quotes. */
+static int split_manifest_line(char *line, char **argv)
+{
+	char *src = line, *dst = line;
+	char quote;
+	int argc = 0;
+
+	while (true) {
+		while (*src == ' ' || *src == '\t' || *src == '\n' ||
+		       *src == '\r') {
+			src++;
+		}
+		if (*src == '\0' || *src == '#') {
+			return argc;
+		}
+
+		argv[argc++] = dst;
+		quote = 0;
+		for (; *src; src++) {
+			if (quote) {
+				if (*src == quote) {
+					quote = 0;
+					continue;
+				}
+			} else if (*src == '\'' || *src == '"') {
+				quote = *src;
+				continue;
+			} else if (*src == ' ' || *src == '\t' ||
+				   *src == '\n' || *src == '\r') {
+				src++;
+				break;
+			}
+			if (*src == '\\' && quote != '\'' && src[1]) {
+				src++;
+			}
+			*dst++ = *src;
+		}
+		if (quote) {
+			return -1;
+		}
+		/* dst never overtakes src */
+		*dst++ = '\0';
+	}
+}
+
+static error_t parse_manifest_line(struct argp *argp, char *line,
+				   struct manifest_variant *variant)
+{
+	char **argv;
+	error_t e;
+	int argc;
+
+	argv = calloc(strlen(line) / 2 + 3, sizeof(char *));
+	if (!argv) {
+		return ENOMEM;
+	}
+	argv[0] = "bg_setenv";
+	argc = split_manifest_line(line, argv + 1);
+	if (argc < 0) {
+		free(argv);
+		return EINVAL;
+	}
+
+	STAILQ_INIT(&head);
+	arena = NULL;
+	journal_reserve(argc + 1, argv);
+	e = argp_parse(argp, argc + 1, argv, ARGP_NO_EXIT, 0,
+		       &variant->arguments);
+	STAILQ_INIT(&variant->journal);
+	STAILQ_CONCAT(&variant->journal, &head);
+	variant->arena = arena;
+	arena = NULL;
+	free(argv);
+
+	return e;
+}
+
+static void manifest_worker(void *ctx, size_t index)
+{
+	struct manifest_variant **variants = ctx;
+	struct manifest_variant *variant = variants[index];
+
+	variant->result =
+		dumpenv_to_file(variant->arguments.common.envfilepath,
+				&variant->journal,
+				variant->arguments.common.verbosity,
+				variant->arguments.preserve_env);
+}
+
+static void manifest_variant_free(struct manifest_variant *variant)
+{
+	journal_free(&variant->journal, &variant->arena);
+	free(variant->arguments.common.envfilepath);
+	free(variant->arguments.manifest);
+	free(variant);
+}
+
+/* Parses all lines of the manifest first, then generates the environment
+ * files in parallel. */
+static int process_manifest(struct argp *argp, char *manifestpath)
+{
+	struct manifest_variant **variants = NULL, **tmp;
+	size_t num_variants = 0, linelen = 0;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	long num_cpus;
+	int result = 0;
+	FILE *f;
+
+	if (strcmp(manifestpath, "-") == 0) {
+		f = stdin;
+	} else {
+		f = fopen(manifestpath, "re");
+	}
+	if (!f) {
+		fprintf(stderr, "Error opening manifest %s (%s).\n",
+			manifestpath, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &linelen, f) != -1) {
+		struct manifest_variant *variant;
+		error_t e;
+
+		lineno++;
+		tmp = realloc(variants, (num_variants + 1) * sizeof(*variants));
+		if (tmp) {
+			variants = tmp;
+		}
+		variant = calloc(1, sizeof(struct manifest_variant));
+		if (!variant || !tmp) {
+			free(variant);
+			fprintf(stderr, "Error parsing manifest: %s\n",
+				strerror(ENOMEM));
+			result = 1;
+			break;
+		}
+		variants[num_variants++] = variant;
+		variant->line = lineno;
+
+		e = parse_manifest_line(argp, line, variant);
+		if (e) {
+			fprintf(stderr, "%s:%u: Invalid options.\n",
+				manifestpath, lineno);
+			result = 1;
+			break;
+		}
+		if (STAILQ_EMPTY(&variant->journal) &&
+		    !variant->arguments.common.envfilepath &&
+		    !variant->arguments.manifest) {
+			/* empty or comment line */
+			manifest_variant_free(variants[--num_variants]);
+			continue;
+		}
+		if (!variant->arguments.common.envfilepath ||
+		    variant->arguments.manifest) {
 			fprintf(stderr,
-				"Error writing to output file: %s\n",
-				strerror(errno));
+				"%s:%u: Each line needs an output file (-f) and "
+				"cannot refer to another manifest.\n",
+				manifestpath, lineno);
 			result = 1;
-		} else {
-			fprintf(stdout, "Output written to %s.\n", envfilepath);
+			break;
+		}
+		/* the files are written concurrently */
+		for (size_t i = 0; i + 1 < num_variants; i++) {
+			if (strcmp(variants[i]->arguments.common.envfilepath,
+				   variant->arguments.common.envfilepath) ==
+			    0) {
+				fprintf(stderr,
+					"%s:%u: %s is already written by line "
+					"%u.\n",
+					manifestpath, lineno,
+					variant->arguments.common.envfilepath,
+					variants[i]->line);
+				result = 1;
+				break;
+			}
+		}
+		if (result) {
+			break;
 		}
-		if (fclose(of)) {
-			fprintf(stderr, "Error closing output file.\n");
+	}
+	free(line);
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	if (result == 0) {
+		num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_pool_run(manifest_worker, variants, num_variants,
+				num_cpus > 0 ? num_cpus : 1);
+	}
+
+	for (size_t i = 0; i < num_variants; i++) {
+		if (variants[i]->result) {
+			fprintf(stderr, "%s:%u: Failed to write %s.\n",
+				manifestpath, variants[i]->line,
+				variants[i]->arguments.common.envfilepath);
 			result = 1;
-		};
-	} else {
-		fprintf(stderr, "Error opening output file %s (%s).\n",
-			envfilepath, strerror(errno));
-		result = 1;
+		}
+		manifest_variant_free(variants[i]);
 	}
+	free(variants);
 
 	return result;
 }
@@ -391,10 +744,12 @@ error_t bg_setenv(int argc, char **argv)
 	memset(&arguments, 0, sizeof(struct arguments_setenv));
 
 	STAILQ_INIT(&head);
+	journal_reserve(argc, argv);
 
 	error_t e;
 	e = argp_parse(&argp_setenv, argc, argv, 0, 0, &arguments);
 	if (e) {
+		journal_free(&head, &arena);
 		return e;
 	}
 
@@ -402,6 +757,7 @@ error_t bg_setenv(int argc, char **argv)
 		fprintf(stderr, "Error, both automatic and manual partition "
 				"selection. Cannot use -p and -u "
 				"simultaneously.\n");
+		journal_free(&head, &arena);
 		return 1;
 	}
 
@@ -409,24 +765,56 @@ error_t bg_setenv(int argc, char **argv)
 
 	/* arguments are parsed, journal is filled */
 
+	if (arguments.manifest) {
+		if (!STAILQ_EMPTY(&head) || arguments.common.envfilepath) {
+			fprintf(stderr, "Error, a manifest cannot be combined "
+					"with other options.\n");
+			result = 1;
+		} else {
+			result = process_manifest(&argp_setenv,
+						  arguments.manifest);
+		}
+		journal_free(&head, &arena);
+		free(arguments.common.envfilepath);
+		free(arguments.manifest);
+		return result;
+	}
+
 	/* is output to file or input from file ? */
 	if (arguments.common.envfilepath) {
-		result = dumpenv_to_file(arguments.common.envfilepath,
+		if (arguments.compact) {
+			fprintf(stderr, "Error, the compact layout is only "
+					"supported on config partitions.\n");
+			journal_free(&head, &arena);
+			free(arguments.common.envfilepath);
+			return 1;
+		}
+		result = dumpenv_to_file(arguments.common.envfilepath, &head,
 					 arguments.common.verbosity,
 					 arguments.preserve_env);
+		journal_free(&head, &arena);
 		free(arguments.common.envfilepath);
 		return result;
 	}
 
 	/* not in file mode */
+	ebg_set_opt_bool(EBG_OPT_PROBE_CACHE, true);
+	if (arguments.compact) {
+		/* the environments have to be written by this process */
+		ebg_set_opt_bool(EBG_OPT_USE_DAEMON, false);
+		ebg_set_opt_bool(EBG_OPT_COMPACT_ENV, true);
+	}
 	if (arguments.common.search_all_devices) {
 		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, true);
 	}
 	if (arguments.common.verbosity) {
 		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
 	}
 	if (!bgenv_init()) {
 		fprintf(stderr, "Error initializing FAT environment.\n");
+		journal_free(&head, &arena);
 		return 1;
 	}
 
@@ -468,8 +856,7 @@ error_t bg_setenv(int argc, char **argv)
 			goto cleanup;
 		}
 
-		memcpy((char *)env_new->data, (char *)env_current->data,
-		       sizeof(BG_ENVDATA));
+		bgenv_stage(env_new, env_current->data);
 		env_new->data->revision = env_current->data->revision + 1;
 
 		bgenv_close(env_current);
@@ -490,7 +877,7 @@ error_t bg_setenv(int argc, char **argv)
 		}
 	}
 
-	update_environment(env_new, arguments.common.verbosity);
+	update_environment(env_new, &head, arguments.common.verbosity);
 
 	if (arguments.common.verbosity) {
 		fprintf(stdout, "New environment data:\n");
@@ -505,6 +892,7 @@ error_t bg_setenv(int argc, char **argv)
 	}
 
 cleanup:
+	journal_free(&head, &arena);
 	bgenv_close(env_new);
 	bgenv_finalize();
 	return result;
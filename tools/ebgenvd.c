@@ -0,0 +1,556 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "env_api.h"
+#include "env_disk_utils.h"
+#include "bg_envtools.h"
+#include "ebgenvd.h"
+#include "test-interface.h"
+#include "version.h"
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+/* clients subscribed with EBGENVD_CMD_WATCH */
+#define MAX_WATCHERS	64
+
+static char doc[] =
+	"ebgenvd - Environment daemon for the EFI Boot Guard";
+
+static struct argp_option options_ebgenvd[] = {
+	OPT("all", 'A', 0, 0,
+	    "search on all devices instead of root device only"),
+	OPT("socket", 's', "SOCKET", 0,
+	    "Listen on SOCKET instead of " EBGENVD_SOCKET_PATH " or the path "
+	    "given by $" EBGENVD_SOCKET_ENV),
+	OPT("verbose", 'v', 0, 0, "Be verbose"),
+	OPT("version", 'V', 0, 0, "Print version"),
+	{0},
+};
+
+struct arguments_ebgenvd {
+	bool search_all_devices;
+	bool verbosity;
+	const char *socket;
+};
+
+struct daemon_state {
+	/* set if config_parts and envdata hold a valid snapshot */
+	bool ready;
+	uint32_t generation;
+	int inotify_fd;
+	/* watch descriptors of /dev and of the config partitions */
+	int dev_wd;
+	int part_wd[ENV_NUM_CONFIG_PARTS];
+	int watch_fd[MAX_WATCHERS];
+	unsigned int num_watchers;
+	/* state last sent to the watchers */
+	struct ebgenvd_event last_event;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments_ebgenvd *arguments = state->input;
+
+	switch (key) {
+	case 'A':
+		arguments->search_all_devices = true;
+		break;
+	case 's':
+		arguments->socket = arg;
+		break;
+	case 'v':
+		arguments->verbosity = true;
+		break;
+	case 'V':
+		fprintf(stdout, "EFI Boot Guard %s\n", EFIBOOTGUARD_VERSION);
+		exit(0);
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		return EINVAL;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static void watch_partitions(struct daemon_state *st)
+{
+	if (st->inotify_fd >= 0) {
+		close(st->inotify_fd);
+	}
+	st->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (st->inotify_fd < 0) {
+		fprintf(stderr, "Cannot watch config partitions: %s\n",
+			strerror(errno));
+		return;
+	}
+	/* new disks or a re-read partition table */
+	st->dev_wd = inotify_add_watch(st->inotify_fd, "/dev", IN_CREATE);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		st->part_wd[i] = -1;
+		if (!st->ready || !config_parts[i].devpath) {
+			continue;
+		}
+		st->part_wd[i] = inotify_add_watch(
+			st->inotify_fd, config_parts[i].devpath,
+			IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+				IN_DELETE_SELF);
+		if (st->part_wd[i] < 0) {
+			VERBOSE(stderr, "Cannot watch %s: %s\n",
+				config_parts[i].devpath, strerror(errno));
+		}
+	}
+}
+
+static void reprobe(struct daemon_state *st)
+{
+	bgenv_finalize();
+	st->ready = bgenv_init();
+	st->generation++;
+	if (!st->ready) {
+		fprintf(stderr, "Error finding config partitions.\n");
+	}
+	watch_partitions(st);
+	VERBOSE(stdout, "Probed config partitions, generation %u.\n",
+		st->generation);
+}
+
+/* Changes are watched on the device nodes, which misses those done through
+ * a mount, so do not keep the partitions mounted while waiting. */
+static void release_temp_mounts(void)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (config_parts[i].not_mounted) {
+			unmount_partition(&config_parts[i]);
+		}
+	}
+}
+
+/* Re-reads all environments and starts a new generation if one of them
+ * was changed by someone else, so that writes based on an older snapshot
+ * are rejected. */
+static void reread(struct daemon_state *st)
+{
+	static BG_ENVDATA data;
+	bool changed = false;
+
+	if (!st->ready) {
+		return;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		memset(&data, 0, sizeof(data));
+		read_env(&config_parts[i], &data);
+		if (memcmp(&data, &envdata[i], sizeof(data)) != 0) {
+			envdata[i] = data;
+			changed = true;
+		}
+	}
+	if (changed) {
+		st->generation++;
+		VERBOSE(stdout, "Re-read environments, generation %u.\n",
+			st->generation);
+	}
+}
+
+static void handle_inotify(struct daemon_state *st)
+{
+	uint8_t buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	bool need_reprobe = false, need_reread = false;
+	ssize_t len;
+
+	while ((len = read(st->inotify_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (uint8_t *p = buf; p < buf + len;
+		     p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->wd == st->dev_wd) {
+				char path[sizeof("/dev/") + NAME_MAX];
+				struct stat s;
+
+				snprintf(path, sizeof(path), "/dev/%s",
+					 ev->name);
+				if (stat(path, &s) == 0 && S_ISBLK(s.st_mode)) {
+					need_reprobe = true;
+				}
+			} else if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+				need_reprobe = true;
+			} else {
+				need_reread = true;
+			}
+		}
+	}
+	if (need_reprobe) {
+		reprobe(st);
+	} else if (need_reread) {
+		reread(st);
+	}
+}
+
+static void fill_event(const struct daemon_state *st,
+		       struct ebgenvd_event *ev)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->magic = EBGENVD_MAGIC;
+	ev->generation = st->generation;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && st->ready; i++) {
+		ev->parts[i].revision = envdata[i].revision;
+		ev->parts[i].ustate = envdata[i].ustate;
+	}
+}
+
+/* never blocks, the socket buffer holds many events */
+static bool send_event(int fd, const struct ebgenvd_event *ev)
+{
+	return send(fd, ev, sizeof(*ev), MSG_NOSIGNAL | MSG_DONTWAIT) ==
+	       sizeof(*ev);
+}
+
+static void drop_watcher(struct daemon_state *st, unsigned int i)
+{
+	close(st->watch_fd[i]);
+	st->watch_fd[i] = st->watch_fd[--st->num_watchers];
+}
+
+static void notify_watchers(struct daemon_state *st)
+{
+	struct ebgenvd_event ev;
+
+	fill_event(st, &ev);
+	if (memcmp(ev.parts, st->last_event.parts, sizeof(ev.parts)) == 0) {
+		return;
+	}
+	st->last_event = ev;
+	for (unsigned int i = 0; i < st->num_watchers;) {
+		if (send_event(st->watch_fd[i], &ev)) {
+			i++;
+			continue;
+		}
+		VERBOSE(stderr, "Dropping watcher which does not keep up.\n");
+		drop_watcher(st, i);
+	}
+}
+
+static int send_response(int fd, const struct daemon_state *st, int status)
+{
+	struct ebgenvd_response resp = {
+		.magic = EBGENVD_MAGIC,
+		.status = status,
+		.flags = ebgenv_opts.search_all_devices
+				 ? EBGENVD_FLAG_ALL_DEVICES
+				 : 0,
+		.num_parts = ENV_NUM_CONFIG_PARTS,
+		.generation = st->generation,
+	};
+
+	return ebgenvd_send(fd, &resp, sizeof(resp));
+}
+
+static int send_snapshot(int fd, const struct daemon_state *st)
+{
+	int res = send_response(fd, st, 0);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && !res; i++) {
+		const char *devpath = config_parts[i].devpath;
+		uint32_t len = devpath ? strlen(devpath) : 0;
+
+		res = ebgenvd_send(fd, &len, sizeof(len));
+		if (!res) {
+			res = ebgenvd_send(fd, devpath, len);
+		}
+		if (!res) {
+			res = ebgenvd_send(fd, &envdata[i], sizeof(BG_ENVDATA));
+		}
+	}
+	return res;
+}
+
+static int write_snapshot(int fd, struct daemon_state *st,
+			  const struct ebgenvd_request *req)
+{
+	static BG_ENVDATA data;
+	int res;
+
+	/* always consume the payload */
+	res = ebgenvd_recv(fd, &data, sizeof(data));
+	if (res) {
+		return res;
+	}
+	if (!st->ready) {
+		return -ENODEV;
+	}
+	/* the snapshot of the client must still match what is on disk */
+	reread(st);
+	if (req->generation != st->generation) {
+		return -ESTALE;
+	}
+	if (req->index >= ENV_NUM_CONFIG_PARTS) {
+		return -EINVAL;
+	}
+	envdata[req->index] = data;
+	if (!write_env(&config_parts[req->index], &envdata[req->index])) {
+		fprintf(stderr, "Could not write to %s\n",
+			config_parts[req->index].devpath);
+		read_env(&config_parts[req->index], &envdata[req->index]);
+		return -EIO;
+	}
+	/* keep the copy as it reads back, so that the next reread() does not
+	 * take this write for a foreign one */
+	memset(&envdata[req->index], 0, sizeof(BG_ENVDATA));
+	read_env(&config_parts[req->index], &envdata[req->index]);
+	VERBOSE(stdout, "Wrote environment to %s.\n",
+		config_parts[req->index].devpath);
+	return 0;
+}
+
+static void serve(int listen_fd, struct daemon_state *st)
+{
+	struct timeval tv = {
+		.tv_sec = EBGENVD_TIMEOUT_MS / 1000,
+		.tv_usec = (EBGENVD_TIMEOUT_MS % 1000) * 1000,
+	};
+	struct ebgenvd_request req;
+	struct ebgenvd_event ev;
+	uint32_t flags;
+	int fd, res;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	/* a stuck client must not block the others for long */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ||
+	    ebgenvd_recv(fd, &req, sizeof(req))) {
+		close(fd);
+		return;
+	}
+
+	if (req.magic != EBGENVD_MAGIC || req.version != EBGENVD_VERSION) {
+		send_response(fd, st, -EPROTO);
+		close(fd);
+		return;
+	}
+	switch (req.cmd) {
+	case EBGENVD_CMD_GET:
+		flags = ebgenv_opts.search_all_devices
+				? EBGENVD_FLAG_ALL_DEVICES
+				: 0;
+		if ((req.flags & EBGENVD_FLAG_ALL_DEVICES) != flags) {
+			res = -EOPNOTSUPP;
+		} else if (!st->ready) {
+			res = -ENODEV;
+		} else {
+			/* inotify misses writes through a mount of the
+			 * partition, so do not trust the cached copy */
+			reread(st);
+			send_snapshot(fd, st);
+			close(fd);
+			return;
+		}
+		break;
+	case EBGENVD_CMD_WRITE:
+		res = write_snapshot(fd, st, &req);
+		break;
+	case EBGENVD_CMD_RELOAD:
+		reprobe(st);
+		res = st->ready ? 0 : -ENODEV;
+		break;
+	case EBGENVD_CMD_WATCH:
+		if (st->num_watchers == MAX_WATCHERS) {
+			res = -EMFILE;
+			break;
+		}
+		fill_event(st, &ev);
+		if (send_response(fd, st, 0) == 0 && send_event(fd, &ev)) {
+			st->watch_fd[st->num_watchers++] = fd;
+		} else {
+			close(fd);
+		}
+		return;
+	default:
+		res = -EOPNOTSUPP;
+		break;
+	}
+	send_response(fd, st, res);
+	close(fd);
+}
+
+static int create_socket(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	mode_t mask;
+	int fd, res;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "ebgenvd is already running on %s.\n", path);
+		close(fd);
+		return -1;
+	}
+	/* remove a stale socket of a previous instance */
+	unlink(path);
+
+	/* the environments are only accessible to root without the daemon */
+	mask = umask(0077);
+	res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (res || listen(fd, SOMAXCONN)) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	struct arguments_ebgenvd arguments = {
+		.socket = ebgenvd_socket_path(),
+	};
+	struct argp argp_ebgenvd = {
+		.options = options_ebgenvd,
+		.parser = parse_opt,
+		.doc = doc,
+	};
+	struct daemon_state st = {
+		.inotify_fd = -1,
+		.dev_wd = -1,
+	};
+	struct signalfd_siginfo si;
+	struct pollfd fds[3 + MAX_WATCHERS];
+	sigset_t mask;
+	int listen_fd, signal_fd;
+	bool running = true;
+	error_t e;
+
+	e = argp_parse(&argp_ebgenvd, argc, argv, 0, 0, &arguments);
+	if (e) {
+		return e;
+	}
+
+	/* the daemon is the one probing and must not query itself */
+	ebg_set_opt_bool(EBG_OPT_USE_DAEMON, false);
+	ebg_set_opt_bool(EBG_OPT_PROBE_CACHE, true);
+	if (arguments.search_all_devices) {
+		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, true);
+	}
+	if (arguments.verbosity) {
+		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		fprintf(stderr, "Cannot create signalfd: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	reprobe(&st);
+	if (!st.ready) {
+		close(signal_fd);
+		return 1;
+	}
+
+	listen_fd = create_socket(arguments.socket);
+	if (listen_fd < 0) {
+		bgenv_finalize();
+		close(signal_fd);
+		return 1;
+	}
+	VERBOSE(stdout, "Listening on %s.\n", arguments.socket);
+
+	while (running) {
+		fds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+		fds[1] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+		fds[2] = (struct pollfd){.fd = st.inotify_fd, .events = POLLIN};
+		for (unsigned int i = 0; i < st.num_watchers; i++) {
+			fds[3 + i] = (struct pollfd){.fd = st.watch_fd[i],
+						     .events = POLLIN};
+		}
+
+		release_temp_mounts();
+		if (poll(fds, 3 + st.num_watchers, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+		/* watchers do not send anything but hang up */
+		for (unsigned int i = st.num_watchers; i-- > 0;) {
+			if (fds[3 + i].revents) {
+				drop_watcher(&st, i);
+			}
+		}
+		/* pick up changes before answering requests */
+		if (fds[2].revents & POLLIN) {
+			handle_inotify(&st);
+		}
+		if (fds[1].revents & POLLIN &&
+		    read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+			if (si.ssi_signo == SIGHUP) {
+				reprobe(&st);
+			} else {
+				running = false;
+			}
+		}
+		if (running && fds[0].revents & POLLIN) {
+			serve(listen_fd, &st);
+		}
+		notify_watchers(&st);
+	}
+
+	while (st.num_watchers > 0) {
+		drop_watcher(&st, 0);
+	}
+
+	close(listen_fd);
+	unlink(arguments.socket);
+	close(signal_fd);
+	if (st.inotify_fd >= 0) {
+		close(st.inotify_fd);
+	}
+	bgenv_finalize();
+	return 0;
+}
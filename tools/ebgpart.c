@@ -17,20 +17,42 @@
  */
 
 #include "ebgpart.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/sysmacros.h>
 #include "fat.h"
+#include "env_stats.h"
+#include "thread_pool.h"
+
+/* upper bound of devices whose partition tables are read concurrently */
+#define PROBE_THREADS_MAX 8
+
+/* upper bound of logical partitions, as DISK_MAX_PARTS of Linux */
+#define EBR_CHAIN_MAX 256
 
 static PedDevice *first_device = NULL;
 static PedDisk g_ped_dummy_disk;
-static char buffer[37];
 
 static bool verbosity = false;
+static bool parallel = false;
+static unsigned int probe_timeout_ms;
 
 void ebgpart_beverbose(bool v)
 {
 	verbosity = v;
 }
 
+void ebgpart_probe_parallel(bool v)
+{
+	parallel = v;
+}
+
+void ebgpart_probe_timeout(unsigned int ms)
+{
+	probe_timeout_ms = ms;
+}
+
 static void add_block_dev(PedDevice *dev)
 {
 	if (!first_device) {
@@ -44,7 +66,163 @@ static void add_block_dev(PedDevice *dev)
 	d->next = dev;
 }
 
-static char *GUID_to_str(const uint8_t *g)
+/* A scan of a partition table which may outlive the wait for its result,
+ * see scan_partition_table_bounded() */
+struct probe_job {
+	PedDevice *dev;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	bool done;
+	bool abandoned;
+	bool result;
+};
+
+/* Devices and partitions are allocated along with their strings, a device
+ * also with the job scanning it, so that all of them come from fixed pools
+ * with EBG_STATIC_ALLOC. */
+struct device_slot {
+	PedDevice dev;
+	char model[4];
+	char path[DEV_FILENAME_LEN + 16];
+	struct probe_job job;
+#ifdef EBG_STATIC_ALLOC
+	bool used;
+#endif
+};
+
+struct partition_slot {
+	PedPartition part;
+	char devpath[DEV_FILENAME_LEN + 16];
+#ifdef EBG_STATIC_ALLOC
+	bool used;
+#endif
+};
+
+#ifdef EBG_STATIC_ALLOC
+/* a device given up on by scan_partition_table_bounded() keeps its slots
+ * until its scan returns */
+static struct device_slot device_slots[EBG_MAX_DEVICES];
+static struct partition_slot partition_slots[EBG_MAX_PARTITIONS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device_slot *device_slot_get(void)
+{
+	struct device_slot *slot = NULL;
+
+	pthread_mutex_lock(&slot_lock);
+	for (size_t i = 0; i < EBG_MAX_DEVICES; i++) {
+		if (!device_slots[i].used) {
+			slot = &device_slots[i];
+			memset(slot, 0, sizeof(*slot));
+			slot->used = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&slot_lock);
+	return slot;
+}
+
+static void device_slot_put(struct device_slot *slot)
+{
+	pthread_mutex_lock(&slot_lock);
+	slot->used = false;
+	pthread_mutex_unlock(&slot_lock);
+}
+
+static struct partition_slot *partition_slot_get(void)
+{
+	struct partition_slot *slot = NULL;
+
+	pthread_mutex_lock(&slot_lock);
+	for (size_t i = 0; i < EBG_MAX_PARTITIONS; i++) {
+		if (!partition_slots[i].used) {
+			slot = &partition_slots[i];
+			memset(slot, 0, sizeof(*slot));
+			slot->used = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&slot_lock);
+	return slot;
+}
+
+static void partition_slot_put(struct partition_slot *slot)
+{
+	pthread_mutex_lock(&slot_lock);
+	slot->used = false;
+	pthread_mutex_unlock(&slot_lock);
+}
+#else
+static struct device_slot *device_slot_get(void)
+{
+	return calloc(1, sizeof(struct device_slot));
+}
+
+static void device_slot_put(struct device_slot *slot)
+{
+	free(slot);
+}
+
+static struct partition_slot *partition_slot_get(void)
+{
+	return calloc(1, sizeof(struct partition_slot));
+}
+
+static void partition_slot_put(struct partition_slot *slot)
+{
+	free(slot);
+}
+#endif
+
+static PedDevice *ped_device_new(const char *path)
+{
+	struct device_slot *slot;
+
+	if (strlen(path) >= sizeof(slot->path)) {
+		return NULL;
+	}
+	slot = device_slot_get();
+	if (!slot) {
+		VERBOSE(stderr, "Out of device slots, skipping %s\n", path);
+		return NULL;
+	}
+	strcpy(slot->model, "N/A");
+	strcpy(slot->path, path);
+	slot->dev.model = slot->model;
+	slot->dev.path = slot->path;
+	return &slot->dev;
+}
+
+static inline struct device_slot *device_to_slot(PedDevice *dev)
+{
+	return (struct device_slot *)dev;
+}
+
+static PedPartition *ped_partition_new(void)
+{
+	struct partition_slot *slot = partition_slot_get();
+
+	return slot ? &slot->part : NULL;
+}
+
+static bool ped_partition_set_devpath(PedPartition *p, const char *devpath)
+{
+	struct partition_slot *slot = (struct partition_slot *)p;
+
+	if (strlen(devpath) >= sizeof(slot->devpath)) {
+		return false;
+	}
+	strcpy(slot->devpath, devpath);
+	p->devpath = slot->devpath;
+	return true;
+}
+
+static inline void ped_partition_destroy(PedPartition *p)
+{
+	partition_slot_put((struct partition_slot *)p);
+}
+
+static char *GUID_to_str(const uint8_t *g, char buffer[37])
 {
 	(void)snprintf(buffer, 37,
 		       "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
@@ -73,6 +251,9 @@ static EbgFileSystemType type_to_fstype(char t)
 	return FS_TYPE_UNKNOWN;
 }
 
+static const uint8_t guid_fat_ntfs[16] = GPT_PARTITION_GUID_FAT_NTFS;
+static const uint8_t guid_esp[16] = GPT_PARTITION_GUID_ESP;
+
 /**
  * @brief Determines the FAT bit size of a disk or partition.
  *
@@ -85,45 +266,27 @@ static EbgFileSystemType type_to_fstype(char t)
  **/
 static int check_GPT_FAT_entry(int fd, const struct EFIpartitionentry *e)
 {
-	char *guid_str = GUID_to_str(e->type_GUID);
-	if (strcmp(GPT_PARTITION_GUID_FAT_NTFS, guid_str) != 0 &&
-	    strcmp(GPT_PARTITION_GUID_ESP, guid_str) != 0) {
-		VERBOSE(stderr, "GPT entry has unsupported GUID: %s\n",
-			guid_str);
+	if (memcmp(e->type_GUID, guid_fat_ntfs, sizeof(guid_fat_ntfs)) != 0 &&
+	    memcmp(e->type_GUID, guid_esp, sizeof(guid_esp)) != 0) {
+		if (verbosity) {
+			char guid_buffer[37];
+
+			fprintf(stderr, "GPT entry has unsupported GUID: %s\n",
+				GUID_to_str(e->type_GUID, guid_buffer));
+		}
 		return 0;
 	}
 	VERBOSE(stdout, "GPT Partition has a FAT/NTFS GUID\n");
 
-	/* Save current file offset */
-	off64_t curr = lseek64(fd, 0, SEEK_CUR);
-	if (curr == -1) {
-		VERBOSE(stderr, "Error getting current seek position: %s\n",
-			strerror(errno));
-		return -1;
-	}
-
-	/* seek to partition start */
-	off64_t offset_start = (off64_t)e->start_LBA * LB_SIZE;
-	if (lseek64(fd, offset_start, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error seeking to partition start: %s\n",
-			strerror(errno));
-		return -1;
-	}
-
 	/* read FAT header */
 	struct fat_boot_sector header;
-	if (read(fd, &header, sizeof(header)) != sizeof(header)) {
+	off64_t offset_start = (off64_t)e->start_LBA * LB_SIZE;
+	if (pread64(fd, &header, sizeof(header), offset_start) !=
+	    sizeof(header)) {
 		VERBOSE(stderr, "Error reading FAT header: %s\n",
 			strerror(errno));
 		return -1;
 	}
-
-	/* restore pos */
-	if (lseek64(fd, curr, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error restoring seek position (%s)",
-			strerror(errno));
-		return -1;
-	}
 	return determine_FAT_bits(&header, verbosity);
 }
 
@@ -148,44 +311,74 @@ static inline EbgFileSystemType fat_size_to_fs_type(int fat_size)
 	}
 }
 
-static void read_GPT_entries(int fd, uint64_t table_LBA, uint32_t num,
+static void read_GPT_entries(int fd, const struct EFIHeader *efihdr,
 			     PedDevice *dev)
 {
-	off64_t offset;
-	struct EFIpartitionentry e;
+	uint32_t num = efihdr->partitions;
+	uint32_t entry_size = efihdr->partitionentrysize;
+	/* the entry array is read in pieces as far as it is in use */
+	uint8_t chunk[16 * 1024];
+	off64_t table_start, table_end;
+	off64_t chunk_start = 0, chunk_end = 0;
 	PedPartition *tmpp;
 
-	offset = LB_SIZE * table_LBA;
-	if (lseek64(fd, offset, SEEK_SET) != offset) {
-		VERBOSE(stderr, "Error seeking EFI partition table\n");
+	if (entry_size < sizeof(struct EFIpartitionentry) ||
+	    (uint64_t)num * entry_size > GPT_ENTRY_ARRAY_MAX) {
+		VERBOSE(stderr, "Invalid EFI partition table size\n");
 		return;
 	}
+	table_start = (off64_t)LB_SIZE * efihdr->partitiontable_LBA;
+	table_end = table_start + (off64_t)num * entry_size;
 
 	PedPartition **list_end = &dev->part_list;
 
 	for (uint32_t i = 0; i < num; i++) {
-		if (read(fd, &e, sizeof(e)) != sizeof(e)) {
-			VERBOSE(stderr, "Error reading partition entry\n");
-			VERBOSE(stderr, "(%s)\n", strerror(errno));
-			return;
+		struct EFIpartitionentry e;
+		static const uint8_t unused_GUID[16];
+		off64_t offset = table_start + (off64_t)i * entry_size;
+
+		if (offset < chunk_start ||
+		    offset + (off64_t)sizeof(e) > chunk_end) {
+			size_t len = sizeof(chunk);
+
+			if ((off64_t)len > table_end - offset) {
+				len = (size_t)(table_end - offset);
+			}
+			if (pread64(fd, chunk, len, offset) != (ssize_t)len) {
+				VERBOSE(stderr,
+					"Error reading partition entries\n");
+				VERBOSE(stderr, "(%s)\n", strerror(errno));
+				break;
+			}
+			chunk_start = offset;
+			chunk_end = offset + (off64_t)len;
 		}
-		if ((*((uint64_t *)&e.type_GUID[0]) == 0) &&
-		    (*((uint64_t *)&e.type_GUID[8]) == 0)) {
-			return;
+		memcpy(&e, chunk + (offset - chunk_start), sizeof(e));
+		if (memcmp(e.type_GUID, unused_GUID, sizeof(unused_GUID)) ==
+		    0) {
+			break;
+		}
+		if (verbosity) {
+			char guid_buffer[37];
+
+			fprintf(stdout, "%u: %s\n", i,
+				GUID_to_str(e.type_GUID, guid_buffer));
+		}
+		if (memcmp(e.type_GUID, guid_esp, sizeof(guid_esp)) == 0) {
+			dev->has_esp = true;
 		}
-		VERBOSE(stdout, "%u: %s\n", i, GUID_to_str(e.type_GUID));
 
-		tmpp = calloc(sizeof(PedPartition), 1);
+		tmpp = ped_partition_new();
 		if (!tmpp) {
 			VERBOSE(stderr, "Out of memory\n");
-			return;
+			break;
 		}
 		tmpp->num = i + 1;
 
 		int result = check_GPT_FAT_entry(fd, &e);
 		if (result < 0) {
 			VERBOSE(stderr, "%u: I/O error, skipping device\n", i);
-			free(tmpp);
+			ped_partition_destroy(tmpp);
 			dev->part_list = NULL;
 			continue;
 		}
@@ -196,56 +389,71 @@ static void read_GPT_entries(int fd, uint64_t table_LBA, uint32_t num,
 	}
 }
 
+/*
+ * Logical partitions are numbered from 5 in the order of the EBR chain. A
+ * corrupt chain may be cyclic, thus it is followed for a limited number of
+ * hops only.
+ */
 static void scanLogicalVolumes(int fd, off64_t extended_start_LBA,
-			       struct Masterbootrecord *ebr, int i,
-			       PedPartition *partition, int lognum)
+			       PedPartition *partition)
 {
-	struct Masterbootrecord next_ebr;
+	struct Masterbootrecord ebr;
+	off64_t ebr_LBA = extended_start_LBA;
 
-	off64_t offset = extended_start_LBA + ebr->parttable[i].start_LBA;
-	if (extended_start_LBA == 0) {
-		extended_start_LBA = offset;
-	}
-	VERBOSE(stdout, "Seeking to LBA %llu\n", (unsigned long long)offset);
-	off64_t res = lseek64(fd, offset * LB_SIZE, SEEK_SET);
-	if (res == -1) {
-		VERBOSE(stderr, "(%s)\n", strerror(errno));
-		return;
-	}
-	VERBOSE(stdout, "Seek returned %lld\n", (signed long long)res);
-	if (read(fd, &next_ebr, sizeof(next_ebr)) != sizeof(next_ebr)) {
-		VERBOSE(stderr, "Error reading next EBR (%s)\n",
-			strerror(errno));
-		return;
-	}
-	if (next_ebr.mbrsignature != 0xaa55) {
-		VERBOSE(stderr, "Wrong signature of extended boot record.\n");
-		return;
-	}
+	for (int lognum = 5; lognum < 5 + EBR_CHAIN_MAX; lognum++) {
+		off64_t next_LBA = 0;
 
-	for (uint8_t j = 0; j < 4; j++) {
-		uint8_t t = next_ebr.parttable[j].partition_type;
-		if (t == 0) {
+		VERBOSE(stdout, "Reading EBR at LBA %llu\n",
+			(unsigned long long)ebr_LBA);
+		if (pread64(fd, &ebr, sizeof(ebr), ebr_LBA * LB_SIZE) !=
+		    sizeof(ebr)) {
+			VERBOSE(stderr, "Error reading next EBR (%s)\n",
+				strerror(errno));
 			return;
 		}
-		if (t == MBR_TYPE_EXTENDED || t == MBR_TYPE_EXTENDED_LBA) {
-			VERBOSE(stdout, "Next EBR found.\n");
-			scanLogicalVolumes(fd, extended_start_LBA, &next_ebr, j,
-					   partition, lognum + 1);
-			continue;
+		if (ebr.mbrsignature != 0xaa55) {
+			VERBOSE(stderr,
+				"Wrong signature of extended boot record.\n");
+			return;
 		}
-		partition->next = calloc(sizeof(PedPartition), 1);
-		if (!partition->next) {
-			goto scl_out_of_mem;
+
+		for (uint8_t j = 0; j < 4; j++) {
+			uint8_t t = ebr.parttable[j].partition_type;
+			if (t == 0) {
+				break;
+			}
+			if (t == MBR_TYPE_EXTENDED ||
+			    t == MBR_TYPE_EXTENDED_LBA) {
+				/* links are relative to the extended
+				 * partition, only the first one counts */
+				if (!next_LBA) {
+					next_LBA = extended_start_LBA +
+						   ebr.parttable[j].start_LBA;
+				}
+				continue;
+			}
+			partition->next = ped_partition_new();
+			if (!partition->next) {
+				VERBOSE(stderr, "Out of memory\n");
+				return;
+			}
+			partition = partition->next;
+			partition->num = lognum;
+			partition->fs_type = type_to_fstype(t);
+		}
+
+		if (!next_LBA) {
+			return;
+		}
+		if (next_LBA == ebr_LBA) {
+			VERBOSE(stderr, "EBR links to itself.\n");
+			return;
 		}
-		partition = partition->next;
-		partition->num = lognum;
-		partition->fs_type = type_to_fstype(t);
+		VERBOSE(stdout, "Next EBR found.\n");
+		ebr_LBA = next_LBA;
 	}
-	return;
-scl_out_of_mem:
-	VERBOSE(stderr, "Out of memory\n");
-	free(partition->next);
+	VERBOSE(stderr, "More than %d logical partitions, skipping the rest\n",
+		EBR_CHAIN_MAX);
 }
 
 static bool check_partition_table(PedDevice *dev)
@@ -254,12 +462,13 @@ static bool check_partition_table(PedDevice *dev)
 	struct Masterbootrecord mbr;
 
 	VERBOSE(stdout, "Checking %s\n", dev->path);
-	fd = open(dev->path, O_RDONLY);
+	/* does not wait for the media of removable drives */
+	fd = open(dev->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
 	if (fd < 0) {
 		VERBOSE(stderr, "Cannot open block device, skipping...\n");
 		return false;
 	}
-	if (read(fd, &mbr, sizeof(mbr)) != sizeof(mbr)) {
+	if (pread64(fd, &mbr, sizeof(mbr), 0) != sizeof(mbr)) {
 		VERBOSE(stderr, "Cannot read MBR on %s, skipping...\n",
 			dev->path);
 		close(fd);
@@ -281,19 +490,16 @@ static bool check_partition_table(PedDevice *dev)
 		VERBOSE(stdout, "Partition %d: Type %X\n", i,
 			mbr.parttable[i].partition_type);
 		uint8_t t = mbr.parttable[i].partition_type;
+		if (t == MBR_TYPE_ESP) {
+			dev->has_esp = true;
+		}
 		if (t == MBR_TYPE_GPT) {
 			VERBOSE(stdout, "GPT header at %X\n",
 				mbr.parttable[i].start_LBA);
 			off64_t offset = LB_SIZE *
 			    (off64_t)mbr.parttable[i].start_LBA;
-			if (lseek64(fd, offset, SEEK_SET) != offset) {
-				VERBOSE(stderr, "Error seeking EFI Header\n.");
-				VERBOSE(stderr, "(%s)", strerror(errno));
-				close(fd);
-				return false;
-			}
 			struct EFIHeader efihdr;
-			if (read(fd, &efihdr, sizeof(efihdr)) !=
+			if (pread64(fd, &efihdr, sizeof(efihdr), offset) !=
 			    sizeof(efihdr)) {
 				close(fd);
 				VERBOSE(stderr, "Error reading EFI Header\n.");
@@ -309,11 +515,10 @@ static bool check_partition_table(PedDevice *dev)
 				efihdr.partitions);
 			VERBOSE(stdout, "Partition Table @ LBA %llu\n",
 				(unsigned long long)efihdr.partitiontable_LBA);
-			read_GPT_entries(fd, efihdr.partitiontable_LBA,
-					 efihdr.partitions, dev);
+			read_GPT_entries(fd, &efihdr, dev);
 			break;
 		}
-		tmp = calloc(sizeof(PedPartition), 1);
+		tmp = ped_partition_new();
 		if (!tmp) {
 			goto cpt_out_of_mem;
 		}
@@ -325,10 +530,11 @@ static bool check_partition_table(PedDevice *dev)
 
 		if (t == MBR_TYPE_EXTENDED || t == MBR_TYPE_EXTENDED_LBA) {
 			tmp->fs_type = FS_TYPE_EXTENDED;
-			scanLogicalVolumes(fd, 0, &mbr, i, tmp, 5);
+			scanLogicalVolumes(fd, mbr.parttable[i].start_LBA,
+					   tmp);
 			/* Could be we still have MBR entries after
 			 * logical volumes */
-			while ((*list_end)->next) {
+			while (*list_end) {
 				list_end = &((*list_end)->next);
 			}
 		} else {
@@ -338,7 +544,6 @@ static bool check_partition_table(PedDevice *dev)
 	cpt_out_of_mem:
 		close(fd);
 		VERBOSE(stderr, "Out of mem while checking partition table\n.");
-		free(tmp);
 		return false;
 	}
 	close(fd);
@@ -348,37 +553,164 @@ static bool check_partition_table(PedDevice *dev)
 	return true;
 }
 
-static int scan_devdir(unsigned int fmajor, unsigned int fminor, char *fullname,
-		       unsigned int maxlen)
+#ifdef EBG_STATIC_ALLOC
+/* without a map of the device nodes, DEVDIR is searched for each device */
+struct devnode_map {
+	bool unused;
+};
+
+static void devnode_map_free(struct devnode_map *map)
 {
+	(void)map;
+}
+
+static int scan_devdir(struct devnode_map *map, unsigned int fmajor,
+		       unsigned int fminor, char *fullname, unsigned int maxlen)
+{
+	dev_t rdev = makedev(fmajor, fminor);
+	struct dirent *devfile;
+	DIR *devdir;
 	int result = -1;
 
-	DIR *devdir = opendir(DEVDIR);
+	(void)map;
+	devdir = opendir(DEVDIR);
 	if (!devdir) {
 		VERBOSE(stderr, "Failed to open %s\n", DEVDIR);
-		return result;
+		return -1;
 	}
-	while (true) {
-		struct dirent *devfile = readdir(devdir);
-		if (!devfile) {
-			break;
+	int fd = dirfd(devdir);
+	while (result != 0 && (devfile = readdir(devdir))) {
+		struct stat statbuf;
+
+		if (fstatat(fd, devfile->d_name, &statbuf, 0) == -1 ||
+		    !S_ISBLK(statbuf.st_mode) || statbuf.st_rdev != rdev) {
+			continue;
 		}
 		(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR,
 			       devfile->d_name);
+		VERBOSE(stdout, "Node found: %s\n", fullname);
+		result = 0;
+	}
+	closedir(devdir);
+	return result;
+}
+#else
+/* device nodes in DEVDIR, sorted by device number */
+struct devnode {
+	dev_t rdev;
+	char *name;
+};
+
+struct devnode_map {
+	struct devnode *nodes;
+	size_t count;
+	bool scanned;
+};
+
+static int compare_devnodes(const void *a, const void *b)
+{
+	dev_t ra = ((const struct devnode *)a)->rdev;
+	dev_t rb = ((const struct devnode *)b)->rdev;
+
+	return (ra > rb) - (ra < rb);
+}
+
+static void devnode_map_free(struct devnode_map *map)
+{
+	for (size_t i = 0; i < map->count; i++) {
+		free(map->nodes[i].name);
+	}
+	free(map->nodes);
+	memset(map, 0, sizeof(*map));
+}
+
+/* Scan DEVDIR once and record all block device nodes */
+static void devnode_map_scan(struct devnode_map *map)
+{
+	struct dirent *devfile;
+	DIR *devdir;
+
+	map->scanned = true;
+	devdir = opendir(DEVDIR);
+	if (!devdir) {
+		VERBOSE(stderr, "Failed to open %s\n", DEVDIR);
+		return;
+	}
+	int fd = dirfd(devdir);
+	while ((devfile = readdir(devdir))) {
 		struct stat statbuf;
-		if (stat(fullname, &statbuf) == -1) {
-			VERBOSE(stderr, "stat failed on %s\n", fullname);
+
+		if (fstatat(fd, devfile->d_name, &statbuf, 0) == -1 ||
+		    !S_ISBLK(statbuf.st_mode)) {
+			continue;
+		}
+		struct devnode *tmp = realloc(map->nodes, (map->count + 1) *
+							      sizeof(*tmp));
+		if (!tmp) {
 			break;
 		}
-		if (major(statbuf.st_rdev) == fmajor &&
-		    minor(statbuf.st_rdev) == fminor) {
-			VERBOSE(stdout, "Node found: %s\n", fullname);
-			result = 0;
+		map->nodes = tmp;
+		map->nodes[map->count].rdev = statbuf.st_rdev;
+		map->nodes[map->count].name = strdup(devfile->d_name);
+		if (!map->nodes[map->count].name) {
 			break;
 		}
+		map->count++;
 	}
 	closedir(devdir);
+	qsort(map->nodes, map->count, sizeof(*map->nodes), compare_devnodes);
+}
+
+static int scan_devdir(struct devnode_map *map, unsigned int fmajor,
+		       unsigned int fminor, char *fullname, unsigned int maxlen)
+{
+	struct devnode key = {.rdev = makedev(fmajor, fminor)};
+	struct devnode *node;
+
+	if (!map->scanned) {
+		devnode_map_scan(map);
+	}
+	node = bsearch(&key, map->nodes, map->count, sizeof(*map->nodes),
+		       compare_devnodes);
+	if (!node) {
+		return -1;
+	}
+	(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR, node->name);
+	VERBOSE(stdout, "Node found: %s\n", fullname);
+	return 0;
+}
+#endif
+
+/* Resolve the device node via the DEVNAME of the device's uevent */
+static int lookup_uevent_devname(unsigned int fmajor, unsigned int fminor,
+				 char *fullname, unsigned int maxlen)
+{
+	char line[DEV_FILENAME_LEN + 16];
+	struct stat statbuf;
+	int result = -1;
+	FILE *fh;
 
+	(void)snprintf(line, sizeof(line), "/sys/dev/block/%u:%u/uevent",
+		       fmajor, fminor);
+	fh = fopen(line, "re");
+	if (!fh) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fh)) {
+		if (strncmp(line, "DEVNAME=", 8) != 0) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR, line + 8);
+		if (stat(fullname, &statbuf) == 0 &&
+		    S_ISBLK(statbuf.st_mode) &&
+		    statbuf.st_rdev == makedev(fmajor, fminor)) {
+			VERBOSE(stdout, "Node found: %s\n", fullname);
+			result = 0;
+		}
+		break;
+	}
+	(void)fclose(fh);
 	return result;
 }
 
@@ -400,10 +732,275 @@ static int get_major_minor(char *filename, unsigned int *major, unsigned int *mi
 	return 0;
 }
 
+static bool is_fat(const PedPartition *p)
+{
+	return p->fs_type == FS_TYPE_FAT12 || p->fs_type == FS_TYPE_FAT16 ||
+	       p->fs_type == FS_TYPE_FAT32;
+}
+
+/* The partitions of a disk are the children of its sysfs directory that hold
+ * a partition attribute with their number. */
+static void resolve_partition_nodes(PedDevice *dev)
+{
+	char path[DEV_FILENAME_LEN + 64];
+	char node[DEV_FILENAME_LEN + 16];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(dev->path, &st) != 0 || !S_ISBLK(st.st_mode)) {
+		return;
+	}
+	(void)snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		       major(st.st_rdev), minor(st.st_rdev));
+	dir = opendir(path);
+	if (!dir) {
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		unsigned int num, fmajor, fminor;
+		PedPartition *p;
+		FILE *fh;
+		int res;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		(void)snprintf(path, sizeof(path),
+			       "/sys/dev/block/%u:%u/%s/partition",
+			       major(st.st_rdev), minor(st.st_rdev),
+			       entry->d_name);
+		fh = fopen(path, "re");
+		if (!fh) {
+			continue;
+		}
+		res = fscanf(fh, "%u", &num);
+		(void)fclose(fh);
+		if (res != 1) {
+			continue;
+		}
+		for (p = dev->part_list; p && p->num != num; p = p->next) {
+		}
+		if (!p || !is_fat(p) || p->devpath) {
+			continue;
+		}
+		(void)snprintf(path, sizeof(path),
+			       "/sys/dev/block/%u:%u/%s/dev",
+			       major(st.st_rdev), minor(st.st_rdev),
+			       entry->d_name);
+		if (get_major_minor(path, &fmajor, &fminor) == 0 &&
+		    lookup_uevent_devname(fmajor, fminor, node,
+					  sizeof(node)) == 0) {
+			(void)ped_partition_set_devpath(p, node);
+		}
+	}
+	closedir(dir);
+}
+
+static void ped_device_destroy(PedDevice *d)
+{
+	if (!d) {
+		return;
+	}
+	PedPartition *p = d->part_list;
+	while (p) {
+		PedPartition *tmpp = p;
+
+		p = p->next;
+		ped_partition_destroy(tmpp);
+	}
+	device_slot_put(device_to_slot(d));
+}
+
+static bool scan_partition_table(PedDevice *dev)
+{
+	uint64_t start = bgenv_stat_begin();
+	bool result;
+
+	result = check_partition_table(dev);
+	if (result) {
+		resolve_partition_nodes(dev);
+	}
+	bgenv_stat_device(dev->path, start);
+	return result;
+}
+
+static void probe_job_free(struct probe_job *job)
+{
+	pthread_cond_destroy(&job->finished);
+	pthread_mutex_destroy(&job->lock);
+}
+
+static void *probe_job_run(void *arg)
+{
+	struct probe_job *job = arg;
+	bool result, abandoned;
+
+	result = scan_partition_table(job->dev);
+
+	pthread_mutex_lock(&job->lock);
+	job->result = result;
+	job->done = true;
+	abandoned = job->abandoned;
+	pthread_cond_signal(&job->finished);
+	pthread_mutex_unlock(&job->lock);
+	/* nobody waits anymore, the device is not used */
+	if (abandoned) {
+		PedDevice *dev = job->dev;
+
+		probe_job_free(job);
+		ped_device_destroy(dev);
+	}
+	return NULL;
+}
+
+static struct probe_job *probe_job_start(PedDevice *dev)
+{
+	struct probe_job *job = &device_to_slot(dev)->job;
+	pthread_condattr_t condattr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	bool started;
+
+	job->dev = dev;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&job->finished, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	started = pthread_create(&thread, &attr, probe_job_run, job) == 0;
+	pthread_attr_destroy(&attr);
+	if (!started) {
+		probe_job_free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/*
+ * Like scan_partition_table(), but gives up on a device which does not
+ * respond within probe_timeout_ms, as a read can block for good on a hung
+ * USB reader or a dead iSCSI LUN. The scan goes on in the background and
+ * frees the device once it returns. Returns 1 if the device holds a
+ * partition table, 0 if not and -ETIMEDOUT if the device was given up, it
+ * must not be used anymore then.
+ */
+static int scan_partition_table_bounded(PedDevice *dev)
+{
+	struct probe_job *job;
+	struct timespec deadline;
+	bool result;
+	int res = 0;
+
+	if (!probe_timeout_ms) {
+		return scan_partition_table(dev);
+	}
+	job = probe_job_start(dev);
+	if (!job) {
+		return scan_partition_table(dev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += probe_timeout_ms / 1000;
+	deadline.tv_nsec += (long)(probe_timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->done && res == 0) {
+		res = pthread_cond_timedwait(&job->finished, &job->lock,
+					     &deadline);
+	}
+	if (!job->done) {
+		fprintf(stderr,
+			"Warning: %s did not respond within %u ms, "
+			"skipping\n",
+			dev->path, probe_timeout_ms);
+		bgenv_stat_device_timeout(dev->path);
+		job->abandoned = true;
+		pthread_mutex_unlock(&job->lock);
+		return -ETIMEDOUT;
+	}
+	result = job->result;
+	pthread_mutex_unlock(&job->lock);
+	probe_job_free(job);
+	return result;
+}
+
+static void check_partition_table_worker(void *ctx, size_t index)
+{
+	PedDevice **devs = ctx;
+	int res = scan_partition_table_bounded(devs[index]);
+
+	if (res <= 0) {
+		if (res == 0) {
+			ped_device_destroy(devs[index]);
+		}
+		devs[index] = NULL;
+	}
+}
+
+/* Device classes which cannot hold config partitions, followed by a
+ * number in /sys/block */
+static const char *const skipped_device_classes[] = {
+	"zram",	/* compressed RAM, e.g. for swap */
+	"ram",	/* RAM disks */
+};
+
+/* Returns true if the device named devname in /sys/block need not be
+ * opened, as it cannot hold config partitions */
+static bool skip_device(const char *devname)
+{
+	char path[DEV_FILENAME_LEN + 32];
+	unsigned long long size;
+	FILE *fh;
+	int res;
+
+	for (size_t i = 0; i < sizeof(skipped_device_classes) /
+				       sizeof(skipped_device_classes[0]);
+	     i++) {
+		const char *prefix = skipped_device_classes[i];
+		size_t len = strlen(prefix);
+
+		if (strncmp(devname, prefix, len) == 0 &&
+		    isdigit((unsigned char)devname[len])) {
+			VERBOSE(stdout, "Skipping %s device %s\n", prefix,
+				devname);
+			return true;
+		}
+	}
+	/* removable drives without media have no size */
+	(void)snprintf(path, sizeof(path), "%s/%s/size", SYSBLOCKDIR,
+		       devname);
+	fh = fopen(path, "re");
+	if (!fh) {
+		return false;
+	}
+	res = fscanf(fh, "%llu", &size);
+	(void)fclose(fh);
+	if (res == 1 && size == 0) {
+		VERBOSE(stdout, "Skipping %s without media\n", devname);
+		return true;
+	}
+	return false;
+}
+
 void ped_device_probe_all(char *rootdev)
 {
 	struct dirent *sysblockfile = NULL;
 	char fullname[DEV_FILENAME_LEN+16];
+	struct devnode_map devnodes = {0};
+#ifdef EBG_STATIC_ALLOC
+	/* bounded by the device slots */
+	PedDevice *devs[EBG_MAX_DEVICES];
+#else
+	PedDevice **devs = NULL;
+#endif
+	size_t num_devs = 0;
 
 	DIR *sysblockdir = opendir(SYSBLOCKDIR);
 	if (!sysblockdir) {
@@ -425,6 +1022,9 @@ void ped_device_probe_all(char *rootdev)
 			}
 			devname = sysblockfile->d_name;
 		}
+		if (skip_device(devname)) {
+			continue;
+		}
 
 		(void)snprintf(fullname, sizeof(fullname), "/sys/block/%s/dev",
 			       devname);
@@ -443,57 +1043,59 @@ void ped_device_probe_all(char *rootdev)
 		if (stat(fullname, &statbuf) == -1) {
 			/* Node with same name not found in /dev, thus search
 			* for node with identical Major and Minor revision */
-			if (scan_devdir(fmajor, fminor, fullname,
+			if (lookup_uevent_devname(fmajor, fminor, fullname,
+						  sizeof(fullname)) != 0 &&
+			    scan_devdir(&devnodes, fmajor, fminor, fullname,
 					sizeof(fullname)) != 0) {
 				continue;
 			}
 		}
 		/* This is a block device, so add it to the list*/
-		PedDevice *dev = calloc(sizeof(PedDevice), 1);
+		PedDevice *dev = ped_device_new(fullname);
 		if (!dev) {
 			continue;
 		}
-		if (asprintf(&dev->model, "%s", "N/A") == -1) {
-			dev->model = NULL;
-			goto pedprobe_error;
-		}
-		if (asprintf(&dev->path, "%s", fullname) == -1) {
-			dev->path = NULL;
-			goto pedprobe_error;
+		if (parallel) {
+			/* partition tables are read below, all at once */
+#ifndef EBG_STATIC_ALLOC
+			PedDevice **tmp = realloc(devs, (num_devs + 1) *
+							    sizeof(*devs));
+			if (!tmp) {
+				ped_device_destroy(dev);
+				continue;
+			}
+			devs = tmp;
+#endif
+			devs[num_devs++] = dev;
+			continue;
 		}
-		if (check_partition_table(dev)) {
+		switch (scan_partition_table_bounded(dev)) {
+		case 1:
 			add_block_dev(dev);
 			continue;
+		case -ETIMEDOUT:
+			/* freed by the scan once it returns */
+			continue;
 		}
-pedprobe_error:
-		free(dev->model);
-		free(dev->path);
-		free(dev);
+		ped_device_destroy(dev);
 	} while (sysblockfile);
 
 	closedir(sysblockdir);
-}
-
-static inline void ped_partition_destroy(PedPartition *p)
-{
-	free(p);
-}
-
-static void ped_device_destroy(PedDevice *d)
-{
-	if (!d) {
-		return;
-	}
-	free(d->model);
-	free(d->path);
-	PedPartition *p = d->part_list;
-	while (p) {
-		PedPartition *tmpp = p;
+	devnode_map_free(&devnodes);
 
-		p = p->next;
-		ped_partition_destroy(tmpp);
+	if (num_devs) {
+		thread_pool_run(check_partition_table_worker, devs, num_devs,
+				PROBE_THREADS_MAX);
+		/* keep the order of /sys/block */
+		for (size_t i = 0; i < num_devs; i++) {
+			if (devs[i]) {
+				add_block_dev(devs[i]);
+			}
+		}
 	}
-	free(d);
+#ifndef EBG_STATIC_ALLOC
+	free(devs);
+#endif
 }
 
 PedDevice *ped_device_get_next(const PedDevice *dev)
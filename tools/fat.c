@@ -11,9 +11,13 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <linux/types.h>
 #include <linux/byteorder/little_endian.h>
@@ -185,3 +189,309 @@ int determine_FAT_bits(const struct fat_boot_sector *sector, bool verbosity)
 		return (total_clusters > MAX_FAT12) ? 16 : 12;
 	}
 }
+
+/* Convert a file name to the space padded 8.3 directory entry format */
+static int fat_short_name(const char *name, u8 out[MSDOS_NAME])
+{
+	const char *dot = strchr(name, '.');
+	size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext_len = dot ? strlen(dot + 1) : 0;
+
+	if (base_len == 0 || base_len > 8 || ext_len > 3) {
+		return -EINVAL;
+	}
+	memset(out, ' ', MSDOS_NAME);
+	for (size_t i = 0; i < base_len; i++) {
+		out[i] = toupper((unsigned char)name[i]);
+	}
+	for (size_t i = 0; i < ext_len; i++) {
+		out[8 + i] = toupper((unsigned char)dot[1 + i]);
+	}
+	return 0;
+}
+
+static int fat_pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t res = pread(fd, buf, len, offset);
+
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res < 0) {
+			return -errno;
+		}
+		if (res == 0) {
+			return -EIO;
+		}
+		buf = (u8 *)buf + res;
+		len -= res;
+		offset += res;
+	}
+	return 0;
+}
+
+static int fat_pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t res = pwrite(fd, buf, len, offset);
+
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res < 0) {
+			return -errno;
+		}
+		buf = (const u8 *)buf + res;
+		len -= res;
+		offset += res;
+	}
+	return 0;
+}
+
+/* Get the FAT entry of a cluster, i.e. the next cluster of the chain */
+static int fat_next_cluster(const struct fat_file *file, u32 cluster,
+			    u32 *next)
+{
+	u8 entry[4];
+	off_t offset;
+	int res;
+
+	switch (file->fat_bits) {
+	case 12:
+		offset = cluster + cluster / 2;
+		res = fat_pread_all(file->fd, entry, 2,
+				    file->fat_offset + offset);
+		*next = get_unaligned_le16(entry);
+		*next = (cluster & 1) ? *next >> 4 : *next & 0xFFF;
+		if (*next >= BAD_FAT12) {
+			*next = FAT_ENT_EOF;
+		}
+		break;
+	case 16:
+		res = fat_pread_all(file->fd, entry, 2,
+				    file->fat_offset + (off_t)cluster * 2);
+		*next = get_unaligned_le16(entry);
+		if (*next >= BAD_FAT16) {
+			*next = FAT_ENT_EOF;
+		}
+		break;
+	default:
+		res = fat_pread_all(file->fd, entry, 4,
+				    file->fat_offset + (off_t)cluster * 4);
+		*next = get_unaligned_le32(entry) & 0x0FFFFFFF;
+		if (*next >= BAD_FAT32) {
+			*next = FAT_ENT_EOF;
+		}
+		break;
+	}
+	return res;
+}
+
+static inline bool fat_cluster_valid(const struct fat_file *file, u32 cluster)
+{
+	return cluster >= 2 && cluster <= file->max_cluster;
+}
+
+static inline off_t fat_cluster_offset(const struct fat_file *file,
+				       u32 cluster)
+{
+	return file->data_offset + (off_t)(cluster - 2) * file->cluster_size;
+}
+
+/*
+ * Transfer len bytes from or to the start of the cluster chain, merging runs
+ * of consecutive clusters into a single request.
+ */
+static ssize_t fat_transfer(const struct fat_file *file, u8 *rbuf,
+			    const u8 *wbuf, size_t len)
+{
+	u32 cluster = file->first_cluster;
+	size_t done = 0;
+
+	while (done < len) {
+		u32 run_start = cluster, next;
+		size_t run_len = 0;
+		int res;
+
+		if (!fat_cluster_valid(file, cluster)) {
+			return -EIO;
+		}
+		/* extend the run while the chain is contiguous */
+		for (;;) {
+			run_len += file->cluster_size;
+			if (done + run_len >= len) {
+				next = FAT_ENT_EOF;
+				break;
+			}
+			res = fat_next_cluster(file, cluster, &next);
+			if (res) {
+				return res;
+			}
+			if (next != cluster + 1 ||
+			    !fat_cluster_valid(file, next)) {
+				break;
+			}
+			cluster = next;
+		}
+		if (run_len > len - done) {
+			run_len = len - done;
+		}
+		if (rbuf) {
+			res = fat_pread_all(file->fd, rbuf + done, run_len,
+					    fat_cluster_offset(file,
+							       run_start));
+		} else {
+			res = fat_pwrite_all(file->fd, wbuf + done, run_len,
+					     fat_cluster_offset(file,
+								run_start));
+		}
+		if (res) {
+			return res;
+		}
+		done += run_len;
+		cluster = next;
+	}
+	return done;
+}
+
+static int fat_match_entries(const struct msdos_dir_entry *de, size_t count,
+			     const u8 name[MSDOS_NAME], struct fat_file *file)
+{
+	for (size_t i = 0; i < count; i++, de++) {
+		if (de->name[0] == 0) {
+			/* end of directory */
+			return -ENOENT;
+		}
+		if (de->name[0] == DELETED_FLAG ||
+		    (de->attr & (ATTR_VOLUME | ATTR_DIR))) {
+			/* also skips long file name slots */
+			continue;
+		}
+		if (memcmp(de->name, name, MSDOS_NAME) == 0) {
+			file->first_cluster = le16_to_cpu(de->start);
+			if (file->fat_bits == 32) {
+				file->first_cluster |=
+					(u32)le16_to_cpu(de->starthi) << 16;
+			}
+			file->size = le32_to_cpu(de->size);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int fat_lookup_root_file(int fd, const char *name, struct fat_file *file,
+			 bool verbosity)
+{
+	struct fat_boot_sector sector;
+	struct fat_bios_param_block bpb;
+	u8 short_name[MSDOS_NAME];
+	u32 fat_length, total_sectors, rootdir_sectors, data_start;
+	u8 *dir;
+	int res;
+
+	res = fat_short_name(name, short_name);
+	if (res) {
+		return res;
+	}
+	res = fat_pread_all(fd, &sector, sizeof(sector), 0);
+	if (res) {
+		return res;
+	}
+	file->fat_bits = determine_FAT_bits(&sector, verbosity);
+	if (file->fat_bits <= 0 ||
+	    fat_read_bpb(NULL, &sector, !verbosity, &bpb)) {
+		return -EINVAL;
+	}
+
+	fat_length = file->fat_bits == 32 ? bpb.fat32_length
+					   : bpb.fat_fat_length;
+	total_sectors = bpb.fat_sectors ? bpb.fat_sectors : bpb.fat_total_sect;
+	rootdir_sectors = bpb.fat_dir_entries *
+			  sizeof(struct msdos_dir_entry) / bpb.fat_sector_size;
+	data_start = bpb.fat_reserved + bpb.fat_fats * fat_length +
+		     rootdir_sectors;
+	if (total_sectors <= data_start) {
+		return -EINVAL;
+	}
+
+	file->fd = fd;
+	file->cluster_size = bpb.fat_sector_size * bpb.fat_sec_per_clus;
+	file->fat_offset = (off_t)bpb.fat_reserved * bpb.fat_sector_size;
+	file->data_offset = (off_t)data_start * bpb.fat_sector_size;
+	file->max_cluster = (total_sectors - data_start) /
+			    bpb.fat_sec_per_clus + 1;
+
+	if (file->fat_bits != 32) {
+		/* fixed root directory in front of the data area */
+		size_t dir_size = bpb.fat_dir_entries *
+				  sizeof(struct msdos_dir_entry);
+
+		dir = malloc(dir_size);
+		if (!dir) {
+			return -ENOMEM;
+		}
+		res = fat_pread_all(fd, dir, dir_size,
+				    file->data_offset -
+				    (off_t)rootdir_sectors *
+				    bpb.fat_sector_size);
+		if (res == 0) {
+			res = fat_match_entries(
+				(struct msdos_dir_entry *)dir,
+				bpb.fat_dir_entries, short_name, file);
+		}
+		free(dir);
+		return res > 0 ? -ENOENT : res;
+	}
+
+	/* FAT32: the root directory is a cluster chain */
+	dir = malloc(file->cluster_size);
+	if (!dir) {
+		return -ENOMEM;
+	}
+	u32 cluster = bpb.fat32_root_cluster;
+	/* bound the walk in case the chain contains a loop */
+	for (u32 n = 0; n <= file->max_cluster; n++) {
+		if (!fat_cluster_valid(file, cluster)) {
+			res = -ENOENT;
+			break;
+		}
+		res = fat_pread_all(fd, dir, file->cluster_size,
+				    fat_cluster_offset(file, cluster));
+		if (res) {
+			break;
+		}
+		res = fat_match_entries((struct msdos_dir_entry *)dir,
+					file->cluster_size /
+					sizeof(struct msdos_dir_entry),
+					short_name, file);
+		if (res <= 0) {
+			break;
+		}
+		res = fat_next_cluster(file, cluster, &cluster);
+		if (res) {
+			break;
+		}
+		res = -ENOENT;
+	}
+	free(dir);
+	return res > 0 ? -ENOENT : res;
+}
+
+ssize_t fat_read_file(const struct fat_file *file, void *buf, size_t len)
+{
+	if (len > file->size) {
+		len = file->size;
+	}
+	return fat_transfer(file, buf, NULL, len);
+}
+
+ssize_t fat_write_file(const struct fat_file *file, const void *buf,
+		       size_t len)
+{
+	if (len != file->size) {
+		return -EINVAL;
+	}
+	return fat_transfer(file, NULL, buf, len);
+}
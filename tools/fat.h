@@ -12,6 +12,7 @@
  */
 #pragma once
 
+#include <sys/types.h>
 #include <linux/msdos_fs.h>
 #include "ebgpart.h"
 
@@ -23,3 +24,41 @@
  * occurs during the determination process, the function returns a value less than or equal to 0.
  */
 int determine_FAT_bits(const struct fat_boot_sector *sector, bool verbosity);
+
+/**
+ * A file in the root directory of a FAT file system, accessed directly on the
+ * block device without mounting it.
+ */
+struct fat_file {
+	int fd;
+	int fat_bits;
+	uint32_t cluster_size;	/* in bytes */
+	off_t fat_offset;	/* byte offset of the first FAT */
+	off_t data_offset;	/* byte offset of cluster 2 */
+	uint32_t max_cluster;	/* highest valid cluster number */
+	uint32_t first_cluster;
+	uint32_t size;		/* file size in bytes */
+};
+
+/**
+ * Looks up the file with the given name (8.3 format, e.g. "BGENV.DAT") in the
+ * root directory of the FAT file system on the open block device fd.
+ *
+ * Returns 0 on success and fills in file, or a negative errno value.
+ */
+int fat_lookup_root_file(int fd, const char *name, struct fat_file *file,
+			 bool verbosity);
+
+/**
+ * Reads up to len bytes from the beginning of the file by following its
+ * cluster chain. Returns the number of bytes read or a negative errno value.
+ */
+ssize_t fat_read_file(const struct fat_file *file, void *buf, size_t len);
+
+/**
+ * Overwrites the file contents in place. The file size and the cluster chain
+ * are not modified, thus len must be equal to the file size.
+ * Returns the number of bytes written or a negative errno value.
+ */
+ssize_t fat_write_file(const struct fat_file *file, const void *buf,
+		       size_t len);
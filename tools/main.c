@@ -13,6 +13,7 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include "bg_envcheck.h"
 #include "bg_printenv.h"
 #include "bg_setenv.h"
 
@@ -20,6 +21,8 @@ int main(int argc, char **argv)
 {
 	if (strstr(argv[0], "bg_setenv")) {
 		return bg_setenv(argc, argv);
+	} else if (strstr(argv[0], "bg_envcheck")) {
+		return bg_envcheck(argc, argv);
 	} else {
 		return bg_printenv(argc, argv);
 	}
@@ -0,0 +1,336 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Micro benchmarks of the library hot paths, see bench_util.h for the
+ * output format.
+ *
+ * Usage: bench_ebgenv [min_time_ms]
+ */
+
+#include <stdlib.h>
+#include <fff.h>
+
+#include <env_api.h>
+#include <env_config_partitions.h>
+#include <uservars.h>
+#include "bench_util.h"
+#include "fake_devices.h"
+#include "fat_image.h"
+
+DEFINE_FFF_GLOBALS;
+
+FAKE_VOID_FUNC(ped_device_probe_all, char *);
+FAKE_VALUE_FUNC(PedDevice *, ped_device_get_next, const PedDevice *);
+
+struct crc_ctx {
+	const uint8_t *buffer;
+	size_t len;
+	uint32_t crc;
+};
+
+static void bench_crc32(void *ctx)
+{
+	struct crc_ctx *c = ctx;
+
+	c->crc = bgenv_crc32(c->crc, c->buffer, c->len);
+}
+
+static void run_crc32_benchmarks(void)
+{
+	static const struct {
+		BGENV_CRC32_BACKEND backend;
+		const char *name;
+	} backends[] = {
+		{BGENV_CRC32_BYTEWISE, "crc32_bytewise"},
+		{BGENV_CRC32_SLICE8, "crc32_slice8"},
+		{BGENV_CRC32_PCLMUL, "crc32_pclmul"},
+		{BGENV_CRC32_ARMV8, "crc32_armv8"},
+	};
+	const size_t sizes[] = {64, 4096, sizeof(BG_ENVDATA)};
+	static uint8_t buffer[sizeof(BG_ENVDATA)];
+
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = i * 31;
+	}
+	for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		if (!bgenv_crc32_select(backends[b].backend)) {
+			continue;
+		}
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			struct crc_ctx c = {.buffer = buffer, .len = sizes[s]};
+
+			run_bench(backends[b].name, sizes[s], sizes[s], 0,
+				  bench_crc32, &c);
+		}
+	}
+	bgenv_crc32_select(BGENV_CRC32_AUTO);
+}
+
+struct uservar_ctx {
+	uint8_t *udata;
+	BGENV_USERVAR_INDEX *index;
+	size_t count;
+	size_t next;
+	char key[16];
+};
+
+static void uservar_key(struct uservar_ctx *c)
+{
+	(void)snprintf(c->key, sizeof(c->key), "key%05u",
+		       (unsigned int)c->next);
+	/* visit the variables in a scattered order */
+	c->next = (c->next + 7919) % c->count;
+}
+
+static void bench_find_uservar(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+
+	uservar_key(c);
+	(void)bgenv_find_uservar(c->udata, c->key);
+}
+
+static void bench_find_uservar_indexed(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+
+	uservar_key(c);
+	(void)bgenv_find_uservar_indexed(c->index, c->udata, c->key);
+}
+
+static void bench_set_uservar(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+	uint32_t value = c->next;
+
+	uservar_key(c);
+	(void)bgenv_set_uservar(c->udata, c->key, USERVAR_TYPE_UINT32, &value,
+				sizeof(value));
+}
+
+static void bench_set_uservar_indexed(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+	uint32_t value = c->next;
+
+	uservar_key(c);
+	(void)bgenv_set_uservar_indexed(c->index, c->udata, c->key,
+					USERVAR_TYPE_UINT32, &value,
+					sizeof(value));
+}
+
+/* changes the size of a variable each time, which moves its record */
+static void bench_resize_uservar_indexed(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+	uint64_t value = c->next;
+
+	uservar_key(c);
+	(void)bgenv_set_uservar_indexed(c->index, c->udata, c->key,
+					USERVAR_TYPE_UINT64, &value,
+					c->next & 1 ? sizeof(uint64_t)
+						    : sizeof(uint32_t));
+}
+
+/* Fill udata with count variables, returns the number actually stored */
+static size_t fill_uservars(uint8_t *udata, size_t count)
+{
+	char key[16];
+
+	memset(udata, 0, ENV_MEM_USERVARS);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t value = i;
+
+		(void)snprintf(key, sizeof(key), "key%05u", (unsigned int)i);
+		if (bgenv_set_uservar(udata, key, USERVAR_TYPE_UINT32, &value,
+				      sizeof(value)) != 0) {
+			return i;
+		}
+	}
+	return count;
+}
+
+static void bench_validate_uservars(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+
+	if (!bgenv_validate_uservars(c->udata)) {
+		fprintf(stderr, "bgenv_validate_uservars failed\n");
+		exit(1);
+	}
+}
+
+/* map every record, as done when listing or exporting the variables */
+static void bench_walk_uservars(void *ctx)
+{
+	struct uservar_ctx *c = ctx;
+	uint32_t data_size, total = 0;
+	uint64_t type;
+	uint8_t *val;
+
+	for (uint8_t *p = c->udata; *p; p = bgenv_next_uservar(p)) {
+		bgenv_map_uservar(p, NULL, &type, &val, NULL, &data_size);
+		total += data_size;
+	}
+	if (total != c->count * sizeof(uint32_t)) {
+		fprintf(stderr, "walking the uservars failed\n");
+		exit(1);
+	}
+}
+
+static BG_ENVDATA bench_env;
+
+static void bench_validate_envdata(void *ctx)
+{
+	BG_ENVDATA *env = ctx;
+
+	if (!validate_envdata(env)) {
+		fprintf(stderr, "validate_envdata failed\n");
+		exit(1);
+	}
+}
+
+static void run_uservar_benchmarks(void)
+{
+	const size_t counts[] = {16, 256, 1024, 4096};
+	static struct uservar_ctx c;
+
+	c.udata = bench_env.userdata;
+	c.index = calloc(1, sizeof(*c.index));
+	if (!c.index) {
+		exit(1);
+	}
+	for (size_t n = 0; n < sizeof(counts) / sizeof(counts[0]); n++) {
+		c.count = fill_uservars(c.udata, counts[n]);
+		if (c.count < counts[n]) {
+			break;
+		}
+		c.next = 0;
+		run_bench("find_uservar", c.count, 0, 0, bench_find_uservar,
+			  &c);
+		run_bench("find_uservar_indexed", c.count, 0, 0,
+			  bench_find_uservar_indexed, &c);
+		run_bench("set_uservar", c.count, 0, 0, bench_set_uservar, &c);
+		bgenv_uservar_index_invalidate(c.index);
+		run_bench("set_uservar_indexed", c.count, 0, 0,
+			  bench_set_uservar_indexed, &c);
+		run_bench("resize_uservar_indexed", c.count, 0, 0,
+			  bench_resize_uservar_indexed, &c);
+		c.count = fill_uservars(c.udata, c.count);
+		bgenv_uservar_index_invalidate(c.index);
+		run_bench("validate_uservars", c.count, 0, c.count,
+			  bench_validate_uservars, &c);
+		run_bench("walk_uservars", c.count, 0, c.count,
+			  bench_walk_uservars, &c);
+
+		bench_env.crc32 = bgenv_crc32(0, &bench_env,
+					      sizeof(BG_ENVDATA) -
+						  sizeof(bench_env.crc32));
+		run_bench("validate_envdata", c.count, sizeof(BG_ENVDATA),
+			  c.count, bench_validate_envdata, &bench_env);
+		bgenv_uservar_index_invalidate(c.index);
+	}
+	bgenv_uservar_index_free(c.index);
+}
+
+/* A valid environment with the given revision in a contiguous BGENV.DAT */
+static bool create_env_image(const char *path, uint32_t revision)
+{
+	BG_ENVDATA *env;
+	bool result;
+
+	env = calloc(1, sizeof(BG_ENVDATA));
+	if (!env) {
+		return false;
+	}
+	env->revision = revision;
+	env->watchdog_timeout_sec = DEFAULT_TIMEOUT_SEC;
+	env->crc32 = bgenv_crc32(0, env,
+				 sizeof(BG_ENVDATA) - sizeof(env->crc32));
+	result = create_fat_image(path, env, sizeof(BG_ENVDATA));
+	free(env);
+	return result;
+}
+
+static void bench_probe_config_partitions(void *ctx)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+
+	if (!probe_config_partitions(parts, true)) {
+		fprintf(stderr, "probe_config_partitions failed\n");
+		exit(1);
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		bgenv_path_free(parts[i].devpath);
+	}
+}
+
+static void bench_open_close(void *ctx)
+{
+	ebgenv_t e;
+
+	memset(&e, 0, sizeof(e));
+	if (ebg_env_open_current(&e) != 0 || ebg_env_close(&e) != 0) {
+		fprintf(stderr, "ebg_env_open_current/close failed\n");
+		exit(1);
+	}
+}
+
+static void run_disk_benchmarks(void)
+{
+	char tmpdir[] = "/tmp/ebg-bench-XXXXXX";
+	char path[sizeof(tmpdir) + 16];
+
+	if (!mkdtemp(tmpdir)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	allocate_fake_devices(1);
+	free(fake_devices[0].path);
+	if (asprintf(&fake_devices[0].path, "%s/disk", tmpdir) == -1) {
+		exit(1);
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		add_fake_partition(0);
+		(void)snprintf(path, sizeof(path), "%s/disk%d", tmpdir, i);
+		if (!create_env_image(path, i + 1)) {
+			fprintf(stderr, "Cannot create image %s\n", path);
+			exit(1);
+		}
+	}
+	ped_device_get_next_fake.custom_fake = ped_device_get_next_custom_fake;
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+
+	for (int parallel = 0; parallel <= 1; parallel++) {
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, parallel);
+		run_bench("probe_config_partitions", parallel, 0, 0,
+			  bench_probe_config_partitions, NULL);
+		run_bench("open_current_close", parallel, 0, 0,
+			  bench_open_close, NULL);
+	}
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		(void)snprintf(path, sizeof(path), "%s/disk%d", tmpdir, i);
+		unlink(path);
+	}
+	rmdir(tmpdir);
+	free_fake_devices();
+}
+
+int main(int argc, char **argv)
+{
+	bench_parse_args(argc, argv);
+
+	run_crc32_benchmarks();
+	run_uservar_benchmarks();
+	run_disk_benchmarks();
+	return 0;
+}
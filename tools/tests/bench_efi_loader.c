@@ -0,0 +1,138 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Benchmarks of the config selection of the loader on simulated firmware,
+ * see efi_sim.h. The parameter is the number of volumes, the config
+ * partitions are enumerated last. See bench_util.h for the output format.
+ *
+ * Usage: bench_efi_loader [min_time_ms]
+ */
+
+#include <string.h>
+
+#include "bench_util.h"
+#include "efi_sim.h"
+#include "efi_sim_host.h"
+#include "fat_image.h"
+#include <bootguard.h>
+#include <configuration.h>
+
+/* image 0 holds no environment, images 1 to ENV_NUM_CONFIG_PARTS one each */
+static char empty_image[FAT_IMAGE_PATH_MAX];
+static char env_images[ENV_NUM_CONFIG_PARTS][FAT_IMAGE_PATH_MAX];
+static EFI_HANDLE config_volume;
+
+static VOID create_images(VOID)
+{
+	const char *path = fat_image_path(0);
+	BG_ENVDATA *env;
+
+	if (!path || !create_fat_image(path, NULL, 0)) {
+		sim_exit("Cannot create the empty image");
+	}
+	strcpy(empty_image, path);
+	env = AllocateZeroPool(sizeof(BG_ENVDATA));
+	if (!env) {
+		sim_exit("Out of memory");
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		path = fat_image_path(i + 1);
+		env->revision = i + 1;
+		env->watchdog_timeout_sec = 30;
+		env->crc32 = sim_crc32(env, sizeof(BG_ENVDATA) -
+						sizeof(env->crc32));
+		if (!path || !create_fat_image(path, env, sizeof(BG_ENVDATA))) {
+			sim_exit("Cannot create an environment image");
+		}
+		strcpy(env_images[i], path);
+	}
+	FreePool(env);
+}
+
+/* count volumes in total, the config partitions on a disk of their own */
+static VOID add_volumes(UINTN count)
+{
+	UINTN others = count - ENV_NUM_CONFIG_PARTS;
+
+	efi_sim_init();
+	for (UINTN i = 0; i < others; i++) {
+		if (!efi_sim_add_volume((const CHAR8 *)empty_image, i / 4,
+					i % 4 + 1)) {
+			sim_exit("Cannot add a volume");
+		}
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		const CHAR8 *path = (const CHAR8 *)env_images[i];
+		EFI_HANDLE h = efi_sim_add_volume(path, others / 4 + 1, i + 1);
+
+		if (!h) {
+			sim_exit("Cannot add a config volume");
+		}
+		if (i == 0) {
+			config_volume = h;
+		}
+	}
+}
+
+static void bench_get_volumes(void *ctx)
+{
+	VOLUME_DESC *v;
+	UINTN count;
+
+	(void)ctx;
+	if (EFI_ERROR(get_volumes(&v, &count))) {
+		sim_exit("get_volumes failed");
+	}
+	FreePool(v);
+}
+
+static void bench_load_config(void *ctx)
+{
+	BG_LOADER_PARAMS params;
+
+	(void)ctx;
+	if (EFI_ERROR(get_volumes(&volumes, &volume_count)) ||
+	    load_config(&params) != BG_SUCCESS) {
+		sim_exit("load_config failed");
+	}
+	FreePool(params.payload_path);
+	FreePool(params.payload_options);
+	(VOID) close_volumes(volumes, volume_count);
+}
+
+int main(int argc, char **argv)
+{
+	const UINTN counts[] = {ENV_NUM_CONFIG_PARTS, 16, 64, 256};
+
+	bench_parse_args(argc, argv);
+	efi_sim_init();
+#if !defined(SILENT_BOOT)
+	quiet_boot = TRUE;
+#endif
+	create_images();
+
+	for (UINTN c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		add_volumes(counts[c]);
+		run_bench("efi_get_volumes", counts[c], 0, 0,
+			  bench_get_volumes, NULL);
+		run_bench("efi_load_config", counts[c], 0, 0,
+			  bench_load_config, NULL);
+		/* booted from the disk with the config partitions */
+		SetBootMedium(DevicePathFromHandle(config_volume));
+		run_bench("efi_load_config_boot_medium", counts[c], 0, 0,
+			  bench_load_config, NULL);
+		SetBootMedium(NULL);
+	}
+
+	efi_sim_cleanup();
+	remove_fat_images();
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench_util.h"
+
+uint64_t bench_min_time_ns = 200 * 1000000ULL;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void run_bench(const char *name, size_t param, size_t bytes_per_op,
+	       size_t records_per_op, bench_fn fn, void *ctx)
+{
+	uint64_t iterations = 1, start, elapsed;
+
+	for (;;) {
+		start = now_ns();
+		for (uint64_t i = 0; i < iterations; i++) {
+			fn(ctx);
+		}
+		elapsed = now_ns() - start;
+		if (elapsed >= bench_min_time_ns ||
+		    iterations >= (1ULL << 40)) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	double ns_per_op = (double)elapsed / iterations;
+	printf("{\"benchmark\":\"%s\",\"param\":%zu,\"iterations\":%llu,"
+	       "\"ns_per_op\":%.1f",
+	       name, param, (unsigned long long)iterations, ns_per_op);
+	if (bytes_per_op) {
+		printf(",\"mb_per_s\":%.1f", bytes_per_op * 1000.0 / ns_per_op);
+	}
+	if (records_per_op) {
+		printf(",\"records_per_s\":%.0f",
+		       records_per_op * 1e9 / ns_per_op);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+void bench_parse_args(int argc, char **argv)
+{
+	if (argc > 1) {
+		bench_min_time_ns = strtoull(argv[1], NULL, 10) * 1000000ULL;
+	}
+}
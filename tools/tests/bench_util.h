@@ -0,0 +1,35 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Timing loop of the benchmarks. Each result is printed as one JSON object
+ * per line:
+ *
+ *   {"benchmark":"crc32_slice8","param":4096,"iterations":..,"ns_per_op":..}
+ *
+ * Throughput is added as mb_per_s or, for parsers, as records_per_s.
+ */
+
+extern uint64_t bench_min_time_ns;
+
+typedef void (*bench_fn)(void *ctx);
+
+/* Run fn until bench_min_time_ns is exceeded, doubling the iterations */
+void run_bench(const char *name, size_t param, size_t bytes_per_op,
+	       size_t records_per_op, bench_fn fn, void *ctx);
+
+/* Parses the optional [min_time_ms] argument of the benchmarks */
+void bench_parse_args(int argc, char **argv);
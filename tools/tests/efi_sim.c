@@ -0,0 +1,605 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include "efi_sim.h"
+#include "efi_sim_host.h"
+
+#define SIM_MAX_VARIABLES 64
+/* 8.3 name and zero-termination */
+#define SIM_MAX_NAME 13
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct {
+	CONTROLLER_DEVICE_PATH disk;
+	HARDDRIVE_DEVICE_PATH partition;
+	EFI_DEVICE_PATH end;
+} SIM_DEVICE_PATH;
+#pragma pack(pop)
+
+/* fs first, the volume is found from the protocol interface */
+typedef struct {
+	EFI_FILE_IO_INTERFACE fs;
+	SIM_DEVICE_PATH devpath;
+	struct sim_image *image;
+} SIM_VOLUME;
+
+/* file first, the state is found from the file handle */
+typedef struct {
+	EFI_FILE file;
+	SIM_VOLUME *volume;
+	BOOLEAN is_root;
+	CHAR8 name[SIM_MAX_NAME];
+	UINT64 mode;
+	UINT8 *data;
+	UINT32 size;
+	UINT64 position;
+	BOOLEAN dirty;
+} SIM_FILE;
+
+typedef struct {
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINT32 attributes;
+	UINTN size;
+	VOID *data;
+} SIM_VARIABLE;
+
+EFI_SIM_STATS efi_sim_stats;
+
+static SIM_VOLUME sim_volumes[EFI_SIM_MAX_VOLUMES];
+static UINTN sim_volume_count;
+static SIM_VARIABLE sim_variables[SIM_MAX_VARIABLES];
+
+static EFI_BOOT_SERVICES sim_bs;
+static EFI_RUNTIME_SERVICES sim_rt;
+static SIMPLE_TEXT_OUTPUT_MODE sim_conout_mode;
+static SIMPLE_TEXT_OUTPUT_INTERFACE sim_conout;
+static EFI_SYSTEM_TABLE sim_st;
+
+static EFI_GUID sfs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+static EFI_GUID devpath_guid = DEVICE_PATH_PROTOCOL;
+static EFI_GUID file_info_guid = EFI_FILE_INFO_ID;
+
+static BOOLEAN guid_equal(EFI_GUID *a, EFI_GUID *b)
+{
+	return CompareMem(a, b, sizeof(EFI_GUID)) == 0;
+}
+
+static EFI_STATUS EFIAPI sim_allocate_pool(EFI_MEMORY_TYPE type, UINTN size,
+					   VOID **buffer)
+{
+	(VOID) type;
+	*buffer = sim_alloc(size);
+	if (!*buffer) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	efi_sim_stats.pool_allocations++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_free_pool(VOID *buffer)
+{
+	if (!buffer) {
+		return EFI_INVALID_PARAMETER;
+	}
+	sim_free(buffer);
+	efi_sim_stats.pool_allocations--;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_calculate_crc32(VOID *data, UINTN size,
+					     UINT32 *crc32)
+{
+	if (!data || !crc32 || size == 0) {
+		return EFI_INVALID_PARAMETER;
+	}
+	*crc32 = sim_crc32(data, size);
+	return EFI_SUCCESS;
+}
+
+/* the handles are the volumes, so that no lookup skews benchmarks */
+static SIM_VOLUME *volume_of(EFI_HANDLE handle)
+{
+	SIM_VOLUME *v = handle;
+
+	if (v < sim_volumes || v >= sim_volumes + sim_volume_count) {
+		return NULL;
+	}
+	return v;
+}
+
+static EFI_STATUS EFIAPI sim_handle_protocol(EFI_HANDLE handle,
+					     EFI_GUID *protocol,
+					     VOID **interface)
+{
+	SIM_VOLUME *v = volume_of(handle);
+
+	if (!v || !protocol || !interface) {
+		return EFI_INVALID_PARAMETER;
+	}
+	if (guid_equal(protocol, &sfs_guid)) {
+		*interface = &v->fs;
+	} else if (guid_equal(protocol, &devpath_guid)) {
+		*interface = &v->devpath;
+	} else {
+		return EFI_UNSUPPORTED;
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE type,
+						  EFI_GUID *protocol,
+						  VOID *key, UINTN *count,
+						  EFI_HANDLE **buffer)
+{
+	(VOID) key;
+	if (!count || !buffer) {
+		return EFI_INVALID_PARAMETER;
+	}
+	/* all volumes support both protocols */
+	if (type != AllHandles &&
+	    (type != ByProtocol || !protocol ||
+	     (!guid_equal(protocol, &sfs_guid) &&
+	      !guid_equal(protocol, &devpath_guid)))) {
+		return EFI_NOT_FOUND;
+	}
+	if (sim_volume_count == 0) {
+		return EFI_NOT_FOUND;
+	}
+	*buffer = AllocatePool(sizeof(EFI_HANDLE) * sim_volume_count);
+	if (!*buffer) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	for (UINTN i = 0; i < sim_volume_count; i++) {
+		(*buffer)[i] = &sim_volumes[i];
+	}
+	*count = sim_volume_count;
+	return EFI_SUCCESS;
+}
+
+static SIM_VARIABLE *find_variable(CHAR16 *name, EFI_GUID *guid)
+{
+	for (UINTN i = 0; i < SIM_MAX_VARIABLES; i++) {
+		SIM_VARIABLE *var = &sim_variables[i];
+
+		if (var->name && StrCmp(var->name, name) == 0 &&
+		    guid_equal(&var->guid, guid)) {
+			return var;
+		}
+	}
+	return NULL;
+}
+
+static VOID drop_variable(SIM_VARIABLE *var)
+{
+	sim_free(var->name);
+	sim_free(var->data);
+	ZeroMem(var, sizeof(*var));
+}
+
+static EFI_STATUS EFIAPI sim_get_variable(CHAR16 *name, EFI_GUID *guid,
+					  UINT32 *attributes, UINTN *size,
+					  VOID *data)
+{
+	SIM_VARIABLE *var;
+
+	if (!name || !guid || !size) {
+		return EFI_INVALID_PARAMETER;
+	}
+	var = find_variable(name, guid);
+	if (!var) {
+		return EFI_NOT_FOUND;
+	}
+	if (*size < var->size) {
+		*size = var->size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	if (!data) {
+		return EFI_INVALID_PARAMETER;
+	}
+	CopyMem(data, var->data, var->size);
+	*size = var->size;
+	if (attributes) {
+		*attributes = var->attributes;
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_set_variable(CHAR16 *name, EFI_GUID *guid,
+					  UINT32 attributes, UINTN size,
+					  VOID *data)
+{
+	SIM_VARIABLE *var;
+	UINTN namesize;
+	VOID *copy;
+
+	if (!name || !*name || !guid || (size && !data)) {
+		return EFI_INVALID_PARAMETER;
+	}
+	var = find_variable(name, guid);
+	if (size == 0 || attributes == 0) {
+		if (!var) {
+			return EFI_NOT_FOUND;
+		}
+		drop_variable(var);
+		return EFI_SUCCESS;
+	}
+	if (!(attributes & EFI_VARIABLE_BOOTSERVICE_ACCESS)) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	copy = sim_alloc(size);
+	if (!copy) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	CopyMem(copy, data, size);
+	if (!var) {
+		for (UINTN i = 0; !var && i < SIM_MAX_VARIABLES; i++) {
+			if (!sim_variables[i].name) {
+				var = &sim_variables[i];
+			}
+		}
+		if (!var) {
+			sim_free(copy);
+			return EFI_OUT_OF_RESOURCES;
+		}
+		namesize = StrSize(name);
+		var->name = sim_alloc(namesize);
+		if (!var->name) {
+			sim_free(copy);
+			return EFI_OUT_OF_RESOURCES;
+		}
+		CopyMem(var->name, name, namesize);
+		CopyMem(&var->guid, guid, sizeof(EFI_GUID));
+	}
+	sim_free(var->data);
+	var->data = copy;
+	var->size = size;
+	var->attributes = attributes;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_output_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+					   CHAR16 *text)
+{
+	(VOID) this;
+	sim_output(text);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_set_attribute(SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+					   UINTN attribute)
+{
+	this->Mode->Attribute = attribute;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_open(EFI_FILE_HANDLE file,
+				       EFI_FILE_HANDLE *new, CHAR16 *name,
+				       UINT64 mode, UINT64 attributes);
+static EFI_STATUS EFIAPI sim_file_close(EFI_FILE_HANDLE file);
+static EFI_STATUS EFIAPI sim_file_read(EFI_FILE_HANDLE file, UINTN *size,
+				       VOID *buffer);
+static EFI_STATUS EFIAPI sim_file_write(EFI_FILE_HANDLE file, UINTN *size,
+					VOID *buffer);
+static EFI_STATUS EFIAPI sim_file_get_position(EFI_FILE_HANDLE file,
+					       UINT64 *position);
+static EFI_STATUS EFIAPI sim_file_set_position(EFI_FILE_HANDLE file,
+					       UINT64 position);
+static EFI_STATUS EFIAPI sim_file_get_info(EFI_FILE_HANDLE file,
+					   EFI_GUID *type, UINTN *size,
+					   VOID *buffer);
+static EFI_STATUS EFIAPI sim_file_flush(EFI_FILE_HANDLE file);
+
+static SIM_FILE *new_file(SIM_VOLUME *volume)
+{
+	SIM_FILE *f = sim_alloc(sizeof(SIM_FILE));
+
+	if (!f) {
+		return NULL;
+	}
+	ZeroMem(f, sizeof(*f));
+	f->file.Revision = EFI_FILE_HANDLE_REVISION;
+	f->file.Open = sim_file_open;
+	f->file.Close = sim_file_close;
+	f->file.Read = sim_file_read;
+	f->file.Write = sim_file_write;
+	f->file.GetPosition = sim_file_get_position;
+	f->file.SetPosition = sim_file_set_position;
+	f->file.GetInfo = sim_file_get_info;
+	f->file.Flush = sim_file_flush;
+	f->volume = volume;
+	return f;
+}
+
+static EFI_STATUS EFIAPI sim_open_volume(EFI_FILE_IO_INTERFACE *this,
+					 EFI_FILE_HANDLE *root)
+{
+	SIM_FILE *f = new_file((SIM_VOLUME *)this);
+
+	if (!f) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	f->is_root = TRUE;
+	f->mode = EFI_FILE_MODE_READ;
+	*root = &f->file;
+	efi_sim_stats.volumes_opened++;
+	return EFI_SUCCESS;
+}
+
+/* file names are passed to the host as ASCII */
+static BOOLEAN to_ascii(const CHAR16 *name, CHAR8 *out)
+{
+	UINTN i;
+
+	for (i = 0; name[i]; i++) {
+		if (i == SIM_MAX_NAME - 1 || name[i] >= 0x80) {
+			return FALSE;
+		}
+		out[i] = name[i];
+	}
+	out[i] = 0;
+	return TRUE;
+}
+
+static EFI_STATUS EFIAPI sim_file_open(EFI_FILE_HANDLE file,
+				       EFI_FILE_HANDLE *new, CHAR16 *name,
+				       UINT64 mode, UINT64 attributes)
+{
+	SIM_FILE *dir = (SIM_FILE *)file;
+	SIM_FILE *f;
+	VOID *data;
+	UINT32 size;
+	int res;
+
+	(VOID) attributes;
+	if (!new || !name || !(mode & EFI_FILE_MODE_READ)) {
+		return EFI_INVALID_PARAMETER;
+	}
+	/* only the root directory is simulated */
+	if (!dir->is_root) {
+		return EFI_NOT_FOUND;
+	}
+	f = new_file(dir->volume);
+	if (!f) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	if (!to_ascii(name, f->name)) {
+		sim_free(f);
+		return EFI_NOT_FOUND;
+	}
+	res = sim_image_read(dir->volume->image, f->name, &data, &size);
+	if (res) {
+		sim_free(f);
+		return res == -ENOENT || res == -EINVAL ? EFI_NOT_FOUND
+							: EFI_DEVICE_ERROR;
+	}
+	f->mode = mode;
+	f->data = data;
+	f->size = size;
+	*new = &f->file;
+	efi_sim_stats.files_opened++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_flush(EFI_FILE_HANDLE file)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+
+	if (!f->dirty) {
+		return EFI_SUCCESS;
+	}
+	if (sim_image_write(f->volume->image, f->name, f->data, f->size)) {
+		return EFI_DEVICE_ERROR;
+	}
+	f->dirty = FALSE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_close(EFI_FILE_HANDLE file)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+	EFI_STATUS status = sim_file_flush(file);
+
+	sim_free(f->data);
+	sim_free(f);
+	return status;
+}
+
+static EFI_STATUS EFIAPI sim_file_read(EFI_FILE_HANDLE file, UINTN *size,
+				       VOID *buffer)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+	UINTN len;
+
+	/* directory listings are not simulated */
+	if (f->is_root) {
+		return EFI_UNSUPPORTED;
+	}
+	if (f->position > f->size) {
+		return EFI_DEVICE_ERROR;
+	}
+	len = f->size - f->position;
+	if (*size < len) {
+		len = *size;
+	}
+	CopyMem(buffer, f->data + f->position, len);
+	f->position += len;
+	*size = len;
+	efi_sim_stats.bytes_read += len;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_write(EFI_FILE_HANDLE file, UINTN *size,
+					VOID *buffer)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+
+	if (f->is_root) {
+		return EFI_UNSUPPORTED;
+	}
+	if (!(f->mode & EFI_FILE_MODE_WRITE)) {
+		return EFI_ACCESS_DENIED;
+	}
+	/* the cluster chain of the file is not extended */
+	if (f->position > f->size || *size > f->size - f->position) {
+		*size = 0;
+		return EFI_VOLUME_FULL;
+	}
+	CopyMem(f->data + f->position, buffer, *size);
+	f->position += *size;
+	f->dirty = TRUE;
+	efi_sim_stats.bytes_written += *size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_get_position(EFI_FILE_HANDLE file,
+					       UINT64 *position)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+
+	if (f->is_root) {
+		return EFI_UNSUPPORTED;
+	}
+	*position = f->position;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_set_position(EFI_FILE_HANDLE file,
+					       UINT64 position)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+
+	if (f->is_root) {
+		return position ? EFI_UNSUPPORTED : EFI_SUCCESS;
+	}
+	/* all ones seeks to the end of the file */
+	f->position = position == ~0ULL ? f->size : position;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sim_file_get_info(EFI_FILE_HANDLE file,
+					   EFI_GUID *type, UINTN *size,
+					   VOID *buffer)
+{
+	SIM_FILE *f = (SIM_FILE *)file;
+	EFI_FILE_INFO *info = buffer;
+	UINTN namelen = 0, needed;
+
+	/* file system information, like volume labels, is not simulated */
+	if (f->is_root || !guid_equal(type, &file_info_guid)) {
+		return EFI_UNSUPPORTED;
+	}
+	while (f->name[namelen]) {
+		namelen++;
+	}
+	needed = sizeof(EFI_FILE_INFO) + namelen * sizeof(CHAR16);
+	if (*size < needed) {
+		*size = needed;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	ZeroMem(info, needed);
+	info->Size = needed;
+	info->FileSize = f->size;
+	info->PhysicalSize = f->size;
+	info->Attribute = EFI_FILE_ARCHIVE;
+	for (UINTN i = 0; i <= namelen; i++) {
+		info->FileName[i] = f->name[i];
+	}
+	*size = needed;
+	return EFI_SUCCESS;
+}
+
+static VOID init_devpath(SIM_DEVICE_PATH *dp, UINT32 disk, UINT32 partition)
+{
+	ZeroMem(dp, sizeof(*dp));
+	dp->disk.Header.Type = HARDWARE_DEVICE_PATH;
+	dp->disk.Header.SubType = HW_CONTROLLER_DP;
+	SetDevicePathNodeLength(&dp->disk.Header, sizeof(dp->disk));
+	dp->disk.Controller = disk;
+	dp->partition.Header.Type = MEDIA_DEVICE_PATH;
+	dp->partition.Header.SubType = MEDIA_HARDDRIVE_DP;
+	SetDevicePathNodeLength(&dp->partition.Header, sizeof(dp->partition));
+	dp->partition.PartitionNumber = partition;
+	dp->partition.MBRType = MBR_TYPE_EFI_PARTITION_TABLE_HEADER;
+	dp->partition.SignatureType = SIGNATURE_TYPE_GUID;
+	dp->partition.Signature[0] = disk;
+	dp->partition.Signature[1] = partition;
+	SetDevicePathEndNode(&dp->end);
+}
+
+EFI_HANDLE efi_sim_add_volume(const CHAR8 *path, UINT32 disk,
+			      UINT32 partition)
+{
+	SIM_VOLUME *v;
+
+	if (sim_volume_count == EFI_SIM_MAX_VOLUMES) {
+		return NULL;
+	}
+	v = &sim_volumes[sim_volume_count];
+	ZeroMem(v, sizeof(*v));
+	v->image = sim_image_open((const char *)path);
+	if (!v->image) {
+		return NULL;
+	}
+	v->fs.Revision = EFI_FILE_IO_INTERFACE_REVISION;
+	v->fs.OpenVolume = sim_open_volume;
+	init_devpath(&v->devpath, disk, partition);
+	sim_volume_count++;
+	return v;
+}
+
+VOID efi_sim_cleanup(VOID)
+{
+	for (UINTN i = 0; i < sim_volume_count; i++) {
+		sim_image_close(sim_volumes[i].image);
+	}
+	sim_volume_count = 0;
+	for (UINTN i = 0; i < SIM_MAX_VARIABLES; i++) {
+		if (sim_variables[i].name) {
+			drop_variable(&sim_variables[i]);
+		}
+	}
+}
+
+VOID efi_sim_init(VOID)
+{
+	efi_sim_cleanup();
+	ZeroMem(&efi_sim_stats, sizeof(efi_sim_stats));
+
+	ZeroMem(&sim_bs, sizeof(sim_bs));
+	sim_bs.AllocatePool = sim_allocate_pool;
+	sim_bs.FreePool = sim_free_pool;
+	sim_bs.HandleProtocol = sim_handle_protocol;
+	sim_bs.LocateHandleBuffer = sim_locate_handle_buffer;
+	sim_bs.CalculateCrc32 = sim_calculate_crc32;
+
+	ZeroMem(&sim_rt, sizeof(sim_rt));
+	sim_rt.GetVariable = sim_get_variable;
+	sim_rt.SetVariable = sim_set_variable;
+
+	ZeroMem(&sim_conout, sizeof(sim_conout));
+	sim_conout_mode.Attribute = EFI_LIGHTGRAY;
+	sim_conout.OutputString = sim_output_string;
+	sim_conout.SetAttribute = sim_set_attribute;
+	sim_conout.Mode = &sim_conout_mode;
+
+	ZeroMem(&sim_st, sizeof(sim_st));
+	sim_st.ConOut = &sim_conout;
+	sim_st.BootServices = &sim_bs;
+	sim_st.RuntimeServices = &sim_rt;
+
+	ST = &sim_st;
+	BS = &sim_bs;
+	RT = &sim_rt;
+}
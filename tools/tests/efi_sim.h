@@ -0,0 +1,56 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+#include <efilib.h>
+#include <utils.h>
+
+/*
+ * Host simulation of the firmware services used by the config selection of
+ * the loader, i.e. by get_volumes() and load_config(). The gnu-efi library
+ * is linked unmodified, so the simulated tables provide:
+ *
+ * - BS: pool allocations, CalculateCrc32, HandleProtocol and
+ *   LocateHandleBuffer for the simple file system and device path protocols
+ * - RT: GetVariable and SetVariable on an in-memory store
+ * - ST: ConOut, printing to stderr if EFI_SIM_VERBOSE is set
+ *
+ * All other services are NULL. Each volume is backed by a FAT image file,
+ * see create_fat_image(). Files in its root directory can be opened, read
+ * and overwritten in place, but not created or resized.
+ */
+
+#define EFI_SIM_MAX_VOLUMES 1024
+
+typedef struct {
+	UINTN volumes_opened;
+	UINTN files_opened;
+	UINTN bytes_read;
+	UINTN bytes_written;
+	/* allocated from pool and not yet freed */
+	UINTN pool_allocations;
+} EFI_SIM_STATS;
+
+extern EFI_SIM_STATS efi_sim_stats;
+
+/* Installs the simulated tables as ST, BS and RT. Volumes and variables of
+ * a previous simulation are dropped. */
+VOID efi_sim_init(VOID);
+
+/* Adds a volume for partition number partition of disk number disk, backed
+ * by the FAT image at path. Returns its handle or NULL on errors. */
+EFI_HANDLE efi_sim_add_volume(const CHAR8 *path, UINT32 disk,
+			      UINT32 partition);
+
+/* Drops all volumes and variables */
+VOID efi_sim_cleanup(VOID);
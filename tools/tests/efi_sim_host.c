@@ -0,0 +1,129 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <env_api.h>
+#include <fat.h>
+#include "efi_sim_host.h"
+
+struct sim_image {
+	int fd;
+};
+
+struct sim_image *sim_image_open(const char *path)
+{
+	struct sim_image *image;
+
+	image = malloc(sizeof(*image));
+	if (!image) {
+		return NULL;
+	}
+	image->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (image->fd < 0) {
+		free(image);
+		return NULL;
+	}
+	return image;
+}
+
+void sim_image_close(struct sim_image *image)
+{
+	if (image) {
+		close(image->fd);
+		free(image);
+	}
+}
+
+int sim_image_read(struct sim_image *image, const char *name, void **data,
+		   uint32_t *size)
+{
+	struct fat_file file;
+	ssize_t len;
+	int res;
+
+	res = fat_lookup_root_file(image->fd, name, &file, false);
+	if (res) {
+		return res;
+	}
+	/* at least one byte, so that empty files are no special case */
+	*data = malloc(file.size + 1);
+	if (!*data) {
+		return -ENOMEM;
+	}
+	len = fat_read_file(&file, *data, file.size);
+	if (len != (ssize_t)file.size) {
+		free(*data);
+		return len < 0 ? len : -EIO;
+	}
+	*size = file.size;
+	return 0;
+}
+
+int sim_image_write(struct sim_image *image, const char *name,
+		    const void *data, uint32_t size)
+{
+	struct fat_file file;
+	ssize_t len;
+	int res;
+
+	res = fat_lookup_root_file(image->fd, name, &file, false);
+	if (res) {
+		return res;
+	}
+	len = fat_write_file(&file, data, size);
+	if (len < 0) {
+		return len;
+	}
+	return len == (ssize_t)size ? 0 : -EIO;
+}
+
+void *sim_alloc(size_t size)
+{
+	return malloc(size);
+}
+
+void sim_free(void *p)
+{
+	free(p);
+}
+
+uint32_t sim_crc32(const void *data, size_t size)
+{
+	return bgenv_crc32(0, data, size);
+}
+
+void sim_output(const uint16_t *text)
+{
+	static int verbose = -1;
+
+	if (verbose < 0) {
+		verbose = getenv("EFI_SIM_VERBOSE") != NULL;
+	}
+	if (!verbose) {
+		return;
+	}
+	for (; *text; text++) {
+		if (*text != '\r') {
+			fputc(*text < 0x80 ? *text : '?', stderr);
+		}
+	}
+}
+
+void sim_exit(const char *reason)
+{
+	fprintf(stderr, "%s\n", reason);
+	exit(1);
+}
@@ -0,0 +1,49 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The part of the EFI simulation using the C library, see efi_sim.h. It is
+ * kept apart as the gnu-efi and the libc headers do not mix: both define
+ * va_list, which is that of the MS ABI for gnu-efi. Code using the gnu-efi
+ * headers must not include stdio.h.
+ */
+
+struct sim_image;
+
+/* Opens the FAT image file at path, NULL on errors */
+struct sim_image *sim_image_open(const char *path);
+void sim_image_close(struct sim_image *image);
+
+/* Reads the file name in the root directory into a buffer from
+ * sim_alloc(). Returns 0 or a negative errno value. */
+int sim_image_read(struct sim_image *image, const char *name, void **data,
+		   uint32_t *size);
+
+/* Overwrites the file name in place, thus size must be its size. Returns 0
+ * or a negative errno value. */
+int sim_image_write(struct sim_image *image, const char *name,
+		    const void *data, uint32_t size);
+
+void *sim_alloc(size_t size);
+void sim_free(void *p);
+
+uint32_t sim_crc32(const void *data, size_t size);
+
+/* Prints the UCS-2 text to stderr if EFI_SIM_VERBOSE is set */
+void sim_output(const uint16_t *text);
+
+/* Prints the reason to stderr and exits with a failure */
+void __attribute__((noreturn)) sim_exit(const char *reason);
@@ -0,0 +1,139 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/msdos_fs.h>
+
+#include "fat_image.h"
+
+#define FAT_CLUSTER_SECTORS 8
+
+static char image_dir[] = "/tmp/ebg-image-XXXXXX";
+static bool image_dir_created;
+static unsigned int max_image;
+static char image_path[FAT_IMAGE_PATH_MAX];
+
+static inline void u16_to_le(uint16_t value, uint8_t out[2])
+{
+	out[0] = value & 0xff;
+	out[1] = value >> 8;
+}
+
+bool create_fat_image(const char *path, const void *data, uint32_t size)
+{
+	const uint32_t cluster_size = FAT_CLUSTER_SECTORS * 512;
+	const uint32_t clusters = size ? (size + cluster_size - 1) /
+					 cluster_size : 1;
+	const uint32_t data_sector = 4;
+	const uint32_t sectors = data_sector + (clusters + 2) *
+					       FAT_CLUSTER_SECTORS;
+	uint8_t sector[512];
+	struct fat_boot_sector *bs = (struct fat_boot_sector *)sector;
+	struct msdos_dir_entry *de = (struct msdos_dir_entry *)sector;
+	bool result = false;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+
+	memset(sector, 0, sizeof(sector));
+	u16_to_le(512, bs->sector_size);
+	bs->sec_per_clus = FAT_CLUSTER_SECTORS;
+	bs->reserved = 1;
+	bs->fats = 2;
+	u16_to_le(512 / sizeof(*de), bs->dir_entries);
+	u16_to_le(sectors, bs->sectors);
+	bs->media = 0xf8;
+	bs->fat_length = 1;
+	if (pwrite(fd, sector, sizeof(sector), 0) != sizeof(sector)) {
+		goto out;
+	}
+
+	/* cluster chain 2 -> 3 -> ... -> end of chain */
+	memset(sector, 0, sizeof(sector));
+	sector[0] = 0xf8;
+	sector[1] = 0xff;
+	sector[2] = 0xff;
+	for (uint32_t n = 2; data && n < clusters + 2; n++) {
+		uint16_t v = n == clusters + 1 ? 0xfff : n + 1;
+		uint8_t *e = sector + n + n / 2;
+
+		if (n & 1) {
+			e[0] = (e[0] & 0x0f) | (v << 4);
+			e[1] = v >> 4;
+		} else {
+			e[0] = v;
+			e[1] = (e[1] & 0xf0) | (v >> 8);
+		}
+	}
+	if (pwrite(fd, sector, sizeof(sector), 512) != sizeof(sector) ||
+	    pwrite(fd, sector, sizeof(sector), 1024) != sizeof(sector)) {
+		goto out;
+	}
+
+	memset(sector, 0, sizeof(sector));
+	if (data) {
+		memcpy(de->name, "BGENV   DAT", MSDOS_NAME);
+		de->start = 2;
+		de->size = size;
+	}
+	if (pwrite(fd, sector, sizeof(sector), 3 * 512) != sizeof(sector)) {
+		goto out;
+	}
+
+	if (data && pwrite(fd, data, size, data_sector * 512) !=
+			    (ssize_t)size) {
+		goto out;
+	}
+	/* pad the image to the size announced in the boot sector */
+	result = ftruncate(fd, (off_t)sectors * 512) == 0;
+out:
+	close(fd);
+	return result;
+}
+
+const char *fat_image_path(unsigned int n)
+{
+	if (!image_dir_created) {
+		if (!mkdtemp(image_dir)) {
+			return NULL;
+		}
+		image_dir_created = true;
+		max_image = 0;
+	}
+	if (n >= max_image) {
+		max_image = n + 1;
+	}
+	(void)snprintf(image_path, sizeof(image_path), "%s/%u", image_dir, n);
+	return image_path;
+}
+
+void remove_fat_images(void)
+{
+	if (!image_dir_created) {
+		return;
+	}
+	for (unsigned int n = 0; n < max_image; n++) {
+		(void)snprintf(image_path, sizeof(image_path), "%s/%u",
+			       image_dir, n);
+		unlink(image_path);
+	}
+	rmdir(image_dir);
+	/* mkdtemp() replaced the template */
+	memcpy(image_dir + sizeof(image_dir) - 7, "XXXXXX", 6);
+	image_dir_created = false;
+}
@@ -0,0 +1,34 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Writes a FAT12 file system image to path. Unless data is NULL, its root
+ * directory holds a contiguous BGENV.DAT of size bytes with the given
+ * contents.
+ */
+bool create_fat_image(const char *path, const void *data, uint32_t size);
+
+/* Size of the paths returned by fat_image_path() */
+#define FAT_IMAGE_PATH_MAX 40
+
+/*
+ * Returns the path of image number n in a temporary directory created on
+ * first use, NULL on errors. The path is valid until the next call.
+ */
+const char *fat_image_path(unsigned int n);
+
+/* Removes the images named by fat_image_path() and their directory */
+void remove_fat_images(void);
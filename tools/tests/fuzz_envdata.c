@@ -0,0 +1,52 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Fuzz target of validate_envdata(): the input is taken as an environment
+ * as read from disk. If its first byte is odd, the CRC is fixed up before,
+ * otherwise hardly any input would get past it to the user variables.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <env_api.h>
+#include <uservars.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	BG_ENVDATA *env = calloc(1, sizeof(BG_ENVDATA));
+
+	if (!env) {
+		abort();
+	}
+	memcpy(env, data, size < sizeof(*env) ? size : sizeof(*env));
+	if (size && data[0] & 1) {
+		env->crc32 = bgenv_crc32(0, env,
+					 sizeof(*env) - sizeof(env->crc32));
+	}
+
+	if (validate_envdata(env)) {
+		uint8_t *end = env->userdata + ENV_MEM_USERVARS;
+		uint32_t record_size;
+
+		for (uint8_t *p = env->userdata; *p;
+		     p = bgenv_next_uservar(p)) {
+			bgenv_map_uservar(p, NULL, NULL, NULL, &record_size,
+					  NULL);
+			if (p + record_size > end) {
+				abort();
+			}
+		}
+	}
+	free(env);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Driver of the fuzz targets if they are not linked with libFuzzer, which
+ * brings its own: each file given is passed to the target once, stdin if
+ * there are none. This is how AFL runs them and how crashes are replayed.
+ */
+
+#ifndef EBG_LIBFUZZER
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int run_file(FILE *f)
+{
+	uint8_t *buf = NULL, *tmp;
+	size_t size = 0, cap = 0;
+
+	for (;;) {
+		if (size == cap) {
+			cap = cap ? cap * 2 : 4096;
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				free(buf);
+				return -1;
+			}
+			buf = tmp;
+		}
+		size_t n = fread(buf + size, 1, cap - size, f);
+		if (n == 0) {
+			break;
+		}
+		size += n;
+	}
+	if (ferror(f)) {
+		free(buf);
+		return -1;
+	}
+	LLVMFuzzerTestOneInput(buf, size);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		return run_file(stdin) ? 1 : 0;
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+
+		if (!f || run_file(f)) {
+			perror(argv[i]);
+			if (f) {
+				fclose(f);
+			}
+			return 1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+#endif
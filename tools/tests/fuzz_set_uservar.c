@@ -0,0 +1,125 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Fuzz target of bgenv_set_uservar(): the input is a sequence of
+ * operations on an initially empty user variable area, each made of
+ *
+ *   | op | key length | key | value length (le16) | value |
+ *
+ * The low bits of op select the type of the variable, deleting it or
+ * converting the area to the other layout. Each operation is applied with
+ * and without an index, after which both areas have to be identical, pass
+ * validation and hold what was stored last.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <env_api.h>
+#include <uservars.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#define FUZZ_KEY_MAX 32
+#define FUZZ_VALUE_MAX 0xffff
+
+static const uint64_t types[] = {
+	USERVAR_TYPE_UINT32,
+	USERVAR_TYPE_STRING_ASCII,
+	USERVAR_TYPE_DELETED,
+	1ULL << 36,
+};
+
+static void check_value(uint8_t *udata, char *key, uint64_t type,
+			const uint8_t *value, uint32_t len)
+{
+	static uint8_t buf[FUZZ_VALUE_MAX];
+	uint64_t stored_type;
+
+	if (type & USERVAR_TYPE_DELETED) {
+		if (bgenv_find_uservar(udata, key)) {
+			abort();
+		}
+		return;
+	}
+	if (bgenv_get_uservar(udata, key, &stored_type, buf, sizeof(buf)) ||
+	    stored_type != type || memcmp(buf, value, len) != 0) {
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	uint8_t *udata = calloc(1, ENV_MEM_USERVARS);
+	uint8_t *indexed = calloc(1, ENV_MEM_USERVARS);
+	BGENV_USERVAR_INDEX *idx = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	const uint8_t *end = data + size;
+	char key[FUZZ_KEY_MAX + 1];
+	int res;
+
+	if (!udata || !indexed || !idx) {
+		abort();
+	}
+	while (end - data >= 2) {
+		uint8_t op = data[0];
+		size_t key_len = data[1] % FUZZ_KEY_MAX + 1;
+		uint64_t type = types[op % (sizeof(types) / sizeof(types[0]))];
+		uint32_t len;
+
+		data += 2;
+		if (op & 0x80) {
+			/* -ENOSPC leaves the area unchanged */
+			(void)bgenv_uservars_convert(udata, op & 1);
+			(void)bgenv_uservars_convert(indexed, op & 1);
+			bgenv_uservar_index_invalidate(idx);
+		} else {
+			if ((size_t)(end - data) < key_len + 2) {
+				break;
+			}
+			for (size_t i = 0; i < key_len; i++) {
+				/* no empty keys, those end the records */
+				key[i] = data[i] ? (char)data[i] : 'k';
+			}
+			key[key_len] = 0;
+			data += key_len;
+			len = data[0] | data[1] << 8;
+			data += 2;
+			/* a short input ends with the rest as value */
+			if (len == 0 || len > (size_t)(end - data)) {
+				len = end - data;
+			}
+			if (len > FUZZ_VALUE_MAX) {
+				len = FUZZ_VALUE_MAX;
+			}
+			if (len == 0) {
+				break;
+			}
+			res = bgenv_set_uservar(udata, key, type, (void *)data,
+						len);
+			if (bgenv_set_uservar_indexed(idx, indexed, key, type,
+						      (void *)data,
+						      len) != res) {
+				abort();
+			}
+			if (res == 0) {
+				check_value(udata, key, type, data, len);
+			}
+			data += len;
+		}
+		if (!bgenv_validate_uservars(udata) ||
+		    memcmp(udata, indexed, ENV_MEM_USERVARS) != 0) {
+			abort();
+		}
+	}
+	bgenv_uservar_index_free(idx);
+	free(indexed);
+	free(udata);
+	return 0;
+}
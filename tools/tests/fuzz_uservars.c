@@ -0,0 +1,55 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ *
+ *
+ * Fuzz target of bgenv_validate_uservars(): the input is taken as the user
+ * variable area as read from disk. Whatever passes validation must then be
+ * safe to walk and map.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <env_api.h>
+#include <uservars.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	/* on the heap, so that reading past the area is detected */
+	uint8_t *udata = calloc(1, ENV_MEM_USERVARS);
+	uint32_t data_size, record_size, used = 0;
+	uint64_t type;
+	uint8_t *val;
+	char *key;
+
+	if (!udata) {
+		abort();
+	}
+	memcpy(udata, data, size < ENV_MEM_USERVARS ? size : ENV_MEM_USERVARS);
+
+	if (bgenv_validate_uservars(udata)) {
+		for (uint8_t *p = udata; *p; p = bgenv_next_uservar(p)) {
+			bgenv_map_uservar(p, &key, &type, &val, &record_size,
+					  &data_size);
+			used += record_size;
+			if (used > ENV_MEM_USERVARS ||
+			    val + data_size > udata + ENV_MEM_USERVARS) {
+				abort();
+			}
+			(void)bgenv_find_uservar(udata, key);
+		}
+		if (bgenv_user_free(udata) > ENV_MEM_USERVARS) {
+			abort();
+		}
+	}
+	free(udata);
+	return 0;
+}
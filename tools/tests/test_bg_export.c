@@ -0,0 +1,155 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+#include <uservars.h>
+#include <bg_export.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static BG_ENVDATA data;
+
+static void setup_env(void)
+{
+	uint16_t u16 = 4711;
+	int8_t s8 = -5;
+
+	memset(&data, 0, sizeof(data));
+	data.revision = 3;
+	data.ustate = USTATE_TESTING;
+	data.watchdog_timeout_sec = 30;
+	str8to16(data.kernelfile, "C:BOOT0:vmlinuz");
+	str8to16(data.kernelparams, "root=\"/dev/sda\"");
+	bgenv_set_uservar(data.userdata, "name",
+			  USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII,
+			  "tab\there", 9);
+	bgenv_set_uservar(data.userdata, "count", USERVAR_TYPE_UINT16, &u16,
+			  sizeof(u16));
+	bgenv_set_uservar(data.userdata, "delta", USERVAR_TYPE_SINT8, &s8,
+			  sizeof(s8));
+	data.crc32 = bgenv_crc32(0, &data,
+				 sizeof(BG_ENVDATA) - sizeof(data.crc32));
+}
+
+START_TEST(bg_export_json)
+{
+	struct bg_export_env env = {
+		.data = &data,
+		.index = 1,
+		.source = "/dev/sda2",
+	};
+	struct fields fields = {
+		.revision = 1,
+		.kernelargs = 1,
+		.ustate = 1,
+		.user = 1,
+	};
+	char *expected;
+	uint8_t *buf;
+	size_t len;
+
+	setup_env();
+
+	buf = bg_export_encode(BG_EXPORT_JSON, &env, 1, &fields, &len);
+	ck_assert_ptr_nonnull(buf);
+	ck_assert_int_ne(
+		asprintf(&expected,
+			 "{\"environments\":[{\"index\":1,"
+			 "\"source\":\"/dev/sda2\",\"valid\":true,"
+			 "\"crc32\":%u,\"revision\":3,"
+			 "\"kernelargs\":\"root=\\\"/dev/sda\\\"\","
+			 "\"ustate\":2,\"ustate_name\":\"TESTING\","
+			 "\"user\":{"
+			 "\"name\":{\"type\":\"string\","
+			 "\"value\":\"tab\\u0009here\"},"
+			 "\"count\":{\"type\":\"uint16\",\"value\":4711},"
+			 "\"delta\":{\"type\":\"sint8\",\"value\":-5}}}]}\n",
+			 data.crc32),
+		-1);
+	ck_assert_uint_eq(len, strlen(expected));
+	ck_assert_mem_eq(buf, expected, len);
+	free(expected);
+	free(buf);
+
+	/* invalid environment */
+	data.revision = 4;
+	buf = bg_export_encode(BG_EXPORT_JSON, &env, 1, &fields, &len);
+	ck_assert_ptr_nonnull(buf);
+	ck_assert_ptr_nonnull(memmem(buf, len, "\"valid\":false", 13));
+	free(buf);
+
+	/* user variables whose records run past the end are not walked */
+	memset(data.userdata, 0xff, sizeof(data.userdata));
+	buf = bg_export_encode(BG_EXPORT_JSON, &env, 1, &fields, &len);
+	ck_assert_ptr_nonnull(buf);
+	ck_assert_ptr_nonnull(memmem(buf, len, "\"user\":{}", 9));
+	free(buf);
+}
+END_TEST
+
+START_TEST(bg_export_cbor)
+{
+	struct bg_export_env env[2] = {
+		{.data = &data, .index = 0},
+		{.data = &data, .index = 1},
+	};
+	struct fields fields = {
+		.revision = 1,
+	};
+	const uint8_t expected_start[] = {
+		0xa1, /* map(1) */
+		0x6c, 'e', 'n', 'v', 'i', 'r', 'o', 'n', 'm', 'e', 'n', 't',
+		's',
+		0x82, /* array(2) */
+		0xa4, /* map(4) */
+		0x65, 'i', 'n', 'd', 'e', 'x', 0x00,
+		0x65, 'v', 'a', 'l', 'i', 'd', 0xf5,
+		0x65, 'c', 'r', 'c', '3', '2', 0x1a,
+	};
+	const uint8_t expected_end[] = {
+		0x68, 'r', 'e', 'v', 'i', 's', 'i', 'o', 'n', 0x03,
+	};
+	uint8_t *buf;
+	size_t len;
+
+	setup_env();
+
+	buf = bg_export_encode(BG_EXPORT_CBOR, env, 2, &fields, &len);
+	ck_assert_ptr_nonnull(buf);
+	/* header, two maps of index, valid, crc32 and revision */
+	ck_assert_uint_eq(len, 15 + 2 * (1 + 7 + 7 + 11 + 10));
+	ck_assert_mem_eq(buf, expected_start, sizeof(expected_start));
+	ck_assert_mem_eq(buf + len - sizeof(expected_end), expected_end,
+			 sizeof(expected_end));
+	free(buf);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("bg_export");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, bg_export_json);
+	tcase_add_test(tc_core, bg_export_cbor);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,135 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static const BGENV_CRC32_BACKEND backends[] = {
+	BGENV_CRC32_SLICE8,
+	BGENV_CRC32_PCLMUL,
+	BGENV_CRC32_ARMV8,
+	BGENV_CRC32_AUTO,
+};
+
+START_TEST(crc32_check_value)
+{
+	const char *input = "123456789";
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!bgenv_crc32_select(backends[i])) {
+			continue;
+		}
+		ck_assert_uint_eq(bgenv_crc32(0, input, strlen(input)),
+				  0xCBF43926);
+		ck_assert_uint_eq(bgenv_crc32(0, input, 0), 0);
+	}
+	bgenv_crc32_select(BGENV_CRC32_AUTO);
+}
+END_TEST
+
+START_TEST(crc32_backends_match_bytewise)
+{
+	static uint8_t buffer[4096 + 64];
+
+	srand(42);
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = rand();
+	}
+
+	/* cover all alignments, tails and the fold thresholds */
+	const size_t sizes[] = {1, 7, 8, 15, 16, 63, 64, 65, 127, 128, 129,
+				1000, 4096};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (size_t offset = 0; offset < 16; offset++) {
+			uint32_t expected, crc;
+
+			bgenv_crc32_select(BGENV_CRC32_BYTEWISE);
+			expected = bgenv_crc32(0x12345678, buffer + offset,
+					       sizes[s]);
+			for (size_t b = 0;
+			     b < sizeof(backends) / sizeof(backends[0]); b++) {
+				if (!bgenv_crc32_select(backends[b])) {
+					continue;
+				}
+				crc = bgenv_crc32(0x12345678, buffer + offset,
+						  sizes[s]);
+				ck_assert_uint_eq(crc, expected);
+			}
+		}
+	}
+	bgenv_crc32_select(BGENV_CRC32_AUTO);
+}
+END_TEST
+
+START_TEST(crc32_chained)
+{
+	static uint8_t buffer[sizeof(BG_ENVDATA)];
+	uint32_t full, chained;
+
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = i * 7;
+	}
+	full = bgenv_crc32(0, buffer, sizeof(buffer));
+	chained = bgenv_crc32(0, buffer, 100);
+	chained = bgenv_crc32(chained, buffer + 100, sizeof(buffer) - 100);
+	ck_assert_uint_eq(full, chained);
+}
+END_TEST
+
+START_TEST(crc32_combine_and_patch)
+{
+	uint8_t buffer[1000];
+	uint32_t crc, before, after;
+
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = i ^ 0x5a;
+	}
+	crc = bgenv_crc32(0, buffer, sizeof(buffer));
+	ck_assert_uint_eq(bgenv_crc32_combine(bgenv_crc32(0, buffer, 333),
+					      bgenv_crc32(0, buffer + 333,
+							  667),
+					      667),
+			  crc);
+
+	/* patch the CRC after changing 8 bytes in the middle */
+	before = bgenv_crc32_raw(buffer + 500, 8);
+	memset(buffer + 500, 0xff, 8);
+	after = bgenv_crc32_raw(buffer + 500, 8);
+	crc ^= bgenv_crc32_shift(before ^ after, sizeof(buffer) - 508);
+	ck_assert_uint_eq(crc, bgenv_crc32(0, buffer, sizeof(buffer)));
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("crc32");
+
+	tc_core = tcase_create("Core");
+
+	tcase_add_test(tc_core, crc32_check_value);
+	tcase_add_test(tc_core, crc32_backends_match_bytewise);
+	tcase_add_test(tc_core, crc32_chained);
+	tcase_add_test(tc_core, crc32_combine_and_patch);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
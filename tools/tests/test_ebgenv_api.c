@@ -13,6 +13,7 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <check.h>
 #include <fff.h>
 #include <env_api.h>
@@ -108,6 +109,16 @@ START_TEST(ebgenv_api_ebg_env_options)
 	ck_assert_int_ne(status, 0);
 	status = ebg_get_opt_bool(0xffff, &verbose);
 	ck_assert_int_ne(status, 0);
+
+	// numeric options are not boolean and vice versa
+	uint32_t timeout;
+	ck_assert_int_eq(ebg_set_opt_uint(EBG_OPT_PROBE_TIMEOUT_MS, 500), 0);
+	ck_assert_int_eq(ebg_get_opt_uint(EBG_OPT_PROBE_TIMEOUT_MS, &timeout),
+			 0);
+	ck_assert_uint_eq(timeout, 500);
+	ck_assert_int_ne(ebg_set_opt_bool(EBG_OPT_PROBE_TIMEOUT_MS, true), 0);
+	ck_assert_int_ne(ebg_set_opt_uint(EBG_OPT_VERBOSE, 1), 0);
+	ck_assert_int_eq(ebg_set_opt_uint(EBG_OPT_PROBE_TIMEOUT_MS, 0), 0);
 }
 END_TEST
 
@@ -660,6 +671,7 @@ START_TEST(ebgenv_api_ebg_env_register_gc_var)
 		envdata[i].revision = i + 1;
 	}
 
+	ebg_set_opt_bool(EBG_OPT_INCREMENTAL_CRC, true);
 	ret = ebg_env_create_new(&e);
 	ck_assert_int_eq(ret, 0);
 
@@ -691,7 +703,254 @@ START_TEST(ebgenv_api_ebg_env_register_gc_var)
 	res = ebg_env_get(&e, "VarC", NULL);
 	ck_assert_int_eq(res, -ENOENT);
 
+	/* many scratch variables, some registered twice, some missing */
+	for (int i = 0; i < 100; i++) {
+		char key[24];
+
+		snprintf(key, sizeof(key), "Scratch%d", i);
+		ck_assert_int_eq(ebg_env_set(&e, key, "x"), 0);
+		ck_assert_int_eq(ebg_env_register_gc_var(&e, key), 0);
+	}
+	ck_assert_int_eq(ebg_env_register_gc_var(&e, "Scratch7"), 0);
+	ck_assert_int_eq(ebg_env_register_gc_var(&e, "Missing"), 0);
+	ebg_env_finalize_update(&e);
+	/* the incrementally patched CRC matches */
+	BG_ENVDATA *data = ((BGENV *)e.bgenv)->data;
+	ck_assert_uint_eq(data->crc32,
+			  bgenv_crc32(0, data, sizeof(BG_ENVDATA) -
+						       sizeof(data->crc32)));
+	for (int i = 0; i < 100; i++) {
+		char key[24];
+
+		snprintf(key, sizeof(key), "Scratch%d", i);
+		ck_assert_int_eq(ebg_env_get(&e, key, NULL), -ENOENT);
+	}
+	res = ebg_env_get(&e, "VarB", NULL);
+	ck_assert_int_eq(res, strlen("TestB") + 1);
+
 	ebg_env_close(&e);
+	ebg_set_opt_bool(EBG_OPT_INCREMENTAL_CRC, false);
+}
+END_TEST
+
+START_TEST(ebgenv_api_ebg_env_transaction)
+{
+#if ENV_NUM_CONFIG_PARTS > 1
+	ebgenv_t e = { };
+	unsigned int writes;
+	static uint8_t big[ENV_MEM_USERVARS];
+	int ret;
+
+	init_test();
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].revision = i + 1;
+		envdata[i].ustate = USTATE_TESTING;
+	}
+	bgenv_init_fake.return_val = true;
+	bgenv_write_fake.return_val = true;
+
+	ret = ebg_env_open_current(&e);
+	ck_assert_int_eq(ret, 0);
+
+	/* Test that changes are only recorded until commit
+	 */
+	ret = ebg_env_begin(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(ebg_env_begin(&e), EBUSY);
+
+	ck_assert_int_eq(ebg_env_set(&e, "VarA", "TestA"), 0);
+	ck_assert_int_eq(ebg_env_set(&e, "VarB", "TestB"), 0);
+	ck_assert_int_eq(ebg_env_set(&e, "VarA", "TestAA"), 0);
+	ck_assert_int_eq(ebg_env_setglobalstate(&e, USTATE_OK), 0);
+
+	writes = bgenv_write_fake.call_count;
+	ck_assert_int_eq(ebg_env_get(&e, "VarA", NULL), -ENOENT);
+	ck_assert_int_eq(envdata[ENV_NUM_CONFIG_PARTS - 1].ustate,
+			 USTATE_TESTING);
+
+	/* Test that commit applies all changes and writes every affected
+	 * environment once
+	 */
+	ret = ebg_env_commit(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(ebg_env_get(&e, "VarA", NULL), strlen("TestAA") + 1);
+	ck_assert_int_eq(ebg_env_get(&e, "VarB", NULL), strlen("TestB") + 1);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_int_eq(envdata[i].ustate, USTATE_OK);
+	}
+	ck_assert_int_eq(bgenv_write_fake.call_count - writes,
+			 ENV_NUM_CONFIG_PARTS);
+	ck_assert_int_eq(ebg_env_commit(&e), EINVAL);
+
+	/* Test that a failing change discards the whole transaction
+	 */
+	memset(big, 'x', sizeof(big));
+	ck_assert_int_eq(ebg_env_begin(&e), 0);
+	ck_assert_int_eq(ebg_env_set(&e, "VarC", "TestC"), 0);
+	ck_assert_int_eq(ebg_env_set_ex(&e, "VarD", USERVAR_TYPE_DEFAULT, big,
+					sizeof(big)), 0);
+	writes = bgenv_write_fake.call_count;
+	ret = ebg_env_commit(&e);
+	ck_assert_int_eq(ret, ENOMEM);
+	ck_assert_int_eq(ebg_env_get(&e, "VarC", NULL), -ENOENT);
+	ck_assert_int_eq(bgenv_write_fake.call_count, writes);
+
+	/* Test that close after commit does not write again
+	 */
+	ck_assert_int_eq(ebg_env_begin(&e), 0);
+	ck_assert_int_eq(ebg_env_set(&e, "VarC", "TestC"), 0);
+	ck_assert_int_eq(ebg_env_commit(&e), 0);
+	writes = bgenv_write_fake.call_count;
+	ck_assert_int_eq(ebg_env_close(&e), 0);
+	ck_assert_int_eq(bgenv_write_fake.call_count, writes);
+#endif
+}
+END_TEST
+
+START_TEST(ebgenv_api_ebg_env_set_many)
+{
+	ebgenv_t e = { };
+	ebg_uservar_t vars[] = {
+		{"VarA", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"a", 2},
+		{"VarB", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"b", 2},
+		{"VarA", USERVAR_TYPE_DELETED, NULL, 0},
+		{"VarC", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"c", 2},
+	};
+	ebg_uservar_t invalid[] = {
+		{"VarD", USERVAR_TYPE_STRING_ASCII, (uint8_t *)"d", 2},
+		{"VarE", USERVAR_TYPE_STRING_ASCII, NULL, 0},
+	};
+	ebg_uservar_t *exported;
+	uint32_t count;
+	int size;
+
+	init_test();
+	bgenv_init_fake.return_val = true;
+	bgenv_write_fake.return_val = true;
+	ck_assert_int_eq(ebg_env_open_current(&e), 0);
+
+	/* Test that built-in variables are rejected
+	 */
+	vars[1].key = "kernelfile";
+	ck_assert_int_eq(ebg_env_set_many(&e, vars, 4), -EINVAL);
+	vars[1].key = "VarB";
+
+	/* Test that the records are only applied on commit in a transaction
+	 */
+	ck_assert_int_eq(ebg_env_begin(&e), 0);
+	/* an invalid record rejects the whole call, nothing is recorded */
+	ck_assert_int_eq(ebg_env_set_many(&e, invalid, 2), -EINVAL);
+	invalid[1].data = (uint8_t *)"e";
+	invalid[1].key = "";
+	ck_assert_int_eq(ebg_env_set_many(&e, invalid, 2), -EINVAL);
+	ck_assert_int_eq(ebg_env_set_many(&e, vars, 4), 0);
+	ck_assert_int_eq(ebg_env_get(&e, "VarB", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_commit(&e), 0);
+	ck_assert_int_eq(ebg_env_get(&e, "VarD", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "VarA", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "VarB", NULL), 2);
+
+	/* Test that all variables are exported at once
+	 */
+	vars[3].data = (uint8_t *)"cc";
+	vars[3].len = 3;
+	ck_assert_int_eq(ebg_env_set_many(&e, &vars[3], 1), 0);
+	size = ebg_env_get_all(&e, NULL, 0, &count);
+	ck_assert_int_eq(count, 2);
+	ck_assert_int_eq(size, 2 * sizeof(ebg_uservar_t) + 5 + 2 + 5 + 3);
+	exported = malloc(size);
+	ck_assert_ptr_nonnull(exported);
+	ck_assert_int_eq(ebg_env_get_all(&e, exported, size, &count), 0);
+	ck_assert_str_eq(exported[0].key, "VarB");
+	ck_assert_str_eq((char *)exported[0].data, "b");
+	ck_assert_str_eq(exported[1].key, "VarC");
+	ck_assert_str_eq((char *)exported[1].data, "cc");
+	ck_assert_int_eq(exported[1].len, 3);
+	free(exported);
+
+	ck_assert_int_eq(ebg_env_close(&e), 0);
+}
+END_TEST
+
+START_TEST(ebgenv_api_ebg_env_shared)
+{
+	ebgenv_t e1 = { }, e2 = { };
+	char buffer[32];
+
+	init_test();
+	bgenv_init_fake.return_val = true;
+	bgenv_write_fake.return_val = true;
+
+	/* Test that a context sees the changes done through another one,
+	 * although they moved the records it has indexed
+	 */
+	ck_assert_int_eq(ebg_env_open_current(&e1), 0);
+	ck_assert_int_eq(ebg_env_open_current(&e2), 0);
+	ck_assert_int_eq(ebg_env_set(&e1, "VarA", "a"), 0);
+	ck_assert_int_eq(ebg_env_set(&e1, "VarB", "b"), 0);
+	ck_assert_int_eq(ebg_env_get(&e2, "VarB", buffer), 0);
+	ck_assert_int_eq(ebg_env_set(&e1, "VarA", "a much longer value"), 0);
+	ck_assert_int_eq(ebg_env_get(&e2, "VarB", buffer), 0);
+	ck_assert_str_eq(buffer, "b");
+	ck_assert_int_eq(ebg_env_close(&e1), 0);
+	ck_assert_int_eq(ebg_env_close(&e2), 0);
+}
+END_TEST
+
+#define TEST_THREADS 8
+
+static void *env_worker(void *arg)
+{
+	char key[16], value[16];
+	ebgenv_t e = { };
+	long id = (long)arg;
+
+	snprintf(key, sizeof(key), "Thread%ld", id);
+	for (int i = 0; i < 50; i++) {
+		if (ebg_env_open_current(&e)) {
+			return (void *)1;
+		}
+		snprintf(value, sizeof(value), "%d", i);
+		if (ebg_env_set(&e, key, value) ||
+		    ebg_env_user_free(&e) == 0 ||
+		    ebg_env_getglobalstate(&e) != USTATE_OK ||
+		    ebg_env_close(&e)) {
+			return (void *)1;
+		}
+	}
+	return NULL;
+}
+
+START_TEST(ebgenv_api_ebg_env_threads)
+{
+	pthread_t threads[TEST_THREADS];
+	ebgenv_t e = { };
+	char key[16], buffer[16];
+	void *res;
+
+	init_test();
+	bgenv_init_fake.return_val = true;
+	bgenv_write_fake.return_val = true;
+
+	/* Test that contexts can be used from several threads at once */
+	for (long i = 0; i < TEST_THREADS; i++) {
+		ck_assert_int_eq(pthread_create(&threads[i], NULL, env_worker,
+						(void *)i),
+				 0);
+	}
+	for (int i = 0; i < TEST_THREADS; i++) {
+		pthread_join(threads[i], &res);
+		ck_assert_ptr_null(res);
+	}
+
+	ck_assert_int_eq(ebg_env_open_current(&e), 0);
+	for (int i = 0; i < TEST_THREADS; i++) {
+		snprintf(key, sizeof(key), "Thread%d", i);
+		ck_assert_int_eq(ebg_env_get(&e, key, buffer), 0);
+		ck_assert_str_eq(buffer, "49");
+	}
+	ck_assert_int_eq(ebg_env_close(&e), 0);
 }
 END_TEST
 
@@ -716,6 +975,10 @@ Suite *ebg_test_suite(void)
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_setglobalstate);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_close);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_register_gc_var);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_transaction);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_set_many);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_shared);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_threads);
 
 	suite_add_tcase(s, tc_core);
 
@@ -19,6 +19,8 @@
 #include <env_config_file.h>
 #include <env_config_partitions.h>
 #include <ebgenv.h>
+#include <uservars.h>
+#include <env_stats.h>
 
 DEFINE_FFF_GLOBALS;
 
@@ -69,6 +71,52 @@ START_TEST(ebgenv_api_internal_strXtoY)
 }
 END_TEST
 
+START_TEST(ebgenv_api_internal_strXtoYn)
+{
+	char16_t bufferw[ENV_STRING_LENGTH];
+	char buffer[ENV_STRING_LENGTH];
+	char input[ENV_STRING_LENGTH];
+
+	/* cover the vectorized steps as well as the remainders */
+	for (size_t len = 0; len < 40; len++) {
+		memset(input, 0, sizeof(input));
+		for (size_t i = 0; i < len; i++) {
+			input[i] = 'a' + i % 26;
+		}
+		memset(bufferw, 0xff, sizeof(bufferw));
+		ck_assert_uint_eq(str8to16n(bufferw, input, ENV_STRING_LENGTH),
+				  len);
+		for (size_t i = 0; i < len; i++) {
+			ck_assert_uint_eq(bufferw[i], input[i]);
+		}
+		ck_assert_uint_eq(bufferw[len], 0);
+
+		memset(buffer, 0xff, sizeof(buffer));
+		ck_assert_uint_eq(str16to8n(buffer, bufferw, ENV_STRING_LENGTH),
+				  len);
+		ck_assert_str_eq(buffer, input);
+
+		/* bounded by the destination, always terminated */
+		memset(buffer, 0xff, sizeof(buffer));
+		ck_assert_uint_eq(str16to8n(buffer, bufferw, 10),
+				  len < 9 ? len : 9);
+		ck_assert_int_eq(strncmp(buffer, input, 9), 0);
+		memset(bufferw, 0xff, sizeof(bufferw));
+		ck_assert_uint_eq(str8to16n(bufferw, input, 17),
+				  len < 16 ? len : 16);
+		ck_assert_uint_eq(bufferw[len < 16 ? len : 16], 0);
+		ck_assert_uint_eq(bufferw[17], 0xffff);
+	}
+
+	/* no sign extension, upper bytes are cut */
+	ck_assert_uint_eq(str8to16n(bufferw, "\xe4", 2), 1);
+	ck_assert_uint_eq(bufferw[0], 0xe4);
+	bufferw[0] = 0x1e4;
+	ck_assert_uint_eq(str16to8n(buffer, bufferw, 2), 1);
+	ck_assert_uint_eq((unsigned char)buffer[0], 0xe4);
+}
+END_TEST
+
 START_TEST(ebgenv_api_internal_bgenv_str2enum)
 {
 	EBGENVKEY e;
@@ -90,6 +138,17 @@ START_TEST(ebgenv_api_internal_bgenv_str2enum)
 	e = bgenv_str2enum("ustate");
 	ck_assert(e == EBGENV_USTATE);
 
+	e = bgenv_str2enum("in_progress");
+	ck_assert(e == EBGENV_IN_PROGRESS);
+
+	/* user variables sharing a prefix or the first character */
+	ck_assert(bgenv_str2enum("kernel") == EBGENV_UNKNOWN);
+	ck_assert(bgenv_str2enum("kernelfiles") == EBGENV_UNKNOWN);
+	ck_assert(bgenv_str2enum("kernelp") == EBGENV_UNKNOWN);
+	ck_assert(bgenv_str2enum("k") == EBGENV_UNKNOWN);
+	ck_assert(bgenv_str2enum("revisions") == EBGENV_UNKNOWN);
+	ck_assert(bgenv_str2enum("user") == EBGENV_UNKNOWN);
+
 	/* Test if bgenv_str2enum returns EBGENV_UNKNOWN for empty and invalid
 	 * keys
 	 */
@@ -109,13 +168,13 @@ START_TEST(ebgenv_api_internal_bgenv_open_by_index)
 	ck_assert(handle != NULL);
 	ck_assert(handle->desc == &config_parts[0]);
 	ck_assert(handle->data == &envdata[0]);
-	free(handle);
+	bgenv_close(handle);
 
 	handle = bgenv_open_by_index(ENV_NUM_CONFIG_PARTS-1);
 	ck_assert(handle != NULL);
 	ck_assert(handle->desc == &config_parts[ENV_NUM_CONFIG_PARTS-1]);
 	ck_assert(handle->data == &envdata[ENV_NUM_CONFIG_PARTS-1]);
-	free(handle);
+	bgenv_close(handle);
 
 	/* Test if bgenv_open_by_index returns NULL if parameter is out of
 	 * range
@@ -140,7 +199,7 @@ START_TEST(ebgenv_api_internal_bgenv_open_oldest)
 	ck_assert(handle != NULL);
 	ck_assert(handle->desc == &config_parts[ENV_NUM_CONFIG_PARTS-1]);
 	ck_assert(handle->data == &envdata[ENV_NUM_CONFIG_PARTS-1]);
-	free(handle);
+	bgenv_close(handle);
 }
 END_TEST
 
@@ -159,7 +218,32 @@ START_TEST(ebgenv_api_internal_bgenv_open_latest)
 	ck_assert(handle != NULL);
 	ck_assert(handle->desc == &config_parts[0]);
 	ck_assert(handle->data == &envdata[0]);
-	free(handle);
+	bgenv_close(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_revision_order)
+{
+	BG_ENVDATA *envs = calloc(4, sizeof(BG_ENVDATA));
+	int invalid[4] = {0, 0, 1, 0};
+	unsigned int order[4];
+
+	/* Test if valid environments are ordered by descending revision,
+	 * equal revisions by index */
+	ck_assert_ptr_nonnull(envs);
+	envs[0].revision = 3;
+	envs[1].revision = 5;
+	envs[2].revision = 9;
+	envs[3].revision = 5;
+	ck_assert_uint_eq(bgenv_revision_order(envs, invalid, 4, order), 3);
+	ck_assert_uint_eq(order[0], 1);
+	ck_assert_uint_eq(order[1], 3);
+	ck_assert_uint_eq(order[2], 0);
+
+	ck_assert_uint_eq(bgenv_revision_order(envs, NULL, 4, order), 4);
+	ck_assert_uint_eq(order[0], 2);
+	ck_assert_uint_eq(order[3], 0);
+	free(envs);
 }
 END_TEST
 
@@ -256,7 +340,42 @@ START_TEST(ebgenv_api_internal_bgenv_create_new)
 	ck_assert(envdata[max-1].revision == max+1);
 	ck_assert(envdata[max-1].watchdog_timeout_sec == (max == 1 ? 0 : 30));
 
-	free(handle);
+	bgenv_close(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_stage)
+{
+	BG_ENVDATA *base = calloc(2, sizeof(BG_ENVDATA));
+	BGENV env = {.data = base + 1, .crc_incremental = true};
+	BGENV src = {.data = base};
+	char value[64];
+
+	ck_assert_ptr_nonnull(base);
+	/* the target uses more of the user variables than the base */
+	for (int i = 0; i < 20; i++) {
+		snprintf(value, sizeof(value), "var%d", i);
+		ck_assert_int_eq(bgenv_set(&env, value, USERVAR_TYPE_DEFAULT |
+					   USERVAR_TYPE_STRING_ASCII, value,
+					   strlen(value) + 1), 0);
+	}
+	ck_assert_int_eq(bgenv_set(&src, "var0", USERVAR_TYPE_DEFAULT |
+				   USERVAR_TYPE_STRING_ASCII, "base", 5), 0);
+	base->revision = 7;
+	base->watchdog_timeout_sec = 11;
+	bgenv_update_crc(&src);
+
+	bgenv_stage(&env, base);
+	ck_assert_int_eq(memcmp(env.data, base, sizeof(BG_ENVDATA)), 0);
+
+	bgenv_stage(&env, NULL);
+	memset(base, 0, sizeof(BG_ENVDATA));
+	bgenv_update_crc(&src);
+	ck_assert_int_eq(memcmp(env.data, base, sizeof(BG_ENVDATA)), 0);
+
+	bgenv_uservar_index_free(env.uservar_index);
+	bgenv_uservar_index_free(src.uservar_index);
+	free(base);
 }
 END_TEST
 
@@ -322,7 +441,58 @@ START_TEST(ebgenv_api_internal_bgenv_get)
 	ck_assert_int_eq(res, 0);
 	ck_assert_int_eq(strcmp(buffera, test_strings[1]), 0);
 
-	free(handle);
+	bgenv_close(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_get_typed)
+{
+	BGENV *handle = bgenv_open_latest();
+	const uint8_t *view;
+	uint16_t small = 4711;
+	int32_t negative = -1;
+	uint64_t value, type;
+	uint32_t len;
+
+	ck_assert(handle != NULL);
+	handle->data->revision = 10000;
+	handle->data->ustate = USTATE_TESTING;
+
+	/* built-in numbers are read without a conversion to strings */
+	ck_assert_int_eq(bgenv_get_u64(handle, "revision", &value), 0);
+	ck_assert_uint_eq(value, 10000);
+	ck_assert_int_eq(bgenv_get_u64(handle, "ustate", &value), 0);
+	ck_assert_uint_eq(value, USTATE_TESTING);
+	ck_assert_int_eq(bgenv_get_u64(handle, "kernelfile", &value), -EINVAL);
+
+	ck_assert_int_eq(bgenv_set(handle, "small", USERVAR_TYPE_UINT16,
+				   &small, sizeof(small)), 0);
+	ck_assert_int_eq(bgenv_set(handle, "negative", USERVAR_TYPE_SINT32,
+				   &negative, sizeof(negative)), 0);
+	ck_assert_int_eq(bgenv_set(handle, "text", USERVAR_TYPE_STRING_ASCII,
+				   "hello", 6), 0);
+	ck_assert_int_eq(bgenv_get_u64(handle, "small", &value), 0);
+	ck_assert_uint_eq(value, 4711);
+	ck_assert_int_eq(bgenv_get_u64(handle, "negative", &value), -ERANGE);
+	ck_assert_int_eq(bgenv_get_u64(handle, "text", &value), -EINVAL);
+	ck_assert_int_eq(bgenv_get_u64(handle, "missing", &value), -ENOENT);
+
+	/* views point into the environment */
+	ck_assert_int_eq(bgenv_get_view(handle, "text", &type, &view, &len),
+			 0);
+	ck_assert(type == USERVAR_TYPE_STRING_ASCII);
+	ck_assert_uint_eq(len, 6);
+	ck_assert_str_eq((const char *)view, "hello");
+	ck_assert(view > handle->data->userdata &&
+		  view < handle->data->userdata + ENV_MEM_USERVARS);
+	ck_assert_int_eq(bgenv_get_view(handle, "missing", &type, &view,
+					&len),
+			 -ENOENT);
+	ck_assert_int_eq(bgenv_get_view(handle, "revision", &type, &view,
+					&len),
+			 -EINVAL);
+
+	bgenv_close(handle);
 }
 END_TEST
 
@@ -382,7 +552,45 @@ START_TEST(ebgenv_api_internal_bgenv_set)
 	ck_assert_int_eq(res, 0);
 	ck_assert_int_eq(handle->data->revision, 10301);
 
-	free(handle);
+	bgenv_close(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_set_uint)
+{
+	BG_ENVDATA *data = calloc(2, sizeof(BG_ENVDATA));
+	BGENV env = {.data = data, .crc_incremental = true};
+	BGENV check = {.data = data + 1};
+	uint64_t type;
+	char value[12];
+
+	ck_assert_ptr_nonnull(data);
+	bgenv_update_crc(&env);
+
+	bgenv_set_revision(&env, 4000000000u);
+	bgenv_set_ustate(&env, USTATE_TESTING);
+	ck_assert_uint_eq(bgenv_get_revision(&env), 4000000000u);
+	ck_assert_uint_eq(bgenv_get_ustate(&env), USTATE_TESTING);
+	ck_assert_int_eq(bgenv_set_uint(&env, EBGENV_WATCHDOG_TIMEOUT_SEC,
+					600), 0);
+	ck_assert_uint_eq(bgenv_get_watchdog_timeout_sec(&env), 600);
+	ck_assert_int_eq(bgenv_set_uint(&env, EBGENV_IN_PROGRESS, 256),
+			 -ERANGE);
+	ck_assert_int_eq(bgenv_set_uint(&env, EBGENV_KERNELFILE, 1), -EINVAL);
+	ck_assert_int_eq(bgenv_set_uint(NULL, EBGENV_REVISION, 1), -EPERM);
+
+	/* the CRC was patched along */
+	memcpy(check.data, data, sizeof(BG_ENVDATA));
+	bgenv_update_crc(&check);
+	ck_assert_uint_eq(data->crc32, check.data->crc32);
+
+	/* the revision is reported with the width of the field */
+	ck_assert_int_eq(bgenv_get(&env, "revision", &type, value,
+				   sizeof(value)), 0);
+	ck_assert(type == USERVAR_TYPE_UINT32);
+	ck_assert_str_eq(value, "4000000000");
+
+	free(data);
 }
 END_TEST
 
@@ -433,6 +641,161 @@ START_TEST(ebgenv_api_internal_uservars)
 }
 END_TEST
 
+START_TEST(ebgenv_api_internal_stats)
+{
+	BGENV_USERVAR_INDEX idx = {0};
+	ebg_env_stats_t stats;
+	uint8_t buf[100] = {0};
+	char dev[32];
+
+	ebg_env_reset_stats();
+	ck_assert_int_eq(ebg_env_get_stats(NULL), EINVAL);
+
+	/* nothing is counted unless enabled */
+	bgenv_crc32(0, buf, sizeof(buf));
+	bgenv_stat_device("/dev/sda", bgenv_stat_begin());
+	ck_assert_int_eq(ebg_env_get_stats(&stats), 0);
+	ck_assert_uint_eq(stats.crc32.count, 0);
+	ck_assert_uint_eq(stats.num_devices, 0);
+
+	ebg_set_opt_bool(EBG_OPT_STATS, true);
+	bgenv_crc32(0, buf, sizeof(buf));
+	bgenv_crc32_raw(buf, 10);
+	bgenv_find_uservar_indexed(&idx, buf, "missing");
+	for (int i = 0; i < EBG_STATS_MAX_DEVICES + 2; i++) {
+		snprintf(dev, sizeof(dev), "/dev/sd%c", 'a' + i);
+		bgenv_stat_device(dev, bgenv_stat_begin());
+	}
+	bgenv_stat_device("/dev/sda", bgenv_stat_begin());
+	ebg_set_opt_bool(EBG_OPT_STATS, false);
+	free(idx.slots);
+
+	ck_assert_int_eq(ebg_env_get_stats(&stats), 0);
+	ck_assert_uint_eq(stats.crc32.count, 2);
+	ck_assert_uint_eq(stats.crc32.bytes, sizeof(buf) + 10);
+	ck_assert_uint_eq(stats.uservar_lookup.count, 1);
+	/* devices beyond the table are dropped */
+	ck_assert_uint_eq(stats.num_devices, EBG_STATS_MAX_DEVICES);
+	ck_assert_str_eq(stats.devices[0].devpath, "/dev/sda");
+	ck_assert_uint_eq(stats.devices[0].scan.count, 2);
+	ck_assert_uint_eq(stats.devices[1].scan.count, 1);
+
+	ebg_env_reset_stats();
+	ck_assert_int_eq(ebg_env_get_stats(&stats), 0);
+	ck_assert_uint_eq(stats.crc32.count, 0);
+	ck_assert_uint_eq(stats.num_devices, 0);
+}
+END_TEST
+
+static int writes_in_flight, max_writes_in_flight;
+
+static bool write_env_slow_fake(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	int n = __atomic_add_fetch(&writes_in_flight, 1, __ATOMIC_SEQ_CST);
+	int max = __atomic_load_n(&max_writes_in_flight, __ATOMIC_SEQ_CST);
+
+	while (n > max &&
+	       !__atomic_compare_exchange_n(&max_writes_in_flight, &max, n,
+					    false, __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST)) {
+	}
+	usleep(20000);
+	__atomic_sub_fetch(&writes_in_flight, 1, __ATOMIC_SEQ_CST);
+	return env->ustate != USTATE_FAILED;
+}
+
+START_TEST(ebgenv_api_internal_bgenv_write_all)
+{
+	BGENV *envs[ENV_NUM_CONFIG_PARTS];
+
+	memset(config_parts, 0, sizeof(config_parts));
+	memset(envdata, 0, sizeof(envdata));
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envs[i] = bgenv_open_by_index(i);
+		ck_assert_ptr_nonnull(envs[i]);
+	}
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_slow_fake;
+
+	max_writes_in_flight = 0;
+	ck_assert(bgenv_write_all(envs, ENV_NUM_CONFIG_PARTS));
+	ck_assert_int_eq(max_writes_in_flight, 1);
+
+	/* unchanged environments are not written again */
+	RESET_FAKE(write_env);
+	ck_assert(bgenv_write_all(envs, ENV_NUM_CONFIG_PARTS));
+	ck_assert_int_eq(write_env_fake.call_count, 0);
+
+	write_env_fake.custom_fake = write_env_slow_fake;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].revision++;
+		bgenv_update_crc(envs[i]);
+	}
+	/* copies are not written at the same time with EBG_OPT_PARALLEL_IO
+	 * either, a crash must leave one of them intact */
+	max_writes_in_flight = 0;
+	ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, true);
+	ck_assert(bgenv_write_all(envs, ENV_NUM_CONFIG_PARTS));
+	ck_assert_int_eq(max_writes_in_flight, 1);
+	ebg_set_opt_bool(EBG_OPT_PARALLEL_IO, false);
+
+	/* the first failure ends writing */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].ustate = i ? USTATE_OK : USTATE_FAILED;
+		bgenv_update_crc(envs[i]);
+	}
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_slow_fake;
+	ck_assert(!bgenv_write_all(envs, ENV_NUM_CONFIG_PARTS));
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		bgenv_close(envs[i]);
+	}
+	memset(envdata, 0, sizeof(envdata));
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_write_unchanged)
+{
+	BGENV *env;
+
+	memset(config_parts, 0, sizeof(config_parts));
+	memset(envdata, 0, sizeof(envdata));
+	env = bgenv_open_by_index(0);
+	ck_assert_ptr_nonnull(env);
+	RESET_FAKE(write_env);
+	write_env_fake.custom_fake = write_env_custom_fake;
+
+	env->data->revision = 4711;
+	bgenv_update_crc(env);
+	ck_assert(bgenv_write(env));
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+	ck_assert(bgenv_write(env));
+	ck_assert_int_eq(write_env_fake.call_count, 1);
+
+	env->data->ustate = USTATE_TESTING;
+	bgenv_update_crc(env);
+	ck_assert(bgenv_write(env));
+	ck_assert_int_eq(write_env_fake.call_count, 2);
+
+	/* after a failure, nothing is known about the stored one */
+	env->data->ustate = USTATE_OK;
+	bgenv_update_crc(env);
+	write_env_fake.custom_fake = NULL;
+	write_env_fake.return_val = false;
+	ck_assert(!bgenv_write(env));
+	ck_assert_int_eq(write_env_fake.call_count, 3);
+	env->data->ustate = USTATE_TESTING;
+	bgenv_update_crc(env);
+	ck_assert(!bgenv_write(env));
+	ck_assert_int_eq(write_env_fake.call_count, 4);
+
+	bgenv_close(env);
+	memset(envdata, 0, sizeof(envdata));
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -443,16 +806,24 @@ Suite *ebg_test_suite(void)
 	tc_core = tcase_create("Core");
 
 	tcase_add_test(tc_core, ebgenv_api_internal_strXtoY);
+	tcase_add_test(tc_core, ebgenv_api_internal_strXtoYn);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_str2enum);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_open_by_index);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_open_oldest);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_open_latest);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_revision_order);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_write);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_write_all);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_write_unchanged);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_read);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_create_new);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_stage);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_get);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_get_typed);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_set);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_set_uint);
 	tcase_add_test(tc_core, ebgenv_api_internal_uservars);
+	tcase_add_test(tc_core, ebgenv_api_internal_stats);
 
 	suite_add_tcase(s, tc_core);
 
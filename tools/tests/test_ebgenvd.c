@@ -0,0 +1,285 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+#include <ebgenvd.h>
+#include <ebgenv.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static char tmpdir[] = "/tmp/ebg-ebgenvd-XXXXXX";
+static char *socket_path;
+
+/* state of the fake daemon, which serves one connection */
+static int listen_fd = -1;
+static pthread_t server;
+static int server_status;
+static struct ebgenvd_request last_request;
+static BG_ENVDATA written;
+static BG_ENVDATA snapshot[ENV_NUM_CONFIG_PARTS];
+/* a watcher gets more events after a byte was written to resume */
+static int resume[2];
+
+static void fill_event(struct ebgenvd_event *ev, uint32_t revision0)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->magic = EBGENVD_MAGIC;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ev->parts[i].revision = i + 1;
+		ev->parts[i].ustate = USTATE_OK;
+	}
+	ev->parts[0].revision = revision0;
+}
+
+static void serve_watcher(int fd)
+{
+	struct ebgenvd_event ev[2];
+	uint8_t byte;
+
+	fill_event(&ev[0], 1);
+	ebgenvd_send(fd, &ev[0], sizeof(ev[0]));
+	if (read(resume[0], &byte, 1) != 1) {
+		return;
+	}
+	/* an unchanged state followed by a changed one */
+	fill_event(&ev[1], 3);
+	ebgenvd_send(fd, ev, sizeof(ev));
+	/* wait for the watcher to hang up */
+	ebgenvd_recv(fd, &byte, 1);
+}
+
+static void *serve_one(void *arg)
+{
+	struct ebgenvd_response resp = {
+		.magic = EBGENVD_MAGIC,
+		.status = server_status,
+		.num_parts = ENV_NUM_CONFIG_PARTS,
+		.generation = 7,
+	};
+	char devpath[32];
+	uint32_t len;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ebgenvd_recv(fd, &last_request, sizeof(last_request))) {
+		close(fd);
+		return NULL;
+	}
+	if (last_request.cmd == EBGENVD_CMD_WRITE) {
+		ebgenvd_recv(fd, &written, sizeof(written));
+	}
+	ebgenvd_send(fd, &resp, sizeof(resp));
+	if (last_request.cmd == EBGENVD_CMD_WATCH && server_status == 0) {
+		serve_watcher(fd);
+	}
+	if (last_request.cmd == EBGENVD_CMD_GET && server_status == 0) {
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			len = snprintf(devpath, sizeof(devpath), "/dev/env%d",
+				       i);
+			ebgenvd_send(fd, &len, sizeof(len));
+			ebgenvd_send(fd, devpath, len);
+			ebgenvd_send(fd, &snapshot[i], sizeof(BG_ENVDATA));
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void start_server(int status)
+{
+	server_status = status;
+	memset(&last_request, 0, sizeof(last_request));
+	ck_assert_int_eq(pthread_create(&server, NULL, serve_one, NULL), 0);
+}
+
+static void create_socket(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	ck_assert_ptr_ne(mkdtemp(tmpdir), NULL);
+	ck_assert_int_ne(asprintf(&socket_path, "%s/ebgenvd.sock", tmpdir),
+			 -1);
+	setenv(EBGENVD_SOCKET_ENV, socket_path, 1);
+	strcpy(addr.sun_path, socket_path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ck_assert_int_ge(listen_fd, 0);
+	ck_assert_int_eq(bind(listen_fd, (struct sockaddr *)&addr,
+			      sizeof(addr)),
+			 0);
+	ck_assert_int_eq(listen(listen_fd, 1), 0);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		memset(&snapshot[i], 0, sizeof(BG_ENVDATA));
+		snapshot[i].revision = i + 1;
+	}
+}
+
+static void remove_socket(void)
+{
+	close(listen_fd);
+	unlink(socket_path);
+	rmdir(tmpdir);
+	free(socket_path);
+	unsetenv(EBGENVD_SOCKET_ENV);
+	strcpy(tmpdir, "/tmp/ebg-ebgenvd-XXXXXX");
+}
+
+START_TEST(ebgenvd_no_daemon)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	BG_ENVDATA envs[ENV_NUM_CONFIG_PARTS];
+
+	create_socket();
+	remove_socket();
+	ck_assert(!ebgenvd_fetch(parts, envs, false));
+}
+END_TEST
+
+START_TEST(ebgenvd_fetch_and_write)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	static BG_ENVDATA envs[ENV_NUM_CONFIG_PARTS];
+	char devpath[32];
+
+	create_socket();
+	start_server(0);
+	ck_assert(ebgenvd_fetch(parts, envs, true));
+	pthread_join(server, NULL);
+	ck_assert_uint_eq(last_request.cmd, EBGENVD_CMD_GET);
+	ck_assert_uint_eq(last_request.flags, EBGENVD_FLAG_ALL_DEVICES);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		snprintf(devpath, sizeof(devpath), "/dev/env%d", i);
+		ck_assert_str_eq(parts[i].devpath, devpath);
+		ck_assert_uint_eq(envs[i].revision, i + 1);
+		bgenv_path_free(parts[i].devpath);
+	}
+
+	/* writes refer to the fetched snapshot */
+	envs[0].revision = 42;
+	start_server(0);
+	ck_assert(ebgenvd_write(0, &envs[0]));
+	pthread_join(server, NULL);
+	ck_assert_uint_eq(last_request.cmd, EBGENVD_CMD_WRITE);
+	ck_assert_uint_eq(last_request.index, 0);
+	ck_assert_uint_eq(last_request.generation, 7);
+	ck_assert_uint_eq(written.revision, 42);
+
+	/* errors of the daemon are passed on */
+	start_server(-ESTALE);
+	ck_assert(!ebgenvd_write(0, &envs[0]));
+	pthread_join(server, NULL);
+	remove_socket();
+}
+END_TEST
+
+START_TEST(ebgenvd_fetch_mismatch)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	static BG_ENVDATA envs[ENV_NUM_CONFIG_PARTS];
+
+	/* daemon started with a different -A setting */
+	create_socket();
+	start_server(-EOPNOTSUPP);
+	ck_assert(!ebgenvd_fetch(parts, envs, false));
+	pthread_join(server, NULL);
+	ck_assert_uint_eq(last_request.flags, 0);
+	remove_socket();
+}
+END_TEST
+
+START_TEST(ebgenvd_bgenv_init)
+{
+	BGENV *env;
+
+	create_socket();
+	start_server(0);
+	ck_assert(bgenv_init());
+	pthread_join(server, NULL);
+
+	env = bgenv_open_latest();
+	ck_assert_ptr_nonnull(env);
+	ck_assert_uint_eq(env->data->revision, ENV_NUM_CONFIG_PARTS);
+	env->data->revision = 4711;
+
+	/* the write goes to the daemon instead of the device */
+	start_server(0);
+	ck_assert(bgenv_write(env));
+	pthread_join(server, NULL);
+	ck_assert_uint_eq(last_request.cmd, EBGENVD_CMD_WRITE);
+	ck_assert_uint_eq(last_request.index, ENV_NUM_CONFIG_PARTS - 1);
+	ck_assert_uint_eq(written.revision, 4711);
+
+	bgenv_close(env);
+	bgenv_finalize();
+	remove_socket();
+}
+END_TEST
+
+START_TEST(ebgenvd_notify)
+{
+	ebg_env_notify_t *n;
+	struct pollfd pfd;
+
+	ck_assert_int_eq(pipe(resume), 0);
+	create_socket();
+	start_server(0);
+	n = ebg_env_notify_open();
+	ck_assert_ptr_nonnull(n);
+	ck_assert_int_eq(ebg_env_notify_read(n), 0);
+
+	ck_assert_int_eq(write(resume[1], "", 1), 1);
+	pfd = (struct pollfd){.fd = ebg_env_notify_fd(n), .events = POLLIN};
+	ck_assert_int_eq(poll(&pfd, 1, EBGENVD_TIMEOUT_MS), 1);
+	ck_assert_int_eq(ebg_env_notify_read(n), 1);
+	ck_assert_int_eq(ebg_env_notify_read(n), 0);
+
+	ebg_env_notify_close(n);
+	pthread_join(server, NULL);
+	ck_assert_uint_eq(last_request.cmd, EBGENVD_CMD_WATCH);
+	remove_socket();
+	close(resume[0]);
+	close(resume[1]);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("ebgenvd");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, ebgenvd_no_daemon);
+	tcase_add_test(tc_core, ebgenvd_fetch_and_write);
+	tcase_add_test(tc_core, ebgenvd_fetch_mismatch);
+	tcase_add_test(tc_core, ebgenvd_bgenv_init);
+	tcase_add_test(tc_core, ebgenvd_notify);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,355 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <check.h>
+
+#include "efi_sim.h"
+#include "efi_sim_host.h"
+#include "fat_image.h"
+#include <bootguard.h>
+#include <configuration.h>
+#include <syspart.h>
+
+Suite *ebg_test_suite(void);
+
+/* from ebgenv.h, which is not usable along with the gnu-efi headers */
+#define USERVAR_TYPE_STRING_ASCII 32
+
+#define MAX_TEST_VOLUMES 8
+
+static UINTN num_images;
+static EFI_HANDLE handles[MAX_TEST_VOLUMES];
+
+static VOID setup(VOID)
+{
+	num_images = 0;
+	efi_sim_init();
+#if !defined(SILENT_BOOT)
+	quiet_boot = TRUE;
+#endif
+	SetBootMedium(NULL);
+}
+
+static VOID teardown(VOID)
+{
+	efi_sim_cleanup();
+	remove_fat_images();
+}
+
+static VOID init_env(BG_ENVDATA *env, UINT32 revision, UINT8 ustate)
+{
+	ZeroMem(env, sizeof(*env));
+	env->revision = revision;
+	env->ustate = ustate;
+	env->watchdog_timeout_sec = 30;
+	/* the revision tells the booted environment apart */
+	env->kernelfile[0] = 'k';
+	env->kernelfile[1] = '0' + revision % 10;
+}
+
+static VOID update_crc(BG_ENVDATA *env)
+{
+	env->crc32 = sim_crc32(env, sizeof(*env) - sizeof(env->crc32));
+}
+
+/* adds a volume on disk, which holds env unless it is NULL */
+static EFI_HANDLE add_volume(UINT32 disk, BG_ENVDATA *env)
+{
+	const char *path;
+	EFI_HANDLE handle;
+
+	ck_assert_uint_lt(num_images, MAX_TEST_VOLUMES);
+	path = fat_image_path(num_images);
+	ck_assert_ptr_nonnull(path);
+	ck_assert(create_fat_image(path, env, env ? sizeof(*env) : 0));
+	handle = efi_sim_add_volume((const CHAR8 *)path, disk, num_images + 1);
+	ck_assert_ptr_nonnull(handle);
+	handles[num_images++] = handle;
+	return handle;
+}
+
+/* config partitions of revisions 1, 2, ... on disk 0 */
+static VOID add_config_volumes(UINT8 latest_ustate)
+{
+	BG_ENVDATA env;
+
+	for (UINT32 i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BOOLEAN latest = i == ENV_NUM_CONFIG_PARTS - 1;
+
+		init_env(&env, i + 1, latest ? latest_ustate : USTATE_OK);
+		update_crc(&env);
+		add_volume(0, &env);
+	}
+}
+
+static VOID read_back(EFI_HANDLE handle, BG_ENVDATA *env)
+{
+	VOLUME_DESC v = {.handle = handle};
+	EFI_FILE_HANDLE fh;
+	UINTN len = sizeof(*env);
+
+	ck_assert_ptr_nonnull(volume_open_root(&v));
+	ck_assert(!EFI_ERROR(open_cfg_file(v.root, &fh, EFI_FILE_MODE_READ)));
+	ck_assert(!EFI_ERROR(read_cfg_file(fh, &len, env)));
+	ck_assert_uint_eq(len, sizeof(*env));
+	ck_assert(!EFI_ERROR(close_cfg_file(v.root, fh)));
+	ck_assert(!EFI_ERROR(v.root->Close(v.root)));
+}
+
+static VOID store(EFI_HANDLE handle, BG_ENVDATA *env)
+{
+	VOLUME_DESC v = {.handle = handle};
+	EFI_FILE_HANDLE fh;
+	UINTN len = sizeof(*env);
+
+	ck_assert_ptr_nonnull(volume_open_root(&v));
+	ck_assert(!EFI_ERROR(open_cfg_file(
+		v.root, &fh, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE)));
+	ck_assert(!EFI_ERROR(fh->Write(fh, &len, env)));
+	ck_assert(!EFI_ERROR(close_cfg_file(v.root, fh)));
+	ck_assert(!EFI_ERROR(v.root->Close(v.root)));
+}
+
+static VOID write_back(EFI_HANDLE handle, BG_ENVDATA *env)
+{
+	update_crc(env);
+	store(handle, env);
+}
+
+/* the part of a boot from enumerating the volumes to closing them again */
+static BG_STATUS boot(BG_LOADER_PARAMS *params)
+{
+	BG_STATUS result;
+
+	ZeroMem(params, sizeof(*params));
+	ck_assert(!EFI_ERROR(get_volumes(&volumes, &volume_count)));
+	result = load_config(params);
+	ck_assert(!EFI_ERROR(close_volumes(volumes, volume_count)));
+	volumes = NULL;
+	return result;
+}
+
+static VOID free_params(BG_LOADER_PARAMS *params)
+{
+	if (params->payload_path) {
+		FreePool(params->payload_path);
+	}
+	if (params->payload_options) {
+		FreePool(params->payload_options);
+	}
+}
+
+static VOID assert_booted(BG_LOADER_PARAMS *params, UINTN index)
+{
+	ck_assert_uint_eq(params->config_index, index);
+	ck_assert_uint_eq(params->config_revision, index + 1);
+	ck_assert_ptr_nonnull(params->payload_path);
+	ck_assert_uint_eq(params->payload_path[1], '0' + (index + 1) % 10);
+	free_params(params);
+}
+
+START_TEST(efi_loader_latest)
+{
+	BG_LOADER_PARAMS params;
+	UINTN latest = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup();
+	add_config_volumes(USTATE_OK);
+	/* no file system holding an environment */
+	add_volume(1, NULL);
+
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	ck_assert_uint_eq(params.timeout, 30);
+	ck_assert(!params.fast_boot);
+	assert_booted(&params, latest);
+	/* nothing written and nothing leaked */
+	ck_assert_uint_eq(efi_sim_stats.bytes_written, 0);
+	ck_assert_uint_eq(efi_sim_stats.pool_allocations, 0);
+	teardown();
+}
+END_TEST
+
+START_TEST(efi_loader_in_progress)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+	UINTN latest = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup();
+	add_config_volumes(USTATE_OK);
+	read_back(handles[latest], &env);
+	env.in_progress = 1;
+	write_back(handles[latest], &env);
+
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, latest - 1);
+	teardown();
+}
+END_TEST
+
+START_TEST(efi_loader_crc_error)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+	UINTN latest = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup();
+	add_config_volumes(USTATE_OK);
+	read_back(handles[latest], &env);
+	env.crc32++;
+	store(handles[latest], &env);
+
+	ck_assert_int_eq(boot(&params), BG_CONFIG_PARTIALLY_CORRUPTED);
+	assert_booted(&params, latest - 1);
+	teardown();
+}
+END_TEST
+
+START_TEST(efi_loader_update_failed)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+	UINTN latest = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup();
+	add_config_volumes(USTATE_INSTALLED);
+
+	/* first boot of the update puts it under test */
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, latest);
+	read_back(handles[latest], &env);
+	ck_assert_uint_eq(env.ustate, USTATE_TESTING);
+
+	/* not confirmed, so the previous environment is booted again */
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, latest - 1);
+	read_back(handles[latest], &env);
+	ck_assert_uint_eq(env.ustate, USTATE_FAILED);
+	ck_assert_uint_eq(env.revision, REVISION_FAILED);
+
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, latest - 1);
+	ck_assert_uint_eq(efi_sim_stats.pool_allocations, 0);
+	teardown();
+}
+END_TEST
+
+/* sets a string as the only user variable, see bgenv_map_uservar() */
+static VOID set_uservar(BG_ENVDATA *env, const CHAR8 *key,
+			const CHAR8 *value)
+{
+	UINTN keylen = strlena(key) + 1, valuelen = strlena(value) + 1;
+	UINT32 size = sizeof(UINT32) + sizeof(UINT64) + valuelen;
+	UINT64 type = USERVAR_TYPE_STRING_ASCII;
+	UINT8 *p = env->userdata;
+
+	CopyMem(p, (VOID *)key, keylen);
+	p += keylen;
+	CopyMem(p, &size, sizeof(size));
+	p += sizeof(size);
+	CopyMem(p, &type, sizeof(type));
+	p += sizeof(type);
+	CopyMem(p, (VOID *)value, valuelen);
+}
+
+START_TEST(efi_loader_boot_attempts)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+	UINTN latest = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup();
+	add_config_volumes(USTATE_INSTALLED);
+	read_back(handles[latest], &env);
+	set_uservar(&env, (CHAR8 *)USERVAR_BOOT_ATTEMPTS, (CHAR8 *)"3");
+	write_back(handles[latest], &env);
+
+	for (int attempt = 0; attempt < 3; attempt++) {
+		ck_assert_int_eq(boot(&params), BG_SUCCESS);
+		assert_booted(&params, latest);
+	}
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, latest - 1);
+	read_back(handles[latest], &env);
+	ck_assert_uint_eq(env.revision, REVISION_FAILED);
+	teardown();
+}
+END_TEST
+
+START_TEST(efi_loader_boot_medium)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+	EFI_HANDLE boot_volume = NULL;
+
+	setup();
+	/* newer environments on another disk, enumerated first */
+	for (UINT32 i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		init_env(&env, i + 5, USTATE_OK);
+		update_crc(&env);
+		add_volume(1, &env);
+	}
+	for (UINT32 i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		EFI_HANDLE h;
+
+		init_env(&env, i + 1, USTATE_OK);
+		update_crc(&env);
+		h = add_volume(0, &env);
+		if (!boot_volume) {
+			boot_volume = h;
+		}
+	}
+	SetBootMedium(DevicePathFromHandle(boot_volume));
+
+	ck_assert_int_eq(boot(&params), BG_SUCCESS);
+	assert_booted(&params, ENV_NUM_CONFIG_PARTS - 1);
+	/* the volumes of the other disk are not even opened */
+	ck_assert_uint_eq(efi_sim_stats.volumes_opened, ENV_NUM_CONFIG_PARTS);
+	teardown();
+}
+END_TEST
+
+START_TEST(efi_loader_too_many)
+{
+	BG_LOADER_PARAMS params;
+	BG_ENVDATA env;
+
+	setup();
+	add_config_volumes(USTATE_OK);
+	init_env(&env, 9, USTATE_OK);
+	update_crc(&env);
+	add_volume(1, &env);
+
+	ck_assert_int_eq(boot(&params), BG_CONFIG_ERROR);
+	ck_assert_uint_eq(efi_sim_stats.pool_allocations, 0);
+	teardown();
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("efi_loader");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, efi_loader_latest);
+	tcase_add_test(tc_core, efi_loader_in_progress);
+	tcase_add_test(tc_core, efi_loader_crc_error);
+	tcase_add_test(tc_core, efi_loader_update_failed);
+	tcase_add_test(tc_core, efi_loader_boot_attempts);
+	tcase_add_test(tc_core, efi_loader_boot_medium);
+	tcase_add_test(tc_core, efi_loader_too_many);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,185 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <env_config_partitions.h>
+#include <test-interface.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static char *tmpdirs[ENV_NUM_CONFIG_PARTS];
+
+bool __wrap_probe_config_partitions(CONFIG_PART *cfgpart, bool search_all);
+bool __wrap_probe_config_partitions(CONFIG_PART *cfgpart,
+				    bool search_all __attribute__((unused)))
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		cfgpart[i].devpath = strdup("test");
+		cfgpart[i].mountpoint = strdup(tmpdirs[i]);
+		cfgpart[i].not_mounted = false;
+	}
+	return true;
+}
+
+static CONFIG_PART *part_of(int i)
+{
+	static CONFIG_PART part = {.devpath = "test"};
+
+	if (!tmpdirs[i]) {
+		tmpdirs[i] = strdup("/tmp/ebg-check-XXXXXX");
+		ck_assert_ptr_nonnull(mkdtemp(tmpdirs[i]));
+	}
+	part.mountpoint = tmpdirs[i];
+	return &part;
+}
+
+/* writes environments of the given revisions, a negative one is corrupt */
+static void write_envs(const int *revisions, uint8_t ustate)
+{
+	BG_ENVDATA *data;
+
+	data = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert_ptr_nonnull(data);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		memset(data, 0, sizeof(BG_ENVDATA));
+		data->revision = abs(revisions[i]);
+		data->ustate = ustate;
+		data->kernelfile[0] = 'a' + i;
+		data->crc32 = bgenv_crc32(0, data, sizeof(BG_ENVDATA) -
+						   sizeof(data->crc32));
+		if (revisions[i] < 0) {
+			data->crc32++;
+		}
+		ck_assert(write_env(part_of(i), data));
+	}
+	free(data);
+}
+
+START_TEST(env_check_clean)
+{
+	BGENV_CHECK results[ENV_NUM_CONFIG_PARTS];
+	int revisions[ENV_NUM_CONFIG_PARTS];
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		revisions[i] = 2 + i;
+	}
+	write_envs(revisions, USTATE_OK);
+	ck_assert_int_eq(bgenv_check(results, false), 0);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_int_eq(results[i].status, BGENV_CHECK_OK);
+		ck_assert_int_eq(results[i].revision, 2 + i);
+		ck_assert(!results[i].duplicate);
+		ck_assert(!results[i].gap);
+	}
+}
+END_TEST
+
+START_TEST(env_check_revisions)
+{
+	BGENV_CHECK results[ENV_NUM_CONFIG_PARTS];
+	int revisions[ENV_NUM_CONFIG_PARTS];
+	int last = ENV_NUM_CONFIG_PARTS - 1;
+
+	/* all equal */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		revisions[i] = 3;
+	}
+	write_envs(revisions, USTATE_OK);
+	ck_assert_int_eq(bgenv_check(results, false), ENV_NUM_CONFIG_PARTS);
+	ck_assert(results[0].duplicate);
+	ck_assert(results[last].duplicate);
+
+	/* the latest one skipped revisions */
+	revisions[last] = 7;
+	write_envs(revisions, USTATE_OK);
+	ck_assert_int_gt(bgenv_check(results, false), 0);
+	ck_assert(results[last].gap);
+	ck_assert(!results[last].duplicate);
+
+	/* failed ones do not count */
+	revisions[last] = REVISION_FAILED;
+	write_envs(revisions, USTATE_OK);
+	bgenv_check(results, false);
+	ck_assert(!results[last].gap);
+	ck_assert(!results[0].gap);
+}
+END_TEST
+
+START_TEST(env_check_repair)
+{
+	BGENV_CHECK results[ENV_NUM_CONFIG_PARTS];
+	int revisions[ENV_NUM_CONFIG_PARTS];
+	BG_ENVDATA *data;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		revisions[i] = 5 + i;
+	}
+	revisions[0] = -revisions[0];
+	write_envs(revisions, USTATE_OK);
+
+	ck_assert_int_eq(bgenv_check(results, false), 1);
+	ck_assert_int_eq(results[0].status, BGENV_CHECK_CRC);
+	ck_assert(!results[0].repaired);
+
+	ck_assert_int_eq(bgenv_check(results, true), 0);
+	ck_assert_int_eq(results[0].status, BGENV_CHECK_OK);
+	ck_assert(results[0].repaired);
+
+	/* a copy of the latest one, as its fallback */
+	data = malloc(sizeof(BG_ENVDATA));
+	ck_assert_ptr_nonnull(data);
+	ck_assert(read_env(part_of(0), data));
+	ck_assert_int_eq(data->revision, 5 + ENV_NUM_CONFIG_PARTS - 2);
+	ck_assert_int_eq(data->kernelfile[0], 'a' + ENV_NUM_CONFIG_PARTS - 1);
+	free(data);
+}
+END_TEST
+
+START_TEST(env_check_repair_unconfirmed)
+{
+	BGENV_CHECK results[ENV_NUM_CONFIG_PARTS];
+	int revisions[ENV_NUM_CONFIG_PARTS];
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		revisions[i] = 5 + i;
+	}
+	revisions[0] = -revisions[0];
+
+	/* an update under test is no source for repairs */
+	write_envs(revisions, USTATE_TESTING);
+	ck_assert_int_eq(bgenv_check(results, true), 1);
+	ck_assert_int_eq(results[0].status, BGENV_CHECK_CRC);
+	ck_assert(!results[0].repaired);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_check");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_check_clean);
+	tcase_add_test(tc_core, env_check_revisions);
+	tcase_add_test(tc_core, env_check_repair);
+	tcase_add_test(tc_core, env_check_repair_unconfirmed);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
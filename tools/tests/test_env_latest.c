@@ -0,0 +1,135 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <env_config_partitions.h>
+#include <test-interface.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+static char *tmpdirs[ENV_NUM_CONFIG_PARTS];
+
+bool __wrap_probe_config_partitions(CONFIG_PART *cfgpart, bool search_all);
+bool __wrap_probe_config_partitions(CONFIG_PART *cfgpart,
+				    bool search_all __attribute__((unused)))
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		cfgpart[i].devpath = strdup("test");
+		cfgpart[i].mountpoint = strdup(tmpdirs[i]);
+		cfgpart[i].not_mounted = false;
+	}
+	return true;
+}
+
+static void write_envs(bool corrupt_latest)
+{
+	CONFIG_PART part = {.devpath = "test"};
+	BG_ENVDATA *data;
+
+	data = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert_ptr_nonnull(data);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!tmpdirs[i]) {
+			tmpdirs[i] = strdup("/tmp/ebg-latest-XXXXXX");
+			ck_assert_ptr_nonnull(mkdtemp(tmpdirs[i]));
+		}
+		part.mountpoint = tmpdirs[i];
+		memset(data, 0, sizeof(BG_ENVDATA));
+		data->revision = 10 + i;
+		data->kernelfile[0] = 'a' + i;
+		data->crc32 = bgenv_crc32(0, data, sizeof(BG_ENVDATA) -
+						   sizeof(data->crc32));
+		if (corrupt_latest && i == ENV_NUM_CONFIG_PARTS - 1) {
+			data->crc32++;
+		}
+		ck_assert(write_env(&part, data));
+	}
+	free(data);
+}
+
+START_TEST(env_latest_only)
+{
+	int latest = ENV_NUM_CONFIG_PARTS - 1;
+	BGENV *env;
+
+	write_envs(false);
+	ck_assert(bgenv_init_latest());
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (i == latest) {
+			ck_assert_int_eq(envdata[i].revision, 10 + i);
+			ck_assert_int_eq(envdata[i].kernelfile[0], 'a' + i);
+		} else {
+			/* only the fixed fields were read, then cleared */
+			ck_assert_int_eq(envdata[i].revision, 0);
+			ck_assert_int_eq(envdata[i].kernelfile[0], 0);
+		}
+	}
+	env = bgenv_open_latest();
+	ck_assert_ptr_nonnull(env);
+	ck_assert_int_eq(env->data->revision, 10 + latest);
+	bgenv_close(env);
+
+	/* environments that were not read are never written back */
+	env = bgenv_open_by_index(0);
+	ck_assert_ptr_nonnull(env);
+	ck_assert(!bgenv_write(env));
+	bgenv_close(env);
+
+	/* a full init later completes them */
+	ck_assert(bgenv_init());
+	ck_assert_int_eq(envdata[0].revision, 10);
+	ck_assert_int_eq(envdata[0].kernelfile[0], 'a');
+	bgenv_finalize();
+	bgenv_finalize();
+}
+END_TEST
+
+START_TEST(env_latest_invalid)
+{
+	int next = ENV_NUM_CONFIG_PARTS - 2;
+	BGENV *env;
+
+	/* the latest one fails validation, so the next one is read */
+	write_envs(true);
+	ck_assert(bgenv_init_latest());
+	ck_assert_int_eq(envdata[ENV_NUM_CONFIG_PARTS - 1].revision, 0);
+	env = bgenv_open_latest();
+	ck_assert_ptr_nonnull(env);
+	ck_assert_int_eq(env->data->revision, 10 + next);
+	ck_assert_int_eq(env->data->kernelfile[0], 'a' + next);
+	bgenv_close(env);
+	bgenv_finalize();
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_api_fat");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_latest_only);
+	tcase_add_test(tc_core, env_latest_invalid);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
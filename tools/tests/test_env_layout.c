@@ -0,0 +1,129 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <uservars.h>
+#include <ebgenv.h>
+#include <test-interface.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+static char tmpdir[] = "/tmp/ebg-layout-XXXXXX";
+static char *path;
+
+static off_t file_size(void)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+static void fill_env(BG_ENVDATA *data)
+{
+	BGENV env = {.data = data};
+
+	memset(data, 0, sizeof(BG_ENVDATA));
+	data->revision = 7;
+	data->ustate = USTATE_INSTALLED;
+	data->kernelfile[0] = 'k';
+	ck_assert_int_eq(bgenv_set(&env, "key", USERVAR_TYPE_STRING_ASCII,
+				   "value", 6),
+			 0);
+	bgenv_uservar_index_free(env.uservar_index);
+	data->crc32 = bgenv_crc32(0, data,
+				  sizeof(BG_ENVDATA) - sizeof(data->crc32));
+}
+
+START_TEST(env_layout_compact)
+{
+	CONFIG_PART part = {0};
+	BG_ENVDATA *data, *read;
+	FILE *f;
+	int c;
+
+	ck_assert_ptr_ne(mkdtemp(tmpdir), NULL);
+	ck_assert_int_ne(asprintf(&path, "%s/%s", tmpdir, FAT_ENV_FILENAME),
+			 -1);
+	part.devpath = "test";
+	part.mountpoint = tmpdir;
+	data = malloc(sizeof(BG_ENVDATA));
+	read = malloc(sizeof(BG_ENVDATA));
+	ck_assert_ptr_nonnull(data);
+	ck_assert_ptr_nonnull(read);
+	fill_env(data);
+
+	/* files keep the fixed layout unless compact ones are requested */
+	ck_assert(write_env(&part, data));
+	ck_assert_int_eq(file_size(), sizeof(BG_ENVDATA));
+	ck_assert(!part.compact);
+
+	ebg_set_opt_bool(EBG_OPT_COMPACT_ENV, true);
+	ck_assert(write_env(&part, data));
+	ebg_set_opt_bool(EBG_OPT_COMPACT_ENV, false);
+	ck_assert_int_eq(file_size(),
+			 bgenv_compact_size(bgenv_userdata_used(data)));
+	ck_assert(part.compact);
+
+	/* reading restores the fixed layout, including its CRC */
+	part.compact = false;
+	ck_assert(read_env(&part, read));
+	ck_assert(part.compact);
+	ck_assert_mem_eq(read, data, sizeof(BG_ENVDATA));
+
+	/* compact files stay compact */
+	ck_assert(write_env(&part, data));
+	ck_assert_int_lt(file_size(), sizeof(BG_ENVDATA));
+
+	/* the CRC covers the stored bytes */
+	f = fopen(path, "r+b");
+	ck_assert_ptr_nonnull(f);
+	ck_assert_int_eq(fseek(f, sizeof(BG_ENVHEADER), SEEK_SET), 0);
+	c = fgetc(f);
+	ck_assert_int_eq(fseek(f, sizeof(BG_ENVHEADER), SEEK_SET), 0);
+	fputc(c ^ 1, f);
+	ck_assert_int_eq(fclose(f), 0);
+	ck_assert(!read_env(&part, read));
+
+	/* as does the size */
+	ck_assert_int_eq(truncate(path, file_size() - 1), 0);
+	ck_assert(!read_env(&part, read));
+
+	unlink(path);
+	rmdir(tmpdir);
+	free(path);
+	free(data);
+	free(read);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_layout");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_layout_compact);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
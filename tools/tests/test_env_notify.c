@@ -0,0 +1,129 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <ebgenv.h>
+#include <test-interface.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
+static char tmpdir[] = "/tmp/ebg-notify-XXXXXX";
+static char *paths[ENV_NUM_CONFIG_PARTS];
+static BG_ENVDATA data;
+
+/* the config partitions are plain files holding the environment */
+bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	FILE *f = fopen(part->devpath, "rb");
+	bool res;
+
+	if (!f) {
+		return false;
+	}
+	res = fread(env, sizeof(BG_ENVDATA), 1, f) == 1;
+	fclose(f);
+	return res;
+}
+
+bool bgenv_init(void)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		config_parts[i].devpath = strdup(paths[i]);
+		config_parts[i].not_mounted = true;
+		read_env(&config_parts[i], &envdata[i]);
+	}
+	return true;
+}
+
+static void write_part(int i, uint16_t revision, uint8_t ustate)
+{
+	FILE *f = fopen(paths[i], "wb");
+
+	ck_assert_ptr_nonnull(f);
+	data.revision = revision;
+	data.ustate = ustate;
+	data.kernelparams[0]++;
+	ck_assert_int_eq(fwrite(&data, sizeof(data), 1, f), 1);
+	ck_assert_int_eq(fclose(f), 0);
+}
+
+static int wait_and_read(ebg_env_notify_t *n)
+{
+	struct pollfd pfd = {.fd = ebg_env_notify_fd(n), .events = POLLIN};
+
+	if (poll(&pfd, 1, 1000) != 1) {
+		return -ETIMEDOUT;
+	}
+	return ebg_env_notify_read(n);
+}
+
+START_TEST(env_notify_inotify)
+{
+	ebg_env_notify_t *n;
+
+	ebg_set_opt_bool(EBG_OPT_USE_DAEMON, false);
+	ck_assert_ptr_ne(mkdtemp(tmpdir), NULL);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_int_ne(asprintf(&paths[i], "%s/env%d", tmpdir, i),
+				 -1);
+		write_part(i, i + 1, USTATE_OK);
+	}
+
+	n = ebg_env_notify_open();
+	ck_assert_ptr_nonnull(n);
+	ck_assert_int_ge(ebg_env_notify_fd(n), 0);
+	ck_assert_int_eq(ebg_env_notify_read(n), 0);
+
+	/* other changes are filtered */
+	write_part(0, 1, USTATE_OK);
+	ck_assert_int_eq(wait_and_read(n), 0);
+
+	write_part(0, ENV_NUM_CONFIG_PARTS + 1, USTATE_INSTALLED);
+	ck_assert_int_eq(wait_and_read(n), 1);
+	ck_assert_int_eq(ebg_env_notify_read(n), 0);
+
+	/* a vanished config partition ends watching */
+	unlink(paths[1]);
+	ck_assert_int_eq(wait_and_read(n), -ENODEV);
+	ebg_env_notify_close(n);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	rmdir(tmpdir);
+	ebg_set_opt_bool(EBG_OPT_USE_DAEMON, true);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_notify");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_notify_inotify);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,212 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <check.h>
+#include <fff.h>
+#include <env_api.h>
+#include <uservars.h>
+#include <ebgenv.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+extern BG_ENVDATA envdata[];
+
+FAKE_VALUE_FUNC(bool, write_env, CONFIG_PART *, BG_ENVDATA *);
+
+static void set_counter(BG_ENVDATA *data, uint64_t counter)
+{
+	BGENV env = {.data = data};
+
+	ck_assert_int_eq(bgenv_set(&env, "counter", USERVAR_TYPE_UINT64,
+				   &counter, sizeof(counter)),
+			 0);
+	bgenv_uservar_index_free(env.uservar_index);
+}
+
+static void fill_envdata(void)
+{
+	memset(envdata, 0, ENV_NUM_CONFIG_PARTS * sizeof(BG_ENVDATA));
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].revision = i + 1;
+		envdata[i].ustate = USTATE_OK;
+		set_counter(&envdata[i], i + 1);
+	}
+}
+
+static unsigned long snapshot_revision(const ebg_env_snapshot_t *s)
+{
+	char buffer[ENV_STRING_LENGTH];
+
+	if (ebg_env_snapshot_get_ex(s, "revision", NULL, (uint8_t *)buffer,
+				    sizeof(buffer))) {
+		return 0;
+	}
+	return strtoul(buffer, NULL, 10);
+}
+
+static uint64_t snapshot_counter(const ebg_env_snapshot_t *s)
+{
+	uint64_t type, counter;
+
+	if (ebg_env_snapshot_get_ex(s, "counter", &type, (uint8_t *)&counter,
+				    sizeof(counter)) ||
+	    type != USERVAR_TYPE_UINT64) {
+		return 0;
+	}
+	return counter;
+}
+
+START_TEST(env_snapshot_publish)
+{
+	const ebg_env_snapshot_t *s, *old;
+	BGENV *env;
+
+	errno = 0;
+	ck_assert_ptr_null(ebg_env_snapshot_get());
+	ck_assert_int_eq(errno, ENOENT);
+
+	fill_envdata();
+	bgenv_snapshot_publish(envdata);
+	s = ebg_env_snapshot_get();
+	ck_assert_ptr_nonnull(s);
+	ck_assert_uint_eq(snapshot_counter(s), ENV_NUM_CONFIG_PARTS);
+	ck_assert_uint_eq(snapshot_revision(s), ENV_NUM_CONFIG_PARTS);
+	ck_assert_uint_eq(ebg_env_snapshot_getglobalstate(s), USTATE_OK);
+	ck_assert_int_eq(ebg_env_snapshot_get_ex(s, "missing", NULL, NULL, 1),
+			 -ENOENT);
+
+	/* changes in memory are not visible before they are written */
+	env = bgenv_open_latest();
+	ck_assert_ptr_nonnull(env);
+	set_counter(env->data, 4711);
+	env->data->ustate = USTATE_INSTALLED;
+	bgenv_update_crc(env);
+	ck_assert_uint_eq(snapshot_counter(s), ENV_NUM_CONFIG_PARTS);
+
+	write_env_fake.return_val = false;
+	ck_assert(!bgenv_write(env));
+	old = s;
+	s = ebg_env_snapshot_get();
+	ck_assert_ptr_eq(s, old);
+	ebg_env_snapshot_put(s);
+
+	write_env_fake.return_val = true;
+	ck_assert(bgenv_write(env));
+	s = ebg_env_snapshot_get();
+	ck_assert_ptr_ne(s, old);
+	ck_assert_uint_eq(snapshot_counter(s), 4711);
+	ck_assert_uint_eq(ebg_env_snapshot_getglobalstate(s),
+			  USTATE_INSTALLED);
+
+	/* references taken before stay valid and unchanged */
+	ck_assert_uint_eq(snapshot_counter(old), ENV_NUM_CONFIG_PARTS);
+	ck_assert_uint_eq(ebg_env_snapshot_getglobalstate(old), USTATE_OK);
+	ebg_env_snapshot_put(old);
+
+	/* a failed update anywhere determines the global state */
+	env->data->revision = REVISION_FAILED;
+	env->data->ustate = USTATE_FAILED;
+	bgenv_update_crc(env);
+	ck_assert(bgenv_write(env));
+	ebg_env_snapshot_put(s);
+	s = ebg_env_snapshot_get();
+	ck_assert_uint_eq(ebg_env_snapshot_getglobalstate(s), USTATE_FAILED);
+	ck_assert_uint_eq(snapshot_counter(s), ENV_NUM_CONFIG_PARTS - 1);
+	bgenv_close(env);
+
+	bgenv_snapshot_clear();
+	ck_assert_ptr_null(ebg_env_snapshot_get());
+	ebg_env_snapshot_put(s);
+}
+END_TEST
+
+#define SNAPSHOT_READERS 4
+#define SNAPSHOT_UPDATES 200
+
+static bool stop_readers;
+
+static void *snapshot_reader(void *arg)
+{
+	uint64_t counter, last = 0;
+	const ebg_env_snapshot_t *s;
+	int *errors = arg;
+
+	while (!__atomic_load_n(&stop_readers, __ATOMIC_ACQUIRE)) {
+		s = ebg_env_snapshot_get();
+		if (!s) {
+			(*errors)++;
+			break;
+		}
+		/* the counter is always written along with the revision */
+		counter = snapshot_counter(s);
+		if (!counter || snapshot_revision(s) != counter ||
+		    counter < last) {
+			(*errors)++;
+		}
+		last = counter;
+		ebg_env_snapshot_put(s);
+	}
+	return NULL;
+}
+
+START_TEST(env_snapshot_threads)
+{
+	pthread_t threads[SNAPSHOT_READERS];
+	int errors[SNAPSHOT_READERS] = {0};
+	BG_ENVDATA *data;
+
+	fill_envdata();
+	bgenv_snapshot_publish(envdata);
+	data = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert_ptr_nonnull(data);
+
+	stop_readers = false;
+	for (int i = 0; i < SNAPSHOT_READERS; i++) {
+		ck_assert_int_eq(pthread_create(&threads[i], NULL,
+						snapshot_reader, &errors[i]),
+				 0);
+	}
+	for (int n = 0; n < SNAPSHOT_UPDATES; n++) {
+		uint32_t revision = ENV_NUM_CONFIG_PARTS + n + 1;
+
+		memset(data, 0, sizeof(BG_ENVDATA));
+		data->revision = revision;
+		set_counter(data, revision);
+		bgenv_snapshot_update(n % ENV_NUM_CONFIG_PARTS, data);
+	}
+	__atomic_store_n(&stop_readers, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < SNAPSHOT_READERS; i++) {
+		pthread_join(threads[i], NULL);
+		ck_assert_int_eq(errors[i], 0);
+	}
+	free(data);
+	bgenv_snapshot_clear();
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_snapshot");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_snapshot_publish);
+	tcase_add_test(tc_core, env_snapshot_threads);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
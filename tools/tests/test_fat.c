@@ -383,6 +383,120 @@ START_TEST(test_determine_FAT_bits_squashfs)
 }
 END_TEST
 
+/* A small FAT12 image: one reserved sector, two single sector FATs, one root
+ * directory sector and 60 data clusters of 512 bytes. */
+static int create_fat12_image(char *path, uint32_t file_size)
+{
+	static uint8_t image[64 * 512];
+	struct fat_boot_sector *bs = (struct fat_boot_sector *)image;
+	struct msdos_dir_entry *de;
+	uint8_t *fat;
+	const uint16_t chain[][2] = {{2, 3}, {3, 5}, {5, 0xFFF}};
+	int fd;
+
+	memset(image, 0, sizeof(image));
+	u16_to_le(512, bs->sector_size);
+	bs->sec_per_clus = 1;
+	bs->reserved = 1;
+	bs->fats = 2;
+	u16_to_le(16, bs->dir_entries);
+	u16_to_le(64, bs->sectors);
+	bs->media = 0xf8;
+	bs->fat_length = 1;
+
+	/* fragmented file in clusters 2, 3 and 5 */
+	for (int f = 0; f < 2; f++) {
+		fat = image + 512 * (1 + f);
+		fat[0] = 0xf8;
+		fat[1] = 0xff;
+		fat[2] = 0xff;
+		for (size_t i = 0; i < sizeof(chain) / sizeof(chain[0]); i++) {
+			uint16_t n = chain[i][0], v = chain[i][1];
+			uint8_t *e = fat + n + n / 2;
+
+			if (n & 1) {
+				e[0] = (e[0] & 0x0f) | (v << 4);
+				e[1] = v >> 4;
+			} else {
+				e[0] = v;
+				e[1] = (e[1] & 0xf0) | (v >> 8);
+			}
+		}
+	}
+
+	de = (struct msdos_dir_entry *)(image + 512 * 3);
+	/* deleted entry and long name slot in front of the file */
+	memcpy(de[0].name, "\xe5GENV   DAT", MSDOS_NAME);
+	de[1].name[0] = 0x41;
+	de[1].attr = ATTR_EXT;
+	memcpy(de[2].name, "BGENV   DAT", MSDOS_NAME);
+	de[2].start = 2;
+	de[2].size = file_size;
+
+	/* recognizable data pattern per cluster */
+	memset(image + 512 * 4, 'A', 512);
+	memset(image + 512 * 5, 'B', 512);
+	memset(image + 512 * 7, 'C', 512);
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+	if (write(fd, image, sizeof(image)) != sizeof(image)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+START_TEST(test_fat_lookup_read_write)
+{
+	char path[] = "/tmp/fat_image_XXXXXX";
+	struct fat_file file;
+	uint8_t buffer[1500], check[1500];
+	int fd;
+
+	fd = create_fat12_image(path, sizeof(buffer));
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(fat_lookup_root_file(fd, "NOFILE.DAT", &file, false),
+			 -ENOENT);
+	ck_assert_int_eq(fat_lookup_root_file(fd, "bgenv.dat", &file, false),
+			 0);
+	ck_assert_int_eq(file.fat_bits, 12);
+	ck_assert_uint_eq(file.first_cluster, 2);
+	ck_assert_uint_eq(file.size, sizeof(buffer));
+
+	ck_assert_int_eq(fat_read_file(&file, buffer, sizeof(buffer)),
+			 sizeof(buffer));
+	ck_assert_int_eq(buffer[0], 'A');
+	ck_assert_int_eq(buffer[1023], 'B');
+	ck_assert_int_eq(buffer[1024], 'C');
+	ck_assert_int_eq(buffer[1499], 'C');
+
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = i;
+	}
+	ck_assert_int_eq(fat_write_file(&file, buffer, sizeof(buffer) - 1),
+			 -EINVAL);
+	ck_assert_int_eq(fat_write_file(&file, buffer, sizeof(buffer)),
+			 sizeof(buffer));
+
+	/* the unused cluster 4 must not have been touched */
+	ck_assert_int_eq(pread(fd, check, 512, 512 * 6), 512);
+	for (int i = 0; i < 512; i++) {
+		ck_assert_int_eq(check[i], 0);
+	}
+	memset(check, 0, sizeof(check));
+	ck_assert_int_eq(fat_read_file(&file, check, sizeof(check)),
+			 sizeof(check));
+	ck_assert_int_eq(memcmp(buffer, check, sizeof(buffer)), 0);
+
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -400,6 +514,7 @@ Suite *ebg_test_suite(void)
 	tcase_add_test(tc_core, test_determine_FAT_bits_32);
 	tcase_add_test(tc_core, test_determine_FAT_bits_fat16_swupdate);
 	tcase_add_test(tc_core, test_determine_FAT_bits_squashfs);
+	tcase_add_test(tc_core, test_fat_lookup_read_write);
 
 	suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,264 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <check.h>
+#include <fff.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <env_api.h>
+#include <env_disk_utils.h>
+#include <env_probe_cache.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+extern const char *mountinfo_path;
+
+bool __wrap_probe_config_file(CONFIG_PART *);
+
+static bool env_file_present = true;
+
+bool __wrap_probe_config_file(CONFIG_PART *cp)
+{
+	cp->not_mounted = true;
+	return env_file_present;
+}
+
+static char tmpdir[] = "/tmp/ebg-probe-cache-XXXXXX";
+
+static void write_file(const char *path, char fill)
+{
+	char buffer[1024];
+	FILE *f;
+
+	memset(buffer, fill, sizeof(buffer));
+	f = fopen(path, "w");
+	ck_assert_ptr_ne(f, NULL);
+	ck_assert_uint_eq(fwrite(buffer, 1, sizeof(buffer), f),
+			  sizeof(buffer));
+	fclose(f);
+}
+
+/* replaces all entries of a stored cache by the first one */
+static void duplicate_first_entry(const char *path)
+{
+	char header[512], entry[8192];
+	FILE *f;
+
+	f = fopen(path, "r");
+	ck_assert_ptr_ne(f, NULL);
+	ck_assert_ptr_ne(fgets(header, sizeof(header), f), NULL);
+	ck_assert_ptr_ne(fgets(entry, sizeof(entry), f), NULL);
+	fclose(f);
+
+	f = fopen(path, "w");
+	ck_assert_ptr_ne(f, NULL);
+	fputs(header, f);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		fputs(entry, f);
+	}
+	fclose(f);
+}
+
+START_TEST(probe_cache_store_and_validate)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	CONFIG_PART loaded[ENV_NUM_CONFIG_PARTS];
+	char *diskpaths[ENV_NUM_CONFIG_PARTS];
+	char *cachepath, *key;
+
+	ck_assert_ptr_ne(mkdtemp(tmpdir), NULL);
+	ck_assert_int_ne(asprintf(&cachepath, "%s/run/probe.cache", tmpdir),
+			 -1);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_int_ne(asprintf(&parts[i].devpath, "%s/part%d",
+					  tmpdir, i),
+				 -1);
+		ck_assert_int_ne(asprintf(&diskpaths[i], "%s/disk", tmpdir),
+				 -1);
+		write_file(parts[i].devpath, 0);
+	}
+	write_file(diskpaths[0], 0x55);
+
+	key = probe_cache_key(NULL);
+	ck_assert_ptr_ne(key, NULL);
+	ck_assert(probe_cache_store(cachepath, key, parts, diskpaths));
+
+	/* valid cache */
+	ck_assert(probe_cache_load(cachepath, key, loaded));
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_str_eq(loaded[i].devpath, parts[i].devpath);
+		ck_assert(loaded[i].not_mounted);
+		bgenv_path_free(loaded[i].devpath);
+	}
+
+	/* different probe key */
+	ck_assert(!probe_cache_load(cachepath, "sdz:00000000", loaded));
+	ck_assert_int_ne(access(cachepath, F_OK), 0);
+
+	/* environment file removed */
+	ck_assert(probe_cache_store(cachepath, key, parts, diskpaths));
+	env_file_present = false;
+	ck_assert(!probe_cache_load(cachepath, key, loaded));
+	env_file_present = true;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_ptr_eq(loaded[i].devpath, NULL);
+	}
+
+	/* the same partition listed for each environment */
+	ck_assert(probe_cache_store(cachepath, key, parts, diskpaths));
+	duplicate_first_entry(cachepath);
+	ck_assert(!probe_cache_load(cachepath, key, loaded));
+	ck_assert_int_ne(access(cachepath, F_OK), 0);
+
+	/* partition table modified */
+	ck_assert(probe_cache_store(cachepath, key, parts, diskpaths));
+	write_file(diskpaths[0], 0xaa);
+	ck_assert(!probe_cache_load(cachepath, key, loaded));
+	ck_assert_int_ne(access(cachepath, F_OK), 0);
+
+	unlink(diskpaths[0]);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		unlink(parts[i].devpath);
+		free(parts[i].devpath);
+		free(diskpaths[i]);
+	}
+	free(key);
+	*strrchr(cachepath, '/') = '\0';
+	rmdir(cachepath);
+	rmdir(tmpdir);
+	free(cachepath);
+}
+END_TEST
+
+/* any block device node will do to look up its mount points */
+static bool find_block_device(char *path, size_t len, dev_t *rdev)
+{
+	struct dirent *entry;
+	struct stat st;
+	bool found = false;
+	DIR *dir;
+
+	dir = opendir("/dev");
+	if (!dir) {
+		return false;
+	}
+	while (!found && (entry = readdir(dir))) {
+		snprintf(path, len, "/dev/%s", entry->d_name);
+		found = stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+	}
+	closedir(dir);
+	if (found) {
+		*rdev = st.st_rdev;
+	}
+	return found;
+}
+
+static void write_mountinfo(const char *path, dev_t rdev, const char *dir)
+{
+	FILE *f = fopen(path, "w");
+
+	ck_assert_ptr_nonnull(f);
+	fprintf(f, "22 1 0:21 / /proc rw - proc proc rw\n");
+	/* bind mounts of directories do not count */
+	fprintf(f, "23 1 %u:%u /sub /mnt/bind rw - vfat x rw\n",
+		major(rdev), minor(rdev));
+	fprintf(f, "24 1 %u:%u / %s rw shared:1 - vfat x rw\n",
+		major(rdev), minor(rdev), dir);
+	fprintf(f, "25 1 %u:%u / /mnt/second rw - vfat x rw\n",
+		major(rdev), minor(rdev));
+	fclose(f);
+}
+
+START_TEST(probe_get_mountpoint)
+{
+	char mountinfo[] = "/tmp/ebg-mountinfo-XXXXXX";
+	char devpath[512];
+	char *mnt;
+	dev_t rdev;
+	int fd;
+
+	fd = mkstemp(mountinfo);
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+	mountinfo_path = mountinfo;
+
+	ck_assert_ptr_null(get_mountpoint(mountinfo));
+	if (find_block_device(devpath, sizeof(devpath), &rdev)) {
+		write_mountinfo(mountinfo, rdev, "/mnt/with\\040space");
+		mnt = get_mountpoint(devpath);
+		ck_assert_ptr_nonnull(mnt);
+		ck_assert_str_eq(mnt, "/mnt/with space");
+		bgenv_path_free(mnt);
+
+		/* changes are not seen until the record is released */
+		mount_map_load();
+		write_mountinfo(mountinfo, rdev, "/mnt/other");
+		mnt = get_mountpoint(devpath);
+		ck_assert_str_eq(mnt, "/mnt/with space");
+		bgenv_path_free(mnt);
+		mount_map_release();
+		mnt = get_mountpoint(devpath);
+		ck_assert_str_eq(mnt, "/mnt/other");
+		bgenv_path_free(mnt);
+
+		write_mountinfo(mountinfo, rdev + 1, "/mnt/other");
+		ck_assert_ptr_null(get_mountpoint(devpath));
+	}
+
+	unlink(mountinfo);
+	mountinfo_path = "/proc/self/mountinfo";
+}
+END_TEST
+
+START_TEST(probe_path_dup)
+{
+	char path[EBG_PATH_LEN + 1];
+	char *copy;
+
+	copy = bgenv_path_dup("/dev/sda1");
+	ck_assert_ptr_nonnull(copy);
+	ck_assert_str_eq(copy, "/dev/sda1");
+	bgenv_path_free(copy);
+	bgenv_path_free(NULL);
+
+	memset(path, 'a', sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	copy = bgenv_path_dup(path);
+#ifdef EBG_STATIC_ALLOC
+	ck_assert_ptr_null(copy);
+#else
+	ck_assert_ptr_nonnull(copy);
+	ck_assert_str_eq(copy, path);
+#endif
+	bgenv_path_free(copy);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("probe_cache");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, probe_cache_store_and_validate);
+	tcase_add_test(tc_core, probe_get_mountpoint);
+	tcase_add_test(tc_core, probe_path_dup);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
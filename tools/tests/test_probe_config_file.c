@@ -14,6 +14,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <check.h>
 #include <fff.h>
@@ -38,6 +39,11 @@ int probe_config_file_call_count;
 
 char *fake_mountpoint = "/tmp/tmp.XXXXXX";
 
+extern CONFIG_PART config_parts[ENV_NUM_CONFIG_PARTS];
+
+/* get_mountpoint() is called concurrently when probing in parallel */
+static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct stailhead *headp;
 struct fake_env_file_path {
 	char *path;
@@ -96,7 +102,9 @@ char *get_mountpoint_custom_fake(char *devpath)
 
 	if (fefp && buffer_copy) {
 		fefp->path = buffer_copy;
+		pthread_mutex_lock(&head_lock);
 		STAILQ_INSERT_TAIL(&head, fefp, fake_env_file_paths);
+		pthread_mutex_unlock(&head_lock);
 	}
 	return buff;
 
@@ -109,7 +117,7 @@ fake_mountpoint_error:
 
 bool __wrap_probe_config_file(CONFIG_PART *cp)
 {
-	probe_config_file_call_count++;
+	__atomic_fetch_add(&probe_config_file_call_count, 1, __ATOMIC_SEQ_CST);
 
 	return  __real_probe_config_file(cp);
 }
@@ -158,6 +166,12 @@ START_TEST(env_api_fat_test_probe_config_file)
 
 	result = bgenv_init();
 
+	/* existing mounts are used for the whole session */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert(!config_parts[i].not_mounted);
+		ck_assert_ptr_nonnull(config_parts[i].mountpoint);
+	}
+
 	delete_temp_files();
 
 	free_fake_devices();
@@ -169,6 +183,111 @@ START_TEST(env_api_fat_test_probe_config_file)
 	ck_assert(result == true);
 
 	bgenv_finalize();
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_ptr_null(config_parts[i].mountpoint);
+	}
+}
+END_TEST
+
+START_TEST(env_api_fat_test_probe_config_file_parallel)
+{
+	bool result;
+	char expected[ENV_NUM_CONFIG_PARTS][32];
+
+	RESET_FAKE(ped_device_probe_all);
+	RESET_FAKE(ped_device_get_next);
+	RESET_FAKE(get_mountpoint);
+
+	/* spread the config partitions over several devices */
+	allocate_fake_devices(ENV_NUM_CONFIG_PARTS);
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		add_fake_partition(i);
+		snprintf(expected[i], sizeof(expected[i]), "/dev/nobrain_%c0",
+			 'a' + i);
+	}
+
+	ped_device_get_next_fake.custom_fake = ped_device_get_next_custom_fake;
+	get_mountpoint_fake.custom_fake = get_mountpoint_custom_fake;
+	probe_config_file_call_count = 0;
+
+	STAILQ_INIT(&head);
+
+	ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, true);
+	result = bgenv_init();
+	ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, false);
+
+	delete_temp_files();
+
+	free_fake_devices();
+
+	ck_assert(result == true);
+	ck_assert_int_eq(__atomic_load_n(&probe_config_file_call_count,
+					 __ATOMIC_SEQ_CST),
+			 ENV_NUM_CONFIG_PARTS);
+	/* the order does not depend on which probe finished first */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_str_eq(config_parts[i].devpath, expected[i]);
+	}
+
+	bgenv_finalize();
+}
+END_TEST
+
+START_TEST(env_api_fat_test_probe_config_file_early_exit)
+{
+	bool result;
+	char expected[ENV_NUM_CONFIG_PARTS][32];
+
+	RESET_FAKE(ped_device_probe_all);
+	RESET_FAKE(ped_device_get_next);
+	RESET_FAKE(get_mountpoint);
+
+	/* surplus environments around a complete set on a disk with an ESP */
+	allocate_fake_devices(3);
+	add_fake_partition(0);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		add_fake_partition(1);
+		snprintf(expected[i], sizeof(expected[i]), "/dev/nobrain_b%d",
+			 i);
+	}
+	add_fake_partition(2);
+	fake_devices[1].has_esp = true;
+
+	ped_device_get_next_fake.custom_fake = ped_device_get_next_custom_fake;
+	get_mountpoint_fake.custom_fake = get_mountpoint_custom_fake;
+
+	STAILQ_INIT(&head);
+
+	/* by default, probing goes on until a surplus one is found */
+	probe_config_file_call_count = 0;
+	result = bgenv_init();
+	delete_temp_files();
+	ck_assert(result == false);
+	ck_assert_int_eq(probe_config_file_call_count,
+			 ENV_NUM_CONFIG_PARTS + 1);
+
+	for (int parallel = 0; parallel < 2; parallel++) {
+		probe_config_file_call_count = 0;
+		ebg_set_opt_bool(EBG_OPT_PROBE_EARLY_EXIT, true);
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, parallel);
+		result = bgenv_init();
+		ebg_set_opt_bool(EBG_OPT_PARALLEL_PROBE, false);
+		ebg_set_opt_bool(EBG_OPT_PROBE_EARLY_EXIT, false);
+		delete_temp_files();
+
+		ck_assert(result == true);
+		ck_assert_int_eq(__atomic_load_n(&probe_config_file_call_count,
+						 __ATOMIC_SEQ_CST),
+				 ENV_NUM_CONFIG_PARTS);
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			ck_assert_str_eq(config_parts[i].devpath,
+					 expected[i]);
+		}
+		bgenv_finalize();
+	}
+
+	free_fake_devices();
 }
 END_TEST
 
@@ -181,6 +300,8 @@ Suite *ebg_test_suite(void)
 
 	tc_core = tcase_create("Core");
 	tcase_add_test(tc_core, env_api_fat_test_probe_config_file);
+	tcase_add_test(tc_core, env_api_fat_test_probe_config_file_parallel);
+	tcase_add_test(tc_core, env_api_fat_test_probe_config_file_early_exit);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -97,6 +97,425 @@ START_TEST(bgenv_get_from_manipulated)
 }
 END_TEST
 
+START_TEST(bgenv_validate_short_payload)
+{
+	BG_ENVDATA data = {0};
+	uint32_t *payload_size;
+	uint32_t value = 1;
+
+	bgenv_set_uservar(data.userdata, "a", USERVAR_TYPE_UINT32, &value,
+			  sizeof(value));
+	ck_assert(bgenv_validate_uservars(data.userdata));
+
+	/* a record too short for the type would make its data size wrap */
+	payload_size = (uint32_t *)(data.userdata + 2);
+	*payload_size = sizeof(uint32_t);
+	ck_assert(!bgenv_validate_uservars(data.userdata));
+}
+END_TEST
+
+static uint32_t full_crc(BG_ENVDATA *data)
+{
+	return bgenv_crc32(0, data, sizeof(BG_ENVDATA) - sizeof(data->crc32));
+}
+
+START_TEST(bgenv_set_incremental_crc)
+{
+	static BG_ENVDATA data;
+	BGENV env = {.data = &data, .crc_incremental = true};
+	uint64_t counter = 0;
+
+	memset(&data, 0, sizeof(data));
+	data.crc32 = full_crc(&data);
+
+	ck_assert_int_eq(bgenv_set(&env, "first", USERVAR_TYPE_STRING_ASCII,
+				   "value", 6), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	ck_assert_int_eq(bgenv_set(&env, "counter", USERVAR_TYPE_UINT64,
+				   &counter, sizeof(counter)), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	/* in-place update */
+	for (counter = 1; counter < 10; counter++) {
+		ck_assert_int_eq(bgenv_set(&env, "counter",
+					   USERVAR_TYPE_UINT64, &counter,
+					   sizeof(counter)), 0);
+		ck_assert_uint_eq(data.crc32, full_crc(&data));
+	}
+
+	/* size change moves the variable behind the others */
+	ck_assert_int_eq(bgenv_set(&env, "first", USERVAR_TYPE_STRING_ASCII,
+				   "a longer value", 15), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	/* deletion */
+	ck_assert_int_eq(bgenv_set(&env, "counter", USERVAR_TYPE_DELETED, "",
+				   1), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	/* built-in fields */
+	ck_assert_int_eq(bgenv_set(&env, "kernelfile", 0, "vmlinuz", 8), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+	ck_assert_int_eq(bgenv_set(&env, "revision", 0, "42", 3), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+	ck_assert_int_eq(bgenv_set(&env, "ustate", 0, "1", 2), 0);
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	bgenv_uservar_index_free(env.uservar_index);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_index_matches_linear)
+{
+	static BG_ENVDATA indexed, linear;
+	BGENV_USERVAR_INDEX *idx = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	char key[16], value[32];
+	uint32_t used, records;
+
+	ck_assert_ptr_nonnull(idx);
+	memset(&indexed, 0, sizeof(indexed));
+	memset(&linear, 0, sizeof(linear));
+
+	srand(7);
+	for (int i = 0; i < 2000; i++) {
+		uint64_t type = USERVAR_TYPE_STRING_ASCII;
+		int res_indexed, res_linear;
+		uint32_t len;
+
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		len = snprintf(value, sizeof(value), "%0*d", rand() % 20,
+			       i) + 1;
+		if (rand() % 5 == 0) {
+			type = USERVAR_TYPE_DELETED;
+		}
+		res_indexed = bgenv_set_uservar_indexed(idx, indexed.userdata,
+							key, type, value,
+							len);
+		res_linear = bgenv_set_uservar(linear.userdata, key, type,
+					       value, len);
+		ck_assert_int_eq(res_indexed, res_linear);
+		ck_assert_int_eq(memcmp(indexed.userdata, linear.userdata,
+					ENV_MEM_USERVARS), 0);
+
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		ck_assert_ptr_eq(bgenv_find_uservar_indexed(idx,
+							    indexed.userdata,
+							    key),
+				 bgenv_find_uservar(indexed.userdata, key));
+	}
+
+	/* records were moved without dropping the index */
+	ck_assert(idx->valid);
+	ck_assert(bgenv_scan_uservars(indexed.userdata, &used, &records));
+	ck_assert_uint_eq(used, idx->used);
+	ck_assert_uint_eq(records, idx->count);
+	ck_assert_uint_eq(bgenv_user_free(indexed.userdata),
+			  ENV_MEM_USERVARS - used);
+
+	bgenv_uservar_index_free(idx);
+}
+END_TEST
+
+static void assert_same_value(uint8_t *udata1, uint8_t *udata2, char *key)
+{
+	char value1[32] = "", value2[32] = "";
+	uint64_t type1 = 0, type2 = 0;
+
+	ck_assert_int_eq(bgenv_get_uservar(udata1, key, &type1, value1,
+					   sizeof(value1)),
+			 bgenv_get_uservar(udata2, key, &type2, value2,
+					   sizeof(value2)));
+	ck_assert_str_eq(value1, value2);
+	ck_assert(type1 == type2);
+}
+
+START_TEST(bgenv_uservar_batch_matches_linear)
+{
+	static BG_ENVDATA batched, linear;
+	BGENV_USERVAR_INDEX *idx = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	char key[16], value[32];
+
+	ck_assert_ptr_nonnull(idx);
+	memset(&batched, 0, sizeof(batched));
+	memset(&linear, 0, sizeof(linear));
+
+	srand(11);
+	ck_assert(bgenv_uservar_batch_begin(idx, batched.userdata));
+	for (int i = 0; i < 2000; i++) {
+		uint64_t type = USERVAR_TYPE_STRING_ASCII;
+		uint32_t len;
+
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		len = snprintf(value, sizeof(value), "%0*d", rand() % 30,
+			       i) + 1;
+		if (rand() % 5 == 0) {
+			type = USERVAR_TYPE_DELETED;
+		}
+		ck_assert_int_eq(bgenv_set_uservar_indexed(idx,
+							   batched.userdata,
+							   key, type, value,
+							   len),
+				 bgenv_set_uservar(linear.userdata, key, type,
+						   value, len));
+
+		/* dead records are invisible and count as free */
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		assert_same_value(batched.userdata, linear.userdata, key);
+		ck_assert_uint_eq(bgenv_user_free_indexed(idx,
+							  batched.userdata),
+				  bgenv_user_free(linear.userdata));
+	}
+	bgenv_uservar_batch_end(idx, batched.userdata);
+
+	ck_assert_uint_eq(bgenv_user_free(batched.userdata),
+			  bgenv_user_free(linear.userdata));
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		assert_same_value(batched.userdata, linear.userdata, key);
+	}
+	for (uint8_t *u = batched.userdata; *u; u = bgenv_next_uservar(u)) {
+		uint64_t type;
+
+		bgenv_map_uservar(u, NULL, &type, NULL, NULL, NULL);
+		ck_assert((type & USERVAR_TYPE_DELETED) == 0);
+	}
+
+	bgenv_uservar_index_free(idx);
+}
+END_TEST
+
+/* the record area of layout v2 equals that of layout v1 */
+static void assert_same_records(uint8_t *v1, uint8_t *v2)
+{
+	uint32_t used = ENV_MEM_USERVARS - bgenv_user_free(v1);
+
+	ck_assert_int_eq(memcmp(v1, v2, used + 1), 0);
+	ck_assert(bgenv_uservars_v2(v2));
+	ck_assert(bgenv_validate_uservars(v2));
+}
+
+START_TEST(bgenv_uservars_v2_layout)
+{
+	static BG_ENVDATA v1, linear, indexed, data;
+	BGENV_USERVAR_INDEX *idx = calloc(1, sizeof(BGENV_USERVAR_INDEX));
+	BGENV env = {.data = &data, .crc_incremental = true};
+	uint32_t count, used, start, length;
+	char key[16], value[32];
+	uint8_t *foreign;
+
+	ck_assert_ptr_nonnull(idx);
+	memset(&v1, 0, sizeof(v1));
+	memset(&linear, 0, sizeof(linear));
+	memset(&indexed, 0, sizeof(indexed));
+	ck_assert(!bgenv_uservars_v2(linear.userdata));
+	ck_assert_int_eq(bgenv_uservars_convert(linear.userdata, true), 0);
+	ck_assert_int_eq(bgenv_uservars_convert(indexed.userdata, true), 0);
+	ck_assert(bgenv_uservars_v2(linear.userdata));
+
+	srand(13);
+	for (int i = 0; i < 2000; i++) {
+		uint64_t type = USERVAR_TYPE_STRING_ASCII;
+		uint32_t len;
+		int res;
+
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		len = snprintf(value, sizeof(value), "%0*d", rand() % 30,
+			       i) + 1;
+		if (rand() % 5 == 0) {
+			type = USERVAR_TYPE_DELETED;
+		}
+		res = bgenv_set_uservar(v1.userdata, key, type, value, len);
+		ck_assert_int_eq(bgenv_set_uservar(linear.userdata, key, type,
+						   value, len),
+				 res);
+		ck_assert_int_eq(bgenv_set_uservar_indexed(idx,
+							   indexed.userdata,
+							   key, type, value,
+							   len),
+				 res);
+
+		snprintf(key, sizeof(key), "key%d", rand() % 200);
+		assert_same_value(v1.userdata, linear.userdata, key);
+		ck_assert_uint_eq(bgenv_user_free_indexed(idx,
+							  indexed.userdata),
+				  bgenv_user_free(linear.userdata));
+	}
+	assert_same_records(v1.userdata, linear.userdata);
+	ck_assert_int_eq(memcmp(linear.userdata, indexed.userdata,
+				ENV_MEM_USERVARS), 0);
+
+	/* a batch restores the table at its end */
+	ck_assert(bgenv_uservar_batch_begin(idx, indexed.userdata));
+	for (int i = 0; i < 200; i += 3) {
+		snprintf(key, sizeof(key), "key%d", i);
+		bgenv_set_uservar(v1.userdata, key, USERVAR_TYPE_DELETED, "",
+				  1);
+		bgenv_set_uservar_indexed(idx, indexed.userdata, key,
+					  USERVAR_TYPE_DELETED, "", 1);
+	}
+	bgenv_uservar_batch_end(idx, indexed.userdata);
+	assert_same_records(v1.userdata, indexed.userdata);
+
+	/* the table costs one entry per variable and the trailer */
+	memcpy(&count, indexed.userdata + ENV_MEM_USERVARS - 12,
+	       sizeof(count));
+	ck_assert_uint_eq(bgenv_user_free(indexed.userdata),
+			  bgenv_user_free(v1.userdata) - 16 - 12 * count);
+
+	/* appending with layout v1 makes the table stale */
+	used = ENV_MEM_USERVARS - bgenv_user_free(v1.userdata);
+	bgenv_set_uservar(v1.userdata, "foreign", USERVAR_TYPE_STRING_ASCII,
+			  "value", 6);
+	foreign = bgenv_find_uservar(v1.userdata, "foreign");
+	bgenv_map_uservar(foreign, NULL, NULL, NULL, &length, NULL);
+	memcpy(indexed.userdata + used, foreign, length);
+	ck_assert(bgenv_validate_uservars(indexed.userdata));
+	ck_assert_ptr_eq(bgenv_find_uservar(indexed.userdata, "foreign"),
+			 indexed.userdata + used);
+	ck_assert_int_eq(bgenv_uservars_convert(indexed.userdata, true), 0);
+	assert_same_records(v1.userdata, indexed.userdata);
+	ck_assert_ptr_eq(bgenv_find_uservar(indexed.userdata, "foreign"),
+			 indexed.userdata + used);
+
+	/* a used table which does not match the records is corrupt */
+	memcpy(&count, indexed.userdata + ENV_MEM_USERVARS - 12,
+	       sizeof(count));
+	start = ENV_MEM_USERVARS - 16 - 12 * count;
+	indexed.userdata[start + 8]++;
+	ck_assert(!bgenv_validate_uservars(indexed.userdata));
+	indexed.userdata[start + 8]--;
+
+	ck_assert_int_eq(bgenv_uservars_convert(indexed.userdata, false), 0);
+	ck_assert(!bgenv_uservars_v2(indexed.userdata));
+	ck_assert_int_eq(memcmp(v1.userdata, indexed.userdata,
+				ENV_MEM_USERVARS), 0);
+
+	/* the checksum covers the rewritten table */
+	memset(&data, 0, sizeof(data));
+	ck_assert_int_eq(bgenv_uservars_convert(data.userdata, true), 0);
+	data.crc32 = full_crc(&data);
+	for (int i = 0; i < 20; i++) {
+		snprintf(key, sizeof(key), "key%d", i % 7);
+		snprintf(value, sizeof(value), "%0*d", i % 5, i);
+		ck_assert_int_eq(bgenv_set(&env, key,
+					   USERVAR_TYPE_STRING_ASCII, value,
+					   strlen(value) + 1),
+				 0);
+		ck_assert_uint_eq(data.crc32, full_crc(&data));
+	}
+	ck_assert(bgenv_uservars_v2(data.userdata));
+
+	bgenv_uservar_index_free(env.uservar_index);
+	bgenv_uservar_index_free(idx);
+}
+END_TEST
+
+#define BULK_RECORDS 64
+
+START_TEST(bgenv_set_many_matches_linear)
+{
+	static BG_ENVDATA data, linear, saved;
+	static uint8_t merged[ENV_MEM_USERVARS];
+	BGENV env = {.data = &data, .crc_incremental = true};
+	char keys[BULK_RECORDS][16], values[BULK_RECORDS][32];
+	ebg_uservar_t vars[BULK_RECORDS], *exported;
+	char key[16], value[32];
+	uint32_t count, n;
+	uint64_t type;
+	int size;
+
+	memset(&data, 0, sizeof(data));
+	memset(&linear, 0, sizeof(linear));
+	data.crc32 = full_crc(&data);
+
+	srand(17);
+	for (int round = 0; round < 50; round++) {
+		for (int i = 0; i < BULK_RECORDS; i++) {
+			snprintf(keys[i], sizeof(keys[i]), "key%d",
+				 rand() % 100);
+			vars[i].key = keys[i];
+			vars[i].type = USERVAR_TYPE_STRING_ASCII;
+			vars[i].len = snprintf(values[i], sizeof(values[i]),
+					       "%0*d", rand() % 30,
+					       round * BULK_RECORDS + i) + 1;
+			vars[i].data = (uint8_t *)values[i];
+			if (rand() % 5 == 0) {
+				vars[i].type = USERVAR_TYPE_DELETED;
+				vars[i].data = NULL;
+				vars[i].len = 0;
+			}
+			/* later records of a key win */
+			ck_assert_int_eq(bgenv_set_uservar(linear.userdata,
+							   keys[i],
+							   vars[i].type,
+							   values[i],
+							   vars[i].data ?
+							   vars[i].len : 1),
+					 0);
+		}
+		ck_assert_int_eq(bgenv_set_many(&env, vars, BULK_RECORDS), 0);
+		ck_assert_uint_eq(data.crc32, full_crc(&data));
+		ck_assert(bgenv_validate_uservars(data.userdata));
+		for (int i = 0; i < 100; i++) {
+			snprintf(key, sizeof(key), "key%d", i);
+			assert_same_value(data.userdata, linear.userdata, key);
+		}
+		ck_assert_uint_eq(bgenv_user_free(data.userdata),
+				  bgenv_user_free(linear.userdata));
+	}
+
+	/* the export holds all variables, in the order of their records */
+	size = bgenv_get_all(&env, NULL, 0, &count);
+	ck_assert_int_gt(size, 0);
+	exported = malloc(size);
+	ck_assert_ptr_nonnull(exported);
+	ck_assert_int_eq(bgenv_get_all(&env, exported, size - 1, &n),
+			 -ENOSPC);
+	ck_assert_int_eq(bgenv_get_all(&env, exported, size, &n), 0);
+	ck_assert_uint_eq(n, count);
+	for (uint32_t i = 0; i < n; i++) {
+		memset(value, 0, sizeof(value));
+		ck_assert_int_eq(bgenv_get_uservar(linear.userdata,
+						   exported[i].key, &type,
+						   value, sizeof(value)),
+				 0);
+		ck_assert(type == exported[i].type);
+		ck_assert_uint_eq(exported[i].len, strlen(value) + 1);
+		ck_assert_int_eq(memcmp(exported[i].data, value,
+					exported[i].len),
+				 0);
+	}
+	memset(&saved, 0, sizeof(saved));
+	ck_assert_int_eq(bgenv_merge_uservars(saved.userdata, exported, n,
+					      merged),
+			 0);
+	ck_assert_int_eq(memcmp(merged, data.userdata, ENV_MEM_USERVARS), 0);
+	free(exported);
+
+	/* either all records are applied or none */
+	memcpy(&saved, &data, sizeof(data));
+	vars[1].key = "big";
+	vars[1].type = USERVAR_TYPE_DEFAULT;
+	vars[1].data = merged;
+	vars[1].len = ENV_MEM_USERVARS - 64;
+	ck_assert_int_eq(bgenv_set_many(&env, vars, 2), -ENOMEM);
+	vars[1].key = "kernelfile";
+	ck_assert_int_eq(bgenv_set_many(&env, vars, 2), -EINVAL);
+	ck_assert_int_eq(memcmp(&saved, &data, sizeof(data)), 0);
+
+	/* layout v2 is kept */
+	ck_assert_int_eq(bgenv_uservars_convert(data.userdata, true), 0);
+	data.crc32 = full_crc(&data);
+	ck_assert_int_eq(bgenv_set_many(&env, vars, 1), 0);
+	ck_assert(bgenv_uservars_v2(data.userdata));
+	ck_assert(bgenv_validate_uservars(data.userdata));
+	ck_assert_uint_eq(data.crc32, full_crc(&data));
+
+	bgenv_uservar_index_free(env.uservar_index);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -107,6 +526,12 @@ Suite *ebg_test_suite(void)
 	tc_core = tcase_create("Core");
 
 	tcase_add_test(tc_core, bgenv_get_from_manipulated);
+	tcase_add_test(tc_core, bgenv_validate_short_payload);
+	tcase_add_test(tc_core, bgenv_set_incremental_crc);
+	tcase_add_test(tc_core, bgenv_uservar_index_matches_linear);
+	tcase_add_test(tc_core, bgenv_uservar_batch_matches_linear);
+	tcase_add_test(tc_core, bgenv_uservars_v2_layout);
+	tcase_add_test(tc_core, bgenv_set_many_matches_linear);
 
 	suite_add_tcase(s, tc_core);
 
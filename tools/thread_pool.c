@@ -0,0 +1,61 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "thread_pool.h"
+
+struct thread_pool_work {
+	thread_pool_fn fn;
+	void *ctx;
+	size_t count;
+	size_t next;
+};
+
+static void *thread_pool_worker(void *arg)
+{
+	struct thread_pool_work *work = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	       work->count) {
+		work->fn(work->ctx, i);
+	}
+	return NULL;
+}
+
+void thread_pool_run(thread_pool_fn fn, void *ctx, size_t count,
+		     unsigned int max_threads)
+{
+	struct thread_pool_work work = {
+		.fn = fn, .ctx = ctx, .count = count, .next = 0};
+	pthread_t *threads = NULL;
+	unsigned int started = 0;
+
+	if (max_threads > count) {
+		max_threads = count;
+	}
+	if (max_threads > 1) {
+		threads = calloc(max_threads - 1, sizeof(pthread_t));
+	}
+	if (threads) {
+		while (started < max_threads - 1 &&
+		       pthread_create(&threads[started], NULL,
+				      thread_pool_worker, &work) == 0) {
+			started++;
+		}
+	}
+	thread_pool_worker(&work);
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
@@ -0,0 +1,25 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2024
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef void (*thread_pool_fn)(void *ctx, size_t index);
+
+/**
+ * Calls fn(ctx, i) for every 0 <= i < count, distributed over up to
+ * max_threads threads including the calling one, and returns when all calls
+ * have finished. The order of the calls is unspecified. If no additional
+ * threads can be started, all calls are done by the calling thread.
+ */
+void thread_pool_run(thread_pool_fn fn, void *ctx, size_t count,
+		     unsigned int max_threads);
@@ -18,6 +18,10 @@
 #include <bootguard.h>
 #include <utils.h>
 
+#if !defined(SILENT_BOOT)
+BOOLEAN quiet_boot = FALSE;
+#endif
+
 VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...)
 {
 	INT32 attr = ST->ConOut->Mode->Attribute;
@@ -31,22 +35,39 @@ VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...)
 	(VOID) ST->ConOut->SetAttribute(ST->ConOut, attr);
 }
 
-BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp)
+/* Size of the device path without its last node, i.e. of the disk a
+ * partition belongs to */
+static UINTN DevicePathParentSize(EFI_DEVICE_PATH *dp)
 {
-	extern CHAR16 *boot_medium_path;
-	CHAR16 *device_path, *tmp;
-	BOOLEAN result = FALSE;
-
-	tmp = DevicePathToStr(dp);
-	device_path = GetBootMediumPath(tmp);
-	FreePool(tmp);
+	EFI_DEVICE_PATH *node, *last = dp;
 
-	if (StrCmp(device_path, boot_medium_path) == 0) {
-		result = TRUE;
+	for (node = dp; !IsDevicePathEnd(node);
+	     node = NextDevicePathNode(node)) {
+		last = node;
 	}
-	FreePool(device_path);
+	if (last == dp) {
+		return (UINT8 *)node - (UINT8 *)dp;
+	}
+	return (UINT8 *)last - (UINT8 *)dp;
+}
 
-	return result;
+/* size of the disk prefix of boot_medium_devpath, 0 if unknown */
+static UINTN boot_medium_prefix_size;
+
+VOID SetBootMedium(EFI_DEVICE_PATH *dp)
+{
+	boot_medium_devpath = dp;
+	boot_medium_prefix_size = dp ? DevicePathParentSize(dp) : 0;
+}
+
+BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp)
+{
+	if (!dp || !boot_medium_prefix_size) {
+		return FALSE;
+	}
+	return DevicePathParentSize(dp) == boot_medium_prefix_size &&
+	       CompareMem(dp, boot_medium_devpath,
+			  boot_medium_prefix_size) == 0;
 }
 
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status)
@@ -102,6 +123,45 @@ CHAR16 *get_volume_custom_label(EFI_FILE_HANDLE fh)
 	return buffer;
 }
 
+EFI_FILE_HANDLE volume_open_root(VOLUME_DESC *volume)
+{
+	EFI_GUID sfspGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+	EFI_FILE_IO_INTERFACE *fs = NULL;
+	EFI_STATUS status;
+
+	if (volume->root) {
+		return volume->root;
+	}
+	status = BS->HandleProtocol(volume->handle, &sfspGuid, (VOID **)&fs);
+	if (EFI_ERROR(status)) {
+		ERROR(L"File IO handle does not support SIMPLE_FILE_SYSTEM_PROTOCOL.\n");
+		return NULL;
+	}
+	status = fs->OpenVolume(fs, &volume->root);
+	if (EFI_ERROR(status)) {
+		ERROR(L"Could not open file system: %r\n", status);
+		volume->root = NULL;
+	}
+	return volume->root;
+}
+
+VOID volume_read_labels(VOLUME_DESC *volume)
+{
+	if (volume->labels_read) {
+		return;
+	}
+	volume->labels_read = TRUE;
+	if (!volume_open_root(volume)) {
+		return;
+	}
+	volume->fslabel = get_volume_label(volume->root);
+	volume->fscustomlabel = get_volume_custom_label(volume->root);
+	INFO(L"Volume LABEL=%s, CLABEL=%s\n", volume->fslabel,
+	     volume->fscustomlabel);
+}
+
+/* Only collects the handles and device paths of the volumes, volumes on the
+ * boot medium first. Their file systems are opened on demand. */
 EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 {
 	EFI_STATUS status;
@@ -110,8 +170,6 @@ EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 	UINTN handleCount = 0;
 	UINTN index, rootCount = 0;
 
-	EFI_FILE_HANDLE tmp;
-
 	if (!volumes || !count) {
 		ERROR(L"Invalid volume enumeration.\n");
 		return EFI_INVALID_PARAMETER;
@@ -125,56 +183,60 @@ EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 	}
 	INFO(L"Found %d handles for file IO\n\n", handleCount);
 
-	*volumes = (VOLUME_DESC *)AllocatePool(sizeof(VOLUME_DESC) * handleCount);
+	*volumes = (VOLUME_DESC *)AllocateZeroPool(sizeof(VOLUME_DESC) *
+						   handleCount);
 	if (!*volumes) {
 		ERROR(L"Could not allocate memory for volume descriptors.\n");
+		FreePool(handles);
 		return EFI_OUT_OF_RESOURCES;
 	}
 
-	for (index = 0; index < handleCount; index++) {
-		EFI_FILE_IO_INTERFACE *fs = NULL;
-		CHAR16 *devpathstr;
-
-		status = BS->HandleProtocol(
-		    handles[index], &sfspGuid, (VOID **)&fs);
-		if (EFI_ERROR(status)) {
-			/* skip failed handle and continue enumerating */
-			ERROR(L"File IO handle %d does not support SIMPLE_FILE_SYSTEM_PROTOCOL, skipping.\n",
-			      index);
-			continue;
-		}
-		status = fs->OpenVolume(fs, &tmp);
-		if (EFI_ERROR(status)) {
-			/* skip failed handle and continue enumerating */
-			ERROR(L"Could not open file system for IO handle %d, skipping.\n",
-			      index);
-			continue;
-		}
-		EFI_DEVICE_PATH *devpath = DevicePathFromHandle(handles[index]);
-		if (devpath == NULL) {
-			ERROR(L"Could not get device path for config partition, skipping.\n");
-			continue;
-		}
-		devpathstr = DevicePathToStr(devpath);
-
-		(*volumes)[rootCount].root = tmp;
-		(*volumes)[rootCount].devpath = devpath;
-		(*volumes)[rootCount].fslabel =
-		    get_volume_label((*volumes)[rootCount].root);
-		(*volumes)[rootCount].fscustomlabel =
-		    get_volume_custom_label((*volumes)[rootCount].root);
-		INFO(L"Volume %d: ", rootCount);
-		if (IsOnBootMedium(devpath)) {
-			INFO(L"(On boot medium) ");
-		}
-		INFO(L"%s, LABEL=%s, CLABEL=%s\n",
-		      devpathstr, (*volumes)[rootCount].fslabel,
-		      (*volumes)[rootCount].fscustomlabel);
+	/* compared once, the second pass only picks up the remaining ones */
+	UINT8 *onmedium = AllocatePool(handleCount);
+	if (!onmedium) {
+		ERROR(L"Could not allocate memory for volume descriptors.\n");
+		FreePool(*volumes);
+		FreePool(handles);
+		return EFI_OUT_OF_RESOURCES;
+	}
 
-		FreePool(devpathstr);
+	for (int pass = 0; pass < 2; pass++) {
+		BOOLEAN want_bootmedium = pass == 0;
+
+		for (index = 0; index < handleCount; index++) {
+			EFI_DEVICE_PATH *devpath =
+				DevicePathFromHandle(handles[index]);
+			if (devpath == NULL) {
+				if (pass == 0) {
+					ERROR(L"Could not get device path for IO handle %d, skipping.\n",
+					      index);
+				}
+				continue;
+			}
+			if (pass == 0) {
+				onmedium[index] = IsOnBootMedium(devpath);
+			}
+			BOOLEAN onbootmedium = onmedium[index];
+			if (onbootmedium != want_bootmedium) {
+				continue;
+			}
 
-		rootCount++;
+			VOLUME_DESC *v = &(*volumes)[rootCount];
+			v->handle = handles[index];
+			v->devpath = devpath;
+			v->onbootmedium = onbootmedium;
+#if !defined(SILENT_BOOT)
+			CHAR16 *devpathstr = DevicePathToStr(devpath);
+			INFO(L"Volume %d: %s%s\n", rootCount,
+			     onbootmedium ? L"(On boot medium) " : L"",
+			     devpathstr);
+			FreePool(devpathstr);
+#endif
+			rootCount++;
+		}
 	}
+	FreePool(onmedium);
+	FreePool(handles);
 	*count = rootCount;
 	return EFI_SUCCESS;
 }
@@ -192,8 +254,7 @@ EFI_STATUS close_volumes(VOLUME_DESC *volumes, UINTN count)
 		EFI_STATUS status;
 
 		if (!volumes[i].root) {
-			ERROR(L"Invalid handle for volume %d.\n", i);
-			result = EFI_INVALID_PARAMETER;
+			/* never opened */
 			continue;
 		}
 		status = volumes[i].root->Close(volumes[i].root);
@@ -234,6 +295,7 @@ EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 	if (prefixlen > 0) {
 		for (UINTN v = 0; v < volume_count; v++) {
 			CHAR16 *src;
+			volume_read_labels(&volumes[v]);
 			switch (lm) {
 			case DOSFSLABEL:
 				src = volumes[v].fslabel;
@@ -264,13 +326,87 @@ EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 	appendeddevpath = AppendDevicePath(devpath, filedevpath);
 	FreePool(filedevpath);
 
+#if !defined(SILENT_BOOT)
 	CHAR16 *pathstr = DevicePathToStr(appendeddevpath);
 	INFO(L"Full path for kernel is: %s\n", pathstr);
 	FreePool(pathstr);
+#endif
 
 	return appendeddevpath;
 }
 
+#define PREFETCH_CHUNK_SIZE (1024 * 1024)
+
+EFI_STATUS prefetch_file(EFI_DEVICE_PATH *filedevpath, VOID **buffer,
+			 UINTN *size)
+{
+	EFI_GUID sfspGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+	EFI_DEVICE_PATH *dp = filedevpath;
+	EFI_FILE_HANDLE root, file;
+	EFI_FILE_INFO *info;
+	EFI_HANDLE device;
+	EFI_STATUS status;
+	UINT8 *data;
+	UINTN pos;
+
+	status = BS->LocateDevicePath(&sfspGuid, &dp, &device);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	/* FileDevicePath() creates a single file path node */
+	if (DevicePathType(dp) != MEDIA_DEVICE_PATH ||
+	    DevicePathSubType(dp) != MEDIA_FILEPATH_DP ||
+	    !IsDevicePathEnd(NextDevicePathNode(dp))) {
+		return EFI_UNSUPPORTED;
+	}
+
+	root = LibOpenRoot(device);
+	if (!root) {
+		return EFI_NOT_FOUND;
+	}
+	status = root->Open(root, &file, ((FILEPATH_DEVICE_PATH *)dp)->PathName,
+			    EFI_FILE_MODE_READ, 0);
+	(VOID) root->Close(root);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+
+	info = LibFileInfo(file);
+	if (!info) {
+		(VOID) file->Close(file);
+		return EFI_DEVICE_ERROR;
+	}
+	*size = info->FileSize;
+	FreePool(info);
+
+	data = AllocatePool(*size);
+	if (!data) {
+		(VOID) file->Close(file);
+		return EFI_OUT_OF_RESOURCES;
+	}
+	/* read in chunks, so that pending events are dispatched in between */
+	for (pos = 0; pos < *size; ) {
+		UINTN len = *size - pos;
+
+		if (len > PREFETCH_CHUNK_SIZE) {
+			len = PREFETCH_CHUNK_SIZE;
+		}
+		status = file->Read(file, &len, data + pos);
+		if (EFI_ERROR(status) || len == 0) {
+			break;
+		}
+		pos += len;
+	}
+	(VOID) file->Close(file);
+	if (pos < *size) {
+		FreePool(data);
+		return EFI_ERROR(status) ? status : EFI_END_OF_FILE;
+	}
+
+	*buffer = data;
+	return EFI_SUCCESS;
+}
+
 CHAR16 *GetBootMediumPath(CHAR16 *input)
 {
 	CHAR16 *dst;
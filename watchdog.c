@@ -0,0 +1,371 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2017-2024
+ *
+ * Authors:
+ *  Jan Kiszka <jan.kiszka@siemens.com>
+ *  Andreas Reichel <andreas.reichel.ext@siemens.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <efiprot.h>
+#include <efipciio.h>
+#include <pci/header.h>
+#include <bootguard.h>
+#include "utils.h"
+#include "watchdog.h"
+
+extern const WATCHDOG_DRIVER *const wdfuncs_start[];
+extern const WATCHDOG_DRIVER *const wdfuncs_end[];
+
+#define PCI_GET_VENDOR_ID(id)	(UINT16)(id)
+#define PCI_GET_PRODUCT_ID(id)	(UINT16)((id) >> 16)
+#define PCI_MAKE_ID(vendor, device)					\
+	((UINT32)(vendor) | ((UINT32)(device) << 16))
+
+/* The PCI device a watchdog was successfully probed on during the last boot,
+ * stored in an EFI variable to try this device first. */
+#define WATCHDOG_HINT_VAR L"BootGuardWatchdogDevice"
+
+static EFI_GUID watchdog_hint_guid = {
+	0x8a2d4c1e,
+	0x6b39,
+	0x4f57,
+	{0x9c, 0x0e, 0x3a, 0x71, 0xd5, 0x28, 0xe6, 0x4b}};
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct {
+	UINT32 pci_id;
+	UINT32 handle_index;
+	UINT32 segment;
+	UINT8 bus;
+	UINT8 device;
+	UINT8 function;
+	UINT8 reserved;
+} WATCHDOG_HINT;
+#pragma pack(pop)
+
+typedef struct {
+	UINT32 pci_id;
+	const WATCHDOG_DRIVER *driver;
+} PCI_MATCH;
+
+/* Collects the PCI IDs of all registered drivers, sorted by ID. Entries
+ * with the same ID keep the link order of their drivers. */
+static PCI_MATCH *build_match_table(UINTN *count)
+{
+	const WATCHDOG_DRIVER *const *entry;
+	PCI_MATCH *table;
+	UINTN n = 0;
+
+	for (entry = wdfuncs_start + 1; entry < wdfuncs_end; entry++) {
+		const WATCHDOG_PCI_ID *id = (*entry)->pci_ids;
+
+		for (; id && id->vendor_id != 0; id++) {
+			n++;
+		}
+	}
+	*count = 0;
+	if (n == 0) {
+		return NULL;
+	}
+	table = AllocatePool(n * sizeof(PCI_MATCH));
+	if (!table) {
+		return NULL;
+	}
+
+	for (entry = wdfuncs_start + 1; entry < wdfuncs_end; entry++) {
+		const WATCHDOG_PCI_ID *id = (*entry)->pci_ids;
+
+		for (; id && id->vendor_id != 0; id++) {
+			PCI_MATCH m = {
+				.pci_id = PCI_MAKE_ID(id->vendor_id,
+						      id->device_id),
+				.driver = *entry,
+			};
+			UINTN pos = *count;
+
+			/* insertion sort, the tables are small */
+			while (pos > 0 && table[pos - 1].pci_id > m.pci_id) {
+				table[pos] = table[pos - 1];
+				pos--;
+			}
+			table[pos] = m;
+			(*count)++;
+		}
+	}
+	return table;
+}
+
+/* Returns the first table entry for pci_id, or NULL */
+static PCI_MATCH *lookup_match(PCI_MATCH *table, UINTN count, UINT32 pci_id)
+{
+	UINTN low = 0, high = count;
+
+	while (low < high) {
+		UINTN mid = low + (high - low) / 2;
+
+		if (table[mid].pci_id < pci_id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < count && table[low].pci_id == pci_id) {
+		return &table[low];
+	}
+	return NULL;
+}
+
+static EFI_STATUS probe_matching(PCI_MATCH *table, UINTN count,
+				 EFI_PCI_IO *pci_io, UINT32 pci_id,
+				 UINTN timeout)
+{
+	PCI_MATCH *m = lookup_match(table, count, pci_id);
+	EFI_STATUS status = EFI_UNSUPPORTED;
+
+	for (; m && m < table + count && m->pci_id == pci_id; m++) {
+		status = m->driver->probe(pci_io, PCI_GET_VENDOR_ID(pci_id),
+					  PCI_GET_PRODUCT_ID(pci_id), timeout);
+		if (status == EFI_SUCCESS) {
+			break;
+		}
+	}
+	return status;
+}
+
+static BOOLEAN get_hint(EFI_PCI_IO *pci_io, UINT32 pci_id, UINTN index,
+			WATCHDOG_HINT *hint)
+{
+	UINTN segment, bus, device, function;
+
+	if (EFI_ERROR(pci_io->GetLocation(pci_io, &segment, &bus, &device,
+					  &function))) {
+		return FALSE;
+	}
+	ZeroMem(hint, sizeof(*hint));
+	hint->pci_id = pci_id;
+	hint->handle_index = index;
+	hint->segment = segment;
+	hint->bus = bus;
+	hint->device = device;
+	hint->function = function;
+	return TRUE;
+}
+
+/* Probes the PCI device of handles[index] with the drivers matching its ID.
+ * If hint is given, the device is only probed if it is still the recorded
+ * one, otherwise probed is set to FALSE. On success, the location of the
+ * device is returned in found. */
+static EFI_STATUS probe_device(EFI_HANDLE *handles, UINTN index,
+			       PCI_MATCH *table, UINTN count, UINTN timeout,
+			       const WATCHDOG_HINT *hint, BOOLEAN *probed,
+			       WATCHDOG_HINT *found)
+{
+	EFI_PCI_IO_PROTOCOL *pci_io;
+	EFI_STATUS status;
+	UINT32 value;
+
+	status = BS->OpenProtocol(handles[index], &PciIoProtocol,
+				  (VOID **)&pci_io, this_image, NULL,
+				  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+	if (EFI_ERROR(status)) {
+		ERROR(L"Cannot not open PciIoProtocol: %r\n", status);
+		return status;
+	}
+
+	status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32, PCI_VENDOR_ID,
+				  1, &value);
+	if (EFI_ERROR(status)) {
+		WARNING(L"Cannot not read from PCI device, skipping: %r\n",
+			status);
+		(VOID) BS->CloseProtocol(handles[index], &PciIoProtocol,
+					 this_image, NULL);
+		return EFI_NOT_FOUND;
+	}
+
+	if (hint) {
+		WATCHDOG_HINT current;
+
+		if (!get_hint(pci_io, value, index, &current) ||
+		    CompareMem(&current, hint, sizeof(current)) != 0) {
+			(VOID) BS->CloseProtocol(handles[index],
+						 &PciIoProtocol, this_image,
+						 NULL);
+			*probed = FALSE;
+			return EFI_NOT_FOUND;
+		}
+	}
+	*probed = TRUE;
+
+	status = probe_matching(table, count, pci_io, value, timeout);
+	if (status == EFI_SUCCESS && !get_hint(pci_io, value, index, found)) {
+		found->pci_id = 0;
+	}
+
+	(VOID) BS->CloseProtocol(handles[index], &PciIoProtocol, this_image,
+				 NULL);
+	return status == EFI_SUCCESS ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+static VOID store_hint(const WATCHDOG_HINT *stored, BOOLEAN have_stored,
+		       WATCHDOG_HINT *found)
+{
+	if (found->pci_id == 0 ||
+	    (have_stored && CompareMem(stored, found, sizeof(*found)) == 0)) {
+		return;
+	}
+	/* only written when the device changed to spare the flash */
+	(VOID) RT->SetVariable(WATCHDOG_HINT_VAR, &watchdog_hint_guid,
+			       EFI_VARIABLE_NON_VOLATILE |
+				       EFI_VARIABLE_BOOTSERVICE_ACCESS,
+			       sizeof(*found), found);
+}
+
+EFI_STATUS probe_watchdogs(UINTN timeout)
+{
+	const WATCHDOG_DRIVER *const *entry;
+
+	if (wdfuncs_end - wdfuncs_start - 1 == 0) {
+		if (timeout > 0) {
+			ERROR(L"No watchdog drivers registered, but timeout is non-zero.\n");
+			return EFI_UNSUPPORTED;
+		}
+		return EFI_SUCCESS;
+	}
+	if (timeout == 0) {
+		WARNING(L"Watchdog is disabled.\n");
+		return EFI_SUCCESS;
+	}
+
+	/* drivers not bound to a PCI device, e.g. ACPI WDAT, come first */
+	for (entry = wdfuncs_start + 1; entry < wdfuncs_end; entry++) {
+		if (!(*entry)->pci_ids &&
+		    (*entry)->probe(NULL, 0, 0, timeout) == EFI_SUCCESS) {
+			return EFI_SUCCESS;
+		}
+	}
+
+	UINTN count;
+	PCI_MATCH *table = build_match_table(&count);
+	if (!table) {
+		return EFI_UNSUPPORTED;
+	}
+
+	UINTN handle_count = 0;
+	EFI_HANDLE *handle_buffer = NULL;
+	EFI_STATUS status = BS->LocateHandleBuffer(ByProtocol, &PciIoProtocol,
+						   NULL, &handle_count,
+						   &handle_buffer);
+	if (EFI_ERROR(status) || (handle_count == 0)) {
+		ERROR(L"No PCI I/O Protocol handles found.\n");
+		if (handle_buffer) {
+			FreePool(handle_buffer);
+		}
+		FreePool(table);
+		return EFI_UNSUPPORTED;
+	}
+
+	WATCHDOG_HINT stored = {0}, found = {0};
+	UINTN size = sizeof(stored);
+	BOOLEAN have_stored = FALSE;
+	BOOLEAN stored_probed = FALSE;
+
+	status = EFI_NOT_FOUND;
+	if (RT->GetVariable(WATCHDOG_HINT_VAR, &watchdog_hint_guid, NULL,
+			    &size, &stored) == EFI_SUCCESS &&
+	    size == sizeof(stored) && stored.handle_index < handle_count) {
+		have_stored = TRUE;
+		status = probe_device(handle_buffer, stored.handle_index,
+				      table, count, timeout, &stored,
+				      &stored_probed, &found);
+	}
+
+	for (UINTN index = 0; index < handle_count && status == EFI_NOT_FOUND;
+	     index++) {
+		BOOLEAN probed;
+
+		if (stored_probed && index == stored.handle_index) {
+			continue;
+		}
+		status = probe_device(handle_buffer, index, table, count,
+				      timeout, NULL, &probed, &found);
+	}
+
+	if (status == EFI_SUCCESS) {
+		store_hint(&stored, have_stored, &found);
+	} else if (status == EFI_NOT_FOUND) {
+		status = EFI_UNSUPPORTED;
+	}
+
+	FreePool(table);
+	FreePool(handle_buffer);
+
+	return status;
+}
+
+/* Probing deferred to a timer event, so that it can run while the firmware
+ * dispatches events during LoadImage(). */
+static struct {
+	EFI_EVENT event;
+	UINTN timeout;
+	BOOLEAN done;
+	EFI_STATUS status;
+} deferred_probe;
+
+static VOID EFIAPI probe_notify(__attribute__((unused)) EFI_EVENT event,
+				__attribute__((unused)) VOID *context)
+{
+	deferred_probe.status = probe_watchdogs(deferred_probe.timeout);
+	deferred_probe.done = TRUE;
+}
+
+VOID start_watchdog_probe(UINTN timeout)
+{
+	EFI_STATUS status;
+
+	deferred_probe.timeout = timeout;
+	deferred_probe.done = FALSE;
+
+	status = BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+				 probe_notify, NULL, &deferred_probe.event);
+	if (EFI_ERROR(status)) {
+		deferred_probe.event = NULL;
+		return;
+	}
+	/* signaled on the next timer tick */
+	status = BS->SetTimer(deferred_probe.event, TimerRelative, 0);
+	if (EFI_ERROR(status)) {
+		(VOID) BS->CloseEvent(deferred_probe.event);
+		deferred_probe.event = NULL;
+	}
+}
+
+EFI_STATUS finish_watchdog_probe(VOID)
+{
+	EFI_TPL tpl;
+	BOOLEAN done;
+
+	/* the notification cannot run while closing the event */
+	tpl = BS->RaiseTPL(TPL_CALLBACK);
+	done = deferred_probe.done;
+	if (deferred_probe.event) {
+		(VOID) BS->CloseEvent(deferred_probe.event);
+		deferred_probe.event = NULL;
+	}
+	BS->RestoreTPL(tpl);
+
+	if (!done) {
+		deferred_probe.status = probe_watchdogs(deferred_probe.timeout);
+		deferred_probe.done = TRUE;
+	}
+	return deferred_probe.status;
+}